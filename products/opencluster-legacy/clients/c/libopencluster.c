@@ -28,24 +28,50 @@
 
 #define DEFAULT_BUFFER_SIZE   OPENCLUSTER_DEFAULT_BUFFSIZE
 
+// the most requests (or bytes of them) that are queued by the cluster_pipe_* functions before 
+// they are sent.  All the replies are read after the requests have been sent, so this keeps the 
+// server from having to hold too many of them for us.
+#define OPENCLUSTER_PIPE_MAX    1024
+#define OPENCLUSTER_PIPE_BYTES  (256*1024)
+
+// the most keys that the server takes in one MGET or MSET (MULTI_MAX_KEYS).
+#define OPENCLUSTER_MULTI_MAX   1024
+
 // #define WAIT_FOR_REPLY 1
 
 
 #define REPLY_FAIL                          0x0003
+#define REPLY_CONFLICT                      0x0007
 #define REPLY_OK                            0x0010
 #define REPLY_KEYVALUE_HASH                 0x001F
 #define REPLY_KEYVALUE                      0x0020
 #define REPLY_DATA_INT                      0x0110
 #define REPLY_DATA_STRING                   0x0120
+#define REPLY_SCAN                          0x0130
+#define REPLY_MULTI                         0x0140
 
 #define COMMAND_HELLO                       0x0010
 #define COMMAND_GOODBYE                     0x0040
 #define COMMAND_GET_INT                     0x2010
 #define COMMAND_GET_STRING                  0x2020
+#define COMMAND_MGET_INT                    0x2030
+#define COMMAND_MGET_STRING                 0x2040
+#define COMMAND_SCAN                        0x2100
 #define COMMAND_SET_INT                     0x2200
 #define COMMAND_SET_STRING                  0x2210
+#define COMMAND_MSET_INT                    0x2220
+#define COMMAND_MSET_STRING                 0x2230
+#define COMMAND_SET_INT_IF                  0x2300
+#define COMMAND_SET_STRING_IF               0x2310
+#define COMMAND_DELETE                      0x2400
 #define COMMAND_SET_KEYVALUE                0x2500
 #define COMMAND_GET_KEYVALUE                0x2520
+#define COMMAND_INCR_INT                    0x2600
+
+// the type of each item in a SCAN reply.  The list of items ends with a 0 type.
+#define SCAN_END                            0
+#define SCAN_INT                            1
+#define SCAN_STRING                         2
 
 // this structure is not packed on word boundaries, so it should represent the 
 // data received over the network.
@@ -93,6 +119,15 @@ typedef struct {
 typedef uint64_t mask_t;
 
 
+// a request that has been queued in the pipe.
+typedef struct {
+	short command;
+	hash_t map_hash;
+	hash_t key_hash;
+	cluster_result_t *result;
+} pipe_entry_t;
+
+
 // information about a server we know about.
 typedef struct {
 	int handle;
@@ -129,12 +164,26 @@ typedef struct {
 
 	message_t message;
 	
+	// requests that have been queued by the cluster_pipe_* functions.  The userid of each one is 
+	// its position in the list (plus 1), so the replies can be matched up whatever order they 
+	// come back in.
+	struct {
+		void *data;
+		int length;
+		int max;
+		
+		pipe_entry_t *list;
+		int count;
+		int waiting;
+	} pipe;
+	
 } cluster_t;
 
 
 //-----------------------------------------------------------------------------
 // function pre-declaration.
 static int server_connect(cluster_t *cluster, server_t *server);
+static void pipe_reply(cluster_t *cluster, int userid, short command, short reply, void *data, int length);
 
 
 
@@ -236,6 +285,16 @@ void cluster_free(OPENCLUSTER cluster_ptr)
 		cluster->payload_max = 0;
 	}
 	
+	assert(cluster->pipe.count == 0);
+	if (cluster->pipe.data) {
+		free(cluster->pipe.data);
+		cluster->pipe.data = NULL;
+	}
+	if (cluster->pipe.list) {
+		free(cluster->pipe.list);
+		cluster->pipe.list = NULL;
+	}
+	
 	free(cluster);
 }
 
@@ -583,6 +642,7 @@ static void * data_int(void *data, int *value)
 	
 	return(next);
 }
+*/
 
 
 static void * data_hash(void *data, uint64_t *value)
@@ -640,7 +700,6 @@ static void * data_string(void *data, int *length, char **ptr)
 	
 	return(next);
 }
-*/
 
 
 
@@ -740,8 +799,12 @@ static void pending_server(cluster_t *cluster, server_t *server)
 						userid = ntohl(header->userid);
 						assert(userid >= 0);
 						
+						// if message is a reply to a request in the pipe, it goes in the caller's slot.
+						if (reply > 0 && userid > 0) {
+							pipe_reply(cluster, userid, command, reply, ptr, length);
+						}
 						// if message is a reply, add it to the reply data.
-						if (reply > 0) {
+						else if (reply > 0) {
 							
 							assert(cluster->message.id == userid);
 							assert(cluster->message.out.command == command);
@@ -796,6 +859,10 @@ static void pending_server(cluster_t *cluster, server_t *server)
 							done = 1;
 						}
 					}
+					else {
+						// only part of the message has arrived, so we need to wait for the rest.
+						inner ++;
+					}
 				}
 			}
 		}
@@ -879,13 +946,62 @@ static void log_data(int handle, char *tag, unsigned char *data, int length)
 
 
 
+//--------------------------------------------------------------------------------------------------
+// send the current message to a particular server, and wait for the reply.  Returns 0 if the 
+// message could not be sent to that server.
+static int send_server(cluster_t *cluster, server_t *server)
+{
+	ssize_t sent, datasent;
+	int avail;
+	int status = 0;
+
+	assert(cluster);
+	assert(server);
+
+	if (check_server_active(cluster, server)) {
+		assert(server->handle > 0);
+
+		if (cluster->debug) {
+			log_data(0, "SEND ", cluster->message.out.data, cluster->message.out.length);
+		}
+		
+		// send the data
+		datasent = 0;
+		status = 0;
+		while (datasent < cluster->message.out.length && server->handle > 0) {
+			avail = cluster->message.out.length - datasent;
+			assert(avail > 0);
+			sent = send(server->handle, cluster->message.out.data + datasent, avail, 0);
+			assert(sent != 0);
+			assert(sent <= avail);
+			if (sent < 0) {
+				server_closed(cluster, server);
+				assert(server->active == 0);
+				assert(status == 0);
+			}
+			else {
+				datasent += sent;
+				status = 1;
+			}
+		}
+		
+		assert(datasent == cluster->message.out.length);
+		
+		// if we are going to be waiting for the data....
+		while (cluster->message.in.result == 0  && server->handle > 0) {
+			pending_server(cluster, server);
+		}
+	}
+	
+	return(status);
+}
+
+
 //--------------------------------------------------------------------------------------------------
 // the included message has the details for the reply, so we need to just send the data, and then 
 // wait for the replies to come in (if we are waiting for them).
 static int send_request(cluster_t *cluster)
 {
-	ssize_t sent, datasent;
-	int avail;
 	int status;
 	server_t *server;
 	int server_entry;
@@ -906,41 +1022,7 @@ static int send_request(cluster_t *cluster)
 	for (server_entry = 0; status == 0 && server_entry < cluster->server_count; server_entry ++) {
 		server = cluster->servers[server_entry];
 		if (server) {
-
-			if (check_server_active(cluster, server)) {
-				assert(server->handle > 0);
-
-				if (cluster->debug) {
-					log_data(0, "SEND ", cluster->message.out.data, cluster->message.out.length);
-				}
-				
-				// send the data
-				datasent = 0;
-				status = 0;
-				while (datasent < cluster->message.out.length && server->handle > 0) {
-					avail = cluster->message.out.length - datasent;
-					assert(avail > 0);
-					sent = send(server->handle, cluster->message.out.data + datasent, avail, 0);
-					assert(sent != 0);
-					assert(sent <= avail);
-					if (sent < 0) {
-						server_closed(cluster, server);
-						assert(server->active == 0);
-						assert(status == 0);
-					}
-					else {
-						datasent += sent;
-						status = 1;
-					}
-				}
-				
-				assert(datasent == cluster->message.out.length);
-				
-				// if we are going to be waiting for the data....
-				while (cluster->message.in.result == 0  && server->handle > 0) {
-					pending_server(cluster, server);
-				}
-			}
+			status = send_server(cluster, server);
 		}
 	}
 	
@@ -1347,6 +1429,39 @@ static void msg_setlong(cluster_t *cluster, long long value)
 
 
 
+// add some bytes to the message exactly as they are.
+static void msg_setraw(cluster_t *cluster, const void *data, int length) 
+{
+	raw_header_t *header;
+	
+	assert(cluster);
+	assert(data);
+	assert(length > 0);
+	
+	// make sure there is enough space in the buffer.
+	while ((cluster->message.out.length + length) > cluster->message.out.max) {
+		cluster->message.out.data = realloc(cluster->message.out.data, cluster->message.out.max + DEFAULT_BUFFER_SIZE);
+		cluster->message.out.max += DEFAULT_BUFFER_SIZE;
+	}
+
+	memcpy(cluster->message.out.data + cluster->message.out.length, data, length);
+	cluster->message.out.length += length;
+	
+	// add the msg details to the outgoing payload buffer.
+	assert(cluster->message.out.max >= sizeof(raw_header_t));
+	assert(cluster->message.out.data);
+	
+	header = cluster->message.out.data;
+	header->length = htobe32(cluster->message.out.length - sizeof(raw_header_t));
+}
+
+
+
+
+
+
+
+
 int cluster_setint(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, const int value, const int expires)
 {
 	cluster_t *cluster = cluster_ptr;
@@ -1402,7 +1517,38 @@ int cluster_setstr(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, co
 }
 
 
-/*
+// Delete an item from the cluster.  If 'map_hash' is 0, then everything stored for the key (in 
+// every map) is deleted.  Returns 1 if anything was deleted, and 0 if there was nothing there.
+int cluster_delete(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash)
+{
+	cluster_t *cluster = cluster_ptr;
+	int res = 0;
+	
+	assert(cluster);
+	
+	// build the message and send it off.
+	message_new(cluster, COMMAND_DELETE);
+	msg_sethash(cluster, map_hash);
+	msg_sethash(cluster, key_hash);
+
+	assert(cluster->message.out.length > 0);
+	send_request(cluster);
+	
+	if (cluster->message.in.result == REPLY_OK) {
+		res = 1;
+	}
+	else {
+		// there was nothing to delete.
+		assert(cluster->message.in.result == REPLY_FAIL);
+		assert(res == 0);
+	}
+	
+	message_done(cluster);
+	
+	return(res);
+}
+
+
 static void msg_getint(cluster_t *cluster, int *value)
 {
 	int *ptr;
@@ -1416,7 +1562,6 @@ static void msg_getint(cluster_t *cluster, int *value)
 
 	cluster->message.in.offset += sizeof(uint32_t);
 }
-*/
 
 static void msg_gethash(cluster_t *cluster, hash_t *value)
 {
@@ -1524,6 +1669,133 @@ int cluster_getint(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash)
 }
 
 
+// Add 'delta' to an integer value on the server (subtract if it is negative), without having to 
+// get it first.  If the item isn't there, it is created (with the expiry), starting from 0.  The 
+// request doesn't depend on anything that came before it.  Puts the new value in 'value' and 
+// returns 0, or returns -1 if the existing value is not an integer, or it could not be stored.
+int cluster_incr(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, long long delta, const int expires, long long *value)
+{
+	cluster_t *cluster = cluster_ptr;
+	int res = -1;
+	
+	assert(cluster);
+	assert(expires >= 0);
+	
+	// build the message and send it off.
+	message_new(cluster, COMMAND_INCR_INT);
+	msg_sethash(cluster, map_hash);
+	msg_sethash(cluster, key_hash);
+	msg_setint(cluster, expires);
+	msg_setlong(cluster, delta);
+	
+	assert(cluster->message.in.result == 0);
+	assert(cluster->message.out.length > 0);
+	send_request(cluster);
+	
+	if (cluster->message.in.result == REPLY_DATA_INT) {
+		
+		hash_t in_maphash;
+		hash_t in_keyhash;
+		hash_t in_valuehash;
+		long long in_value;
+		
+		msg_gethash(cluster, &in_maphash);
+		msg_gethash(cluster, &in_keyhash);
+		msg_gethash(cluster, &in_valuehash);
+		msg_getlong(cluster, &in_value);
+		assert(in_maphash == map_hash);
+		assert(in_keyhash == key_hash);
+		
+		if (value) { *value = in_value; }
+		res = 0;
+	}
+	
+	message_done(cluster);
+	
+	return(res);
+}
+
+
+// get the reply of a conditional set (see cluster_setint_if).  
+static int reply_set_if(cluster_t *cluster, hash_t map_hash, hash_t key_hash, hash_t *current)
+{
+	int res = -1;
+	hash_t in_maphash;
+	hash_t in_keyhash;
+	hash_t in_valuehash;
+	
+	assert(cluster);
+	
+	if (cluster->message.in.result == REPLY_OK || cluster->message.in.result == REPLY_CONFLICT) {
+		msg_gethash(cluster, &in_maphash);
+		msg_gethash(cluster, &in_keyhash);
+		msg_gethash(cluster, &in_valuehash);
+		assert(in_maphash == map_hash);
+		assert(in_keyhash == key_hash);
+		
+		if (current) { *current = in_valuehash; }
+		res = (cluster->message.in.result == REPLY_OK) ? 0 : 1;
+	}
+	
+	message_done(cluster);
+	
+	return(res);
+}
+
+
+// Set an integer, but only if the value currently stored is the one expected.  'expected' is the 
+// hash of the value that should be there (cluster_hash_long() of it), or 0 if nothing should be 
+// there yet.  Returns 0 if the value was stored, 1 if something else was stored (in which case 
+// 'current' is set to its hash, so the caller can try again), or -1 if it failed.
+int cluster_setint_if(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, const long long value, const int expires, hash_t expected, hash_t *current)
+{
+	cluster_t *cluster = cluster_ptr;
+	
+	assert(cluster);
+	assert(expires >= 0);
+	
+	// build the message and send it off.
+	message_new(cluster, COMMAND_SET_INT_IF);
+	msg_sethash(cluster, map_hash);
+	msg_sethash(cluster, key_hash);
+	msg_setint(cluster, expires);
+	msg_sethash(cluster, expected);
+	msg_setlong(cluster, value);
+
+	assert(cluster->message.in.result == 0);
+	assert(cluster->message.out.length > 0);
+	send_request(cluster);
+	
+	return(reply_set_if(cluster, map_hash, key_hash, current));
+}
+
+
+// Set a string, but only if the value currently stored is the one expected.  'expected' is the 
+// cluster_hash_str() of the string that should be there, or 0 if nothing should be there yet.  
+// Returns the same as cluster_setint_if().
+int cluster_setstr_if(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, const char *value, const int expires, hash_t expected, hash_t *current)
+{
+	cluster_t *cluster = cluster_ptr;
+	
+	assert(cluster);
+	assert(expires >= 0);
+	
+	// build the message and send it off.
+	message_new(cluster, COMMAND_SET_STRING_IF);
+	msg_sethash(cluster, map_hash);
+	msg_sethash(cluster, key_hash);
+	msg_setint(cluster, expires);
+	msg_sethash(cluster, expected);
+	msg_setstr(cluster, value);
+
+	assert(cluster->message.in.result == 0);
+	assert(cluster->message.out.length > 0);
+	send_request(cluster);
+	
+	return(reply_set_if(cluster, map_hash, key_hash, current));
+}
+
+
 char * cluster_getstr(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash)
 {
 	char *str = NULL;
@@ -1575,6 +1847,124 @@ char * cluster_getstr(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash)
 }
 
 
+// copy some bytes out of the reply exactly as they are.
+static void msg_getraw(cluster_t *cluster, void *data, int length)
+{
+	assert(cluster);
+	assert(data);
+	assert(length > 0);
+	assert(cluster->message.in.offset >= 0);
+	assert(cluster->message.in.offset + length <= cluster->message.in.length);
+	
+	memcpy(data, cluster->message.in.payload + cluster->message.in.offset, length);
+	cluster->message.in.offset += length;
+}
+
+
+// Get the next page of items from a scan of the cluster.  Each server is scanned in turn, and 
+// the handler is called for every item in the page.  Returns the number of items in the page, or 
+// -1 if the server could not be asked.  When the whole cluster has been scanned, 'scan->done' is 
+// set.  Items can be returned more than once if they were moved around while the scan was going.
+int cluster_scan(OPENCLUSTER cluster_ptr, cluster_scan_t *scan, hash_t map_hash, int max_items, cluster_scan_handler handler, void *arg)
+{
+	cluster_t *cluster = cluster_ptr;
+	server_t *server = NULL;
+	int count = 0;
+	int more;
+	int type;
+	hash_t in_maphash;
+	hash_t in_keyhash;
+	hash_t in_valuehash;
+	long long in_value;
+	int str_len;
+	
+	assert(cluster);
+	assert(scan);
+	assert(handler);
+	assert(max_items >= 0);
+	
+	if (scan->done) {
+		return(0);
+	}
+	
+	assert(scan->server >= 0);
+	while (scan->server < cluster->server_count && (server = cluster->servers[scan->server]) == NULL) {
+		scan->server ++;
+	}
+	
+	if (scan->server >= cluster->server_count) {
+		scan->done = 1;
+		return(0);
+	}
+	assert(server);
+	
+	// build the message and send it off.
+	message_new(cluster, COMMAND_SCAN);
+	msg_sethash(cluster, map_hash);
+	msg_setint(cluster, max_items);
+	msg_setraw(cluster, scan->position, OPENCLUSTER_SCAN_CURSOR);
+	
+	assert(cluster->message.in.result == 0);
+	assert(cluster->message.out.length > 0);
+	cluster->message.in.offset = 0;
+	if (send_server(cluster, server) == 0) {
+		message_done(cluster);
+		return(-1);
+	}
+	
+	if (cluster->message.in.result == REPLY_SCAN) {
+		
+		msg_getint(cluster, &type);
+		while (type != SCAN_END) {
+			msg_gethash(cluster, &in_maphash);
+			msg_gethash(cluster, &in_keyhash);
+			msg_gethash(cluster, &in_valuehash);
+			
+			if (type == SCAN_INT) {
+				msg_getlong(cluster, &in_value);
+				handler(in_maphash, in_keyhash, in_value, NULL, 0, arg);
+			}
+			else {
+				assert(type == SCAN_STRING);
+				
+				// the string is passed straight out of the reply buffer, so it is not null terminated.
+				msg_getint(cluster, &str_len);
+				assert(str_len >= 0);
+				handler(in_maphash, in_keyhash, 0, cluster->message.in.payload + cluster->message.in.offset, str_len, arg);
+				cluster->message.in.offset += str_len;
+			}
+			
+			count ++;
+			msg_getint(cluster, &type);
+		}
+		
+		msg_getraw(cluster, scan->position, OPENCLUSTER_SCAN_CURSOR);
+		msg_getint(cluster, &more);
+		
+		if (more == 0) {
+			// this server is finished, so start again on the next one.
+			memset(scan->position, 0, OPENCLUSTER_SCAN_CURSOR);
+			scan->server ++;
+			if (scan->server >= cluster->server_count) {
+				scan->done = 1;
+			}
+		}
+		
+		if (cluster->debug) {
+			printf("=== scan: %d items, server=%d, done=%d\n", count, scan->server, scan->done);
+		}
+	}
+	else {
+		// the server could not scan.
+		count = -1;
+	}
+	
+	message_done(cluster);
+	
+	return(count);
+}
+
+
 // Return the number of active servers in the cluster.
 int cluster_servercount(OPENCLUSTER cluster_ptr)
 {
@@ -1675,4 +2065,411 @@ const char * cluster_getlabel(OPENCLUSTER cluster_ptr, hash_t hash)
 	message_done(cluster);
 	
 	return(str);
-}
\ No newline at end of file
+}
+
+
+// get the reply to an MGET or MSET.  Each key has a status (and the value, for the gets).  The 
+// nodes that the server says have the other keys are left at the end of the reply, because this 
+// library doesn't send anywhere else.
+static int reply_multi(cluster_t *cluster, int count, cluster_result_t *results)
+{
+	int failed = 0;
+	int in_count;
+	int status;
+	hash_t in_valuehash;
+	long long in_value;
+	int i;
+	
+	assert(cluster);
+	assert(count > 0);
+	assert(results);
+	
+	if (cluster->message.in.result == REPLY_MULTI) {
+		msg_getint(cluster, &in_count);
+		assert(in_count == count);
+	}
+	
+	for (i=0; i<count; i++) {
+		results[i].status = -1;
+		results[i].value = 0;
+		results[i].str = NULL;
+		results[i].length = 0;
+		
+		if (cluster->message.in.result == REPLY_MULTI) {
+			msg_getint(cluster, &status);
+			if (status == REPLY_DATA_INT) {
+				msg_gethash(cluster, &in_valuehash);
+				msg_getlong(cluster, &in_value);
+				results[i].value = in_value;
+				results[i].status = 0;
+			}
+			else if (status == REPLY_DATA_STRING) {
+				msg_gethash(cluster, &in_valuehash);
+				msg_getint(cluster, &results[i].length);
+				assert(results[i].length >= 0);
+				results[i].str = malloc(results[i].length + 1);
+				assert(results[i].str);
+				if (results[i].length > 0) {
+					msg_getraw(cluster, results[i].str, results[i].length);
+				}
+				results[i].str[results[i].length] = 0;
+				results[i].status = 0;
+			}
+			else if (status == REPLY_OK) {
+				results[i].status = 0;
+			}
+		}
+		
+		if (results[i].status != 0) {
+			failed ++;
+		}
+	}
+	
+	message_done(cluster);
+	
+	return(failed);
+}
+
+
+// send an MGET or MSET, OPENCLUSTER_MULTI_MAX keys at a time.  The 'values' are only used for 
+// MSET_INT and MSET_STRING.
+static int cluster_multi(cluster_t *cluster, short command, int count, const hash_t *map_hashes, const hash_t *key_hashes, const void *values, const int expires, cluster_result_t *results)
+{
+	int failed = 0;
+	int batch;
+	int start;
+	int i;
+	
+	assert(cluster);
+	assert(count >= 0);
+	assert(map_hashes);
+	assert(key_hashes);
+	assert(results);
+	assert(expires >= 0);
+	
+	for (start=0; start<count; start+=batch) {
+		batch = (count - start) < OPENCLUSTER_MULTI_MAX ? (count - start) : OPENCLUSTER_MULTI_MAX;
+		
+		message_new(cluster, command);
+		msg_setint(cluster, batch);
+		if (command == COMMAND_MSET_INT || command == COMMAND_MSET_STRING) {
+			msg_setint(cluster, expires);
+		}
+		
+		for (i=start; i<start+batch; i++) {
+			msg_sethash(cluster, map_hashes[i]);
+			msg_sethash(cluster, key_hashes[i]);
+			if (command == COMMAND_MSET_INT) {
+				msg_setlong(cluster, ((const long long *) values)[i]);
+			}
+			else if (command == COMMAND_MSET_STRING) {
+				msg_setstr(cluster, ((const char **) values)[i]);
+			}
+		}
+		
+		assert(cluster->message.in.result == 0);
+		assert(cluster->message.out.length > 0);
+		send_request(cluster);
+		
+		failed += reply_multi(cluster, batch, results + start);
+	}
+	
+	return(failed);
+}
+
+
+// Get a list of integers in one request.  The value for each key is put in the 'results' entry 
+// for it.  Returns the number that could not be got.
+int cluster_mgetint(OPENCLUSTER cluster_ptr, int count, const hash_t *map_hashes, const hash_t *key_hashes, cluster_result_t *results)
+{
+	return(cluster_multi(cluster_ptr, COMMAND_MGET_INT, count, map_hashes, key_hashes, NULL, 0, results));
+}
+
+
+// Get a list of strings in one request.  The strings in the 'results' need to be freed by the 
+// caller.  Returns the number that could not be got.
+int cluster_mgetstr(OPENCLUSTER cluster_ptr, int count, const hash_t *map_hashes, const hash_t *key_hashes, cluster_result_t *results)
+{
+	return(cluster_multi(cluster_ptr, COMMAND_MGET_STRING, count, map_hashes, key_hashes, NULL, 0, results));
+}
+
+
+// Set a list of integers in one request.  Returns the number that could not be set.
+int cluster_msetint(OPENCLUSTER cluster_ptr, int count, const hash_t *map_hashes, const hash_t *key_hashes, const long long *values, const int expires, cluster_result_t *results)
+{
+	assert(values);
+	return(cluster_multi(cluster_ptr, COMMAND_MSET_INT, count, map_hashes, key_hashes, values, expires, results));
+}
+
+
+// Set a list of strings in one request.  Returns the number that could not be set.
+int cluster_msetstr(OPENCLUSTER cluster_ptr, int count, const hash_t *map_hashes, const hash_t *key_hashes, const char **values, const int expires, cluster_result_t *results)
+{
+	assert(values);
+	return(cluster_multi(cluster_ptr, COMMAND_MSET_STRING, count, map_hashes, key_hashes, values, expires, results));
+}
+
+
+
+//--------------------------------------------------------------------------------------------------
+// Pipelined requests.  Instead of waiting for the reply to each request before sending the next 
+// one, the requests are queued up and sent together, and the replies are put in the slots that 
+// the caller gave for them.  The server can then be working on all of them at the same time, and 
+// it only costs one round trip (per OPENCLUSTER_PIPE_MAX requests) instead of one each.
+
+
+// move the message that has just been built into the pipe.  If the pipe is full, it is sent.
+static void pipe_add(cluster_t *cluster, hash_t map_hash, hash_t key_hash, cluster_result_t *result)
+{
+	raw_header_t *header;
+	pipe_entry_t *entry;
+	
+	assert(cluster);
+	assert(result);
+	assert(cluster->message.out.command > 0);
+	assert(cluster->message.out.length >= sizeof(raw_header_t));
+	assert(cluster->pipe.count < OPENCLUSTER_PIPE_MAX);
+	assert(cluster->pipe.waiting == 0);
+	
+	if (cluster->pipe.list == NULL) {
+		cluster->pipe.list = malloc(sizeof(pipe_entry_t) * OPENCLUSTER_PIPE_MAX);
+		assert(cluster->pipe.list);
+	}
+	
+	entry = &cluster->pipe.list[cluster->pipe.count];
+	entry->command = cluster->message.out.command;
+	entry->map_hash = map_hash;
+	entry->key_hash = key_hash;
+	entry->result = result;
+	cluster->pipe.count ++;
+	
+	result->status = -1;
+	result->value = 0;
+	result->str = NULL;
+	result->length = 0;
+	
+	// the userid is how the reply is matched up with the request.
+	header = cluster->message.out.data;
+	header->userid = htobe32(cluster->pipe.count);
+	
+	// make sure there is enough space in the buffer.
+	while ((cluster->pipe.length + cluster->message.out.length) > cluster->pipe.max) {
+		cluster->pipe.data = realloc(cluster->pipe.data, cluster->pipe.max + DEFAULT_BUFFER_SIZE);
+		cluster->pipe.max += DEFAULT_BUFFER_SIZE;
+	}
+	assert(cluster->pipe.data);
+	
+	memcpy(cluster->pipe.data + cluster->pipe.length, cluster->message.out.data, cluster->message.out.length);
+	cluster->pipe.length += cluster->message.out.length;
+	
+	message_done(cluster);
+	
+	if (cluster->pipe.count >= OPENCLUSTER_PIPE_MAX || cluster->pipe.length >= OPENCLUSTER_PIPE_BYTES) {
+		cluster_pipe_flush(cluster);
+	}
+}
+
+
+// a reply has come back for one of the requests in the pipe.
+static void pipe_reply(cluster_t *cluster, int userid, short command, short reply, void *data, int length)
+{
+	pipe_entry_t *entry;
+	hash_t in_maphash;
+	hash_t in_keyhash;
+	hash_t in_valuehash;
+	int64_t in_value;
+	char *str;
+	
+	assert(cluster);
+	assert(userid > 0 && userid <= cluster->pipe.count);
+	assert(cluster->pipe.waiting > 0);
+	
+	entry = &cluster->pipe.list[userid - 1];
+	assert(entry->command == command);
+	assert(entry->result);
+	assert(entry->result->status == -1);
+	
+	switch (command) {
+		case COMMAND_GET_INT:
+			if (reply == REPLY_DATA_INT) {
+				assert(length > 0);
+				data = data_hash(data, &in_maphash);
+				data = data_hash(data, &in_keyhash);
+				data = data_hash(data, &in_valuehash);
+				data = data_long(data, &in_value);
+				assert(in_maphash == entry->map_hash);
+				assert(in_keyhash == entry->key_hash);
+				
+				entry->result->value = in_value;
+				entry->result->status = 0;
+			}
+			break;
+			
+		case COMMAND_GET_STRING:
+			if (reply == REPLY_DATA_STRING) {
+				assert(length > 0);
+				data = data_hash(data, &in_maphash);
+				data = data_hash(data, &in_keyhash);
+				data = data_hash(data, &in_valuehash);
+				data = data_string(data, &entry->result->length, &str);
+				assert(in_maphash == entry->map_hash);
+				assert(in_keyhash == entry->key_hash);
+				assert(entry->result->length >= 0);
+				
+				entry->result->str = malloc(entry->result->length + 1);
+				assert(entry->result->str);
+				memcpy(entry->result->str, str, entry->result->length);
+				entry->result->str[entry->result->length] = 0;
+				entry->result->status = 0;
+			}
+			break;
+			
+		default:
+			if (reply == REPLY_OK) {
+				entry->result->status = 0;
+			}
+			break;
+	}
+	
+	cluster->pipe.waiting --;
+}
+
+
+// Queue a request to get an integer value.  When cluster_pipe_flush() returns, the value is in 
+// result->value.
+void cluster_pipe_getint(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, cluster_result_t *result)
+{
+	cluster_t *cluster = cluster_ptr;
+	
+	assert(cluster);
+	assert(result);
+	
+	message_new(cluster, COMMAND_GET_INT);
+	msg_sethash(cluster, map_hash);
+	msg_sethash(cluster, key_hash);
+	pipe_add(cluster, map_hash, key_hash, result);
+}
+
+
+// Queue a request to get a string value.  When cluster_pipe_flush() returns, the string is in 
+// result->str (null terminated), and needs to be freed by the caller.
+void cluster_pipe_getstr(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, cluster_result_t *result)
+{
+	cluster_t *cluster = cluster_ptr;
+	
+	assert(cluster);
+	assert(result);
+	
+	message_new(cluster, COMMAND_GET_STRING);
+	msg_sethash(cluster, map_hash);
+	msg_sethash(cluster, key_hash);
+	msg_setint(cluster, 0);			// unlimited string size.
+	pipe_add(cluster, map_hash, key_hash, result);
+}
+
+
+void cluster_pipe_setint(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, const long long value, const int expires, cluster_result_t *result)
+{
+	cluster_t *cluster = cluster_ptr;
+	
+	assert(cluster);
+	assert(expires >= 0);
+	assert(result);
+	
+	message_new(cluster, COMMAND_SET_INT);
+	msg_sethash(cluster, map_hash);
+	msg_sethash(cluster, key_hash);
+	msg_setint(cluster,  expires);
+	msg_setlong(cluster, value);
+	pipe_add(cluster, map_hash, key_hash, result);
+}
+
+
+void cluster_pipe_setstr(OPENCLUSTER cluster_ptr, hash_t map_hash, hash_t key_hash, const char *value, const int expires, cluster_result_t *result)
+{
+	cluster_t *cluster = cluster_ptr;
+	
+	assert(cluster);
+	assert(expires >= 0);
+	assert(result);
+	
+	message_new(cluster, COMMAND_SET_STRING);
+	msg_sethash(cluster, map_hash);
+	msg_sethash(cluster, key_hash);
+	msg_setint(cluster, expires);
+	msg_setstr(cluster, value);
+	pipe_add(cluster, map_hash, key_hash, result);
+}
+
+
+// Send everything that is in the pipe, in one go, and wait for all the replies.  Returns the 
+// number of requests that failed (their result->status is -1).
+int cluster_pipe_flush(OPENCLUSTER cluster_ptr)
+{
+	cluster_t *cluster = cluster_ptr;
+	server_t *server = NULL;
+	ssize_t sent, datasent;
+	int server_entry;
+	int failed;
+	int i;
+	
+	assert(cluster);
+	assert(cluster->pipe.waiting == 0);
+	
+	if (cluster->pipe.count == 0) {
+		return(0);
+	}
+	
+	assert(cluster->pipe.data);
+	assert(cluster->pipe.length > 0);
+	
+	// the whole pipe goes to the first server that is connected.
+	for (server_entry = 0; server == NULL && server_entry < cluster->server_count; server_entry ++) {
+		server = cluster->servers[server_entry];
+		if (server && check_server_active(cluster, server) == 0) {
+			server = NULL;
+		}
+	}
+	
+	if (server) {
+		assert(server->handle > 0);
+		
+		if (cluster->debug) {
+			log_data(0, "SEND ", cluster->pipe.data, cluster->pipe.length);
+		}
+		
+		datasent = 0;
+		while (datasent < cluster->pipe.length && server->handle > 0) {
+			sent = send(server->handle, cluster->pipe.data + datasent, cluster->pipe.length - datasent, 0);
+			assert(sent != 0);
+			if (sent < 0) {
+				server_closed(cluster, server);
+				assert(server->active == 0);
+			}
+			else {
+				datasent += sent;
+			}
+		}
+		
+		// the replies can come back in any order.
+		if (datasent == cluster->pipe.length) {
+			cluster->pipe.waiting = cluster->pipe.count;
+			while (cluster->pipe.waiting > 0 && server->handle > 0) {
+				pending_server(cluster, server);
+			}
+			cluster->pipe.waiting = 0;
+		}
+	}
+	
+	failed = 0;
+	for (i=0; i<cluster->pipe.count; i++) {
+		if (cluster->pipe.list[i].result->status != 0) {
+			failed ++;
+		}
+	}
+	
+	cluster->pipe.count = 0;
+	cluster->pipe.length = 0;
+	
+	return(failed);
+}
@@ -55,6 +55,32 @@ typedef uint64_t hash_t;
 typedef void * OPENCLUSTER;
 
 
+// the size of the position that a server returns with each page of a scan.  The client just 
+// passes it back to get the next page.
+#define OPENCLUSTER_SCAN_CURSOR 28
+
+// keeps track of how far through the cluster a scan has got.  Clear it to zero to start a scan.
+typedef struct {
+	int server;
+	char position[OPENCLUSTER_SCAN_CURSOR];
+	int done;
+} cluster_scan_t;
+
+// the result of a request that was queued with one of the cluster_pipe_* functions, filled in by 
+// cluster_pipe_flush().  'status' is 0 if the request worked, or -1 if it failed (or there was 
+// nothing there).  'str' is only set by cluster_pipe_getstr, and needs to be freed by the caller.
+typedef struct {
+	int status;
+	long long value;
+	char *str;
+	int length;
+} cluster_result_t;
+
+// called for each item that is returned by cluster_scan.  Integer items have a NULL 'str'.  String 
+// items are not null terminated, and are only valid until the handler returns.
+typedef void (*cluster_scan_handler)(hash_t map_hash, hash_t key_hash, long long value, const char *str, int length, void *arg);
+
+
 
 
 OPENCLUSTER cluster_init(void);
@@ -77,11 +103,39 @@ void cluster_setkeyvalue(OPENCLUSTER cluster, hash_t key_hash, const char *name)
 
 int cluster_setint(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash, const int value, const int expires);
 int cluster_getint(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash);
+int cluster_incr(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash, long long delta, const int expires, long long *value);
 
 int cluster_setstr(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash, const char *value, const int expires);
 int cluster_setbin(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash, const char *value, const int length, const int expires);
 char * cluster_getstr(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash);
 
+// check-and-set.  'expected' is the hash of the value that should be stored (cluster_hash_long() 
+// or cluster_hash_str() of it), or 0 for nothing.  Returns 0 if stored, 1 if the value had changed 
+// ('current' is set to the hash of what is there now), or -1 on failure.
+int cluster_setint_if(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash, const long long value, const int expires, hash_t expected, hash_t *current);
+int cluster_setstr_if(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash, const char *value, const int expires, hash_t expected, hash_t *current);
+
+// a 'map_hash' of 0 deletes everything for the key.
+int cluster_delete(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash);
+
+int cluster_scan(OPENCLUSTER cluster, cluster_scan_t *scan, hash_t map_hash, int max_items, cluster_scan_handler handler, void *arg);
+
+// get or set a list of items in a single request.  The result for each key goes in its 'results' 
+// entry, and the number that failed is returned.
+int cluster_mgetint(OPENCLUSTER cluster, int count, const hash_t *map_hashes, const hash_t *key_hashes, cluster_result_t *results);
+int cluster_mgetstr(OPENCLUSTER cluster, int count, const hash_t *map_hashes, const hash_t *key_hashes, cluster_result_t *results);
+int cluster_msetint(OPENCLUSTER cluster, int count, const hash_t *map_hashes, const hash_t *key_hashes, const long long *values, const int expires, cluster_result_t *results);
+int cluster_msetstr(OPENCLUSTER cluster, int count, const hash_t *map_hashes, const hash_t *key_hashes, const char **values, const int expires, cluster_result_t *results);
+
+// pipelined requests.  These are queued without waiting for any replies, and sent together by 
+// cluster_pipe_flush(), which waits until all the replies are in the 'result' slots (so they need 
+// to stay valid until then).  If a lot are queued, some are flushed along the way.
+void cluster_pipe_getint(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash, cluster_result_t *result);
+void cluster_pipe_getstr(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash, cluster_result_t *result);
+void cluster_pipe_setint(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash, const long long value, const int expires, cluster_result_t *result);
+void cluster_pipe_setstr(OPENCLUSTER cluster, hash_t map_hash, hash_t key_hash, const char *value, const int expires, cluster_result_t *result);
+int cluster_pipe_flush(OPENCLUSTER cluster);
+
 hash_t cluster_hash_str(const char *str);
 hash_t cluster_hash_bin(const char *str, const int length);
 hash_t cluster_hash_int(const int key);
@@ -13,6 +13,7 @@
 
 
 #define GET_LIMIT 400000
+#define PIPE_BATCH 1000
 
 
 int main(int argc, char **argv)
@@ -21,11 +22,13 @@ int main(int argc, char **argv)
 	GTimer *timer;
 	int nodes;
 	register int i;
+	int j;
 	gdouble sec;
 	gulong msec;
 	char key_buffer[128];
 	conninfo_t *conninfo;
 	int result;
+	cluster_result_t *results;
 
 	hash_t map_hash;
 	hash_t key_hash;
@@ -97,6 +100,27 @@ int main(int argc, char **argv)
 		printf ("Result of 'testint' in cache.  result=%d\n", result);
 		sec = g_timer_elapsed(timer, &msec);
 		printf("Timing of %d gets(int). %f  [Gets per second=%f]\n", GET_LIMIT, sec, GET_LIMIT/sec);
+		
+		// and again, but pipelined, so that each get doesn't have to wait for the one before it.
+		printf("Getting data from the cluster (pipelined, %d at a time).\n", PIPE_BATCH);
+		results = calloc(PIPE_BATCH, sizeof(cluster_result_t));
+		assert(results);
+		g_timer_start(timer);
+		for (i=0; i<GET_LIMIT; i+=PIPE_BATCH) {
+			for (j=0; j<PIPE_BATCH; j++) {
+				cluster_pipe_getint(cluster, map_hash, key_hash, &results[j]);
+			}
+			result = cluster_pipe_flush(cluster);
+			assert(result == 0);
+			for (j=0; j<PIPE_BATCH; j++) {
+				assert(results[j].status == 0);
+				assert(results[j].value == 45);
+			}
+		}
+		g_timer_stop(timer);
+		free(results);
+		sec = g_timer_elapsed(timer, &msec);
+		printf("Timing of %d pipelined gets(int). %f  [Gets per second=%f]\n", GET_LIMIT, sec, GET_LIMIT/sec);
 	
 // 		printf("Setting 6000 items of data\n");
 // 		g_timer_start(timer);
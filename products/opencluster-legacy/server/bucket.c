@@ -7,7 +7,10 @@
 #include "constants.h"
 #include "item.h"
 #include "push.h"
+#include "seconds.h"
 #include "server.h"
+#include "shard.h"
+#include "slab.h"
 #include "stats.h"
 #include "timeout.h"
 
@@ -17,8 +20,22 @@
 
 
 
-// the list of buckets that this server is handling.  '_mask' indicates how many entries in the 
-// array there is, but the ones that are not handled by this server, will have a NULL entry.
+// the table of buckets that this server is handling.  'mask' indicates how many entries in the 
+// table there is, but the ones that are not handled by this server, will have a NULL entry.
+// The table is only changed by the main loop.  When the mask is split, a whole new table is made 
+// and put in place of the old one, so the workers (which look buckets up without locking, see 
+// bucket_lookup) see either one or the other.  The old table, and any buckets that are taken out, 
+// are only freed once the workers have all moved on (see shard_defer).  The data in each bucket 
+// belongs to the shard that owns it.
+typedef struct {
+	hash_t mask;
+	bucket_t *buckets[];
+} bucket_table_t;
+
+static bucket_table_t *_table = NULL;
+
+// the current table, as the main loop sees it.  Nothing else changes the table, so the main loop 
+// can use these directly.  The workers should always use bucket_lookup().
 bucket_t ** _buckets = NULL;
 
 
@@ -28,7 +45,8 @@ bucket_t ** _buckets = NULL;
 // certain importain options might get skipped incorrectly.
 int _nobackup_buckets = 0;
 
-// the mask is used to determine which bucket a hash belongs to.
+// the mask is used to determine which bucket a hash belongs to (it is the mask of the current 
+// table).
 hash_t _mask = 0;
 
 
@@ -56,6 +74,83 @@ int _migrate_sync = 0;
 
 static struct event_base *_evbase = NULL;
 
+// the number of buckets that still have chained data from a split, and the total number of 
+// entries that have been moved out of the chained data.  These, and the eviction and delete counts, 
+// are updated by all the shards, so they are only changed atomically.
+int _buckets_draining = 0;
+long long _buckets_drained = 0;
+
+// when the memory runs out, items are evicted from the primary buckets according to the policy 
+// (see buckets_eviction).  Each eviction looks at '_evict_samples' items, spread over the buckets, 
+// and evicts the best one out of those.  Each shard only evicts from its own buckets.
+static SHARD_LOCAL int _evict_policy = EVICT_NONE;
+static SHARD_LOCAL int _evict_samples = 0;
+static SHARD_LOCAL hash_t _evict_next = 0;
+static long long _evicted = 0;
+static long long _evicted_bytes = 0;
+static long long _evict_missed = 0;
+
+// number of items and keyvalues that have been deleted (see buckets_delete).
+static long long _deleted = 0;
+
+
+// make a new table with every entry empty.
+static bucket_table_t * table_new(hash_t mask)
+{
+	bucket_table_t *table;
+	
+	assert(mask > 0);
+	
+	table = calloc(1, sizeof(bucket_table_t) + (sizeof(bucket_t *) * (mask+1)));
+	assert(table);
+	table->mask = mask;
+	
+	return(table);
+}
+
+
+// make the table the current one.  Everything in it needs to be filled in before this, because 
+// the workers can start looking at it straight away.
+static void table_publish(bucket_table_t *table)
+{
+	assert(table);
+	assert(table->mask > _mask);
+	assert(shard_id() == 0);
+	
+	_buckets = table->buckets;
+	_mask = table->mask;
+	__atomic_store_n(&_table, table, __ATOMIC_RELEASE);
+}
+
+
+// put a bucket in (or take it out of) the current table.
+static void bucket_set(hash_t hashmask, bucket_t *bucket)
+{
+	assert(_table);
+	assert(hashmask <= _mask);
+	assert(shard_id() == 0);
+	
+	__atomic_store_n(&_table->buckets[hashmask], bucket, __ATOMIC_RELEASE);
+}
+
+
+// find the bucket that the key belongs in.  This can be done from any shard.  The bucket that is 
+// returned wont be freed until the shard has finished what it is doing, but it shouldn't be kept 
+// any longer than that.  Returns NULL if that bucket isn't here.
+static bucket_t * bucket_lookup(hash_t key_hash)
+{
+	bucket_table_t *table;
+	
+	table = __atomic_load_n(&_table, __ATOMIC_ACQUIRE);
+	if (table == NULL) {
+		return(NULL);
+	}
+	
+	assert(table->mask > 0);
+	return(__atomic_load_n(&table->buckets[key_hash & table->mask], __ATOMIC_ACQUIRE));
+}
+
+
 
 // return the current migrate sync counter.  This is used when traversing the data trees to find 
 // items that have not been migrated.
@@ -68,20 +163,15 @@ int buckets_get_migrate_sync(void)
 // get a value from whichever bucket is resposible.
 value_t * buckets_get_value(hash_t map_hash, hash_t key_hash) 
 {
-	int bucket_index;
 	bucket_t *bucket;
 	value_t *value = NULL;
 
-	// calculate the bucket that this item belongs in.
-	assert(_mask > 0);
-	bucket_index = _mask & key_hash;
-	assert(bucket_index >= 0);
-	assert(bucket_index <= _mask);
-	bucket = _buckets[bucket_index];
+	// find the bucket that this item belongs in.
+	bucket = bucket_lookup(key_hash);
 
 	// if we have a record for this bucket, then we are either a primary or a backup for it.
 	if (bucket) {
-		assert(bucket->hashmask == bucket_index);
+		assert((key_hash & bucket->hashmask) == bucket->hashmask);
 		
 		// make sure that this server is 'primary' for this bucket.
 		if (bucket->level != 0) {
@@ -104,24 +194,20 @@ value_t * buckets_get_value(hash_t map_hash, hash_t key_hash)
 
 
 // store the value in whatever bucket is resposible for the key_hash.
-// NOTE: value is controlled by the tree after this function call.
-// NOTE: name is controlled by the tree after this function call.
+// NOTE: the contents of value are moved into the stored item, the value_t itself still belongs to
+//       the caller.
 int buckets_store_value(hash_t map_hash, hash_t key_hash, int expires, value_t *value) 
 {
-	int bucket_index;
 	bucket_t *bucket;
 	client_t *backup_client;
 
-	// calculate the bucket that this item belongs in.
-	bucket_index = _mask & key_hash;
-	assert(bucket_index >= 0);
-	assert(bucket_index <= _mask);
-	bucket = _buckets[bucket_index];
+	// find the bucket that this item belongs in.
+	bucket = bucket_lookup(key_hash);
 
 	// if we have a record for this bucket, then we are (potentially) either a primary or a backup 
 	// for it.
 	if (bucket) {
-		assert(bucket->hashmask == bucket_index);
+		assert((key_hash & bucket->hashmask) == bucket->hashmask);
 		if (bucket->backup_node) {
 			// since we have a backup_node specified, then we must be the primary.
 			backup_client = bucket->backup_node->client;
@@ -133,8 +219,7 @@ int buckets_store_value(hash_t map_hash, hash_t key_hash, int expires, value_t *
 			backup_client = NULL;
 		}
 		
-		data_set_value(map_hash, key_hash, bucket->data, value, expires, backup_client);
-		return(0);
+		return(data_set_value(map_hash, key_hash, bucket->data, value, expires, backup_client));
 	}
 	else {
 		assert(0);
@@ -144,19 +229,89 @@ int buckets_store_value(hash_t map_hash, hash_t key_hash, int expires, value_t *
 
 
 
-bucket_t * bucket_new(hash_t hashmask)
+// add 'delta' to the integer item, if this node is the primary for the bucket it belongs in (see 
+// data_incr_value).  Returns -1 if the bucket isn't here, or there was no memory available.
+int buckets_incr_value(hash_t map_hash, hash_t key_hash, long long delta, int expires, value_t *result)
 {
 	bucket_t *bucket;
+	client_t *backup_client = NULL;
 
-	assert(_mask > 0);
-	assert(hashmask >= 0);
-	assert(hashmask <= _mask);
+	assert(result);
+	
+	bucket = bucket_lookup(key_hash);
+	if (bucket == NULL || bucket->data == NULL || bucket->level != 0) {
+		return(-1);
+	}
+	
+	if (bucket->backup_node) {
+		backup_client = bucket->backup_node->client;
+		assert(backup_client);
+	}
+	
+	return(data_incr_value(map_hash, key_hash, bucket->data, delta, expires, backup_client, result));
+}
+
+
+
+// store the value only if the valuehash of what is currently stored matches 'expected'.  An 
+// 'expected' of 0 means that nothing should be stored there yet (deleted and expired items count as 
+// nothing).  The hash of what is currently stored is put in 'current' either way.  Returns 0 if it 
+// was stored, -2 if the hash did not match, or -1 if this node is not the primary for the bucket or 
+// there was no memory available.
+// NOTE: like buckets_store_value, the contents of value are moved into the stored item.
+int buckets_store_value_if(hash_t map_hash, hash_t key_hash, int expires, value_t *value, long long expected, long long *current)
+{
+	bucket_t *bucket;
+	client_t *backup_client = NULL;
+	value_t *stored;
+	long long hash;
+	int result;
+
+	assert(value);
+	assert(current);
+	
+	bucket = bucket_lookup(key_hash);
+	if (bucket == NULL || bucket->data == NULL || bucket->level != 0) {
+		return(-1);
+	}
+	
+	// the check and the store need to happen without anything else getting in between, so the 
+	// stored value pointer is not kept past this point (storing can cause items to be evicted).
+	stored = data_get_value(map_hash, key_hash, bucket->data);
+	*current = stored ? stored->valuehash : 0;
+	if (*current != expected) {
+		return(-2);
+	}
+	
+	if (bucket->backup_node) {
+		backup_client = bucket->backup_node->client;
+		assert(backup_client);
+	}
 	
-	assert(_buckets[hashmask] == NULL);
+	// the value is moved into the item when it is stored, so get the new hash first.
+	hash = value->valuehash;
+	result = data_set_value(map_hash, key_hash, bucket->data, value, expires, backup_client);
+	if (result == 0) {
+		*current = hash;
+	}
+	return(result);
+}
+
+
+
+// a new empty bucket, for the table with 'mask'.  It still needs to be put in the table.
+bucket_t * bucket_new(hash_t mask, hash_t hashmask)
+{
+	bucket_t *bucket;
+
+	assert(mask > 0);
+	assert(hashmask >= 0);
+	assert(hashmask <= mask);
 	
 	bucket = calloc(1, sizeof(bucket_t));
 	bucket->hashmask = hashmask;
 	bucket->level = -1;
+	bucket->shard = shard_owner(hashmask);
 
 	assert(bucket->primary_node == NULL);
 	assert(bucket->secondary_node == NULL);
@@ -171,13 +326,36 @@ bucket_t * bucket_new(hash_t hashmask)
 	assert(bucket->transfer_mode_special == 0);
 	assert(bucket->promoting == NOT_PROMOTING);
 	
-	bucket->data = data_new(_mask, hashmask);
+	bucket->data = data_new(mask, hashmask);
 	
 	return(bucket);
 }
 
 
 
+// run by the shard that owns the bucket, because the memory for the data belongs to it.
+static void bucket_destroy_run(void *arg)
+{
+	bucket_t *bucket = arg;
+	
+	assert(bucket);
+	assert(bucket->shard == shard_id());
+
+	if (bucket->oldbucket_event) {
+		event_free(bucket->oldbucket_event);
+		bucket->oldbucket_event = NULL;
+		assert(_buckets_draining > 0);
+		__sync_fetch_and_sub(&_buckets_draining, 1);
+	}
+
+	if (bucket->data) {
+		data_destroy(bucket->data, bucket->data->mask, bucket->hashmask);
+		data_release(bucket->data);
+		bucket->data = NULL;
+	}
+}
+
+
 // delete the contents of the bucket.  Note, that the bucket becomes empty, but the bucket itself is 
 // not destroyed.
 void bucket_destroy_contents(bucket_t *bucket)
@@ -187,115 +365,241 @@ void bucket_destroy_contents(bucket_t *bucket)
 	// at this point, since the bucket is being destroyed, there should be a connected transfer client.
 	assert(bucket->transfer_client == NULL);
 
-	if (bucket->data) {
-		data_destroy(bucket->data, _mask, bucket->hashmask);
-		data_free(bucket->data);
-		bucket->data = NULL;
-	}
+	shard_run(shard_get(bucket->shard), bucket_destroy_run, bucket);
 	
 	assert(bucket->data == NULL);
+	assert(bucket->oldbucket_event == NULL);
 }
 
 
-static void bucket_close(bucket_t *bucket)
+// fires regularly after a split, moving the bucket's entries out of the chained data.  Once all of 
+// them have been moved, lookups only need to look in the one place.
+static void bucket_oldbucket_handler(evutil_socket_t fd, short what, void *arg) 
 {
+	bucket_t *bucket = arg;
+	int moved;
+	
+	assert(fd == -1);
+	assert(arg);
+	assert(bucket->oldbucket_event);
+	assert(bucket->data);
+	
+	assert(bucket->shard == shard_id());
+	
+	moved = data_drain(bucket->data, DRAIN_LIMIT);
+	assert(moved >= 0);
+	__sync_fetch_and_add(&_buckets_drained, moved);
+	
+	if (bucket->data->next) {
+		evtimer_add(bucket->oldbucket_event, &_timeout_drain);
+	}
+	else {
+		logger(LOG_INFO, "Bucket %#llx has finished draining its split data.", bucket->hashmask);
+		event_free(bucket->oldbucket_event);
+		bucket->oldbucket_event = NULL;
+		assert(_buckets_draining > 0);
+		__sync_fetch_and_sub(&_buckets_draining, 1);
+	}
+}
+
+
+// start moving the items out of the chained data.  This is run by the shard that owns the bucket, 
+// so that the timer fires on its event base.
+static void bucket_drain_start(void *arg)
+{
+	bucket_t *bucket = arg;
+	
 	assert(bucket);
+	assert(bucket->shard == shard_id());
+	assert(bucket->oldbucket_event == NULL);
 	
+	bucket->oldbucket_event = evtimer_new(shard_current()->evbase, bucket_oldbucket_handler, bucket);
+	assert(bucket->oldbucket_event);
+	evtimer_add(bucket->oldbucket_event, &_timeout_drain);
+}
+
+
+
+// the old and new tables while the mask is being split.
+typedef struct {
+	bucket_table_t *oldtable;
+	bucket_table_t *newtable;
+} bucket_split_t;
+
+
+// run by each shard before the new table is put in place, so that the new buckets it will own can 
+// see everything in the old bucket they were split from.  The old buckets stop draining their own 
+// chains, the new ones will drain the whole chain instead.  Until the new table is in place, things 
+// are still stored in the old data, but nothing drains it, so that is fine.
+static void bucket_split_link(void *arg)
+{
+	bucket_split_t *split = arg;
+	bucket_t *oldbucket;
+	bucket_t *newbucket;
+	hash_t i;
+	
+	assert(split);
+	assert(split->oldtable);
+	assert(split->newtable);
+	
+	for (i=0; i<=split->oldtable->mask; i++) {
+		oldbucket = split->oldtable->buckets[i];
+		if (oldbucket && oldbucket->shard == shard_id() && oldbucket->oldbucket_event) {
+			event_free(oldbucket->oldbucket_event);
+			oldbucket->oldbucket_event = NULL;
+			assert(_buckets_draining > 0);
+			__sync_fetch_and_sub(&_buckets_draining, 1);
+		}
+	}
+	
+	for (i=0; i<=split->newtable->mask; i++) {
+		newbucket = split->newtable->buckets[i];
+		if (newbucket && newbucket->shard == shard_id()) {
+			oldbucket = split->oldtable->buckets[i & split->oldtable->mask];
+			assert(oldbucket);
+			assert(oldbucket->shard == newbucket->shard);
+			
+			assert(newbucket->data);
+			assert(newbucket->data->next == NULL);
+			assert(oldbucket->data);
+			assert(oldbucket->data->ref > 0);
+			newbucket->data->next = oldbucket->data;
+			oldbucket->data->ref ++;
+		}
+	}
+}
+
+
+// run by the shard that owns the new bucket, once the new table is in place.  Nothing is stored in 
+// the old data anymore, so the items can be counted, and moved out of it in the background.
+static void bucket_split_start(void *arg)
+{
+	bucket_t *bucket = arg;
+	
+	assert(bucket);
+	assert(bucket->shard == shard_id());
+	assert(bucket->data);
 	
-	// cant remember what this function is used for, need to look through the code that calls it.
-	// it might be the same as bucket_destroy.
-	assert(0);
+	data_recount(bucket->data);
+	bucket_drain_start(bucket);
 }
 
 
+// run by the shard that owns the old bucket, to let go of its data.  The new buckets have their own 
+// references to it.
+static void bucket_retire_run(void *arg)
+{
+	bucket_t *bucket = arg;
+	
+	assert(bucket);
+	assert(bucket->shard == shard_id());
+	assert(bucket->oldbucket_event == NULL);
+	
+	assert(bucket->data);
+	assert(bucket->data->ref > 1);
+	data_release(bucket->data);
+	bucket->data = NULL;
+}
 
 
-// this function will take the current array, and put it aside, creating a new array based on the 
+// none of the workers can still be looking at the old table, so it can be freed, along with the 
+// buckets in it.
+static void bucket_split_retire(void *arg)
+{
+	bucket_table_t *oldtable = arg;
+	bucket_t *bucket;
+	hash_t i;
+	
+	assert(oldtable);
+	
+	for (i=0; i<=oldtable->mask; i++) {
+		bucket = oldtable->buckets[i];
+		if (bucket) {
+			shard_run(shard_get(bucket->shard), bucket_retire_run, bucket);
+			assert(bucket->data == NULL);
+			free(bucket);
+		}
+	}
+	
+	free(oldtable);
+}
+
+
+
+// this function will take the current table, and put it aside, creating a new table based on the 
 // new mask supplied (we can only make the mask bigger, and cannot shrink it).
-// We create a new array, and for each entry, we compare it against the old mask, and use 
-// the data for that hash from the old list.
-// NOTE: We may be starting off with an empty lists.  If this is the first time we've 
+// We create a new table, and for each entry, we compare it against the old mask, and use 
+// the data for that hash from the old table.  The workers keep going while this is done, and are 
+// using the old table until the new one is put in place.
+// NOTE: We may be starting off with an empty table.  If this is the first time we've 
 //       received some hashmasks.  To implement this easily, if we dont already have hashmasks, we 
 //       may need to create one that has a dummy entry in it.
 void buckets_split_mask(hash_t current_mask, hash_t new_mask) 
 {
-	bucket_t **newbuckets = NULL;
-	bucket_t **oldbuckets = NULL;
-	
-	int i;
-	int index;
+	bucket_split_t split;
+	bucket_t *oldbucket;
+	bucket_t *newbucket;
+	hash_t i;
+	int shard;
 	
 	assert(new_mask > current_mask);
+	assert(shard_id() == 0);
 	
 	logger(LOG_INFO, "Splitting Mask: Old Mask: %#llx, New Mask; %#llx", current_mask, new_mask);
 	
-	// grab a copy of the existing buckets as the 'oldbuckets';
-	oldbuckets = _buckets;
-	_buckets = NULL;
-	
-	// make an appropriate sized new buckets list;
-	newbuckets = malloc(sizeof(bucket_t *) * (new_mask+1));
-	assert(newbuckets);
+	split.oldtable = _table;
+	assert(split.oldtable == NULL || split.oldtable->mask == current_mask);
+	split.newtable = table_new(new_mask);
 	
 	// go through every hash for this mask.
-	for (i=0; i<=new_mask; i++) {
-
-		// determine what the old index is.
-		index = i & current_mask;
-		
-		// create the new bucket ONLY if we already have a bucket object for that index.
-		if (oldbuckets == NULL || oldbuckets[index] == NULL) {
-			newbuckets[i] = NULL;
-		}
-		else {
-			// we have a bucket for this old index.  So we need to create a new one for this index.
-			
-			
-			newbuckets[i] = bucket_new(i);
-
-			assert(newbuckets[i]->data);
-			assert(newbuckets[i]->data->next == NULL);
-			assert(oldbuckets[index]->data);
-			assert(oldbuckets[index]->data->ref > 0);
-			newbuckets[i]->data->next = oldbuckets[index]->data;
-			oldbuckets[index]->data->ref ++;
-
-			assert(newbuckets[i]->hashmask == i);
-			newbuckets[i]->level = oldbuckets[index]->level;
+	if (split.oldtable) {
+		for (i=0; i<=new_mask; i++) {
 			
-			newbuckets[i]->source_node = oldbuckets[index]->source_node;
-			newbuckets[i]->backup_node = oldbuckets[index]->backup_node;
-			newbuckets[i]->logging_node = oldbuckets[index]->logging_node;
-			
-			newbuckets[i]->primary_node = oldbuckets[index]->primary_node;
-			newbuckets[i]->secondary_node = oldbuckets[index]->secondary_node;
-			
-			assert(data_in_transit() == 0);
-		}
-	}
-
-	assert(_mask >= 0);
-	assert(new_mask > _mask);
-	_mask = new_mask;
-	
-	// clean up the old buckets list.
-	if (oldbuckets) {
-		for (i=0; i<=_mask; i++) {
-			if (oldbuckets[i]) {
-				assert(oldbuckets[i]->data);
-				assert(oldbuckets[i]->data->ref > 1);
-				oldbuckets[i]->data->ref --;
-				assert(oldbuckets[i]->data->ref > 0);
+			// create the new bucket ONLY if we already have a bucket object for that index.
+			oldbucket = split.oldtable->buckets[i & current_mask];
+			if (oldbucket) {
+				newbucket = bucket_new(new_mask, i);
+				
+				// the new buckets share the old data until it has been drained, so they stay with 
+				// the shard that owns it.
+				newbucket->shard = oldbucket->shard;
+				
+				assert(newbucket->hashmask == i);
+				newbucket->level = oldbucket->level;
+				
+				newbucket->source_node = oldbucket->source_node;
+				newbucket->backup_node = oldbucket->backup_node;
+				newbucket->logging_node = oldbucket->logging_node;
 				
-				oldbuckets[i]->data = NULL;
+				newbucket->primary_node = oldbucket->primary_node;
+				newbucket->secondary_node = oldbucket->secondary_node;
 				
-				bucket_close(oldbuckets[i]);
+				assert(data_in_transit() == 0);
+				split.newtable->buckets[i] = newbucket;
 			}
 		}
-	}	
+		
+		for (shard=0; shard<=shards_workers(); shard++) {
+			shard_run(shard_get(shard), bucket_split_link, &split);
+		}
+	}
 	
-	_buckets = newbuckets;
-	assert(_buckets);
+	table_publish(split.newtable);
+	
+	// start moving the items out of the old data in the background.
+	for (i=0; i<=new_mask; i++) {
+		newbucket = split.newtable->buckets[i];
+		if (newbucket) {
+			assert(newbucket->oldbucket_event == NULL);
+			__sync_fetch_and_add(&_buckets_draining, 1);
+			shard_call(shard_get(newbucket->shard), bucket_split_start, newbucket);
+		}
+	}
+	
+	// the workers could still be using the old table, so it is freed when they are done with it.
+	if (split.oldtable) {
+		shard_defer(bucket_split_retire, split.oldtable);
+	}
 }
 
 
@@ -307,8 +611,10 @@ int buckets_nobackup_count(void)
 
 
 // check the integrity of the empty bucket, and then free the memory it uses.
-static void bucket_free(bucket_t *bucket)
+static void bucket_free(void *arg)
 {
+	bucket_t *bucket = arg;
+	
 	assert(bucket);
 	assert(bucket->level < 0);
 	assert(bucket->data == NULL);
@@ -390,6 +696,12 @@ static void bucket_shutdown_handler(evutil_socket_t fd, short what, void *arg)
 		// we are done with the bucket.
 	
 		assert(bucket->transfer_client == NULL);
+		
+		// take the bucket out of the table first, so that nothing else can get to it while the 
+		// contents are destroyed.
+		assert(_buckets[bucket->hashmask] == bucket);
+		bucket_set(bucket->hashmask, NULL);
+		
 		bucket_destroy_contents(bucket);
 		update_hashmasks(bucket);
 				
@@ -397,10 +709,8 @@ static void bucket_shutdown_handler(evutil_socket_t fd, short what, void *arg)
 		event_free(bucket->shutdown_event);
 		bucket->shutdown_event = NULL;
 
-		assert(_buckets[bucket->hashmask] == bucket);
-		_buckets[bucket->hashmask] = NULL;
-		
-		bucket_free(bucket);
+		// a worker could have looked the bucket up just before it was taken out.
+		shard_defer(bucket_free, bucket);
 		bucket = NULL;
 	}
 	else {
@@ -458,17 +768,16 @@ void buckets_init(hash_t mask, struct event_base *evbase)
 {
 	int i;
 
+	bucket_table_t *table;
+
 	assert(_evbase == NULL);
 	assert(evbase);
 	_evbase = evbase;
 	
+	assert(_table == NULL);
 	assert(_mask == 0);
-	assert(mask >= _mask);
-	_mask = mask;
-	
-	assert(_mask > 0);
-	_buckets = calloc(_mask+1, sizeof(bucket_t *));
-	assert(_buckets);
+	assert(mask > 0);
+	table = table_new(mask);
 
 	assert(_primary_buckets == 0);
 	assert(_secondary_buckets == 0);
@@ -476,13 +785,18 @@ void buckets_init(hash_t mask, struct event_base *evbase)
 	
 	
 	// for starters we will need to create a bucket for each hash.
-	for (i=0; i<=_mask; i++) {
-		_buckets[i] = bucket_new(i);
+	for (i=0; i<=mask; i++) {
+		table->buckets[i] = bucket_new(mask, i);
 
 		_primary_buckets ++;
-		_buckets[i]->level = 0;
+		table->buckets[i]->level = 0;
+	}
+	
+	table_publish(table);
+	assert(_mask == mask);
 
-		// send out a message to all connected clients, to let them know that the buckets have changed.
+	// send out a message to all connected clients, to let them know that the buckets have changed.
+	for (i=0; i<=_mask; i++) {
 		update_hashmasks(_buckets[i]); // all_hashmask(i, 0);
 	}
 
@@ -496,7 +810,6 @@ void buckets_init(hash_t mask, struct event_base *evbase)
 // for that item.  the 'data' module will then find the data store within that handles that item.
 int buckets_store_keyvalue(hash_t key_hash, char *name, int expires)
 {
-	hash_t bucket_index;
 	bucket_t *bucket;
 
 	assert(name);
@@ -504,22 +817,18 @@ int buckets_store_keyvalue(hash_t key_hash, char *name, int expires)
 	assert(expires >= 0);
 	if (expires < 0) { expires = 0; }
 
-	// calculate the bucket that this item belongs in.
-	assert(_mask > 0);
-	bucket_index = _mask & key_hash;
-	assert(bucket_index <= _mask);
-	bucket = _buckets[bucket_index];
+	// find the bucket that this item belongs in.
+	bucket = bucket_lookup(key_hash);
 
 	// if we have a record for this bucket, then we are either a primary or a backup for it.
 	if (bucket) {
-		assert(bucket->hashmask == bucket_index);
+		assert((key_hash & bucket->hashmask) == bucket->hashmask);
 		
 		// make sure that this server is 'primary' or 'secondary' for this bucket.
 		assert(bucket->data);
 		
 		// 'name' will be controlled by the keyvalue tree after this function.
-		data_set_keyvalue(key_hash, bucket->data, name, expires);
-		return(0);
+		return(data_set_keyvalue(key_hash, bucket->data, name, expires));
 	}
 	else {
 		// we dont have the bucket, we need to let the other node know that something has gone wrong.
@@ -532,19 +841,14 @@ const char * buckets_get_keyvalue(hash_t key_hash)
 {
 	const char *keyvalue = NULL;
 	
-	int bucket_index;
 	bucket_t *bucket;
 
-	// calculate the bucket that this item belongs in.
-	assert(_mask > 0);
-	bucket_index = _mask & key_hash;
-	assert(bucket_index >= 0);
-	assert(bucket_index <= _mask);
-	bucket = _buckets[bucket_index];
+	// find the bucket that this item belongs in.
+	bucket = bucket_lookup(key_hash);
 
 	// if we have a record for this bucket, then we are either a primary or a backup for it.
 	if (bucket) {
-		assert(bucket->hashmask == bucket_index);
+		assert((key_hash & bucket->hashmask) == bucket->hashmask);
 		
 		// make sure that this server is 'primary' for this bucket.
 		if (bucket->level != 0) {
@@ -568,6 +872,323 @@ const char * buckets_get_keyvalue(hash_t key_hash)
 
 
 
+// remove an item (or keyvalue) that has expired.  The wheel doesnt know if the item is still there, 
+// or if it has been set again since, so it only gets removed if it still has the same expiry.  If we 
+// are the primary for the bucket, the backup node is told to delete it as well.  Returns 1 if it 
+// was removed.
+int buckets_expire(hash_t map_hash, hash_t key_hash, int expires, int keyvalue)
+{
+	bucket_t *bucket;
+	int removed;
+
+	assert(expires > 0);
+	
+	bucket = bucket_lookup(key_hash);
+	if (bucket == NULL || bucket->data == NULL) {
+		// we dont have that bucket anymore.
+		return(0);
+	}
+	
+	if (keyvalue) {
+		removed = data_delete_keyvalue(bucket->data, key_hash, expires);
+	}
+	else {
+		removed = data_delete_item(bucket->data, map_hash, key_hash, expires);
+	}
+	
+	if (removed > 0 && bucket->backup_node) {
+		assert(bucket->level == 0);
+		assert(bucket->backup_node->client);
+		if (keyvalue) {
+			push_sync_delete_keyvalue(bucket->backup_node->client, key_hash);
+		}
+		else {
+			push_sync_delete(bucket->backup_node->client, map_hash, key_hash);
+		}
+	}
+	
+	return(removed);
+}
+
+
+// remove the item from whichever bucket it is in, regardless of its expiry.  If there is a backup 
+// node for the bucket, it will be told as well.
+int buckets_delete_value(hash_t map_hash, hash_t key_hash)
+{
+	bucket_t *bucket;
+	int removed;
+
+	bucket = bucket_lookup(key_hash);
+	if (bucket == NULL || bucket->data == NULL) {
+		return(0);
+	}
+	
+	removed = data_delete_item(bucket->data, map_hash, key_hash, 0);
+	if (removed > 0 && bucket->backup_node) {
+		assert(bucket->backup_node->client);
+		push_sync_delete(bucket->backup_node->client, map_hash, key_hash);
+	}
+	
+	return(removed);
+}
+
+
+int buckets_delete_keyvalue(hash_t key_hash)
+{
+	bucket_t *bucket;
+	int removed;
+
+	bucket = bucket_lookup(key_hash);
+	if (bucket == NULL || bucket->data == NULL) {
+		return(0);
+	}
+	
+	removed = data_delete_keyvalue(bucket->data, key_hash, 0);
+	if (removed > 0 && bucket->backup_node) {
+		assert(bucket->backup_node->client);
+		push_sync_delete_keyvalue(bucket->backup_node->client, key_hash);
+	}
+	
+	return(removed);
+}
+
+
+
+
+
+// Delete an item, or if 'map_hash' is 0, all the items for the key and its keyvalue.  The items 
+// are left as tombstones (see data_tombstone), and the backup node is told to do the same.  When 
+// 'primary' is set, the delete is only done if this node is the primary for the bucket.  Otherwise 
+// it has come from the primary, and a tombstone is left even if the item wasn't here.  Returns the 
+// number of entries that were deleted, or -1 if the bucket is not here.
+int buckets_delete(hash_t map_hash, hash_t key_hash, int primary)
+{
+	bucket_t *bucket;
+	int deleted;
+
+	bucket = bucket_lookup(key_hash);
+	if (bucket == NULL || bucket->data == NULL || (primary && bucket->level != 0)) {
+		return(-1);
+	}
+	
+	deleted = data_tombstone(bucket->data, map_hash, key_hash, primary == 0);
+	if (map_hash == 0) {
+		deleted += data_delete_keyvalue(bucket->data, key_hash, 0);
+	}
+	
+	if (deleted > 0 && bucket->backup_node) {
+		assert(bucket->backup_node->client);
+		push_sync_tombstone(bucket->backup_node->client, map_hash, key_hash);
+	}
+	
+	__sync_fetch_and_add(&_deleted, deleted);
+	
+	return(deleted);
+}
+
+
+
+// find the next primary bucket that has items in it, starting from where we got up to last time.  
+// Only the buckets that this shard owns are looked at, because it is its memory that has run out.
+static bucket_t * buckets_next_evictable(bucket_table_t *table)
+{
+	bucket_t *bucket;
+	hash_t tries;
+	
+	assert(table);
+	assert(table->mask > 0);
+	
+	for (tries = 0; tries <= table->mask; tries ++) {
+		bucket = __atomic_load_n(&table->buckets[_evict_next & table->mask], __ATOMIC_ACQUIRE);
+		_evict_next ++;
+		if (bucket && bucket->shard == shard_id() && bucket->level == 0 && bucket->data && bucket->data->item_count > 0) {
+			return(bucket);
+		}
+	}
+	
+	return(NULL);
+}
+
+
+// called by the slab allocator when it has run out of memory.  We look at a sample of items from 
+// the primary buckets and evict the best candidate according to the policy.  Items that would free 
+// up memory that can be used for 'size' are preferred.  Buckets that we are only a backup for are 
+// left alone, the primary will tell us when it evicts from them.  Returns the number of bytes 
+// that were freed.
+static int buckets_evict(int size)
+{
+	bucket_table_t *table;
+	bucket_t *bucket;
+	bucket_t *best_bucket = NULL;
+	item_t *item;
+	hash_t best_map = 0, best_key = 0;
+	long long score, best_score = -1;
+	unsigned int now;
+	int bytes = 0;
+	int sample;
+	
+	assert(size > 0);
+	assert(_evict_policy != EVICT_NONE);
+	assert(_evict_samples > 0);
+	
+	table = __atomic_load_n(&_table, __ATOMIC_ACQUIRE);
+	if (table == NULL) {
+		return(0);
+	}
+	
+	now = seconds_get();
+	for (sample = 0; sample < _evict_samples; sample ++) {
+		bucket = buckets_next_evictable(table);
+		if (bucket == NULL) {
+			break;
+		}
+		
+		item = data_sample(bucket->data);
+		if (item) {
+			score = item_evict_score(item, _evict_policy, now);
+			if (slab_same_class(sizeof(item_t), size) 
+					|| (value_bytes(&item->value) > 0 && slab_same_class(value_bytes(&item->value), size))) {
+				score += (1LL << 50);
+			}
+			
+			if (score > best_score) {
+				best_score = score;
+				best_bucket = bucket;
+				best_map = item->map_key;
+				best_key = item->item_key;
+				bytes = item_bytes(item);
+			}
+		}
+	}
+	
+	if (best_bucket == NULL) {
+		__sync_fetch_and_add(&_evict_missed, 1);
+		return(0);
+	}
+	
+	logger(LOG_DEBUG, "evicting [%#llx/%#llx] from bucket %#llx.", best_map, best_key, best_bucket->hashmask);
+	
+	if (data_delete_item(best_bucket->data, best_map, best_key, 0) == 0) {
+		__sync_fetch_and_add(&_evict_missed, 1);
+		return(0);
+	}
+	
+	if (best_bucket->backup_node) {
+		assert(best_bucket->backup_node->client);
+		push_sync_delete(best_bucket->backup_node->client, best_map, best_key);
+	}
+	
+	__sync_fetch_and_add(&_evicted, 1);
+	__sync_fetch_and_add(&_evicted_bytes, bytes);
+	
+	return(bytes);
+}
+
+
+// set the eviction policy.  It can be 'none', 'lru' (least recently used), 'lfu' (least 
+// frequently used) or 'ttl' (items closest to expiring, then least recently used).  With 'none', 
+// nothing is evicted and storing fails when the memory runs out.
+void buckets_eviction(const char *policy, int samples)
+{
+	assert(_evict_policy == EVICT_NONE);
+	
+	if (policy == NULL || strcasecmp(policy, "none") == 0) {
+		return;
+	}
+	else if (strcasecmp(policy, "lru") == 0) { _evict_policy = EVICT_LRU; }
+	else if (strcasecmp(policy, "lfu") == 0) { _evict_policy = EVICT_LFU; }
+	else if (strcasecmp(policy, "ttl") == 0) { _evict_policy = EVICT_TTL; }
+	else {
+		logger(LOG_ERROR, "Unknown eviction policy '%s'.  Nothing will be evicted.", policy);
+		return;
+	}
+	
+	_evict_samples = samples > 0 ? samples : EVICT_SAMPLES;
+	slab_reclaim(buckets_evict);
+	
+	logger(LOG_INFO, "Eviction policy: %s, sampling %d items.", policy, _evict_samples);
+}
+
+
+
+
+
+// reverse the order of the bits, so that the scan cursor can be incremented from the top.
+static hash_t reverse_bits(hash_t v)
+{
+	v = ((v >> 1) & 0x5555555555555555llu) | ((v & 0x5555555555555555llu) << 1);
+	v = ((v >> 2) & 0x3333333333333333llu) | ((v & 0x3333333333333333llu) << 2);
+	v = ((v >> 4) & 0x0F0F0F0F0F0F0F0Fllu) | ((v & 0x0F0F0F0F0F0F0F0Fllu) << 4);
+	v = ((v >> 8) & 0x00FF00FF00FF00FFllu) | ((v & 0x00FF00FF00FF00FFllu) << 8);
+	v = ((v >> 16) & 0x0000FFFF0000FFFFllu) | ((v & 0x0000FFFF0000FFFFllu) << 16);
+	v = (v >> 32) | (v << 32);
+	return(v);
+}
+
+
+// Scan through the items in all of the primary buckets, a page at a time.  Each item is passed to 
+// the handler, which returns non-zero when the page is full.  'limit' is the maximum number of 
+// entries (and buckets) that will be looked at.  Returns non-zero when the scan is complete.
+//
+// The buckets are visited in the order of their reversed index bits (the same as redis does).  
+// When the mask is split, the buckets that have already been visited become buckets with reversed 
+// indexes that are lower than the cursor, so they are not visited again, and the ones that 
+// haven't been visited yet are still in front of it.  If the mask changes in the middle of a 
+// bucket, then the new buckets that it was split into are scanned from the start.  When there are 
+// worker threads, the page stops at a bucket that belongs to another shard, and the next page is 
+// done by that shard (the command is routed on the cursor, see buckets_shard).
+int buckets_scan(buckets_scan_t *cursor, hash_t map_hash, int limit, int (*handler)(item_t *item, void *arg), void *arg)
+{
+	bucket_table_t *table;
+	bucket_t *bucket;
+	
+	assert(cursor);
+	assert(limit > 0);
+	assert(handler);
+	
+	// the whole page is done from the same table, even if it is replaced in the middle of it.
+	table = __atomic_load_n(&_table, __ATOMIC_ACQUIRE);
+	if (table == NULL) {
+		return(1);
+	}
+	
+	assert(table->mask > 0);
+	if (cursor->mask != table->mask) {
+		cursor->mask = table->mask;
+		cursor->bucket &= table->mask;
+		memset(&cursor->data, 0, sizeof(cursor->data));
+	}
+	
+	while (limit > 0) {
+		bucket = __atomic_load_n(&table->buckets[cursor->bucket & table->mask], __ATOMIC_ACQUIRE);
+		if (bucket && bucket->shard != shard_id()) {
+			return(0);
+		}
+		limit --;
+		
+		if (bucket && bucket->level == 0 && bucket->data) {
+			if (data_scan(bucket->data, &cursor->data, map_hash, &limit, handler, arg) == 0) {
+				// the page is full, or we ran out of the limit.
+				return(0);
+			}
+		}
+		
+		// move on to the next bucket.
+		memset(&cursor->data, 0, sizeof(cursor->data));
+		cursor->bucket |= ~table->mask;
+		cursor->bucket = reverse_bits(reverse_bits(cursor->bucket) + 1);
+		if (cursor->bucket == 0) {
+			return(1);
+		}
+	}
+	
+	return(0);
+}
+
+
+
+
+
 static void hashmasks_dump(void)
 {
 	hash_t i;
@@ -630,10 +1251,10 @@ static void bucket_dump(bucket_t *bucket)
 	assert(mode);
 	assert(altmode);
 	assert(altnode);
-	stat_dumpstr("    Bucket:%#llx, Mode:%s, %s Node:%s", bucket->hashmask, mode, altmode, altnode);
+	stat_dumpstr("    Bucket:%#llx, Mode:%s, %s Node:%s, Shard:%d", bucket->hashmask, mode, altmode, altnode, bucket->shard);
 	
 	assert(bucket->data);
-//	data_dump(bucket->data);
+	data_dump(bucket->data);
 
 	if (bucket->transfer_client) {
 		node = bucket->transfer_client->node;
@@ -650,6 +1271,7 @@ static void bucket_dump(bucket_t *bucket)
 void buckets_dump(void)
 {
 	int i;
+	long long items, keyvalues, bytes;
 	
 	stat_dumpstr("BUCKETS");
 	stat_dumpstr("  Mask: %#llx", _mask);
@@ -658,6 +1280,15 @@ void buckets_dump(void)
 	stat_dumpstr("  Secondary Buckets: %d", _secondary_buckets);
 	stat_dumpstr("  Bucket currently transferring: %s", _bucket_transfer == NULL ? "no" : "yes");
 	stat_dumpstr("  Migration Sync Counter: %d", _migrate_sync);
+	stat_dumpstr("  Buckets draining split data: %d", _buckets_draining);
+	stat_dumpstr("  Entries drained from split data: %lld", _buckets_drained);
+	buckets_data_totals(&items, &keyvalues, &bytes);
+	stat_dumpstr("  Items: %lld", items);
+	stat_dumpstr("  Keyvalues: %lld", keyvalues);
+	stat_dumpstr("  Data Bytes: %lld", bytes);
+	stat_dumpstr("  Deleted: %lld", _deleted);
+	stat_dumpstr("  Evicted: %lld (%lld bytes)", _evicted, _evicted_bytes);
+	stat_dumpstr("  Evictions without a candidate: %lld", _evict_missed);
 
 	hashmasks_dump();
 	
@@ -684,26 +1315,38 @@ void buckets_dump(void)
 // a node pointer.
 node_t * buckets_get_primary_node(hash_t key_hash) 
 {
-	int bucket_index;
 	bucket_t *bucket;
 
-	// calculate the bucket that this item belongs in.
-	assert(_mask > 0);
-	bucket_index = _mask & key_hash;
-	assert(bucket_index >= 0);
-	assert(bucket_index <= _mask);
+	// find the bucket that this item belongs in.
+	bucket = bucket_lookup(key_hash);
+	assert(bucket);
 	
-	logger(LOG_DEBUG, "buckets_get_primary_node(): bucket_index=%d", bucket_index);
+	logger(LOG_DEBUG, "buckets_get_primary_node(): bucket_index=%#llx", bucket->hashmask);
 	
-	bucket = _buckets[bucket_index];
 	if (bucket->source_node == NULL) {
 		// that bucket is being handled locally.
 		return(NULL);
 	}
 	else {
 		assert(bucket->primary_node);
-		return(bucket->primary_node);
+		return(__atomic_load_n(&bucket->primary_node, __ATOMIC_ACQUIRE));
+	}
+}
+
+
+// the shard that owns the bucket that the key belongs in.  If the bucket isn't here, then it doesnt 
+// matter which shard deals with it, so it is left with the current one.
+int buckets_shard(hash_t key_hash)
+{
+	bucket_t *bucket;
+	
+	bucket = bucket_lookup(key_hash);
+	if (bucket == NULL) {
+		return(shard_id());
 	}
+	
+	assert(bucket->shard >= 0 && bucket->shard <= shards_workers());
+	return(bucket->shard);
 }
 
 
@@ -720,6 +1363,31 @@ int buckets_get_secondary_count(void)
 }
 
 
+// add up the items, keyvalues and bytes in all the buckets we have (primary and backup).  Any of 
+// the pointers can be NULL if that total isn't needed.
+void buckets_data_totals(long long *items, long long *keyvalues, long long *bytes)
+{
+	long long total_items = 0;
+	long long total_keyvalues = 0;
+	long long total_bytes = 0;
+	hash_t i;
+	
+	if (_buckets) {
+		for (i=0; i<=_mask; i++) {
+			if (_buckets[i] && _buckets[i]->data) {
+				total_items += _buckets[i]->data->item_count;
+				total_keyvalues += _buckets[i]->data->list_count;
+				total_bytes += _buckets[i]->data->data_size;
+			}
+		}
+	}
+	
+	if (items) { *items = total_items; }
+	if (keyvalues) { *keyvalues = total_keyvalues; }
+	if (bytes) { *bytes = total_bytes; }
+}
+
+
 // return the number of buckets that are currently transferring.
 int buckets_transferring(void)
 {
@@ -755,9 +1423,9 @@ int buckets_accept_bucket(client_t *client, hash_t mask, hash_t hashmask)
 			assert(hashmask <= mask);
 			assert(_mask == mask);
 			
-			// if we dont currently have a buckets list, we need to create one.
-			if (_buckets == NULL) {
-				_buckets = calloc(_mask + 1, sizeof(bucket_t *));
+			// if we dont currently have a buckets table, we need to create one.
+			if (_table == NULL) {
+				table_publish(table_new(mask));
 				assert(_buckets);
 				assert(_buckets[0] == NULL);
 				assert(_primary_buckets == 0);
@@ -773,9 +1441,8 @@ int buckets_accept_bucket(client_t *client, hash_t mask, hash_t hashmask)
 				logger(LOG_INFO, "accepting bucket. (%#llx/%#llx)", mask, hashmask);
 				
 				// need to create the bucket, and mark it as in-transit.
-				bucket_t *bucket = bucket_new(hashmask);
+				bucket_t *bucket = bucket_new(mask, hashmask);
 				assert(bucket);
-				_buckets[hashmask] = bucket;
 				assert(data_in_transit() == 0);
 				assert(bucket->transfer_client == NULL);
 				assert(client->node);
@@ -786,6 +1453,8 @@ int buckets_accept_bucket(client_t *client, hash_t mask, hash_t hashmask)
 				
 				assert(_bucket_transfer == NULL);
 				_bucket_transfer = bucket;
+				
+				bucket_set(hashmask, bucket);
 			}
 		}
 	}
@@ -857,6 +1526,8 @@ void buckets_control_bucket(client_t *client, hash_t mask, hash_t hashmask, int
 	assert(data_in_transit() == 0);
 	assert(bucket->transfer_event == NULL);
 	
+	shards_pause();
+	
 	// mark the bucket as ready for action.
 	if (level == 0) {
 		// we are switching a bucket from secondary to primary.
@@ -902,6 +1573,8 @@ void buckets_control_bucket(client_t *client, hash_t mask, hash_t hashmask, int
 	node_t *node = bucket->primary_node;
 	bucket->primary_node = bucket->secondary_node;
 	bucket->secondary_node = node;
+	
+	shards_resume();
 		
 	// since this node is receiving the 'switch' command, we should not have any buckets transferring.
 	assert(_bucket_transfer == NULL);
@@ -919,15 +1592,17 @@ void buckets_hashmasks_update(node_t *node, hash_t hashmask, int level)
 	// verify that the hash provided actually describes a bucket.
 	assert((hashmask & _mask) == hashmask);	
 	
+	// the workers only look at the node pointers on their own, so they can be changed without 
+	// stopping them.
 	if (level == 0) {
-		_buckets[hashmask]->primary_node = node;
+		__atomic_store_n(&_buckets[hashmask]->primary_node, node, __ATOMIC_RELEASE);
 		
 		logger(LOG_DEBUG, "Setting HASHMASK: Primary [%#llx] = '%s'",
 			hashmask, node_name(node)
 		);
 	}
 	else if (level == 1) {
-		_buckets[hashmask]->secondary_node = node;
+		__atomic_store_n(&_buckets[hashmask]->secondary_node, node, __ATOMIC_RELEASE);
 
 		logger(LOG_DEBUG, "Setting HASHMASK: Secondary [%#llx] = '%s'",
 			hashmask, node_name(node)
@@ -942,8 +1617,12 @@ void buckets_hashmasks_update(node_t *node, hash_t hashmask, int level)
 // return the mask
 hash_t buckets_mask(void)
 {
-	assert(_mask > 0);
-	return(_mask);
+	bucket_table_t *table;
+	
+	table = __atomic_load_n(&_table, __ATOMIC_ACQUIRE);
+	assert(table);
+	assert(table->mask > 0);
+	return(table->mask);
 }
 
 
@@ -1023,6 +1702,8 @@ void buckets_finalize_migration(client_t *client, hash_t hashmask, int level, co
 	logger(LOG_DEBUG, "Removing transfer client ('%s') from bucket %#llx.", node_name(client->node), bucket->hashmask);
 
 	bucket->transfer_client = NULL;
+	
+	shards_pause();
 		
 	// mark the bucket as ready for action.
 	bucket->level = level;
@@ -1069,6 +1750,8 @@ void buckets_finalize_migration(client_t *client, hash_t hashmask, int level, co
 		_secondary_buckets ++;
 		assert(_secondary_buckets > 0);
 	}
+	
+	shards_resume();
 }
 
 
@@ -1137,46 +1820,141 @@ bucket_t * buckets_nobackup_bucket(void)
 
 
 
-static bucket_t * choose_bucket_for_migrate(client_t *client, int primary, int backups, int ideal) 
+// a bucket can be sent to the client's node if it is at 'send_level', and that node doesn't 
+// already have the other copy of it.
+static int bucket_can_migrate(client_t *client, int send_level, bucket_t *bucket)
+{
+	assert(client);
+	assert(send_level == 0 || send_level == 1);
+	
+	if (bucket == NULL || bucket->level != send_level) {
+		return(0);
+	}
+	
+	if (send_level == 0) {
+		assert(bucket->source_node == NULL);
+		assert(bucket->backup_node);
+		return(bucket->backup_node != client->node);
+	}
+	else {
+		assert(bucket->source_node);
+		assert(bucket->backup_node == NULL);
+		return(bucket->source_node != client->node);
+	}
+}
+
+
+// find a bucket at 'send_level' that can be sent to the client's node.  If 'max_bytes' is -1, 
+// then the first one found will do, otherwise it is the biggest one that has no more than 
+// 'max_bytes' of data.
+static bucket_t * find_bucket_for_migrate(client_t *client, int send_level, long long max_bytes)
 {
 	bucket_t *bucket = NULL;
-	int send_level = 0;
 	int i;
 	
+	assert(client);
+	assert(send_level == 0 || send_level == 1);
+	
+	for (i=0; i<=_mask && (bucket == NULL || max_bytes >= 0); i++) {
+		if (bucket_can_migrate(client, send_level, _buckets[i])) {
+			if (max_bytes < 0) {
+				bucket = _buckets[i];
+			}
+			else {
+				assert(_buckets[i]->data);
+				if (_buckets[i]->data->data_size > 0 && _buckets[i]->data->data_size <= max_bytes) {
+					if (bucket == NULL || _buckets[i]->data->data_size > bucket->data->data_size) {
+						bucket = _buckets[i];
+					}
+				}
+			}
+		}
+	}
+	
+	return(bucket);
+}
+
+
+// the bucket at 'send_level' with the least data in it, that can be sent to the client's node.
+static bucket_t * find_smallest_bucket_for_migrate(client_t *client, int send_level)
+{
+	bucket_t *bucket = NULL;
+	int i;
+	
+	assert(client);
+	assert(send_level == 0 || send_level == 1);
+	
+	for (i=0; i<=_mask; i++) {
+		if (bucket_can_migrate(client, send_level, _buckets[i])) {
+			assert(_buckets[i]->data);
+			if (bucket == NULL || _buckets[i]->data->data_size < bucket->data->data_size) {
+				bucket = _buckets[i];
+			}
+		}
+	}
+	
+	return(bucket);
+}
+
+
+// 'bytes' is the amount of data the other node has, or -1 if it didn't tell us.
+//
+// The counts and the bytes are balanced separately.  Sending a bucket to even out the bytes can 
+// leave us with fewer buckets than the ideal, in which case the other node will send one back to 
+// even out the counts.  So that the two dont undo each other, a bucket sent for the counts is 
+// chosen by its size as well (if we know how much the other node has): the biggest one that still 
+// leaves it with less than us, or failing that, the smallest one we have.  Each round trip then 
+// moves data towards the node that has less, and it stops once it is within the margin.
+static bucket_t * choose_bucket_for_migrate(client_t *client, int primary, int backups, int ideal, long long bytes) 
+{
+	bucket_t *bucket = NULL;
+	int send_level = 0;
+	long long ours = 0;
+	long long margin;
+	
+	// If we have more primary than secondary buckets, then we need to send a primary, 
+	// otherwise we need to send a secondary.
+	assert(send_level == 0);
+	if (_secondary_buckets >= _primary_buckets) {
+		send_level = 1;
+	}
+	
+	if (bytes >= 0) {
+		buckets_data_totals(NULL, NULL, &ours);
+	}
+		
 	if (((primary+backups) < ideal) && ((_primary_buckets+_secondary_buckets) > ideal)) {
 		// we have more buckets than the target, and it needs one, so should send one.
 		
 		assert(bucket == NULL);
-						
-		// If we have more primary than secondary buckets, then we need to send a primary, 
-		// otherwise we need to send a secondary.
-		assert(send_level == 0);
-		if (_secondary_buckets >= _primary_buckets) {
-			send_level = 1;
+		if (bytes < 0) {
+			bucket = find_bucket_for_migrate(client, send_level, -1);
+		}
+		else {
+			if (ours > bytes) {
+				bucket = find_bucket_for_migrate(client, send_level, (ours - bytes) / 2);
+			}
+			if (bucket == NULL) {
+				bucket = find_smallest_bucket_for_migrate(client, send_level);
+			}
+		}
+	}
+	else if (bytes >= 0) {
+		// the amount of data might not be balanced, whatever the number of buckets is.  We only 
+		// start sending once we have more than the margin over the target (and at least a bucket's 
+		// worth), and the bucket sent is small enough that the target will still have no more than 
+		// us afterwards.  So once a bucket is sent, the difference has to grow past the margin again 
+		// the other way before one is sent back, which stops them bouncing between the two.
+		margin = ours / LOADLEVEL_BYTES_MARGIN;
+		if (margin < LOADLEVEL_BYTES_MIN) {
+			margin = LOADLEVEL_BYTES_MIN;
 		}
 		
-		// simply go through the bucket list until we find the appropriate bucket.
-		for (i=0; i<=_mask && bucket == NULL; i++) {
-			if (_buckets[i]) {
-				if (_buckets[i]->level == send_level) {
-					
-					if (send_level == 0) {
-						assert(_buckets[i]->source_node == NULL);
-						assert(_buckets[i]->backup_node);
-						
-						if (_buckets[i]->backup_node != client->node) {
-							bucket = _buckets[i];
-						}
-					}
-					else {
-						assert(_buckets[i]->source_node);
-						assert(_buckets[i]->backup_node == NULL);
-						
-						if (_buckets[i]->source_node != client->node) {
-							bucket = _buckets[i];
-						}
-					}
-				}
+		if (ours - bytes > margin) {
+			bucket = find_bucket_for_migrate(client, send_level, (ours - bytes) / 2);
+			if (bucket) {
+				logger(LOG_DEBUG, "Balancing data.  Ours:%lld, Theirs:%lld, Bucket:%#llx (%lld bytes)", 
+					ours, bytes, bucket->hashmask, bucket->data->data_size);
 			}
 		}
 	}
@@ -1187,7 +1965,7 @@ static bucket_t * choose_bucket_for_migrate(client_t *client, int primary, int b
 
 // This function checks the list of buckets to find a suitable one to transfer if any need to be 
 // transferred to keep balance between this node, and the other node.
-bucket_t * buckets_check_loadlevels(client_t *client, int primary, int backups)
+bucket_t * buckets_check_loadlevels(client_t *client, int primary, int backups, long long bytes)
 {
 	bucket_t *bucket = NULL;
 	
@@ -1242,7 +2020,7 @@ bucket_t * buckets_check_loadlevels(client_t *client, int primary, int backups)
 				assert(0);
 			}
 			else {
-				bucket = choose_bucket_for_migrate(client, primary, backups, ideal);
+				bucket = choose_bucket_for_migrate(client, primary, backups, ideal, bytes);
 			}
 		}	
 	}
@@ -1252,8 +2030,31 @@ bucket_t * buckets_check_loadlevels(client_t *client, int primary, int backups)
 
 
 
+typedef struct {
+	bucket_t *bucket;
+	int limit;
+	int items;
+} transfer_items_t;
+
+
+// run by the shard that owns the bucket being transferred.
+static void transfer_items_run(void *arg)
+{
+	transfer_items_t *transfer = arg;
+	
+	assert(transfer);
+	assert(transfer->bucket);
+	assert(transfer->bucket->shard == shard_id());
+	assert(transfer->bucket->data);
+	
+	transfer->items = data_migrate_items(transfer->bucket->transfer_client, transfer->bucket->data, transfer->bucket->hashmask, transfer->limit);
+}
+
+
 int buckets_transfer_items(client_t *client)
 {
+	transfer_items_t transfer;
+	
 	assert(client);
 	assert(_bucket_transfer);
 	assert(_bucket_transfer->transfer_client == client);
@@ -1266,12 +2067,16 @@ int buckets_transfer_items(client_t *client)
 	
 	logger(LOG_DEBUG, "Requesting %d items to migrate.", avail);
 	
-	// ask the data system for a certain number of migrate items.
+	// ask the data system for a certain number of migrate items.  Only the shard that owns the 
+	// bucket can look at the data.
 	assert(_bucket_transfer->data);
 	assert(avail > 0);
-	int items = data_migrate_items(_bucket_transfer->transfer_client, _bucket_transfer->data, _bucket_transfer->hashmask, avail);
-	assert(items >= 0);
-	return(items);
+	transfer.bucket = _bucket_transfer;
+	transfer.limit = avail;
+	transfer.items = 0;
+	shard_run(shard_get(_bucket_transfer->shard), transfer_items_run, &transfer);
+	assert(transfer.items >= 0);
+	return(transfer.items);
 }
 
 
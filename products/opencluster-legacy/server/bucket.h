@@ -46,12 +46,14 @@ typedef struct {
 	struct event *shutdown_event;
 	struct event *transfer_event;
 
-	// an event will fire every second to pull out an item from the tree and put it in its proper 
-	// tree.  If there are 10,000 items in the tree, this could take a while.  However, every time a 
-	// lookup on an item is made, and it is found in one of these trees, it is removed and put in 
-	// the proper tree so active items should get moved pretty quickly.
+	// after a split, this event fires regularly to move a batch of this bucket's items out of the
+	// chained data and into its own (see data_drain).  It is freed when the chain is empty.
 	struct event *oldbucket_event;
 	
+	// the shard that owns the data in this bucket (see shard.h).  Only that shard looks at the data, 
+	// or stores anything in it.
+	int shard;
+	
 	// indicate that the bucket is attempting to promote a bucket on another node.  We keep the 
 	// bucket until it is confirmed that the other node has promoted.
 	enum {
@@ -62,27 +64,46 @@ typedef struct {
 } bucket_t;
 
 
+// the position of a scan through all the primary buckets (see buckets_scan).  A zeroed cursor 
+// starts a new scan.
+typedef struct {
+	hash_t bucket;			// the bucket index with its bits reversed.
+	hash_t mask;			// the mask that was in use when the position was saved.
+	data_scan_t data;		// position within that bucket.
+} buckets_scan_t;
+
+
 value_t * buckets_get_value(hash_t map_hash, hash_t key_hash);
 int buckets_store_value(hash_t map_hash, hash_t key_hash, int expires, value_t *value);
+int buckets_store_value_if(hash_t map_hash, hash_t key_hash, int expires, value_t *value, long long expected, long long *current);
+int buckets_incr_value(hash_t map_hash, hash_t key_hash, long long delta, int expires, value_t *result);
 void buckets_split_mask(hash_t current_mask, hash_t new_mask);
 void buckets_init(hash_t mask, struct event_base *evbase);
 int buckets_store_keyvalue(hash_t key_hash, char *name, int expires);
 const char * buckets_get_keyvalue(hash_t hash_hash);
+int buckets_expire(hash_t map_hash, hash_t key_hash, int expires, int keyvalue);
+int buckets_delete_value(hash_t map_hash, hash_t key_hash);
+int buckets_delete_keyvalue(hash_t key_hash);
+int buckets_delete(hash_t map_hash, hash_t key_hash, int primary);
+void buckets_eviction(const char *policy, int samples);
+int buckets_scan(buckets_scan_t *cursor, hash_t map_hash, int limit, int (*handler)(item_t *item, void *arg), void *arg);
 
 
-bucket_t * bucket_new(hash_t hash);
+bucket_t * bucket_new(hash_t mask, hash_t hashmask);
 int buckets_shutdown(void);
 
 int buckets_nobackup_count(void);
 void bucket_destroy_contents(bucket_t *bucket);
 
 node_t * buckets_get_primary_node(hash_t key_hash);
+int buckets_shard(hash_t key_hash);
 int buckets_get_migrate_sync(void);
 
 void buckets_dump(void);
 
 int buckets_get_primary_count(void);
 int buckets_get_secondary_count(void);
+void buckets_data_totals(long long *items, long long *keyvalues, long long *bytes);
 
 int buckets_transferring(void);
 int buckets_send_bucket(client_t *client, hash_t mask, hash_t hashmask);
@@ -96,7 +117,7 @@ bucket_t * buckets_find_switchable(node_t *node);
 bucket_t * buckets_nobackup_bucket(void);
 
 void buckets_finalize_migration(client_t *client, hash_t hashmask, int level, conninfo_t *conninfo);
-bucket_t * buckets_check_loadlevels(client_t *client, int primary, int backups);
+bucket_t * buckets_check_loadlevels(client_t *client, int primary, int backups, long long bytes);
 
 void buckets_set_transferring(bucket_t *bucket, client_t *client);
 void buckets_clear_transferring(bucket_t *bucket);
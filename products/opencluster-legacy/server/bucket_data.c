@@ -4,11 +4,13 @@
 #include "bucket.h"
 #include "client.h"
 #include "constants.h"
+#include "expiry.h"
 #include "hash.h"
 #include "item.h"
 #include "logging.h"
 #include "push.h"
 #include "seconds.h"
+#include "slab.h"
 #include "stats.h"
 
 #include <assert.h>
@@ -17,20 +19,10 @@
 
 
 
-typedef struct {
-	hash_t search_hash;
-	hash_t search_mask;
-	maplist_t *map;
-	item_t *item;
-	int items_count;
-	int limit;
-	client_t *client;
-} trav_t;
-
-
 // the number of items that have been sent to the transfer client, but have not been ack'd yet.  
 // Since only one bucket can be migrating at a time, this should be only in use by one bucket at a 
-// time.  No need to keep seperate values per bucket.
+// time.  No need to keep seperate values per bucket.  The items are sent by the shard that owns the 
+// bucket, but the acks are processed by the main loop, so it is only changed atomically.
 int _in_transit = 0;
 
 
@@ -46,21 +38,9 @@ int data_in_transit(void)
 void data_in_transit_dec(void)
 {
 	assert(_in_transit > 0);
-	_in_transit --;
+	__sync_fetch_and_sub(&_in_transit, 1);
 }
 
-static gint key_compare_fn(gconstpointer a, gconstpointer b)
-{
-	const register hash_t *aa, *bb;
-	
-	aa = a;
-	bb = b;
-	
-	return((*aa) - (*bb));
-}
-
-
-
 bucket_data_t * data_new(hash_t mask, hash_t hashmask)
 {
 	bucket_data_t *data;
@@ -72,12 +52,21 @@ bucket_data_t * data_new(hash_t mask, hash_t hashmask)
 	data = malloc(sizeof(bucket_data_t));
 	assert(data);
 	data->ref = 1;
-	data->tree = g_tree_new(key_compare_fn);
-	assert(data->tree);
+	data->items = hashindex_new(0);
+	assert(data->items);
+	data->lists = hashindex_new(0);
+	assert(data->lists);
 	data->next = NULL;
 	
+	data->drain = NULL;
+	data->drain_cursor = 0;
+	data->drain_lists = 0;
+	data->drained = 0;
+	
 	data->item_count = 0;
+	data->list_count = 0;
 	data->data_size = 0;
+	data->tombstone_count = 0;
 	
 	assert(mask > 0);
 	assert(hashmask >= 0 && hashmask <= mask);
@@ -90,141 +79,245 @@ bucket_data_t * data_new(hash_t mask, hash_t hashmask)
 
 
 
-gboolean traverse_map_fn(gpointer p_key, gpointer p_value, void *p_data)
+// remove all the items and keyvalues from the chain of containers that match the mask.
+void data_destroy(bucket_data_t *data, hash_t mask, hash_t hashmask) 
 {
-	trav_t *data = p_data;
+	bucket_data_t *current;
+	hashindex_entry_t *entry;
+	item_t *item;
+	maplist_t *list;
+	int cursor;
 	
-	assert(p_key);
-	assert(p_value);
-	assert(p_data);
-	assert(data->map);
-	assert(data->item == NULL);
-	assert(data->search_mask > 0);
+	assert(data);
+	assert(mask > 0);
+	assert(hashmask >= 0);
+	assert(hashmask <= mask);
 
-	data->item = p_value;
-	return(TRUE);
+	// removing entries from the index does not move anything else around, so we can remove them 
+	// as we go through it.
+	current = data;
+	while (current) {
+		
+		assert(current->items);
+		assert(current->lists);
+
+		cursor = 0;
+		while ((entry = hashindex_next(current->items, &cursor))) {
+			if ((entry->key_hash & mask) == hashmask) {
+				item = hashindex_remove(current->items, entry->key_hash, entry->map_hash);
+				assert(item);
+				item_destroy(item);
+			}
+		}
+		
+		cursor = 0;
+		while ((entry = hashindex_next(current->lists, &cursor))) {
+			if ((entry->key_hash & mask) == hashmask) {
+				list = hashindex_remove(current->lists, entry->key_hash, entry->map_hash);
+				assert(list);
+				if (list->keyvalue) { free(list->keyvalue); }
+				slab_free(list, sizeof(maplist_t));
+			}
+		}
+	
+		current = current->next;
+	}
+	
+	// everything that belonged to this bucket is gone now.
+	data->item_count = 0;
+	data->list_count = 0;
+	data->data_size = 0;
+	data->tombstone_count = 0;
 }
 
+void data_free(bucket_data_t *data)
+{
+	assert(data);
+	assert(data->ref == 0);
+	assert(data->next == NULL);
+	assert(data->items);
+	assert(data->lists);
+	
+	hashindex_free(data->items);
+	data->items = NULL;
+	hashindex_free(data->lists);
+	data->lists = NULL;
+	
+	free(data);
+}
 
 
-
-gboolean traverse_hash_fn(gpointer p_key, gpointer p_value, void *p_data)
+// drop a reference to the container.  When nothing is referencing it anymore, it is freed, along 
+// with the reference it had to the next container in the chain.
+void data_release(bucket_data_t *data)
 {
-	trav_t *data = p_data;
-	hash_t *key = p_key;
-	
-	assert(p_key);
-	assert(p_value);
-	assert(p_data);
-	assert(data->map == NULL);
-	assert(data->search_mask > 0);
-	
-	if ((*key & data->search_mask) == data->search_hash) {
-		data->map = p_value;
-		return(TRUE);
-	}
-	else {
-		// this item isn't one that we care about.
-		return(FALSE);
+	bucket_data_t *next;
+	
+	while (data) {
+		assert(data->ref > 0);
+		data->ref --;
+		if (data->ref > 0) {
+			break;
+		}
+		
+		next = data->next;
+		data->next = NULL;
+		data->drain = NULL;
+		data_free(data);
+		data = next;
 	}
 }
 
-void data_destroy(bucket_data_t *data, hash_t mask, hash_t hashmask) 
+
+// the amount of memory that the keyvalue is taking up.
+static int list_bytes(maplist_t *list)
 {
-	int total;
-	trav_t trav;
-	int finished = 0;
-	bucket_data_t *current;
-	
-	assert(mask > 0);
-	assert(hashmask >= 0);
-	assert(hashmask <= mask);
+	assert(list);
+	return(sizeof(maplist_t) + (list->keyvalue ? strlen(list->keyvalue) + 1 : 0));
+}
+
 
-	trav.search_hash = hashmask;
-	trav.search_mask = mask;
+// after a split, the items that belong to the new container are all still in the chained data, so 
+// they need to be counted up.  From then on the counts are kept up to date as items are changed.
+void data_recount(bucket_data_t *data)
+{
+	bucket_data_t *current;
+	hashindex_entry_t *entry;
+	item_t *item;
+	int cursor;
 	
 	assert(data);
-	assert(hashmask <= trav.search_mask);
 	
-	// while going through the tree, cannot modify the tree, so we will continuously go through the 
-	// list, getting an item one at a time, clearing it and removing it from the tree.  Continue the 
-	// process until there is no more items in the tree.
+	data->item_count = 0;
+	data->list_count = 0;
+	data->data_size = 0;
+	data->tombstone_count = 0;
+	
 	current = data;
-	assert(current);
 	while (current) {
+		assert(current->items);
+		assert(current->lists);
 		
-		assert(current->tree);
-
-		total = g_tree_nnodes(current->tree);
-		assert(total >= 0);
-		if (total == 0) { finished = 1; }
-		
-		finished = 0;
-		while (finished == 0) {
-			trav.map = NULL;
-			g_tree_foreach(current->tree, traverse_hash_fn, &trav);
-			if (trav.map == NULL) {
-				// there are no more hash items.  SO we finish out of the loop.
-				finished ++;
-				assert(finished > 0);
-			}
-			else {
-				assert(finished == 0);
-				assert(trav.map->mapstree);
-				
-				while (finished == 0) {
-					trav.item = NULL;
-					g_tree_foreach(trav.map->mapstree, traverse_map_fn, &trav);
-					if (trav.item == NULL)  {
-						// didn't find any more map entries, so we can continue
-						finished ++;
-						assert(finished != 0);
-					}
-					else {
-						assert(trav.item->item_key == trav.map->item_key);
-						
-						// now remove the reference from the binary tree.
-						gboolean found = g_tree_remove(trav.map->mapstree, &trav.item->map_key);
-						assert(found == TRUE);
-						
-						item_destroy(trav.item);
-						trav.item = NULL;
-					}
+		cursor = 0;
+		while ((entry = hashindex_next(current->items, &cursor))) {
+			if ((entry->key_hash & data->mask) == data->hashmask) {
+				item = entry->ptr;
+				if (item->value.type == VALUE_DELETED) {
+					data->tombstone_count ++;
 				}
-				
-				assert(trav.item == NULL);
-				
-				// we need to reset 'finished' to zero, because the outer loop is using it too.
-				finished = 0;
-				
-				total = g_tree_nnodes(trav.map->mapstree);
-				assert(total >= 0);
-				if (total > 0) {
-					g_tree_destroy(trav.map->mapstree);
-					trav.map->mapstree = NULL;
-					
+				else {
+					data->item_count ++;
 				}
-				
-				g_tree_remove(data->tree, &trav.map->item_key);
-				free(trav.map);
+				data->data_size += item_bytes(item);
 			}
 		}
-	
+		
+		cursor = 0;
+		while ((entry = hashindex_next(current->lists, &cursor))) {
+			if ((entry->key_hash & data->mask) == data->hashmask) {
+				data->list_count ++;
+				data->data_size += list_bytes(entry->ptr);
+			}
+		}
+		
 		current = current->next;
 	}
 }
 
-void data_free(bucket_data_t *data)
+
+int data_chain_length(bucket_data_t *data)
 {
+	int length = 0;
+	
 	assert(data);
-	assert(data->ref == 0);
-	assert(data->tree);
-	assert(data->next == NULL);
-	assert(g_tree_nnodes(data->tree) == 0);
-	g_tree_destroy(data->tree);
-	data->tree = NULL;
 	
-	free(data);
+	data = data->next;
+	while (data) {
+		length ++;
+		data = data->next;
+	}
+	
+	return(length);
+}
+
+
+// Move up to 'limit' of the entries that belong to this container out of the chained containers 
+// and into this one.  The chained containers are shared with the other buckets that were split 
+// from the same one, so each only moves out the entries that match its own mask.  When the whole 
+// chain has been worked through, our reference to it is released.  Returns the number of entries 
+// that were moved.
+int data_drain(bucket_data_t *data, int limit)
+{
+	bucket_data_t *current;
+	hashindex_t *index;
+	hashindex_entry_t *entry;
+	hash_t key_hash, map_hash;
+	void *ptr;
+	int checked = 0;
+	int moved = 0;
+	
+	assert(data);
+	assert(limit > 0);
+	assert(data->items);
+
+	// if the index is in the middle of a resize, then help it along as well.
+	hashindex_step(data->items, limit);
+	
+	while (data->next && checked < limit) {
+		
+		if (data->drain == NULL) {
+			data->drain = data->next;
+			data->drain_cursor = 0;
+			data->drain_lists = 0;
+		}
+		
+		current = data->drain;
+		assert(current->ref > 0);
+		index = data->drain_lists ? current->lists : current->items;
+		assert(index);
+		
+		entry = hashindex_next(index, &data->drain_cursor);
+		if (entry == NULL) {
+			// reached the end of this index, so move onto the next one.
+			data->drain_cursor = 0;
+			if (data->drain_lists == 0) {
+				data->drain_lists = 1;
+			}
+			else {
+				data->drain_lists = 0;
+				data->drain = current->next;
+				if (data->drain == NULL) {
+					// we have been through all of the chain, so we dont need it anymore.
+					logger(LOG_DEBUG, "data_drain: finished draining container %#llx/%#llx", data->mask, data->hashmask);
+					data_release(data->next);
+					data->next = NULL;
+				}
+			}
+		}
+		else {
+			checked ++;
+			if ((entry->key_hash & data->mask) == data->hashmask) {
+				// nothing is ever inserted into the chained containers, so removing entries as 
+				// we go will not upset the cursor.
+				key_hash = entry->key_hash;
+				map_hash = entry->map_hash;
+				ptr = hashindex_remove(index, key_hash, map_hash);
+				assert(ptr);
+				
+				if (data->drain_lists) {
+					hashindex_insert(data->lists, key_hash, map_hash, ptr);
+				}
+				else {
+					hashindex_insert(data->items, key_hash, map_hash, ptr);
+				}
+				moved ++;
+			}
+		}
+	}
+	
+	data->drained += moved;
+	
+	return(moved);
 }
 
 
@@ -232,47 +325,49 @@ void data_free(bucket_data_t *data)
 
 
 
-// will look through the data-tree for this item hash-key.  If it finds the item in a sub-chain of 
-// trees, it will move it to the one in 'data', in other words, it will move it to the front.   It 
-// will return the maplist_t object so that it can be accessed directly.  It will return NULL if it 
-// could not find the hash in the entire chain, therefore a new entry should be created, but is not 
-// done for you.
+// will look through the chain of containers for this item.  It will return NULL if it could not 
+// find the item in the entire chain, therefore a new entry should be created, but is not done for 
+// you.  Entries that are found in the chained containers are left where they are, the drain 
+// (see data_drain) will move them.
+static item_t * find_item(hash_t map_hash, hash_t key_hash, bucket_data_t *data)
+{
+	item_t *item;
+	bucket_data_t *current;
+	
+	assert(data);
+
+	current = data;
+	assert(current->items);
+	
+	item = hashindex_get(current->items, key_hash, map_hash);
+	while (item == NULL && current->next) {
+		current = current->next;
+		
+		logger(LOG_DEBUG, "find_item: Looking for [%#llx/%#llx] in container %#llx/%#llx", map_hash, key_hash, current->mask, current->hashmask);
+		item = hashindex_get(current->items, key_hash, map_hash);
+	}
+	
+	return(item);
+}
+
+
+// same as find_item, but for the keyvalue entries.
 static maplist_t * find_maplist(hash_t key_hash, bucket_data_t *data)
 {
-	maplist_t *list = NULL;
+	maplist_t *list;
 	bucket_data_t *current;
 	
 	assert(data);
 
 	current = data;
-	assert(current->tree);
+	assert(current->lists);
+	
+	list = hashindex_get(current->lists, key_hash, 0);
+	while (list == NULL && current->next) {
+		current = current->next;
 
-	while (current) {
-		
 		logger(LOG_DEBUG, "find_maplist: Looking for %#llx in container %#llx/%#llx", key_hash, current->mask, current->hashmask);
-		
-		list = g_tree_lookup(current->tree, &key_hash);
-		if (list == NULL) {
-			// list is not in this one, so we should try the next one.
-			current = current->next;
-		}
-		else {
-			// we found the item.
-			
-			assert(list->mapstree);
-			if (current != data) {
-				// we found the item in one of the sub-chains, so we need to move it to the top.
-				g_tree_remove(current->tree, &key_hash);
-				g_tree_insert(data->tree, &key_hash, list);
-			}
-			
-			// since the item was found, it shouldn't be anywhere else, so we can stop going 
-			// through the trees.
-			current = NULL;
-			
-			// since we MUST be returning a list at this point, make sure we haven't lost it.
-			assert(list);
-		}
+		list = hashindex_get(current->lists, key_hash, 0);
 	}
 	
 	return (list);
@@ -282,38 +377,31 @@ static maplist_t * find_maplist(hash_t key_hash, bucket_data_t *data)
 
 value_t * data_get_value(hash_t map_hash, hash_t key_hash, bucket_data_t *ddata) 
 {
-	maplist_t *list;
 	item_t *item;
 	value_t *value = NULL;
 
 	assert(ddata);
-	assert(ddata->tree);
+	assert(ddata->items);
 
 	logger(LOG_DEBUG, "data_get_value: Looking up [%#llx/%#llx].", map_hash, key_hash);
 	
-	list = find_maplist(key_hash, ddata);
-	if (list) {
-
-		logger(LOG_DEBUG, "data_get_value: key found. [%#llx/%#llx].", map_hash, key_hash);
+	item = find_item(map_hash, key_hash, ddata);
+	if (item) {
+		// item is found, return with the data.
+		logger(LOG_DEBUG, "data_get_value: key and map found. [%#llx/%#llx].", map_hash, key_hash);
 		
-		// search the list of maps for a match.
-		assert(list->mapstree);
-		item = g_tree_lookup(list->mapstree, &map_hash);
-		if (item) {
-			// item is found, return with the data.
-			assert(item->value);
-
-			logger(LOG_DEBUG, "data_get_value: key and map found. [%#llx/%#llx].", map_hash, key_hash);
-			
-			if (item->expires > 0 && item->expires < seconds_get()) {
-				// item has expired.   We need to remove it from the map list.
-				assert(value == NULL);
-				assert(0);
-			}
-			else {
-				value = item->value;
-				assert(value);
-			}
+		if (item->value.type == VALUE_DELETED) {
+			// item has been deleted, and only the tombstone is left.
+			assert(value == NULL);
+		}
+		else if (item->expires > 0 && item->expires < seconds_get()) {
+			// item has expired.  It will be removed by the expiry wheel, so we just pretend it isnt 
+			// there.
+			assert(value == NULL);
+		}
+		else {
+			item_touch(item, seconds_get());
+			value = &item->value;
 		}
 	}
 	
@@ -329,7 +417,7 @@ const char * data_get_keyvalue(hash_t key_hash, bucket_data_t *ddata)
 	const char *keyvalue = NULL;
 
 	assert(ddata);
-	assert(ddata->tree);
+	assert(ddata->lists);
 
 	logger(LOG_DEBUG, "data_get_keyvalue: Looking up [%#llx].", key_hash);
 	
@@ -340,13 +428,8 @@ const char * data_get_keyvalue(hash_t key_hash, bucket_data_t *ddata)
 			assert(list->keyvalue_expires >= 0);
 			
 			if (list->keyvalue_expires > 0 && list->keyvalue_expires < seconds_get()) {
-				// item has expired.   We need to remove it from the map list.
-				
+				// keyvalue has expired.  It will be removed by the expiry wheel.
 				logger(LOG_DEBUG, "data_get_keyvalue: key [%#llx:'%s'] has expired.", key_hash, list->keyvalue);
-				free(list->keyvalue);
-				list->keyvalue = NULL;
-				list->keyvalue_expires = 0;
-				
 				assert(keyvalue == NULL);
 			}
 			else {
@@ -367,15 +450,16 @@ const char * data_get_keyvalue(hash_t key_hash, bucket_data_t *ddata)
 
 
 
+// returns NULL if there is no memory available.
 static maplist_t * list_new(hash_t key_hash)
 {
 	maplist_t *list;
 	
-	list = calloc(1, sizeof(maplist_t));
-	assert(list);
+	list = slab_calloc(sizeof(maplist_t));
+	if (list == NULL) {
+		return(NULL);
+	}
 	list->item_key = key_hash;
-	list->mapstree = g_tree_new(key_compare_fn);
-	assert(list->mapstree);
 	assert(list->migrate == 0);
 	assert(list->keyvalue == NULL);
 	assert(list->keyvalue_expires == 0);
@@ -385,256 +469,219 @@ static maplist_t * list_new(hash_t key_hash)
 
 
 
+// an item only needs a new entry on the expiry wheel if it didn't have an expiry before, or if it 
+// now expires sooner.  If it expires later, the entry that it already has finds that out when it 
+// is due, and puts it back on the wheel for the new time (see data_delete_item).  So an item that 
+// keeps being set with the same ttl only ever has the one entry.
+static int expiry_needed(int previous, int expires)
+{
+	assert(previous >= 0);
+	assert(expires >= 0);
+	return(expires > 0 && (previous == 0 || expires < previous));
+}
+
+
 
-// the control of 'value' is given to this function.
-// NOTE: value is controlled by the tree after this function call.
-// NOTE: name is controlled by the tree after this function call.
-void data_set_value(
+// the contents of 'value' are moved into the item, leaving 'value' empty.  The value_t itself still 
+// belongs to the caller.
+// Returns -1 if there was no memory available to store a new item (the value is left as it was).
+// NOTE: allocating the item can cause other items to be evicted, so nothing that was looked up 
+//       beforehand can be relied on.
+int data_set_value(
 	hash_t map_hash, hash_t key_hash, bucket_data_t *ddata,  
 	value_t *value, int expires, client_t *backup_client) 
 {
-	maplist_t *list;
 	item_t *item = NULL;
+	unsigned int now;
+	int previous = 0;
 	
 	assert(ddata);
 	assert(value);
 	assert(expires >= 0);
 
-	assert(ddata->tree);
+	assert(ddata->items);
 	
-	// first we are going to store the value in the primary 'bucket_data'.  If it exists, we will 
-	// update the value in there.  If it doesn't exist we will add it, and when we've done that, 
-	// then we will go through the rest of the chain to find this same entry, if it exists, then 
-	// search the btree in the bucket for this key.
-	list = find_maplist(key_hash, ddata);
-	if (list == NULL) {
+	now = seconds_get();
+	
+	// if the item already exists anywhere in the chain, we will update the value where it is.  New 
+	// items are always added to the primary 'bucket_data'.
+	item = find_item(map_hash, key_hash, ddata);
+	if (item) {
+		// the item was found, so now we need to update the value with the one we have.
 
-		logger(LOG_DEBUG, "data_set_value: key %#llx not found.  Creating new one.", key_hash);
-		
-		list = list_new(key_hash);
-		g_tree_insert(ddata->tree, &list->item_key, list);
-	}
-	else {
-		// since we found a maplist for this hash, we should look to see if this map is in there.  
-		// We only do this if we found the list, because we know a newly created one wont have it, 
-		// so no need to waste time doing a lookup when we know it wont be in there.  That is why we 
-		// have a slightly convoluted logic structure here.
-		
-		logger(LOG_DEBUG, "data_set_value: key %#llx found.", key_hash);
+		logger(LOG_DEBUG, "data_set_value: item [%#llx/%#llx] found, updating value.", map_hash, key_hash);
 		
-		// Now we need to look at the maps to see if the complete entry is here.
-		assert(list->mapstree);
-		item = g_tree_lookup(list->mapstree, &map_hash);
-		if (item) {
-			// the item was found, so now we need to update the value with the one we have.
-
-			logger(LOG_DEBUG, "data_set_value: item [%#llx/%#llx] found, updating value.", map_hash, key_hash);
-			
-			assert(item->value);
-			value_move(item->value, value);
-			
-			// ** PERF: value objects should be put back in a pool to avoid having to alloc/free all the time.
-			free(value);
-			value = NULL;
-			
-			item->expires = expires == 0 ? 0 : seconds_get() + expires;
+		if (item->value.type == VALUE_DELETED) {
+			// the item is coming back from being deleted.
+			ddata->tombstone_count --;
+			ddata->item_count ++;
+			assert(ddata->tombstone_count >= 0);
 		}
+		
+		ddata->data_size -= value_bytes(&item->value);
+		value_move(&item->value, value);
+		ddata->data_size += value_bytes(&item->value);
+		previous = item->expires;
+		item->expires = expires == 0 ? 0 : now + expires;
 	}
-	
-	assert(list);
-
-	if (item == NULL) {
+	else {
 		// item was not found, so create a new one.
 
 		logger(LOG_DEBUG, "data_set_value: item [%#llx/%#llx] NOT found, creating a new one.", map_hash, key_hash);
 		
-		item = calloc(1, sizeof(item_t));
-		assert(item);
+		item = slab_calloc(sizeof(item_t));
+		if (item == NULL) {
+			logger(LOG_WARN, "data_set_value: no memory available for item [%#llx/%#llx].", map_hash, key_hash);
+			return(-1);
+		}
 
 		item->item_key = key_hash;
 		item->map_key = map_hash;
-		item->value = value;
-		item->expires = expires == 0 ? 0 : seconds_get() + expires;
+		value_move(&item->value, value);
+		item->expires = expires == 0 ? 0 : now + expires;
 		item->migrate = 0;
 		
-		g_tree_insert(list->mapstree, &item->map_key, item);
+		hashindex_insert(ddata->items, key_hash, map_hash, item);
+		ddata->item_count ++;
+		ddata->data_size += item_bytes(item);
 	}
 	
 	// by this point, we should have either found an existing item that matches, or created a new one.
 	assert(item);
+	item_touch(item, now);
+	expires = item->expires;
 
 	// if we have a backup node connected, we need to send the item details to it.
 	if (backup_client) {
 		push_sync_item(backup_client, item);
 	}
-}
-
-
-
-
-// traverse function for g_tree_foreach search for hashs that have not been migrated.
-static gboolean migrate_map_fn(gpointer p_key, gpointer p_value, void *p_data)
-{
-	trav_t *data = p_data;
-	hash_t *key = p_key;
-	item_t *item;
-	int sync;
-	
-	assert(p_key);
-	assert(p_value);
-	assert(p_data);
-	assert(data->map == NULL);
-	assert(data->client);
-	
-	assert(data->limit > 0);
-	assert(data->items_count < data->limit);
-	assert(data->items_count >= 0);
 	
-	// get the current sync value for all the buckets.  This is used so that we can find the items that have not yet been migrated.
-	sync = buckets_get_migrate_sync();
-	assert(sync > 0);
-	
-	item = p_value;
-	assert(item->migrate <= sync);
-	if (item->migrate < sync) {
-		logger(LOG_DEBUG, "migrate: map %#llx ready to migrate.  Sending now.", *key);
-		push_sync_item(data->client, item);
-		_in_transit ++;
-		assert(_in_transit <= TRANSIT_MAX);
-		data->items_count ++;
-		assert(data->items_count <= data->limit);
-		item->migrate = sync;
-		logger(LOG_DEBUG, "migrate: items in list: %d", data->items_count);
+	// adding the expiry needs memory, which could evict the item, so it is done last.
+	if (expiry_needed(previous, expires)) {
+		expiry_add(map_hash, key_hash, expires, 0);
 	}
 	
-	if (data->items_count < data->limit) {
-		// returning TRUE will exit the traversal.
-		return(TRUE);
-	}
-	else {
-		// if we have more items we can get, then we return FALSE.
-		return(FALSE);
-	}
+	return(0);
 }
 
 
 
-// traverse function for g_tree_foreach search for hashs that have not been migrated.
-static gboolean migrate_hash_fn(gpointer p_key, gpointer p_value, void *p_data)
+
+// Add 'delta' to an integer item, creating it (with 'expires') if it isn't there.  The value is 
+// changed where it is, and only the new value is sent to the backup.  The new value is copied 
+// into 'result'.  Returns 0 if it worked, -1 if there was no memory available to create the item, 
+// -2 if the item is not an integer, or -3 if adding 'delta' would overflow (the item is left as it 
+// was).
+int data_incr_value(
+	hash_t map_hash, hash_t key_hash, bucket_data_t *ddata, 
+	long long delta, int expires, client_t *backup_client, value_t *result)
 {
-	trav_t *data = p_data;
-	hash_t *key = p_key;
-	maplist_t *map;	
+	item_t *item;
+	value_t value;
+	unsigned int now;
+	long long sum;
 	
-	assert(p_key);
-	assert(p_value);
-	assert(p_data);
-	assert(data->map == NULL);
-	assert(data->client);
-	assert(data->search_mask > 0);
+	assert(ddata);
+	assert(result);
+	assert(expires >= 0);
 	
-	assert(data->limit > 0);
-	assert(data->items_count < data->limit);
-
-	int sync = buckets_get_migrate_sync();
-	assert(sync > 0);
+	now = seconds_get();
 	
-	if ((*key & data->search_mask) == data->search_hash) {
+	item = find_item(map_hash, key_hash, ddata);
+	if (item && item->value.type != VALUE_DELETED && (item->expires == 0 || item->expires >= now)) {
+		if (item->value.type != VALUE_LONG) {
+			return(-2);
+		}
 		
-		map = p_value;
-		assert(sync > 0);
-		assert(map->migrate >= 0);
+		logger(LOG_DEBUG, "data_incr_value: item [%#llx/%#llx] found, adding %lld.", map_hash, key_hash, delta);
 		
-// 		logger(LOG_DEBUG, "migrate: found hash: %#llx, migrate=%d", *key, map->migrate);
-	
-		assert(map->migrate <= sync);
-		if (map->migrate < sync) {
-			// found one.
-			// now we need to search the inner tree
-			
-			logger(LOG_DEBUG, "migrate: hash %#llx is ready to migrate.", *key);
-			
-			g_tree_foreach(map->mapstree, migrate_map_fn, data);
-			
-			if (data->items_count < data->limit) {
-				// the traversal returned while there are still item slots available.  This must 
-				// mean that there are no more items in this map that need to be migrated, so we 
-				// will mark the map with the current migrate sync value.
-				map->migrate = sync;
-				
-				logger(LOG_DEBUG,
-						"migrate: hash %#llx seems to have all its maps migrated, "
-						"so we mark the hash as complete.",
-						*key
-  						);
-			}
+		if (__builtin_add_overflow(item->value.data.l, delta, &sum)) {
+			logger(LOG_DEBUG, "data_incr_value: item [%#llx/%#llx] would overflow.", map_hash, key_hash);
+			return(-3);
 		}
+		
+		value_set_long(&item->value, sum);
+		item_touch(item, now);
+		*result = item->value;
+		
+		if (backup_client) {
+			push_sync_item(backup_client, item);
+		}
+		
+		return(0);
 	}
-
-	// if we haven't yet reached our limit, then we return FALSE.
-	if (data->items_count < data->limit) {
-		return(FALSE);
-	}
-	else {
-		// returning TRUE will exit the traversal
-		return(TRUE);		
-	}
+	
+	// the item isn't there (or is deleted or expired), so the counter starts from 0.
+	value_init(&value);
+	value_set_long(&value, delta);
+	*result = value;
+	
+	return(data_set_value(map_hash, key_hash, ddata, &value, expires, backup_client));
 }
 
 
 
-
-// go through the trees in the data to find items for this hashkey that need to be migrated.  Uses 
-// some global variables for extra information.
+// go through the containers in the data to find items for this hashkey that need to be migrated.  
 int data_migrate_items(client_t *client, bucket_data_t *data, hash_t hashmask, int limit)
 {
 	bucket_data_t *current;
-	trav_t trav = {
-		.search_hash=0, 
-		.map=NULL, 
-		.item=NULL,
-		.items_count=0
-	};
+	hashindex_entry_t *entry;
+	item_t *item;
+	int items_count = 0;
+	int cursor;
+	int sync;
 	
 	assert(data);
 	assert(limit > 0);
-	
 	assert(client);
-	trav.client = client;
-
-	assert(trav.items_count == 0);
-	trav.limit = limit;
-	trav.search_hash = hashmask;
-	current = data;
+	assert(data->mask > 0);
 
+	// get the current sync value for all the buckets.  This is used so that we can find the items 
+	// that have not yet been migrated.
+	sync = buckets_get_migrate_sync();
+	assert(sync > 0);
+	
 	logger(LOG_DEBUG, "About to search the data for hashmask:%#llx, limit:%d", 
 			   hashmask, limit);
 	
-	while (current && trav.items_count < limit) {
+	current = data;
+	while (current && items_count < limit) {
 
 		logger(LOG_DEBUG, "Searching container: %#llx/%#llx", 
 				   current->mask, current->hashmask);
 		
-		assert(current->tree);
-		assert(trav.map == NULL);
+		assert(current->items);
 			
-		// go through the 'hash' tree pulling out the items we need.  As we pull the items out, we 
-		// will mark things as complete.  the items array then needs to be processed completely or 
-		// items will be lost.
-		g_tree_foreach(current->tree, migrate_hash_fn, &trav);
+		cursor = 0;
+		while (items_count < limit && (entry = hashindex_next(current->items, &cursor))) {
+			if ((entry->key_hash & data->mask) == hashmask) {
+				item = entry->ptr;
+				assert(item);
+				assert(item->migrate <= sync);
+				if (item->migrate < sync) {
+					logger(LOG_DEBUG, "migrate: item [%#llx/%#llx] ready to migrate.  Sending now.", item->map_key, item->item_key);
+					push_sync_item(client, item);
+					__sync_fetch_and_add(&_in_transit, 1);
+					assert(_in_transit <= TRANSIT_MAX);
+					items_count ++;
+					item->migrate = sync;
+				}
+			}
+		}
 		
 		current = current->next;
 	}
-	logger(LOG_DEBUG, "found %d items", trav.items_count);
+	logger(LOG_DEBUG, "found %d items", items_count);
 	
-	assert(trav.items_count >= 0);
-	return(trav.items_count);
+	assert(items_count >= 0);
+	return(items_count);
 }
 
 
 
-// 'keyvalue' is a pointer that is controlled by the keyvalue tree.
-void data_set_keyvalue(hash_t key_hash, bucket_data_t *data, char *keyvalue, int expires)
+// 'keyvalue' is a pointer that is controlled by the keyvalue index.
+// Returns -1 if there was no memory available to store it (the keyvalue is freed).
+int data_set_keyvalue(hash_t key_hash, bucket_data_t *data, char *keyvalue, int expires)
 {
 	assert(data);
 	assert(keyvalue);
@@ -655,10 +702,20 @@ void data_set_keyvalue(hash_t key_hash, bucket_data_t *data, char *keyvalue, int
 		logger(LOG_DEBUG, "data_set_keyvalue: key %#llx not found.  Creating new one.", key_hash);
 		
 		list = list_new(key_hash);
+		if (list == NULL) {
+			logger(LOG_WARN, "data_set_keyvalue: no memory available for key %#llx.", key_hash);
+			free(keyvalue);
+			return(-1);
+		}
 		list->keyvalue = keyvalue;
 		if (expires == 0) { list->keyvalue_expires = 0; }
-		else { list->keyvalue_expires = seconds_get() + expires; }
-		g_tree_insert(data->tree, &list->item_key, list);
+		else { 
+			list->keyvalue_expires = seconds_get() + expires; 
+			expiry_add(0, key_hash, list->keyvalue_expires, 1);
+		}
+		hashindex_insert(data->lists, key_hash, 0, list);
+		data->list_count ++;
+		data->data_size += list_bytes(list);
 	}
 	else {
 
@@ -667,6 +724,341 @@ void data_set_keyvalue(hash_t key_hash, bucket_data_t *data, char *keyvalue, int
 		// since we are in control of 'keyvalue' at this point. we need to free it.
 		free(keyvalue);
 	}
+	
+	return(0);
+}
+
+
+
+
+
+// remove the item from wherever it is in the chain.  If 'expires' is not 0, then the item is only 
+// removed if it still has that expiry time, so that an item that has been set again since it was 
+// scheduled to expire is left alone.  Returns 1 if the item was removed.
+int data_delete_item(bucket_data_t *data, hash_t map_hash, hash_t key_hash, int expires)
+{
+	bucket_data_t *current;
+	item_t *item;
+	
+	assert(data);
+	assert(expires >= 0);
+
+	current = data;
+	while (current) {
+		assert(current->items);
+		item = hashindex_get(current->items, key_hash, map_hash);
+		if (item) {
+			if (expires > 0 && item->expires != expires) {
+				// it has been set again since.  If it expires later now, it goes back on the wheel 
+				// for then (see expiry_needed).
+				if (item->expires > expires) {
+					expiry_add(map_hash, key_hash, item->expires, 0);
+				}
+				return(0);
+			}
+			
+			logger(LOG_DEBUG, "data_delete_item: removing [%#llx/%#llx].", map_hash, key_hash);
+			
+			hashindex_remove(current->items, key_hash, map_hash);
+			if (item->value.type == VALUE_DELETED) {
+				data->tombstone_count --;
+			}
+			else {
+				data->item_count --;
+			}
+			data->data_size -= item_bytes(item);
+			assert(data->item_count >= 0);
+			assert(data->tombstone_count >= 0);
+			assert(data->data_size >= 0);
+			item_destroy(item);
+			return(1);
+		}
+		current = current->next;
+	}
+	
+	return(0);
+}
+
+
+// Turn the item into a tombstone.  The value is released, but the item itself is kept (with 
+// the migrate flag cleared, so that a bucket transfer will pass the delete on).  
+// NOTE: there is no version kept with the items, so a tombstone does not stop the item from being 
+//       set again by whatever copy arrives after it.  It only makes sure the delete follows the 
+//       bucket to its backup and to wherever it is transferred.
+static void item_tombstone(bucket_data_t *data, item_t *item, unsigned int expires)
+{
+	assert(data);
+	assert(item);
+	assert(item->value.type != VALUE_DELETED);
+	assert(expires > 0);
+	
+	data->item_count --;
+	data->tombstone_count ++;
+	data->data_size -= value_bytes(&item->value);
+	assert(data->item_count >= 0);
+	assert(data->data_size >= 0);
+	
+	value_clear(&item->value);
+	assert(item->value.type == VALUE_DELETED);
+	item->expires = expires;
+	item->migrate = 0;
+}
+
+
+// Delete the item, leaving a tombstone in its place.  If 'map_hash' is 0, then the items for 
+// 'key_hash' in every map are deleted.  Because the index is keyed on both hashes, that means 
+// going through the whole bucket.  The tombstones are put on the expiry wheel, which will remove 
+// them in batches after TOMBSTONE_LIFE seconds.  Returns the number of items that were deleted.
+// If 'create' is set and a single item was asked for, but it isn't here, a tombstone is added for 
+// it anyway.  A backup uses this so that its copy of the bucket has the same tombstones as the 
+// primary's.
+int data_tombstone(bucket_data_t *data, hash_t map_hash, hash_t key_hash, int create)
+{
+	bucket_data_t *current;
+	hashindex_entry_t *entry;
+	item_t *item;
+	unsigned int expires;
+	int previous;
+	int deleted = 0;
+	int cursor;
+	
+	assert(data);
+	
+	expires = seconds_get() + TOMBSTONE_LIFE;
+	
+	if (map_hash != 0) {
+		item = find_item(map_hash, key_hash, data);
+		if (item == NULL && create) {
+			item = slab_calloc(sizeof(item_t));
+			if (item) {
+				logger(LOG_DEBUG, "data_tombstone: adding tombstone for [%#llx/%#llx].", map_hash, key_hash);
+				item->item_key = key_hash;
+				item->map_key = map_hash;
+				item->expires = expires;
+				assert(item->value.type == VALUE_DELETED);
+				
+				hashindex_insert(data->items, key_hash, map_hash, item);
+				data->tombstone_count ++;
+				data->data_size += item_bytes(item);
+				expiry_add(map_hash, key_hash, expires, 0);
+			}
+			return(0);
+		}
+		
+		if (item == NULL || item->value.type == VALUE_DELETED) {
+			return(0);
+		}
+		
+		logger(LOG_DEBUG, "data_tombstone: deleting [%#llx/%#llx].", map_hash, key_hash);
+		previous = item->expires;
+		item_tombstone(data, item, expires);
+		
+		// adding the expiry could evict the tombstone, so the item can't be used after this.
+		if (expiry_needed(previous, expires)) {
+			expiry_add(map_hash, key_hash, expires, 0);
+		}
+		return(1);
+	}
+	
+	// entries can be removed while the index is being looked through (which eviction might do), 
+	// and nothing is added.
+	current = data;
+	while (current) {
+		assert(current->items);
+		
+		cursor = 0;
+		while ((entry = hashindex_next(current->items, &cursor))) {
+			item = entry->ptr;
+			assert(item);
+			if (entry->key_hash == key_hash && item->value.type != VALUE_DELETED) {
+				logger(LOG_DEBUG, "data_tombstone: deleting [%#llx/%#llx].", item->map_key, key_hash);
+				map_hash = item->map_key;
+				previous = item->expires;
+				item_tombstone(data, item, expires);
+				if (expiry_needed(previous, expires)) {
+					expiry_add(map_hash, key_hash, expires, 0);
+				}
+				deleted ++;
+			}
+		}
+		
+		current = current->next;
+	}
+	
+	return(deleted);
+}
+
+
+// pick an item from somewhere in the container, to see if it should be evicted.  If this container 
+// is empty, then it is picked from the chained data, although there is a chance that it will 
+// belong to one of the other buckets that was split from it, in which case NULL is returned.
+item_t * data_sample(bucket_data_t *data)
+{
+	bucket_data_t *current;
+	hashindex_entry_t *entry;
+	
+	assert(data);
+	
+	current = data;
+	while (current) {
+		assert(current->items);
+		if (hashindex_count(current->items) > 0) {
+			entry = hashindex_random(current->items, item_random());
+			assert(entry);
+			if ((entry->key_hash & data->mask) == data->hashmask) {
+				assert(entry->ptr);
+				return(entry->ptr);
+			}
+			return(NULL);
+		}
+		current = current->next;
+	}
+	
+	return(NULL);
+}
+
+
+// Go through the items that belong to this bucket, starting from 'pos', and pass each one that 
+// hasn't expired or been deleted (and is in 'map_hash', unless it is 0) to the handler.  The handler returns 
+// non-zero when it doesn't want any more.  'budget' is reduced for every entry that is looked at, 
+// and the scan stops when it runs out.  Returns non-zero when the whole bucket has been scanned.
+//
+// The chained containers are scanned first, and the head container last.  Entries are only ever 
+// moved from the chain into the head, so anything that is drained while the scan is in progress 
+// will still be found.  Nothing is inserted into the chained containers, so a position in them 
+// stays valid.  The head index is only moved around when it is resized, in which case that part 
+// of the scan starts again.  Entries can be returned more than once, but an entry that is there 
+// for the whole scan will not be missed.
+int data_scan(bucket_data_t *data, data_scan_t *pos, hash_t map_hash, int *budget, int (*handler)(item_t *item, void *arg), void *arg)
+{
+	bucket_data_t *current;
+	hashindex_entry_t *entry;
+	item_t *item;
+	int now;
+	int i;
+	
+	assert(data);
+	assert(pos);
+	assert(budget);
+	assert(handler);
+	
+	now = seconds_get();
+	
+	if (pos->container == 0) {
+		pos->container = data->next ? 1 : -1;
+		pos->slot = 0;
+		pos->resizes = data->items->resizes;
+	}
+	
+	// work through the chained containers.
+	while (pos->container > 0) {
+		current = data->next;
+		for (i=1; current && i<pos->container; i++) {
+			current = current->next;
+		}
+		
+		if (current == NULL) {
+			// either we have been through the whole chain, or it has finished draining (which 
+			// means that everything is in the head now).
+			pos->container = -1;
+			pos->slot = 0;
+			pos->resizes = data->items->resizes;
+		}
+		else {
+			assert(current->items);
+			while ((entry = hashindex_next(current->items, &pos->slot))) {
+				if (*budget <= 0) {
+					// the entry hasn't been looked at, so come back to it next time.
+					pos->slot --;
+					return(0);
+				}
+				(*budget) --;
+				
+				item = entry->ptr;
+				assert(item);
+				if ((entry->key_hash & data->mask) == data->hashmask 
+						&& item->value.type != VALUE_DELETED
+						&& (map_hash == 0 || item->map_key == map_hash)
+						&& (item->expires == 0 || item->expires >= now)) {
+					if (handler(item, arg) != 0) {
+						return(0);
+					}
+				}
+			}
+			pos->container ++;
+			pos->slot = 0;
+		}
+	}
+	
+	assert(pos->container == -1);
+	assert(data->items);
+	
+	// if the index is being resized, then finish it off, otherwise entries could be moved from 
+	// in front of the position to behind it.
+	if (data->items->old.tags) {
+		hashindex_step(data->items, data->items->old.mask + 1);
+		assert(data->items->old.tags == NULL);
+	}
+	
+	if (pos->resizes != data->items->resizes) {
+		pos->slot = 0;
+		pos->resizes = data->items->resizes;
+	}
+	
+	while ((entry = hashindex_next(data->items, &pos->slot))) {
+		if (*budget <= 0) {
+			pos->slot --;
+			return(0);
+		}
+		(*budget) --;
+		
+		item = entry->ptr;
+		assert(item);
+		if (item->value.type != VALUE_DELETED && (map_hash == 0 || item->map_key == map_hash) 
+				&& (item->expires == 0 || item->expires >= now)) {
+			if (handler(item, arg) != 0) {
+				return(0);
+			}
+		}
+	}
+	
+	return(1);
+}
+
+
+// same as data_delete_item, but for keyvalues.
+int data_delete_keyvalue(bucket_data_t *data, hash_t key_hash, int expires)
+{
+	bucket_data_t *current;
+	maplist_t *list;
+	
+	assert(data);
+	assert(expires >= 0);
+
+	current = data;
+	while (current) {
+		assert(current->lists);
+		list = hashindex_get(current->lists, key_hash, 0);
+		if (list) {
+			if (expires > 0 && list->keyvalue_expires != expires) {
+				return(0);
+			}
+			
+			logger(LOG_DEBUG, "data_delete_keyvalue: removing %#llx.", key_hash);
+			
+			hashindex_remove(current->lists, key_hash, 0);
+			data->list_count --;
+			data->data_size -= list_bytes(list);
+			assert(data->list_count >= 0);
+			assert(data->data_size >= 0);
+			if (list->keyvalue) { free(list->keyvalue); }
+			slab_free(list, sizeof(maplist_t));
+			return(1);
+		}
+		current = current->next;
+	}
+	
+	return(0);
 }
 
 
@@ -678,23 +1070,14 @@ void data_set_keyvalue(hash_t key_hash, bucket_data_t *data, char *keyvalue, int
 void data_migrated(bucket_data_t *data, hash_t map_hash, hash_t key_hash)
 {
 #ifndef NDEBUG
-	maplist_t *list;
 	item_t *item;
 
 	assert(data);
-	assert(data->tree);
+	assert(data->items);
 
-	list = find_maplist(key_hash, data);
-	if (list) {
-			
-		// search the list of maps for a match.
-		assert(list->mapstree);
-		item = g_tree_lookup(list->mapstree, &map_hash);
-		if (item) {
-			// item is found, return with the data.
-			assert(item->value);
-			assert(item->migrate == buckets_get_migrate_sync() || item->migrate == 0);
-		}
+	item = find_item(map_hash, key_hash, data);
+	if (item) {
+		assert(item->migrate == buckets_get_migrate_sync() || item->migrate == 0);
 	}
 #endif
 }
@@ -704,6 +1087,16 @@ void data_migrated(bucket_data_t *data, hash_t map_hash, hash_t key_hash)
 
 void data_dump(bucket_data_t *data)
 {
-	stat_dumpstr("      Data Items: %ld", data->item_count);
-	stat_dumpstr("      Data Bytes: %ld", data->data_size);
+	stat_dumpstr("      Data Items: %lld", data->item_count);
+	if (data->tombstone_count > 0) {
+		stat_dumpstr("      Data Tombstones: %lld", data->tombstone_count);
+	}
+	stat_dumpstr("      Data Keyvalues: %lld", data->list_count);
+	stat_dumpstr("      Data Bytes: %lld", data->data_size);
+	stat_dumpstr("      Index Entries: %d", hashindex_count(data->items) + hashindex_count(data->lists));
+	stat_dumpstr("      Index Bytes: %lld", hashindex_bytes(data->items) + hashindex_bytes(data->lists));
+	if (data->next) {
+		stat_dumpstr("      Chained Containers: %d", data_chain_length(data));
+	}
+	stat_dumpstr("      Drained Entries: %lld", data->drained);
 }
@@ -3,11 +3,10 @@
 
 #include "client.h"
 #include "hash.h"
+#include "hashindex.h"
 #include "item.h"
 #include "value.h"
 
-#include <glib.h>
-
 
 
 
@@ -20,27 +19,54 @@ typedef struct __bucket_data_t {
 	// it can be cleaned up and deallocated.
 	int ref;
 	
-	// the value tree.
-	GTree *tree;
+	// all the items in this container, indexed on the (item_key, map_key) pair.
+	hashindex_t *items;
+	
+	// the keyvalues, indexed on just the item_key (map hash is always 0).
+	hashindex_t *lists;
 	
 	// if we already have an 'oldtree' and we need to split again, then we put the existing old tree 
 	// inside this new one.   When the data is eventually moved out of it, it can be deleted.
 	struct __bucket_data_t *next;
 	
+	// the entries that belong to this container are moved out of the chained containers in the 
+	// background.  'drain' is the container in the chain that is currently being worked through, 
+	// and 'drain_cursor' is how far through it we are.  'drained' is the number of entries that 
+	// have been moved so far.
+	struct __bucket_data_t *drain;
+	int drain_cursor;
+	int drain_lists;
+	long long drained;
+	
+	// the number of items and keyvalues that belong to the bucket, and the memory they use, 
+	// wherever in the chain they are.  These are kept up to date as things are stored and removed, 
+	// and are only kept in the container that the bucket points to.
 	long long item_count;
+	long long list_count;
 	long long data_size;
+	
+	// deleted items that are being kept as tombstones (see data_tombstone).  These are not 
+	// included in 'item_count'.
+	long long tombstone_count;
 
 } bucket_data_t;
 
 
+// how far a scan has got through a bucket (see data_scan).  A zeroed position is the start of the 
+// bucket.
+typedef struct {
+	int container;			// 0 at the start, -1 for the head container, or the position in the chain.
+	int slot;
+	int resizes;			// the head index resize count, when scanning the head container.
+} data_scan_t;
+
+
 typedef struct {
-	GTree *mapstree;
 	hash_t item_key;
 	char *keyvalue;
 	long keyvalue_expires;
 	
-	// indicates that something inside this maps tree has not been migrated yet.  
-	// keyvalue is last to be migrated, so if nothing else needs to go, keyvalue does.
+	// indicates that the keyvalue has not been migrated yet.  
 	int migrate;
 } maplist_t;
 
@@ -48,12 +74,22 @@ typedef struct {
 
 bucket_data_t * data_new(hash_t mask, hash_t hashmask);
 void data_free(bucket_data_t *data);
+void data_release(bucket_data_t *data);
 void data_destroy(bucket_data_t *data, hash_t mask, hash_t hashmask);
+int data_drain(bucket_data_t *data, int limit);
+int data_chain_length(bucket_data_t *data);
+void data_recount(bucket_data_t *data);
 
 value_t * data_get_value(hash_t map_hash, hash_t key_hash, bucket_data_t *ddata);
-void data_set_value(hash_t map_hash, hash_t key_hash, bucket_data_t *ddata, value_t *value, int expires, client_t *backup_client);
+int data_set_value(hash_t map_hash, hash_t key_hash, bucket_data_t *ddata, value_t *value, int expires, client_t *backup_client);
+int data_incr_value(hash_t map_hash, hash_t key_hash, bucket_data_t *ddata, long long delta, int expires, client_t *backup_client, value_t *result);
 const char * data_get_keyvalue(hash_t key_hash, bucket_data_t *data);
-void data_set_keyvalue(hash_t key_hash, bucket_data_t *data, char *keyvalue, int expires);
+int data_set_keyvalue(hash_t key_hash, bucket_data_t *data, char *keyvalue, int expires);
+int data_delete_item(bucket_data_t *data, hash_t map_hash, hash_t key_hash, int expires);
+int data_delete_keyvalue(bucket_data_t *data, hash_t key_hash, int expires);
+int data_tombstone(bucket_data_t *data, hash_t map_hash, hash_t key_hash, int create);
+item_t * data_sample(bucket_data_t *data);
+int data_scan(bucket_data_t *data, data_scan_t *pos, hash_t map_hash, int *budget, int (*handler)(item_t *item, void *arg), void *arg);
 int data_migrate_items(client_t *client, bucket_data_t *data, hash_t hash, int limit);
 int data_in_transit(void);
 void data_in_transit_dec(void);
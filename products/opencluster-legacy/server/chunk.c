@@ -0,0 +1,114 @@
+// chunk.c
+
+#include "chunk.h"
+
+#include "shard.h"
+#include "stats.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+
+// the most chunks that each shard keeps on its free-list.  Any more than that are freed.
+#define CHUNK_FREE_MAX  256
+
+
+// kept in front of the buffer.  Chunks on the free-list are linked through 'next'.
+typedef union __chunk_t {
+	int size;
+	union __chunk_t *next;
+	long long align;
+} chunk_t;
+
+
+static SHARD_LOCAL chunk_t *_free_list = NULL;
+static SHARD_LOCAL int _free_count = 0;
+
+static SHARD_LOCAL long long _used = 0;
+static SHARD_LOCAL long long _used_bytes = 0;
+static SHARD_LOCAL long long _reused = 0;
+static SHARD_LOCAL long long _allocated = 0;
+static SHARD_LOCAL long long _large = 0;
+
+
+
+// get a buffer with room for at least 'size' bytes.
+char * chunk_get(int size)
+{
+	chunk_t *chunk;
+	
+	assert(size > 0);
+	
+	if (size <= CHUNK_SIZE && _free_list) {
+		chunk = _free_list;
+		_free_list = chunk->next;
+		_free_count --;
+		assert(_free_count >= 0);
+		_reused ++;
+		size = CHUNK_SIZE;
+	}
+	else {
+		if (size <= CHUNK_SIZE) {
+			size = CHUNK_SIZE;
+		}
+		else {
+			_large ++;
+		}
+		
+		chunk = malloc(sizeof(chunk_t) + size);
+		assert(chunk);
+		_allocated ++;
+	}
+	
+	chunk->size = size;
+	_used ++;
+	_used_bytes += size;
+	
+	return((char *) (chunk + 1));
+}
+
+
+// give back a buffer from chunk_get().  It doesnt need to be the same shard.
+void chunk_put(void *ptr)
+{
+	chunk_t *chunk;
+	
+	assert(ptr);
+	
+	chunk = ((chunk_t *) ptr) - 1;
+	assert(chunk->size >= CHUNK_SIZE);
+	
+	// the counts are only for this shard, so they can go negative when the connection was moved.
+	_used --;
+	_used_bytes -= chunk->size;
+	
+	if (chunk->size == CHUNK_SIZE && _free_count < CHUNK_FREE_MAX) {
+		chunk->next = _free_list;
+		_free_list = chunk;
+		_free_count ++;
+	}
+	else {
+		free(chunk);
+	}
+}
+
+
+// the number of bytes that the buffer has room for.
+int chunk_size(char *ptr)
+{
+	assert(ptr);
+	return((((chunk_t *) ptr) - 1)->size);
+}
+
+
+
+void chunk_dump(void)
+{
+	stat_dumpstr("CONNECTION BUFFERS");
+	stat_dumpstr("  Chunk Size: %d", CHUNK_SIZE);
+	stat_dumpstr("  In Use: %lld (%lld bytes)", _used, _used_bytes);
+	stat_dumpstr("  Free: %d", _free_count);
+	stat_dumpstr("  Reused: %lld", _reused);
+	stat_dumpstr("  Allocated: %lld (%lld large)", _allocated, _large);
+	stat_dumpstr(NULL);
+}
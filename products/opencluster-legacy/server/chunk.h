@@ -0,0 +1,25 @@
+// chunk.h
+
+#ifndef __CHUNK_H
+#define __CHUNK_H
+
+// Buffers for the data going in and out of the connections.  Most of them are CHUNK_SIZE, and
+// those are kept on a free-list when they are given back, so that a busy connection (or a new
+// one) can pick one up again without going to the heap.  Each shard has its own free-list, and it
+// only keeps so many, so the memory that idle connections were using is given back eventually.
+// Bigger buffers (for frames that wont fit in a chunk) come straight from the heap.
+//
+// The size is kept in front of the buffer, so chunk_put() can be used as a release function (see
+// client_segment_t).
+
+#define CHUNK_SIZE  (1024*16)
+
+
+char * chunk_get(int size);
+void chunk_put(void *ptr);
+int chunk_size(char *ptr);
+
+void chunk_dump(void);
+
+
+#endif
@@ -3,6 +3,7 @@
 #include "client.h"
 
 #include "bucket.h"
+#include "chunk.h"
 #include "commands.h"
 #include "constants.h"
 #include "header.h"
@@ -12,13 +13,17 @@
 #include "protocol.h"
 #include "push.h"
 #include "server.h"
+#include "shard.h"
 #include "stats.h"
 #include "timeout.h"
+#include "uring.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 
@@ -33,11 +38,62 @@ typedef struct {
 	int cmd;
 	int max;
 	handler_info_t *handlers;
+
+	// commands for a particular key are run by the shard that owns its bucket (see 
+	// client_route_cmd), and commands that change the cluster are run by the main loop (see 
+	// client_control_cmd).
+	int (*route)(char *payload, int length);
+	int control;
 } command_handlers_t;
 
 
-static client_t **_clients = NULL;
-static int _client_count = 0;
+// a command that has been handed to the shard that owns the data it is for.  When it is done, it is 
+// handed back to the shard that the client belongs to (see handoff_done).
+typedef struct {
+	client_t *client;
+	header_t header;
+	char payload[];
+} handoff_t;
+
+
+// something to send to a client that belongs to another shard.  If 'command' is set, it is a new 
+// message, otherwise it is a reply that is ready to go.  A large value in the reply isn't copied, 
+// it is passed along in 'ref' (see send_data).
+typedef struct {
+	client_t *client;
+	int command;
+	raw_header_t raw;
+	client_segment_t ref;
+	int length;
+	char data[];
+} delivery_t;
+
+
+typedef struct {
+	hash_t mask;
+	hash_t hashmask;
+	int level;
+} hashmask_update_t;
+
+
+// each shard has its own list of the clients it is serving.
+static SHARD_LOCAL client_t **_clients = NULL;
+static SHARD_LOCAL int _client_count = 0;
+
+// number of times that a connection has used up its turn, and had to wait to be processed again.
+static SHARD_LOCAL long long _yields = 0;
+
+// the number of times that a connection was stopped because too much was waiting to be sent to it.
+static SHARD_LOCAL long long _stalls = 0;
+
+// how much (in bytes) can be waiting to be sent to a client before it is stopped, and how far that 
+// has to go down before it carries on (see out_stall).  They are set from the config before the 
+// shards are started, so they are shared.
+static int _out_high = 0;
+static int _out_low = 0;
+
+// the biggest frame that will be accepted (see in_reserve).
+static int _max_frame = CLIENT_FRAME_MAX;
 
 
 // char *_connectinfo = NULL;
@@ -45,6 +101,21 @@ static int _client_count = 0;
 
 static void read_handler(int fd, short int flags, void *arg);
 static void write_handler(int fd, short int flags, void *arg);
+static void timeout_handler(int fd, short int flags, void *arg);
+static void ring_recv_handler(uring_op_t *op, int res, char *data);
+static void ring_send_handler(uring_op_t *op, int res, char *data);
+static void send_data(client_t *client, raw_header_t *rawheader, int length, void *payload, client_segment_t *ref);
+static void out_discard(client_t *client);
+static void out_flush(client_t *client);
+static void in_release(client_t *client);
+static int in_ready(client_t *client);
+static void client_handoff(client_t *client, header_t *header, char *payload, shard_t *shard);
+static void client_handoff_done(client_t *client);
+static void client_move(client_t *client, shard_t *shard);
+static void client_move_done(client_t *client);
+static void resume_handler(int fd, short int flags, void *arg);
+static void client_resume(client_t *client);
+static void ring_throttle(client_t *client);
 
 
 static command_handlers_t **_commands = NULL;
@@ -54,8 +125,8 @@ static handler_info_t *_specials = NULL;
 static int _special_max = 0;
 
 // we will keep track of the evbase clients will be using here, rather than using an extern 
-// variable.  Gives more flexibility if we want to have seperate evbases.
-static struct event_base *_evbase = NULL;
+// variable.  Gives more flexibility if we want to have seperate evbases.  Each shard has its own.
+static SHARD_LOCAL struct event_base *_evbase = NULL;
 
 
 
@@ -162,6 +233,38 @@ void client_add_special(int code, void *fn)
 }
 
 
+// commands for a particular key are run by the shard that owns the bucket it belongs to.  'route' 
+// gets that shard from the payload, or returns -1 if it cant tell, in which case the command is 
+// run wherever it is, and the handler deals with it.
+void client_route_cmd(int cmd, int (*route)(char *payload, int length))
+{
+	assert(cmd > 0);
+	assert(route);
+	
+	assert(_commands);
+	assert(cmd < _command_max);
+	assert(_commands[cmd]);
+	assert(_commands[cmd]->route == NULL);
+	assert(_commands[cmd]->control == 0);
+	_commands[cmd]->route = route;
+}
+
+
+// commands that change the shape of the cluster are only run by the main loop.  A connection that 
+// sends one is handed over to the main loop (see client_move).
+void client_control_cmd(int cmd)
+{
+	assert(cmd > 0);
+	
+	assert(_commands);
+	assert(cmd < _command_max);
+	assert(_commands[cmd]);
+	assert(_commands[cmd]->route == NULL);
+	assert(_commands[cmd]->control == 0);
+	_commands[cmd]->control = 1;
+}
+
+
 void clients_cleanup(void)
 {
 	int i;
@@ -191,6 +294,9 @@ void clients_cleanup(void)
 	
 }
 
+static void clients_add(client_t *client);
+
+
 client_t * client_new(void)
 {
 	client_t *client;
@@ -204,6 +310,7 @@ client_t * client_new(void)
 	client->read_event = NULL;
 	client->write_event = NULL;
 	client->shutdown_event = NULL;
+	client->resume_event = NULL;
 	
 	client->out.buffer = NULL;
 	client->out.offset = 0;
@@ -222,7 +329,36 @@ client_t * client_new(void)
 	client->tries = 0;
 	
 	client->closing = 0;
+	client->corked = 0;
+	client->stalled = 0;
+	
+	client->ring.recv.handler = ring_recv_handler;
+	client->ring.recv.arg = client;
+	client->ring.send.handler = ring_send_handler;
+	client->ring.send.arg = client;
+	client->ring.msg.msg_iov = client->ring.iov;
+
+	// the client belongs to the shard that created it.
+	client->shard = shard_current();
+	assert(client->handoffs == 0);
+	assert(client->orphaned == 0);
+	
+	clients_add(client);
+	
+	assert(client->transfer_bucket == NULL);
+	
+	assert(client);
+	return(client);
+}
+
 
+
+// add the client to the list of clients that this shard is serving.
+static void clients_add(client_t *client)
+{
+	assert(client);
+	assert(client->shard == shard_current());
+	
 	// add the new client to the clients list.
 	if (_client_count > 0) {
 		assert(_clients != NULL);
@@ -244,10 +380,58 @@ client_t * client_new(void)
 	}
 	assert(_clients && _client_count > 0);
 	
-	assert(client->transfer_bucket == NULL);
+	__sync_fetch_and_add(&client->shard->clients, 1);
+}
+
+
+
+// remove the client from the list of clients that this shard is serving.
+static void clients_remove(client_t *client)
+{
+	char found=0, resize=0;
+	int i;
 	
 	assert(client);
-	return(client);
+	assert(client->shard == shard_current());
+	
+	// remove the client from the main list.
+	assert(_clients);
+	assert(_client_count > 0);
+	assert(found == 0);
+	assert(resize == 0);
+	for (i=0; i < _client_count && found == 0; i++) {
+		if (_clients[i] == client) {
+			found ++;
+			_clients[i] = NULL;
+			if (i == (_client_count - 1)) {
+				// client was at the end of the list, so we need to shorten it.
+				_client_count --;
+				assert(_client_count >= 0);
+				resize ++;
+	}	}	}
+	
+	logger(LOG_DEBUG, "found:%d, client_count:%d", found, _client_count);
+	
+	assert(found == 1);
+	
+	if (_client_count > 2) {
+		// if the first client entry is null, but the last one isnt, then move the last one to the front.
+		if (_clients[0] == NULL) {
+			if (_clients[_client_count-1] != NULL) {
+				_clients[0] = _clients[_client_count-1];
+				_clients[_client_count-1] = NULL;
+				_client_count --;
+				resize ++;
+	}	}	}
+
+	if (resize > 0) {
+		_clients = realloc(_clients, sizeof(void*)*_client_count);
+	}
+	
+	assert(_client_count >= 0);
+	
+	assert(client->shard->clients > 0);
+	__sync_fetch_and_sub(&client->shard->clients, 1);
 }
 
 
@@ -256,6 +440,45 @@ client_t * client_new(void)
 
 
 
+// is the shard's ring doing anything for the connection.
+static int ring_busy(client_t *client)
+{
+	assert(client);
+	return(client->ring.recv.active || client->ring.send.active);
+}
+
+
+// start reading from the connection.  If the shard has a ring, it does the receiving, and the read 
+// event is only a timer, so that the connection still times out when nothing arrives.
+static void client_reading(client_t *client, struct timeval *timeout)
+{
+	assert(client);
+	assert(timeout);
+	assert(client->read_event == NULL);
+	
+	assert(_evbase);
+	assert(client->handle > 0);
+	if (uring_active()) {
+		client->read_event = event_new( _evbase, -1, EV_PERSIST, timeout_handler, client);
+	}
+	else {
+		client->read_event = event_new( _evbase, client->handle, EV_READ|EV_PERSIST, read_handler, client);
+	}
+	assert(client->read_event);
+	
+	// a connection that was stopped before it was moved starts reading again once it can (see 
+	// out_unstall).
+	if (client->stalled == 0) {
+		if (uring_active()) {
+			uring_recv(&client->ring.recv, client->handle);
+		}
+		int s = event_add(client->read_event, timeout);
+		assert(s == 0);
+	}
+}
+
+
+
 //--------------------------------------------------------------------------------------------------
 // Initialise the client structure.
 void client_accept(client_t *client, evutil_socket_t handle, struct sockaddr *address, int socklen)
@@ -268,12 +491,11 @@ void client_accept(client_t *client, evutil_socket_t handle, struct sockaddr *ad
 	
 	logger(LOG_INFO, "New client - handle=%d", handle);
 
-	assert(_evbase);
-	assert(client->handle > 0);
-	client->read_event = event_new( _evbase, client->handle, EV_READ|EV_PERSIST, read_handler, client);
-	assert(client->read_event);
-	int s = event_add(client->read_event, &_timeout_accept);
-	assert(s == 0);
+	// replies are written straight to the socket when they can be (see out_flush), so it must 
+	// not block.  The listener in event-compat.c doesn't do this for us.
+	evutil_make_socket_nonblocking(handle);
+
+	client_reading(client, &_timeout_accept);
 }
 
 
@@ -281,36 +503,59 @@ void client_accept(client_t *client, evutil_socket_t handle, struct sockaddr *ad
 
 
 //--------------------------------------------------------------------------------------------------
-// Free the resources used by the client object.
-void client_free(client_t *client)
+// free the buffers and the client itself, once nothing else has it.
+static void client_destroy(client_t *client)
 {
-	char found=0, resize=0;
-	int i;
-	
 	assert(client);
-	assert(client->transfer_bucket == NULL);
+	assert(client->handoffs == 0);
+	assert(ring_busy(client) == 0);
 	
-	logger(LOG_INFO, "client_free: handle=%d", client->handle);
-
-	if (client->node) {
-		node_detach_client(client->node);
-	}
-
 	assert(client->out.length == 0);
 	assert(client->out.offset == 0);
 	if (client->out.buffer) {
-		free(client->out.buffer);
+		chunk_put(client->out.buffer);
 		client->out.buffer = NULL;
 		client->out.max = 0;
 	}
 
+	assert(client->segments.count == 0);
+	if (client->segments.list) {
+		free(client->segments.list);
+		client->segments.list = NULL;
+		client->segments.max = 0;
+	}
+
 	assert(client->in.length == 0);
 	assert(client->in.offset == 0);
 	if (client->in.buffer) {
-		free(client->in.buffer);
+		chunk_put(client->in.buffer);
 		client->in.buffer = NULL;
 		client->in.max = 0;
 	}
+	
+	free(client);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// Free the resources used by the client object.
+void client_free(client_t *client)
+{
+	assert(client);
+	assert(client->transfer_bucket == NULL);
+	assert(client->shard == shard_current());
+	assert(client->orphaned == 0);
+	
+	logger(LOG_INFO, "client_free: handle=%d", client->handle);
+
+	if (client->node) {
+		// node connections belong to the main loop.  The workers send to them directly (to keep 
+		// their backups up to date), so they need to be stopped while the node lets go of it.
+		assert(shard_id() == 0);
+		shards_pause();
+		node_detach_client(client->node);
+		shards_resume();
+	}
 
 	if (client->read_event) {
 		event_free(client->read_event);
@@ -322,64 +567,53 @@ void client_free(client_t *client)
 		client->write_event = NULL;
 	}
 	
+	if (client->resume_event) {
+		event_free(client->resume_event);
+		client->resume_event = NULL;
+	}
+	
 	assert(client->shutdown_event == NULL);
 
+	if (ring_busy(client)) {
+		// the ring has the socket open until its operations are finished, and shutting it down is 
+		// what makes them finish.
+		assert(client->handle != INVALID_HANDLE);
+		shutdown(client->handle, SHUT_RDWR);
+	}
+
 	if (client->handle != INVALID_HANDLE) {
 		logger(LOG_DEBUG, "client_free: closing socket %d", client->handle);
 		EVUTIL_CLOSESOCKET(client->handle);
 		client->handle = INVALID_HANDLE;
 	}
 	
-	// remove the client from the main list.
-	assert(_clients);
-	assert(_client_count > 0);
-	assert(found == 0);
-	assert(resize == 0);
-	for (i=0; i < _client_count && found == 0; i++) {
-		if (_clients[i] == client) {
-			found ++;
-			_clients[i] = NULL;
-			if (i == (_client_count - 1)) {
-				// client was at the end of the list, so we need to shorten it.
-				_client_count --;
-				assert(_client_count >= 0);
-				resize ++;
-	}	}	}
-	
-	logger(LOG_DEBUG, "found:%d, client_count:%d", found, _client_count);
-	
-	assert(found == 1);
-	
-	if (_client_count > 2) {
-		// if the first client entry is null, but the last one isnt, then move the last one to the front.
-		if (_clients[0] == NULL) {
-			if (_clients[_client_count-1] != NULL) {
-				_clients[0] = _clients[_client_count-1];
-				_clients[_client_count-1] = NULL;
-				_client_count --;
-				resize ++;
-	}	}	}
-
-	if (resize > 0) {
-		_clients = realloc(_clients, sizeof(void*)*_client_count);
-	}
+	clients_remove(client);
 	
 	server_conn_closed();
 	
 	assert(client);
-	free(client);
-	
-	assert(_client_count >= 0);
+	if (client->handoffs > 0 || ring_busy(client)) {
+		// other shards still have calls for this client (or the ring has operations for it).  It 
+		// can only be freed when they are done.
+		logger(LOG_DEBUG, "client_free: waiting for %d handoffs", client->handoffs);
+		client->orphaned = 1;
+	}
+	else {
+		client_destroy(client);
+	}
 }
 
 
 
 
-// Process the messages received.  The messages could be new commands, or replies to commands that were sent.
-static int process_data(client_t *client) 
+// Process the messages received.  The messages could be new commands, or replies to commands that were sent.  
+// No more than 'budget' of them are processed, and the number that were is returned.
+static int process_data(client_t *client, int budget) 
 {
 	int processed = 0;
 	int stopped = 0;
+	int waiting = 0;
+	int owner;
 	char *ptr;
 	header_t header;
 	raw_header_t *raw;
@@ -395,6 +629,8 @@ static int process_data(client_t *client)
 	
 	assert(client);
 	assert(client->handle > 0);
+	assert(client->shard == shard_current());
+	assert(budget > 0);
 
 	#ifndef NDEBUG
 	int cycle_count = 0;
@@ -410,7 +646,7 @@ static int process_data(client_t *client)
 		logger(LOG_DEBUG, "[process_data] in.length=%d, in.offset=%d, in.max=%d",
 			   client->in.length, client->in.offset, client->in.max);
 		
-		assert(client->in.buffer);
+		assert(client->in.buffer || client->in.length == 0);
 		assert((client->in.length + client->in.offset) <= client->in.max);
 		
 		// if we dont have enough for a header, then we dont have enough to build a message.  Messages are at least that.
@@ -419,6 +655,16 @@ static int process_data(client_t *client)
             logger(LOG_DEBUG, "[process_data] There wasn't enough data to build anything so not processing the buffer. in.length=%d", client->in.length);
 			stopped = 1;
 		}
+		else if (processed >= budget) {
+			// the connection has had its turn.  The rest is processed once the others have had 
+			// theirs (see client_process).
+			stopped = 1;
+		}
+		else if (client->stalled) {
+			// the client isn't taking its replies, so it doesn't get any more until it does (see 
+			// out_stall).
+			stopped = 1;
+		}
 		else {
 			
 			// keeping in mind the offset, get the 4 params, and determine what we need to do with 
@@ -484,12 +730,35 @@ static int process_data(client_t *client)
 							// this server doesnt understand that command.
 							assert(0);
 						}
+						else if (_commands[header.command]->control && client->handoffs > 0) {
+							// the commands that were sent before this one need to be finished 
+							// first.  It will be processed when they are (see client_handoff_done).
+							waiting = 1;
+							stopped = 1;
+						}
+						else if (_commands[header.command]->control && shard_id() != 0) {
+							// only the main loop can run this command, so the connection is handed 
+							// to it, along with everything it has sent that hasn't been processed.
+							client_move(client, shard_get(0));
+							return(processed);
+						}
 						else {
 							assert(_commands[header.command]->handlers[0].code == 0);
 							assert(_commands[header.command]->handlers[0].fn);
 							
-							func_cmd = _commands[header.command]->handlers[0].fn;
-							(*func_cmd)(client, &header, ptr);
+							owner = -1;
+							if (_commands[header.command]->route && shards_workers() > 0) {
+								owner = (*_commands[header.command]->route)(ptr, header.length);
+							}
+							
+							if (owner >= 0 && owner != shard_id()) {
+								// the data for this command belongs to another shard.
+								client_handoff(client, &header, ptr, shard_get(owner));
+							}
+							else {
+								func_cmd = _commands[header.command]->handlers[0].fn;
+								(*func_cmd)(client, &header, ptr);
+							}
 						}
 					}
 					else {
@@ -547,14 +816,17 @@ static int process_data(client_t *client)
 				}
 				
 				// need to adjust the details of the incoming buffer.
-				client->in.length -= (header.length + HEADER_SIZE);
-				assert(client->in.length >= 0);
-				if (client->in.length == 0) {
-					client->in.offset = 0;
-					stopped = 1;
-				}
-				else {
-					client->in.offset += (header.length + HEADER_SIZE);
+				if (waiting == 0) {
+					processed ++;
+					client->in.length -= (header.length + HEADER_SIZE);
+					assert(client->in.length >= 0);
+					if (client->in.length == 0) {
+						client->in.offset = 0;
+						stopped = 1;
+					}
+					else {
+						client->in.offset += (header.length + HEADER_SIZE);
+					}
 				}
 				assert( ( client->in.length + client->in.offset ) <= client->in.max);
 			}	
@@ -568,47 +840,381 @@ static int process_data(client_t *client)
 
 
 
-static void log_data(int handle, char *tag, unsigned char *data, int length)
+// the connection has used up its turn, but there is more that it has sent waiting to be 
+// processed.  It is resumed with a timer that has already expired, so it runs the next time 
+// around the loop, after the sockets have been checked.  (Making the event active would run it 
+// in the same pass as the events already waiting, and a connection that keeps using up its turn 
+// would then keep the loop from ever checking the sockets again).
+static void client_resume(client_t *client)
 {
-	int i;
-	int col;
-	char buffer[512];	// line buffer.
-	int len;  			// buffer length;
-	int start;
+	struct timeval now = {0, 0};
+
+	assert(client);
+	assert(client->shard == shard_current());
 	
-	assert(tag);
-	assert(data);
-	assert(length > 0);
+	if (client->resume_event == NULL) {
+		assert(_evbase);
+		client->resume_event = evtimer_new(_evbase, resume_handler, client);
+		assert(client->resume_event);
+	}
+	
+	evtimer_add(client->resume_event, &now);
+}
 
-	i = 0;
-	while (i < length) {
 
-		start = i;
-		
-		// first put the tag in the buffer.
-		strncpy(buffer, tag, sizeof(buffer));
-		len = strlen(tag);
-		
-		// now put the line count.
-		len += sprintf(buffer+len, "[%d] %04X: ", handle, i);
-		
-		// now display the columns of text.
-		for (col=0; col<16; col++) {
-			if (i < length && col==7) {
-				len += sprintf(buffer+len, "%02x-", data[i]);
-			}
-			else if (i < length) {
-				len += sprintf(buffer+len, "%02x ", data[i]);
-			}
-			else {
-				len += sprintf(buffer+len, "   ");
-			}
-			
-			i++;
-		}
-		
-		// add a seperator
-		len += sprintf(buffer+len, ": ");
+// has the connection used up its turn, and is waiting for the others to have theirs.
+static int client_yielded(client_t *client)
+{
+	assert(client);
+	return(client->resume_event && event_pending(client->resume_event, EV_TIMEOUT, NULL));
+}
+
+
+// with io_uring, the receive keeps going whether what it has received has been processed or not.  
+// So it is stopped when a lot is waiting (because the connection keeps using up its turn, or 
+// because it has stalled), and started again once it has caught up.
+static void ring_throttle(client_t *client)
+{
+	assert(client);
+	
+	if (uring_active() == 0 || client->moving || client->read_event == NULL) {
+		return;
+	}
+	
+	if (client->in.length >= CLIENT_READ_BUDGET || client->stalled) {
+		uring_cancel(&client->ring.recv);
+	}
+	else if (client->ring.recv.active == 0) {
+		uring_recv(&client->ring.recv, client->handle);
+	}
+}
+
+
+// process what has been received (as much as the connection's turn allows), and then send all the 
+// replies together.  While the client is corked, send_data only adds to what is waiting to be 
+// sent.  Returns the number of frames that were processed, or -1 if the connection was handed to 
+// another shard (in which case it can't be touched any more).
+static int client_process(client_t *client, int budget)
+{
+	int processed;
+	
+	assert(client);
+	assert(client->shard == shard_current());
+	
+	client->corked ++;
+	processed = process_data(client, budget);
+	client->corked --;
+	assert(client->corked >= 0);
+	
+	// if the connection is being handed to another shard, what is left goes with it.
+	if (client->moving) {
+		client_move_done(client);
+		return(-1);
+	}
+	
+	if (processed >= budget && client->stalled == 0 && in_ready(client)) {
+		_yields ++;
+		client_resume(client);
+	}
+	
+	ring_throttle(client);
+	in_release(client);
+	out_flush(client);
+	
+	return(processed);
+}
+
+
+static void resume_handler(int fd, short int flags, void *arg)
+{
+	client_t *client = arg;
+	
+	assert(fd == -1);
+	assert(client);
+	assert(client->resume_event);
+	
+	client_process(client, CLIENT_FRAME_BUDGET);
+}
+
+
+// run by the client's shard when the command it handed off has been done.
+static void handoff_done(void *arg)
+{
+	handoff_t *handoff = arg;
+	client_t *client;
+	
+	assert(handoff);
+	client = handoff->client;
+	free(handoff);
+	
+	client_handoff_done(client);
+}
+
+
+// run by the shard that owns the data for the command.  The client belongs to another shard, so 
+// anything that the handler sends to it is handed back to that shard (see send_data).
+static void handoff_run(void *arg)
+{
+	handoff_t *handoff = arg;
+	void (*func_cmd)(client_t *client, header_t *header, char *payload);
+	
+	assert(handoff);
+	assert(handoff->client);
+	assert(handoff->client->shard != shard_current());
+	assert(handoff->header.response_code == 0);
+	
+	assert(_commands[handoff->header.command]);
+	assert(_commands[handoff->header.command]->handlers[0].code == 0);
+	func_cmd = _commands[handoff->header.command]->handlers[0].fn;
+	assert(func_cmd);
+	(*func_cmd)(handoff->client, &handoff->header, handoff->header.length > 0 ? handoff->payload : NULL);
+	
+	shard_call(handoff->client->shard, handoff_done, handoff);
+}
+
+
+// hand the command to the shard that owns the data it is for.  The payload is copied, because the 
+// incoming buffer will be re-used before it gets to it.
+static void client_handoff(client_t *client, header_t *header, char *payload, shard_t *shard)
+{
+	handoff_t *handoff;
+	
+	assert(client);
+	assert(header);
+	assert((header->length == 0 && payload == NULL) || (header->length > 0 && payload));
+	assert(shard);
+	assert(shard != shard_current());
+	assert(client->shard == shard_current());
+	
+	handoff = malloc(sizeof(handoff_t) + header->length);
+	assert(handoff);
+	handoff->client = client;
+	handoff->header = *header;
+	if (header->length > 0) {
+		memcpy(handoff->payload, payload, header->length);
+	}
+	
+	__sync_fetch_and_add(&client->handoffs, 1);
+	shard_call(shard, handoff_run, handoff);
+}
+
+
+// something that another shard had for this client is done.  If the connection was closed in the 
+// meantime, and that was the last one, the client can finally be freed.  Otherwise, there might be 
+// a command that was waiting for it.
+static void client_handoff_done(client_t *client)
+{
+	assert(client);
+	assert(client->shard == shard_current());
+	assert(client->handoffs > 0);
+	
+	if (__sync_sub_and_fetch(&client->handoffs, 1) == 0) {
+		if (client->orphaned) {
+			if (ring_busy(client) == 0) {
+				client_destroy(client);
+			}
+		}
+		else if (client->moving) {
+			client_move_done(client);
+		}
+		else if (client->in.length >= HEADER_SIZE) {
+			client_process(client, CLIENT_FRAME_BUDGET);
+		}
+	}
+}
+
+
+
+// the connection has been handed over to this shard.  Set up its events here, and carry on with 
+// what it had sent.  Anything that was waiting to be sent goes when that is done.
+static void client_adopt(void *arg)
+{
+	client_t *client = arg;
+	
+	assert(client);
+	assert(client->shard == shard_current());
+	assert(client->handoffs == 0);
+	assert(client->read_event == NULL);
+	assert(client->write_event == NULL);
+	assert(ring_busy(client) == 0);
+	
+	clients_add(client);
+	
+	client_reading(client, &_timeout_client);
+	
+	client_process(client, CLIENT_FRAME_BUDGET);
+}
+
+
+// something that a command needs done by another shard, on behalf of the client.
+typedef struct {
+	client_t *client;
+	void (*fn)(void *arg);
+	void (*done)(client_t *client, void *arg);
+	void *arg;
+} client_call_t;
+
+
+// back on the client's shard.  If the connection was closed while the call was away, 'done' gets 
+// a NULL client, so it only needs to clean up.
+static void client_call_done(void *arg)
+{
+	client_call_t *call = arg;
+	client_t *client;
+	
+	assert(call);
+	client = call->client;
+	assert(client);
+	assert(client->shard == shard_current());
+	
+	(*call->done)(client->orphaned ? NULL : client, call->arg);
+	free(call);
+	
+	client_handoff_done(client);
+}
+
+
+static void client_call_run(void *arg)
+{
+	client_call_t *call = arg;
+	
+	assert(call);
+	assert(call->client);
+	assert(call->client->shard != shard_current());
+	
+	(*call->fn)(call->arg);
+	shard_call(call->client->shard, client_call_done, call);
+}
+
+
+// Run 'fn' on another shard (for the data that it owns), and then 'done' back on the client's 
+// shard, where it can reply.  This is for commands that need more than one shard (see cmd_mget), 
+// so the client is kept until 'done' has run, the same as for a handoff.
+void client_call(client_t *client, shard_t *shard, void (*fn)(void *arg), void (*done)(client_t *client, void *arg), void *arg)
+{
+	client_call_t *call;
+	
+	assert(client);
+	assert(client->shard == shard_current());
+	assert(shard);
+	assert(shard != shard_current());
+	assert(fn);
+	assert(done);
+	
+	call = malloc(sizeof(client_call_t));
+	assert(call);
+	call->client = client;
+	call->fn = fn;
+	call->done = done;
+	call->arg = arg;
+	
+	__sync_fetch_and_add(&client->handoffs, 1);
+	shard_call(shard, client_call_run, call);
+}
+
+
+// hand the connection over to another shard.  Nothing else can have a call for the client at this 
+// point, so once its events are removed, and the ring has stopped receiving (and finished what it 
+// was sending), this shard is done with it.  That happens in client_move_done(), because the 
+// client is still being processed here.
+static void client_move(client_t *client, shard_t *shard)
+{
+	assert(client);
+	assert(shard);
+	assert(client->shard == shard_current());
+	assert(shard != client->shard);
+	assert(client->handoffs == 0);
+	assert(client->shutdown_event == NULL);
+	assert(client->moving == NULL);
+	
+	logger(LOG_DEBUG, "Moving client [%d] from shard %d to shard %d.", client->handle, client->shard->id, shard->id);
+	
+	if (client->read_event) {
+		event_free(client->read_event);
+		client->read_event = NULL;
+	}
+	
+	if (client->write_event) {
+		event_free(client->write_event);
+		client->write_event = NULL;
+	}
+	
+	if (client->resume_event) {
+		event_free(client->resume_event);
+		client->resume_event = NULL;
+	}
+	
+	uring_cancel(&client->ring.recv);
+	
+	client->moving = shard;
+}
+
+
+// once nothing on this shard has anything for the client that is moving, it can go.
+static void client_move_done(client_t *client)
+{
+	shard_t *shard;
+	
+	assert(client);
+	assert(client->moving);
+	assert(client->shard == shard_current());
+	
+	if (client->handoffs > 0 || ring_busy(client)) {
+		return;
+	}
+	
+	shard = client->moving;
+	client->moving = NULL;
+	
+	clients_remove(client);
+	
+	client->shard = shard;
+	shard_call(shard, client_adopt, client);
+}
+
+
+
+static void log_data(int handle, char *tag, unsigned char *data, int length)
+{
+	int i;
+	int col;
+	char buffer[512];	// line buffer.
+	int len;  			// buffer length;
+	int start;
+	
+	assert(tag);
+	assert(data);
+	assert(length > 0);
+
+	i = 0;
+	while (i < length) {
+
+		start = i;
+		
+		// first put the tag in the buffer.
+		strncpy(buffer, tag, sizeof(buffer));
+		len = strlen(tag);
+		
+		// now put the line count.
+		len += sprintf(buffer+len, "[%d] %04X: ", handle, i);
+		
+		// now display the columns of text.
+		for (col=0; col<16; col++) {
+			if (i < length && col==7) {
+				len += sprintf(buffer+len, "%02x-", data[i]);
+			}
+			else if (i < length) {
+				len += sprintf(buffer+len, "%02x ", data[i]);
+			}
+			else {
+				len += sprintf(buffer+len, "   ");
+			}
+			
+			i++;
+		}
+		
+		// add a seperator
+		len += sprintf(buffer+len, ": ");
 		
 		// now we display the plain text.
 		assert(start >= 0);
@@ -638,149 +1244,716 @@ static void log_data(int handle, char *tag, unsigned char *data, int length)
 
 
 
-// This function is called when data is available on the socket.  We need to 
-// read the data from the socket, and process as much of it as we can.  We 
-// need to remember that we might possibly have leftover data from previous 
-// reads, so we will need to append the new data in that case.
-static void read_handler(int fd, short int flags, void *arg)
+// make sure there is room in the in buffer to read into.  The frames are processed from where 
+// they are in the chunk, so the only data that is ever moved is what is left over at the end of 
+// one (a frame that has only partly arrived), and that is moved into a fresh chunk along with 
+// the rest of it.  A frame too big for a chunk gets a buffer big enough to hold all of it.
+// Returns -1 if the frame is bigger than it is allowed to be, in which case the connection needs 
+// to be closed.
+static int in_reserve(client_t *client)
+{
+	raw_header_t *raw;
+	char *buffer;
+	unsigned int length;
+	unsigned int limit;
+	int need;
+	
+	assert(client);
+	assert(client->in.length >= 0);
+	assert(_max_frame > 0);
+	
+	need = client->in.length + DEFAULT_BUFSIZE;
+	if (client->in.length >= HEADER_SIZE) {
+		raw = (void *) (client->in.buffer + client->in.offset);
+		length = be32toh(raw->length);
+		
+		// a node passes values on with their details added, so a value that only just fitted in 
+		// a client's frame still needs to fit in the node's.
+		limit = _max_frame + (client->node ? DEFAULT_BUFSIZE : 0);
+		if (length > limit) {
+			logger(LOG_ERROR, "socket %d sent a frame of %u bytes, which is more than the limit of %u.  Closing.", 
+				client->handle, length, limit);
+			return(-1);
+		}
+		
+		if (HEADER_SIZE + (int) length > need) {
+			need = HEADER_SIZE + length;
+		}
+	}
+	
+	if (client->in.buffer == NULL || client->in.offset + need > client->in.max) {
+		// when it has to get bigger, it at least doubles.  Otherwise a connection that is sending 
+		// faster than it is being processed would have everything it has sent copied again for 
+		// every few kb that it adds.
+		if (client->in.buffer && need > client->in.max && need < client->in.max * 2) {
+			need = client->in.max * 2;
+		}
+		buffer = chunk_get(need);
+		assert(buffer);
+		if (client->in.length > 0) {
+			memcpy(buffer, client->in.buffer + client->in.offset, client->in.length);
+		}
+		if (client->in.buffer) {
+			chunk_put(client->in.buffer);
+		}
+		client->in.buffer = buffer;
+		client->in.offset = 0;
+		client->in.max = chunk_size(buffer);
+	}
+	
+	assert(client->in.max - client->in.offset - client->in.length >= DEFAULT_BUFSIZE);
+	return(0);
+}
+
+
+// is there a whole frame in the in buffer, ready to be processed.
+static int in_ready(client_t *client)
+{
+	raw_header_t *raw;
+	
+	assert(client);
+	
+	if (client->in.length < HEADER_SIZE) {
+		return(0);
+	}
+	
+	raw = (void *) (client->in.buffer + client->in.offset);
+	return(client->in.length - HEADER_SIZE >= be32toh(raw->length));
+}
+
+
+// once everything that was received has been processed, the chunk can go back, so that idle 
+// connections are not holding on to them.
+static void in_release(client_t *client)
+{
+	assert(client);
+	
+	if (client->in.length == 0 && client->in.buffer) {
+		chunk_put(client->in.buffer);
+		client->in.buffer = NULL;
+		client->in.offset = 0;
+		client->in.max = 0;
+	}
+}
+
+
+// throw away whatever has been received, because the connection is going.
+static void in_discard(client_t *client)
+{
+	assert(client);
+	
+	client->in.length = 0;
+	in_release(client);
+}
+
+
+// nothing has been received from the client for a while.
+static void client_timeout(client_t *client)
+{
+	assert(client);
+	assert(client->timeout >= 0 && client->timeout < CLIENT_TIMEOUT_LIMIT);
+
+	client->timeout ++;
+	if (client->timeout >= client->timeout_limit) {
+	
+		// we timed out, so we should kill the client.
+		logger(LOG_ERROR, "client timed out. handle=%d", client->handle);
+		
+		// because the client has timed out, we need to clear out any data that we currently 
+		// have for it.
+		in_discard(client);
+		
+		client_free(client);
+		client = NULL;
+	}
+	else {
+		// if the client is a node, then // we send a ping.
+		if (client->node) {
+			push_ping(client);
+		}
+	}
+}
+
+
+// the connection has closed, or failed.
+static void client_closed(client_t *client)
+{
+	assert(client);
+	
+	// free the client resources.
+	if (client->node) {
+		// this client is actually a node connection.  We need to create an event to wait 
+		// and then try connecting again.
+		node_retry(client->node);
+	}
+	
+	// if we received partial data from the socket before it closed, we need to clear it.
+	in_discard(client);
+	
+	// if we have data pending to send, we might as well clear that out too, as we cant send it now.
+	out_discard(client);
+
+	client_free(client);
+}
+
+
+// This function is called when data is available on the socket.  We need to 
+// read the data from the socket, and process as much of it as we can.  We 
+// need to remember that we might possibly have leftover data from previous 
+// reads, so we will need to append the new data in that case.
+//
+// Each lot is processed as soon as it is read, and then it reads again, until there is nothing 
+// left (a read that doesn't fill the buffer means the socket has been emptied, so there is no 
+// need to wait for it to say so), or the connection has had its turn (CLIENT_FRAME_BUDGET frames 
+// or CLIENT_READ_BUDGET bytes).  Whatever is left is processed once the other connections have 
+// had their turn.
+static void read_handler(int fd, short int flags, void *arg)
+{
+	client_t *client = (client_t *) arg;
+	int avail;
+	int res;
+	int processed;
+	int budget;
+	int total;
+	
+	assert(fd >= 0);
+	assert(flags != 0);
+	assert(client);
+	assert(client->handle == fd);
+
+	if (flags & EV_TIMEOUT) {
+		client_timeout(client);
+	}
+	else if (client_yielded(client)) {
+		// it has already used up its turn.  What is waiting on the socket is read after the rest 
+		// of what it sent has been processed.
+	}
+	else {
+		budget = CLIENT_FRAME_BUDGET;
+		total = 0;
+		
+		do {
+			// Make sure we have room in our inbuffer.
+			if (in_reserve(client) < 0) {
+				client_closed(client);
+				return;
+			}
+			avail = client->in.max - client->in.length - client->in.offset;
+			assert(avail >= DEFAULT_BUFSIZE);
+			
+			// read data from the socket, after whatever is already there.
+			assert(client->in.buffer);
+			res = read(fd, client->in.buffer + client->in.offset + client->in.length, avail);
+			if (res > 0) {
+				
+				client->timeout = 0;
+				
+				stats_bytes_in(res);
+				client->in.total += res;
+				
+				if (log_getlevel() >= LOG_EXTRA) {
+					log_data(fd, "IN: ", (unsigned char *)client->in.buffer + client->in.offset + client->in.length, res);
+				}
+
+				// got some data.
+				assert(res <= avail);
+				client->in.length += res;
+				total += res;
+				
+				processed = client_process(client, budget);
+				if (processed < 0) {
+					// the connection has been handed to another shard.
+					return;
+				}
+				budget -= processed;
+			}
+			else if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+				// there is nothing more to read for now.
+			}
+			else {
+				// the connection was closed, or there was an error.
+				logger(LOG_ERROR, "socket %d closed. res=%d, errno=%d,'%s'", fd, res, errno, strerror(errno));
+				client_closed(client);
+				client = NULL;
+				return;
+			}
+		} while (res == avail && budget > 0 && total < CLIENT_READ_BUDGET && client->stalled == 0);
+	}
+}
+
+
+// when the ring is receiving for the client, the read event is only a timer.
+static void timeout_handler(int fd, short int flags, void *arg)
+{
+	assert(fd == -1);
+	assert(flags & EV_TIMEOUT);
+	assert(arg);
+	
+	client_timeout(arg);
+}
+
+
+// the connection was freed while the ring still had operations for it.  Once they are all done 
+// (and no other shard has anything for it either), it is finally gone.
+static void ring_orphaned(client_t *client)
+{
+	assert(client);
+	assert(client->orphaned);
+	
+	if (client->handoffs == 0 && ring_busy(client) == 0) {
+		client_destroy(client);
+	}
+}
+
+
+// the ring has received some data for the client.  It is copied into the in buffer (a piece at a 
+// time if there isn't room for all of it), so that the frames are processed the same way as they 
+// are when the socket is read.
+static void ring_recv_handler(uring_op_t *op, int res, char *data)
+{
+	client_t *client;
+	int avail;
+	int n;
+	
+	assert(op);
+	client = op->arg;
+	assert(client);
+	assert(op == &client->ring.recv);
+	assert(client->shard == shard_current());
+	
+	if (client->orphaned) {
+		ring_orphaned(client);
+		return;
+	}
+	
+	if (res > 0) {
+		assert(data);
+		
+		client->timeout = 0;
+		
+		stats_bytes_in(res);
+		client->in.total += res;
+		
+		if (log_getlevel() >= LOG_EXTRA) {
+			log_data(client->handle, "IN: ", (unsigned char *) data, res);
+		}
+		
+		while (res > 0) {
+			if (in_reserve(client) < 0) {
+				client_closed(client);
+				return;
+			}
+			avail = client->in.max - client->in.length - client->in.offset;
+			n = res < avail ? res : avail;
+			memcpy(client->in.buffer + client->in.offset + client->in.length, data, n);
+			client->in.length += n;
+			data += n;
+			res -= n;
+		}
+		
+		// if the connection is moving, it is processed by the shard it is going to.  If it has 
+		// used up its turn (or has stalled), it is processed when it gets another one.
+		if (client->moving == NULL) {
+			if (client_yielded(client) || client->stalled) {
+				ring_throttle(client);
+			}
+			else {
+				client_process(client, CLIENT_FRAME_BUDGET);
+			}
+			return;
+		}
+	}
+	else if (res != -ECANCELED) {
+		logger(LOG_ERROR, "socket %d closed. res=%d, errno=%d,'%s'", client->handle, res, -res, strerror(-res));
+		client_closed(client);
+		return;
+	}
+	
+	// the receive was stopped so that the connection can be moved to another shard, or because 
+	// too much was waiting to be processed (or it just stopped, which it can do when the kernel 
+	// falls behind with the completions).
+	if (client->moving) {
+		client_move_done(client);
+	}
+	else {
+		ring_throttle(client);
+	}
+}
+
+
+// a value is only worth sending from where it is stored if it is big, and it will still be there 
+// after the reply has been queued.
+static int segment_shared(client_segment_t *ref)
+{
+	assert(ref);
+	assert(ref->base);
+	return(ref->release && ref->length >= CLIENT_COPY_MAX);
+}
+
+
+// let go of a value that was being sent from where it was stored.  It belongs to the shard that 
+// made the reply, so that is where it is done.
+static void segment_release(client_segment_t *seg)
+{
+	assert(seg);
+	assert(seg->base);
+	
+	if (seg->release) {
+		if (seg->shard == shard_current()) {
+			(*seg->release)(seg->base);
+		}
+		else {
+			shard_call(seg->shard, seg->release, seg->base);
+		}
+	}
+	
+	seg->base = NULL;
+	seg->release = NULL;
+}
+
+
+// run by the client's shard, to send something that another shard had for it.
+static void deliver_run(void *arg)
+{
+	delivery_t *delivery = arg;
+	client_t *client;
+	PAYLOAD payload;
+	
+	assert(delivery);
+	client = delivery->client;
+	assert(client);
+	assert(client->shard == shard_current());
+
+	// if the connection has been closed, there is nothing to send it to.
+	if (client->orphaned == 0) {
+		if (delivery->command > 0) {
+			// the reply will come back here, so the message needs a payload from this shard.
+			payload = payload_new(client, delivery->command);
+			payload_raw(payload, delivery->length, delivery->data);
+			client_send_message(payload);
+		}
+		else {
+			send_data(client, &delivery->raw, delivery->length, delivery->length > 0 ? delivery->data : NULL, delivery->ref.base ? &delivery->ref : NULL);
+			delivery->ref.base = NULL;
+		}
+	}
+	
+	if (delivery->ref.base) {
+		segment_release(&delivery->ref);
+	}
+	
+	free(delivery);
+	client_handoff_done(client);
+}
+
+
+// hand a message or reply to the shard that the client belongs to, so that it can send it.
+static void client_deliver(client_t *client, int command, raw_header_t *rawheader, int length, void *data, client_segment_t *ref)
+{
+	delivery_t *delivery;
+	int copy = 0;
+	
+	assert(client);
+	assert(client->shard != shard_current());
+	assert((command > 0 && rawheader == NULL) || (command == 0 && rawheader));
+	assert((length == 0) || (length > 0 && data));
+	assert(ref == NULL || command == 0);
+
+	// a value that is not worth referring to goes in with the rest of the reply.
+	if (ref && segment_shared(ref) == 0) {
+		copy = ref->length;
+	}
+
+	delivery = malloc(sizeof(delivery_t) + length + copy);
+	assert(delivery);
+	delivery->client = client;
+	delivery->command = command;
+	if (rawheader) {
+		delivery->raw = *rawheader;
+	}
+	delivery->length = length + copy;
+	if (length > 0) {
+		memcpy(delivery->data, data, length);
+	}
+	
+	delivery->ref.base = NULL;
+	if (ref) {
+		if (copy > 0) {
+			memcpy(delivery->data + length, ref->ptr, copy);
+			segment_release(ref);
+		}
+		else {
+			delivery->ref = *ref;
+		}
+	}
+
+	__sync_fetch_and_add(&client->handoffs, 1);
+	shard_call(client->shard, deliver_run, delivery);
+}
+
+
+// add a segment to the end of the ones waiting to be sent.  Copied data is added onto the segment 
+// before it, if that was copied too.
+static void segment_push(client_t *client, client_segment_t *seg)
+{
+	client_segment_t *last;
+	
+	assert(client);
+	assert(seg);
+	assert(seg->length > 0);
+	
+	client->segments.bytes += seg->length;
+	
+	if (seg->base == NULL && client->segments.count > 0) {
+		last = &client->segments.list[client->segments.head + client->segments.count - 1];
+		if (last->base == NULL) {
+			last->length += seg->length;
+			return;
+		}
+	}
+	
+	if (client->segments.head + client->segments.count == client->segments.max) {
+		if (client->segments.head > 0) {
+			memmove(client->segments.list, client->segments.list + client->segments.head, client->segments.count * sizeof(client_segment_t));
+			client->segments.head = 0;
+		}
+		else {
+			client->segments.max = client->segments.max > 0 ? client->segments.max * 2 : 8;
+			client->segments.list = realloc(client->segments.list, client->segments.max * sizeof(client_segment_t));
+			assert(client->segments.list);
+		}
+	}
+	
+	client->segments.list[client->segments.head + client->segments.count] = *seg;
+	client->segments.count ++;
+}
+
+
+// the out chunk is full.  The copied segments that are still waiting in it are given pointers 
+// to where they are, and the last of them gives the chunk back when it has been sent, so that a 
+// fresh chunk can be started without moving anything.
+static void out_seal(client_t *client)
+{
+	client_segment_t *seg;
+	client_segment_t *last = NULL;
+	char *ptr;
+	int i;
+	
+	assert(client);
+	assert(client->out.buffer);
+	
+	ptr = client->out.buffer + client->out.offset;
+	for (i=0; i<client->segments.count; i++) {
+		seg = &client->segments.list[client->segments.head + i];
+		if (seg->base == NULL) {
+			seg->base = ptr;
+			seg->ptr = ptr;
+			ptr += seg->length;
+			last = seg;
+		}
+	}
+	assert(ptr == client->out.buffer + client->out.offset + client->out.length);
+	
+	if (last) {
+		last->base = client->out.buffer;
+		last->release = chunk_put;
+		last->shard = shard_current();
+	}
+	else {
+		chunk_put(client->out.buffer);
+	}
+	
+	client->out.buffer = NULL;
+	client->out.offset = 0;
+	client->out.length = 0;
+	client->out.max = 0;
+}
+
+
+// copy the data onto the end of the out buffer.
+static void out_copy(client_t *client, const void *data, int length)
+{
+	client_segment_t seg;
+	
+	assert(client);
+	assert(data);
+	assert(length > 0);
+	
+	seg.base = NULL;
+	seg.ptr = NULL;
+	seg.length = length;
+	seg.release = NULL;
+	seg.shard = NULL;
+	
+	if (length > CHUNK_SIZE) {
+		// too big for a chunk, so it gets a buffer of its own.
+		seg.base = chunk_get(length);
+		seg.ptr = seg.base;
+		seg.release = chunk_put;
+		seg.shard = shard_current();
+		memcpy(seg.base, data, length);
+		segment_push(client, &seg);
+		return;
+	}
+	
+	if (client->out.buffer && client->out.max < client->out.length + client->out.offset + length) {
+		out_seal(client);
+	}
+	if (client->out.buffer == NULL) {
+		client->out.buffer = chunk_get(CHUNK_SIZE);
+		client->out.max = chunk_size(client->out.buffer);
+	}
+	assert(client->out.buffer);
+	assert(client->out.max >= client->out.length + client->out.offset + length);
+	
+	memcpy(client->out.buffer + client->out.offset + client->out.length, data, length);
+	client->out.length += length;
+	
+	segment_push(client, &seg);
+}
+
+
+// throw away everything that is waiting to be sent, because the connection has gone.  If the 
+// ring is still sending some of it, it can't be touched until it is done (see ring_send_handler).
+static void out_discard(client_t *client)
+{
+	client_segment_t *seg;
+	
+	assert(client);
+	
+	if (client->ring.send.active) {
+		return;
+	}
+	
+	while (client->segments.count > 0) {
+		seg = &client->segments.list[client->segments.head];
+		if (seg->base) {
+			segment_release(seg);
+		}
+		client->segments.head ++;
+		client->segments.count --;
+	}
+	
+	client->segments.head = 0;
+	client->segments.bytes = 0;
+	client->out.offset = 0;
+	client->out.length = 0;
+	
+	if (client->out.buffer) {
+		chunk_put(client->out.buffer);
+		client->out.buffer = NULL;
+		client->out.max = 0;
+	}
+}
+
+
+// is too much waiting to be sent to the client.  The connections to other nodes are never stopped.  
+// Two nodes that are both sending to each other (which they do when buckets are being migrated) 
+// would each stop reading the other, and then neither would ever get its buffer down.
+static int out_high(client_t *client)
+{
+	assert(client);
+	
+	if (client->node) {
+		return(0);
+	}
+	return(_out_high > 0 && client->segments.bytes >= _out_high);
+}
+
+
+// has what is waiting to be sent gone down enough for a stalled client to carry on.
+static int out_low(client_t *client)
+{
+	assert(client);
+	return(client->segments.bytes <= _out_low);
+}
+
+
+// the client isn't taking its replies as fast as it is asking for them (or the network can't keep 
+// up), so nothing more is read from it, or processed, until most of what is waiting has gone (see 
+// out_unstall).  Otherwise a client that sends a lot of requests for large values, but doesn't read 
+// the replies, would have them all kept in memory.
+static void out_stall(client_t *client)
 {
-	client_t *client = (client_t *) arg;
-	int avail;
-	int res;
-	int processed;
-	
-	assert(fd >= 0);
-	assert(flags != 0);
 	assert(client);
-	assert(client->handle == fd);
+	assert(client->stalled == 0);
+	assert(client->shard == shard_current());
+	
+	logger(LOG_DEBUG, "Client [%d] stalled, %d bytes waiting to be sent.", client->handle, client->segments.bytes);
+	
+	client->stalled = 1;
+	_stalls ++;
+	
+	if (client->read_event) {
+		event_del(client->read_event);
+	}
+	ring_throttle(client);
+}
 
-	if (flags & EV_TIMEOUT) {
-		
-		assert(client->timeout >= 0 && client->timeout < CLIENT_TIMEOUT_LIMIT);
 
-		client->timeout ++;
-		if (client->timeout >= client->timeout_limit) {
-		
-			// we timed out, so we should kill the client.
-			logger(LOG_ERROR, "client timed out. handle=%d", fd);
-			
-			// because the client has timed out, we need to clear out any data that we currently 
-			// have for it.
-			client->in.offset = 0;
-			client->in.length = 0;
-			
-			client_free(client);
-			client = NULL;
-		}
-		else {
-			// if the client is a node, then // we send a ping.
-			if (client->node) {
-				push_ping(client);
-			}
-		}
-	}
-	else {
-		// Make sure we have room in our inbuffer.
-		assert((client->in.length + client->in.offset) <= client->in.max);
-		avail = client->in.max - client->in.length - client->in.offset;
-		if (avail < DEFAULT_BUFSIZE) {
-			// we want to increase buffer size, so we'll add another DEFAULT_BUFSIZE to the max.  
-			// This should keep it in multiples of DEFAULT_BUFSIZE, regardless of how much is 
-			// available for each read.
-			
-			client->in.buffer = realloc(client->in.buffer, client->in.max + DEFAULT_BUFSIZE);
-			client->in.max += DEFAULT_BUFSIZE;
-			avail += DEFAULT_BUFSIZE;
-		}
-		assert(avail >= DEFAULT_BUFSIZE);
+// enough of what was waiting has been sent, so the client can be read and processed again.  If it 
+// is moving, the shard it is going to starts reading it.
+static void out_unstall(client_t *client)
+{
+	assert(client);
+	assert(client->stalled);
+	assert(client->shard == shard_current());
+	
+	logger(LOG_DEBUG, "Client [%d] resumed, %d bytes waiting to be sent.", client->handle, client->segments.bytes);
+	
+	client->stalled = 0;
+	
+	if (client->moving == NULL && client->read_event) {
+		event_add(client->read_event, &_timeout_client);
+		ring_throttle(client);
 		
-		// read data from the socket.
-		assert(client->in.buffer);
-		res = read(fd, client->in.buffer + client->in.offset, avail);
-		if (res > 0) {
-			
-			client->timeout = 0;
-			
-			stats_bytes_in(res);
-			client->in.total += res;
-			
-			if (log_getlevel() >= LOG_EXTRA) {
-				log_data(fd, "IN: ", (unsigned char *)client->in.buffer + client->in.offset, res);
-			}
-
-			// got some data.
-			assert(res <= avail);
-			client->in.length += res;
-			
-			processed = process_data(client);
-			if (processed < 0) {
-				// something failed while processing.  We need to close the client connection.
-				assert(0);
-			}
+		// whatever it had already sent is processed in its next turn.
+		if (in_ready(client)) {
+			client_resume(client);
 		}
-		else {
-			// the connection was closed, or there was an error.
-			logger(LOG_ERROR, "socket %d closed. res=%d, errno=%d,'%s'", fd, res, errno, strerror(errno));
-			
-			// free the client resources.
-			if (client->node) {
-				// this client is actually a node connection.  We need to create an event to wait 
-				// and then try connecting again.
-				node_retry(client->node);
-			}
-			
-			// if we received partial data from the socket before it closed, we need to clear it.
-			if (client->in.length > 0) {
-				client->in.length = 0;
-			}
-			
-			// if we have data pending to send, we might as well clear that out too, as we cant send it now.
-			if (client->out.length > 0) {
-				client->out.length = 0;
-			}
-
-			client_free(client);
-			client = NULL;
-		}	
 	}
 }
 
-static void send_data(client_t *client, raw_header_t *rawheader, int length, void *payload)
+
+// add the reply (or message) to what is waiting to be sent to the client.  The header and payload 
+// are copied into the out buffer.  If there is a 'ref' (see client_send_reply_data), it is sent 
+// from where it is, as long as it is big enough to be worth it, otherwise it is copied as well.
+static void send_data(client_t *client, raw_header_t *rawheader, int length, void *payload, client_segment_t *ref)
 {
-	char *ptr;
-	
 	assert(client);
 	assert(rawheader);
 	assert((length == 0 && payload == NULL) || (length > 0 && payload));
+	assert(ref == NULL || (ref->base && ref->length > 0));
 
 	assert(sizeof(raw_header_t) == HEADER_SIZE);
 
-	// make sure the clients out_buffer is big enough for the message.
-	while (client->out.max < client->out.length + client->out.offset + sizeof(raw_header_t) + length) {
-		client->out.buffer = realloc(client->out.buffer, client->out.max + DEFAULT_BUFSIZE);
-		client->out.max += DEFAULT_BUFSIZE;
+	if (client->shard != shard_current()) {
+		// only the shard that the client belongs to can use its buffers.
+		client_deliver(client, 0, rawheader, length, payload, ref);
+		return;
+	}
+
+	out_copy(client, rawheader, sizeof(raw_header_t));
+	if (length > 0) {
+		out_copy(client, payload, length);
 	}
-	assert(client->out.buffer);
 	
-	// add the header and the payload to the clients out_buffer, a
-	ptr = (client->out.buffer + client->out.offset + client->out.length);
+	if (ref) {
+		if (segment_shared(ref)) {
+			segment_push(client, ref);
+		}
+		else {
+			out_copy(client, ref->ptr, ref->length);
+			segment_release(ref);
+		}
+	}
 	
-	memcpy(ptr, rawheader, sizeof(raw_header_t));
-	ptr += sizeof(raw_header_t);
-	memcpy(ptr, payload, length);
-	client->out.length += (sizeof(raw_header_t) + length);
+	// if the client is corked, it will be sent with the rest of the replies when it is finished.
+	assert(client->segments.count > 0);
+	out_flush(client);
 	
-	// if the clients write-event is not set, then set it.
-	// *** For data throughput performance, it may be better to attempt to send the data straight 
-	//     away if a write-event hasn't been set, and if the write fails, then set an event.  This 
-	//     will only work on non-blocking sockets though.
-	assert(client->out.length > 0);
-	if (client->write_event == NULL) {
-		assert(_evbase);
-		assert(client->handle > 0);
-		client->write_event = event_new( _evbase, client->handle, EV_WRITE | EV_PERSIST, write_handler, (void *)client); 
-		assert(client->write_event);
-		event_add(client->write_event, NULL);
+	if (client->stalled == 0 && out_high(client)) {
+		out_stall(client);
 	}
 }
 
@@ -805,12 +1978,21 @@ void client_send_message(PAYLOAD payload_id)
 	
 	client_t *client = payload->client;
 	assert(client);
-	assert(client->pending >= 0);
-	client->pending++;
-	assert(client->pending > 0);
 	
-	send_data(client, &raw, payload->length, 
-		payload->length > 0 ? payload->buffer : NULL );
+	if (client->shard != shard_current()) {
+		// the reply will go to the shard that the client belongs to, so it needs to send the 
+		// message itself.  This payload isn't needed once it has been copied.
+		client_deliver(client, payload->command, NULL, payload->length, payload->buffer, NULL);
+		payload_release(payload_id);
+	}
+	else {
+		assert(client->pending >= 0);
+		client->pending++;
+		assert(client->pending > 0);
+		
+		send_data(client, &raw, payload->length, 
+			payload->length > 0 ? payload->buffer : NULL, NULL);
+	}
 }
 
 
@@ -819,11 +2001,25 @@ void client_send_message(PAYLOAD payload_id)
 // Note that the payload_id here is a new payload for the reply, not the original payload from the query.
 void client_send_reply(client_t *client, header_t *header, short code, PAYLOAD payload_id)
 {
+	client_send_reply_data(client, header, code, payload_id, NULL, 0, NULL);
+}
+
+
+// the same as client_send_reply(), but the reply is followed by 'length' bytes of 'data' (usually 
+// a value, with its length at the end of the payload).  If 'release' is given, then the data 
+// is left where it is until it has been sent, and then release(data) is called by this shard.  
+// Otherwise it is copied straight away.
+void client_send_reply_data(client_t *client, header_t *header, short code, PAYLOAD payload_id, char *data, int length, void (*release)(void *ptr))
+{
+	client_segment_t ref;
+	
 	assert(client);
 	assert(header);
 	assert(code > 0);
+	assert(length >= 0);
+	assert(length == 0 || data);
 
-	int length = 0;
+	int payload_length = 0;
 	void *ptr = NULL;
 	
 	if (payload_id >= 0) {
@@ -832,8 +2028,8 @@ void client_send_reply(client_t *client, header_t *header, short code, PAYLOAD p
 		assert(payload);
 		assert(payload->length >= 0);
 		
-		length = payload->length;
-		if (length > 0) {
+		payload_length = payload->length;
+		if (payload_length > 0) {
 			ptr = payload->buffer;
 		}
 	}
@@ -845,9 +2041,22 @@ void client_send_reply(client_t *client, header_t *header, short code, PAYLOAD p
 	raw.command = htobe16(header->command);
 	raw.response_code = htobe16(code);
 	raw.userid = htobe32(header->userid);
-	raw.length = htobe32(length);
-
-	send_data(client, &raw, length, ptr);
+	raw.length = htobe32(payload_length + length);
+
+	if (length > 0) {
+		ref.base = data;
+		ref.ptr = data;
+		ref.length = length;
+		ref.release = release;
+		ref.shard = shard_current();
+		send_data(client, &raw, payload_length, ptr, &ref);
+	}
+	else {
+		send_data(client, &raw, payload_length, ptr, NULL);
+		if (data && release) {
+			(*release)(data);
+		}
+	}
 
 	if (payload_id >= 0) {
 		// since this is a reply, we are not going to need the payload again, so we can release it now.
@@ -857,57 +2066,230 @@ void client_send_reply(client_t *client, header_t *header, short code, PAYLOAD p
 
 
 
-//-----------------------------------------------------------------------------
-// when the write event fires, we will try to write everything to the socket.
-// If everything has been sent, then we will remove the write_event, and the
-// out_buffer.
-static void write_handler(int fd, short int flags, void *arg)
+// point the iovec's at what is waiting to be sent (as much of it as they will hold).  Returns how 
+// many of them were used.
+static int out_iov(client_t *client, struct iovec *iov)
 {
-	client_t *client;
-	int res;
+	client_segment_t *seg;
+	char *ptr;
+	int count;
 	
-	assert(fd > 0);
-	assert(arg);
+	assert(client);
+	assert(iov);
+	assert(client->segments.count > 0);
+	assert( ( client->out.offset + client->out.length ) <= client->out.max);
+	
+	// the copied segments are one after the other in the out buffer.
+	ptr = client->out.buffer + client->out.offset;
+	for (count=0; count < client->segments.count && count < CLIENT_IOV_MAX; count++) {
+		seg = &client->segments.list[client->segments.head + count];
+		if (seg->base) {
+			iov[count].iov_base = seg->ptr;
+		}
+		else {
+			iov[count].iov_base = ptr;
+			ptr += seg->length;
+		}
+		iov[count].iov_len = seg->length;
+	}
+	
+	return(count);
+}
 
-	client = arg;
 
-	// PERF: if a performance issue is found with sending large chunks of data 
-	//       that dont fit in single send, we might be wasting time by purging 
-	//       sent data from the buffer which results in moving data in memory.
+// take off the 'sent' bytes that were sent from the iovec's.
+static void out_sent(client_t *client, struct iovec *iov, int count, int sent)
+{
+	client_segment_t *seg;
+	int n;
+	int i;
 	
-	assert(client->write_event);
-	assert(client->out.buffer);
-	assert(client->out.length > 0);
-	assert( ( client->out.offset + client->out.length ) <= client->out.max);
+	assert(client);
+	assert(iov);
+	assert(count > 0);
+	assert(sent > 0);
 	
-	assert(client->handle > 0);
+	stats_bytes_out(sent);
+	client->out.total += sent;
 	
-	res = send(client->handle, client->out.buffer + client->out.offset, client->out.length, 0);
-	if (res > 0) {
-		
-		stats_bytes_out(res);
-		client->out.total += res;
+	for (i=0; i<count && sent > 0; i++) {
+		seg = &client->segments.list[client->segments.head];
+		n = sent < seg->length ? sent : seg->length;
 		
 		if (log_getlevel() >= LOG_EXTRA) {
-			log_data(client->handle, "OUT: ", (unsigned char *)client->out.buffer + client->out.offset, res);
+			log_data(client->handle, "OUT: ", (unsigned char *)iov[i].iov_base, n);
 		}
 		
-		assert(res <= client->out.length);
-		if (res == client->out.length) {
-			client->out.offset = 0;
-			client->out.length = 0;
+		sent -= n;
+		seg->length -= n;
+		client->segments.bytes -= n;
+		if (seg->base) {
+			seg->ptr += n;
 		}
 		else {
-			client->out.offset += res;
-			client->out.length -= res;
-			
-			if (client->out.length == 0) {
-				client->out.offset = 0;
+			client->out.offset += n;
+			client->out.length -= n;
+		}
+		
+		if (seg->length == 0) {
+			if (seg->base) {
+				segment_release(seg);
 			}
+			client->segments.head ++;
+			client->segments.count --;
 		}
+	}
+	assert(sent == 0);
+	
+	assert(client->out.length >= 0);
+	assert(client->segments.bytes >= 0);
+	if (client->segments.count == 0) {
+		assert(client->out.length == 0);
+		assert(client->segments.bytes == 0);
+		client->out.offset = 0;
+		client->segments.head = 0;
 		
-		assert(client->out.length >= 0);
-		if (client->out.length == 0) {
+		// nothing left to send, so the chunk can go back until there is.
+		if (client->out.buffer) {
+			chunk_put(client->out.buffer);
+			client->out.buffer = NULL;
+			client->out.max = 0;
+		}
+	}
+	
+	if (client->stalled && out_low(client)) {
+		out_unstall(client);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// when the write event fires, we will try to write everything to the socket, in as few calls as we 
+// can.  If everything has been sent, then we will remove the write_event.
+// send as much of what is waiting as the socket will take.  Returns what writev() did.
+static int out_write(client_t *client)
+{
+	struct iovec iov[CLIENT_IOV_MAX];
+	int count;
+	int res;
+	
+	assert(client);
+	assert(client->handle > 0);
+	
+	count = out_iov(client, iov);
+	res = writev(client->handle, iov, count);
+	if (res > 0) {
+		out_sent(client, iov, count, res);
+	}
+	
+	return(res);
+}
+
+
+// try to send what is waiting straight away, rather than waiting a trip around the event loop 
+// for the socket to be writable.  Whatever the socket wont take is left for the write event.  If 
+// the write fails, the write event is still set, and write_handler() finds the error and closes 
+// the connection (the client cant be freed from here, because the caller might still be using 
+// it).
+static void out_flush(client_t *client)
+{
+	int i;
+	
+	assert(client);
+	
+	if (client->corked > 0 || client->segments.count == 0 || client->write_event || client->ring.send.active || client->moving) {
+		return;
+	}
+	
+	// the ring sends it all (or fails) in one go.  It is submitted with everything else that the 
+	// shard starts before it gets back to the event loop.
+	if (uring_active()) {
+		client->ring.msg.msg_iovlen = out_iov(client, client->ring.iov);
+		client->ring.sending = 0;
+		for (i=0; i < client->ring.msg.msg_iovlen; i++) {
+			client->ring.sending += client->ring.iov[i].iov_len;
+		}
+		uring_sendmsg(&client->ring.send, client->handle, &client->ring.msg);
+		return;
+	}
+	
+	// a closing connection is closed by write_handler() once everything has gone.
+	if (client->closing == 0) {
+		out_write(client);
+	}
+	
+	if (client->segments.count > 0) {
+		assert(_evbase);
+		assert(client->handle > 0);
+		client->write_event = event_new( _evbase, client->handle, EV_WRITE | EV_PERSIST, write_handler, (void *)client); 
+		assert(client->write_event);
+		event_add(client->write_event, NULL);
+	}
+}
+
+
+// the ring has finished sending.  If there is more waiting, that is sent now, unless the 
+// connection is closing, and it was the last of it.
+static void ring_send_handler(uring_op_t *op, int res, char *data)
+{
+	client_t *client;
+	
+	assert(op);
+	assert(op->active == 0);
+	assert(data == NULL);
+	client = op->arg;
+	assert(client);
+	assert(op == &client->ring.send);
+	assert(client->shard == shard_current());
+	
+	if (client->orphaned) {
+		// it couldn't be thrown away while it was being sent.
+		out_discard(client);
+		ring_orphaned(client);
+		return;
+	}
+	
+	if (res > 0) {
+		out_sent(client, client->ring.iov, client->ring.msg.msg_iovlen, res);
+	}
+	
+	if (res < client->ring.sending) {
+		// the connection has failed part way through.
+		logger(LOG_ERROR, "socket %d send failed. res=%d, '%s'", client->handle, res, res < 0 ? strerror(-res) : "short send");
+		in_discard(client);
+		out_discard(client);
+		client_free(client);
+	}
+	else if (client->moving) {
+		client_move_done(client);
+	}
+	else if (client->closing > 0 && client->segments.count == 0) {
+		// we can now close the connection because we have sent everything.
+		logger(LOG_INFO, "Closing connection to client [%d]", client->handle);
+		client_free(client);
+	}
+	else {
+		out_flush(client);
+	}
+}
+
+
+static void write_handler(int fd, short int flags, void *arg)
+{
+	client_t *client;
+	int res;
+	
+	assert(fd > 0);
+	assert(arg);
+
+	client = arg;
+
+	assert(client->write_event);
+	assert(client->segments.count > 0);
+	
+	res = out_write(client);
+	if (res > 0) {
+		if (client->segments.count == 0) {
 			// all data has been sent, so we clear the write event.
 			assert(client->write_event);
 			event_free(client->write_event);
@@ -916,7 +2298,10 @@ static void write_handler(int fd, short int flags, void *arg)
 		}
 	}
 	else if (res == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
-		// the connection has closed, so we need to clean up.
+		// the connection has closed, so we need to clean up.  What it sent that hasn't been 
+		// processed yet (because it had stalled, or used up its turn) is thrown away too.
+		in_discard(client);
+		out_discard(client);
 		client_free(client);
 		client = NULL;
 	}
@@ -949,14 +2334,8 @@ void client_attach_node(client_t *client, void *node, int fd)
 	
 	client->node = node;
 	client->handle = fd;
-			
-	assert(_evbase);
-	assert(client->handle > 0);
-	assert(client->read_event == NULL);
-	client->read_event = event_new( _evbase, fd, EV_READ|EV_PERSIST, read_handler, client);
-	assert(client->read_event);
-	int s = event_add(client->read_event, &_timeout_client);
-	assert(s == 0);
+	
+	client_reading(client, &_timeout_client);
 }
 
 
@@ -1000,7 +2379,7 @@ static void client_shutdown_handler(evutil_socket_t fd, short what, void *arg)
 		}
 		else {
 			// client is not a node, we can shut it down straight away, if there isn't pending data going out to it.
-			if (client->in.length == 0 && client->out.length == 0) {
+			if (client->in.length == 0 && client->segments.count == 0) {
 				event_free(client->shutdown_event);
 				client->shutdown_event = NULL;
 				client_free(client);
@@ -1035,11 +2414,13 @@ static void client_dump(client_t *client)
 {
 	assert(client);
 	
-	stat_dumpstr("    [%d] Node=%s, Data Received=%ld, Data Sent=%ld", 
+	stat_dumpstr("    [%d] Node=%s, Data Received=%ld, Data Sent=%ld, Waiting=%d%s", 
 				 client->handle,
 				 client->node ? "yes" : "no",
 				 client->in.total,
-				 client->out.total
+				 client->out.total,
+				 client->segments.bytes,
+				 client->stalled ? " (stalled)" : ""
 				);
 }
 
@@ -1049,6 +2430,8 @@ void clients_dump(void)
 	int i;
 	
 	stat_dumpstr("CLIENTS");
+	stat_dumpstr("  Yielded: %lld", _yields);
+	stat_dumpstr("  Stalled: %lld", _stalls);
 	
 	if (_client_count > 0) {
 		stat_dumpstr(NULL);
@@ -1076,8 +2459,8 @@ void client_closing(client_t *client)
 }
 
 
-// push the hashmask update to all the clients that we have connections with.
-void client_update_hashmasks(hash_t mask, hash_t hashmask, int level)
+// push the hashmask update to all the clients that this shard has connections with.
+static void hashmasks_push(hash_t mask, hash_t hashmask, int level)
 {
 	int i;
 	
@@ -1094,10 +2477,53 @@ void client_update_hashmasks(hash_t mask, hash_t hashmask, int level)
 }
 
 
+static void hashmasks_run(void *arg)
+{
+	hashmask_update_t *update = arg;
+	
+	assert(update);
+	hashmasks_push(update->mask, update->hashmask, update->level);
+	free(update);
+}
+
+
+// push the hashmask update to all the clients that we have connections with.  Each shard tells its 
+// own.
+void client_update_hashmasks(hash_t mask, hash_t hashmask, int level)
+{
+	hashmask_update_t *update;
+	shard_t *shard;
+	int i;
+	
+	for (i=0; i<=shards_workers(); i++) {
+		shard = shard_get(i);
+		if (shard == shard_current()) {
+			hashmasks_push(mask, hashmask, level);
+		}
+		else {
+			update = malloc(sizeof(hashmask_update_t));
+			assert(update);
+			update->mask = mask;
+			update->hashmask = hashmask;
+			update->level = level;
+			shard_call(shard, hashmasks_run, update);
+		}
+	}
+}
+
+
+// the number of connections that are being served, by all the shards.
 int client_count(void)
 {
-	assert(_client_count >= 0);
-	return(_client_count);
+	int count = 0;
+	int i;
+	
+	for (i=0; i<=shards_workers(); i++) {
+		count += shard_get(i)->clients;
+	}
+	
+	assert(count >= 0);
+	return(count);
 }
 
 
@@ -1125,12 +2551,57 @@ void client_fail(client_t *client)
 }
 
 
+// each worker has its own event base for the connections it is serving (see shard.c).
+void clients_evbase(struct event_base *evbase)
+{
+	assert(_evbase == NULL);
+	assert(evbase);
+	_evbase = evbase;
+	
+	// the connections use the shard's own io_uring, if it can have one.
+	uring_init(evbase);
+}
+
+
+// how much can be waiting to be sent to a client before it is stalled, and how far that has to go 
+// down before it carries on (see out_stall).  A 'high' of 0 means there is no limit.  Connections 
+// to other nodes are never stalled (see out_high).  Set before the shards are started.
+void clients_watermarks(int high, int low)
+{
+	assert(high >= 0 && low >= 0);
+	
+	if (high > 0 && low >= high) {
+		logger(LOG_WARN, "out-low must be less than out-high, using half of out-high.");
+		low = high / 2;
+	}
+	
+	_out_high = high;
+	_out_low = low;
+}
+
+
+// the biggest frame (in bytes, not counting the header) that a connection can send before it is 
+// closed.  If it is 0, CLIENT_FRAME_MAX is used.  Set before the shards are started.
+void clients_max_frame(int max)
+{
+	assert(max >= 0);
+	
+	if (max > (1 << 30)) {
+		logger(LOG_WARN, "max-frame is too big, using 1GB.");
+		max = 1 << 30;
+	}
+	_max_frame = max > 0 ? max : CLIENT_FRAME_MAX;
+}
+
+
 // first do any init that can be done straight away, and the rest will be done as part of a timed event.
 void clients_init(struct event_base *evbase)
 {
 	assert(_evbase == NULL);
 	assert(evbase);
 	_evbase = evbase;
+	
+	uring_init(evbase);
 
 	// use a hint of 4096, so that it reserves space up to that ID number.  It will dynamically 
 	// increase as needed, but will avoid some very slight memory thrashing during startup.
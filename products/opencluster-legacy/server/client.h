@@ -3,14 +3,32 @@
 #ifndef __CLIENT_H
 #define __CLIENT_H
 
+#include "constants.h"
 #include "event-compat.h"
 #include "hash.h"
 #include "header.h"
 #include "payload.h"
+#include "shard.h"
+#include "uring.h"
 
+#include <sys/uio.h>
 
 
 
+
+// a piece of the data that is waiting to be sent to a client.  Most of it is copied into the out 
+// buffer, and these segments (with no 'base') just say how much of it to send.  Large values are 
+// sent from where they are stored instead (see client_send_reply_data), and 'release' is called 
+// with the 'base' by the shard that the value belongs to once it has all been sent.
+typedef struct {
+	char *base;
+	char *ptr;
+	int length;
+	void (*release)(void *ptr);
+	shard_t *shard;
+} client_segment_t;
+
+
 typedef struct {
 	void *node;	// node_t;
 	
@@ -26,6 +44,16 @@ typedef struct {
 		int max;
 		long long total;
 	} in, out;
+
+	// everything that is waiting to be sent, in order (see send_data), and how many bytes that 
+	// adds up to.
+	struct {
+		client_segment_t *list;
+		int head;
+		int count;
+		int max;
+		int bytes;
+	} segments;
 	
 	int timeout_limit;
 	int timeout;
@@ -34,27 +62,71 @@ typedef struct {
 	int pending;
 	
 	int closing;
+	
+	// set while the client's data is being processed, so that the replies are sent together when 
+	// it is done (see client_process).
+	int corked;
+	
+	// fired to carry on processing what the client has sent, once the other connections have had 
+	// a turn.
+	struct event *resume_event;
+	
+	// set while too much is waiting to be sent to the client.  Nothing more is read or processed 
+	// until it has gone down (see out_stall).
+	int stalled;
+
+	// when the shard is using io_uring (see uring.h), the socket is read and written by these 
+	// operations instead of the events, and the read event is only there for the timeout.  'msg' 
+	// and 'iov' are for the send that is in progress, which is 'sending' bytes.
+	struct {
+		uring_op_t recv;
+		uring_op_t send;
+		struct msghdr msg;
+		struct iovec iov[CLIENT_IOV_MAX];
+		int sending;
+	} ring;
 
 	void *transfer_bucket;
+
+	// the shard that the connection belongs to.  Only that shard reads and writes the socket (see 
+	// shard.h).
+	shard_t *shard;
+
+	// number of calls that other shards have for this client that are not finished yet.  If the 
+	// connection is closed before then, it is marked as orphaned, and is freed when the last one is 
+	// done.
+	int handoffs;
+	int orphaned;
+
+	// the shard that the connection is being handed to, once this one is finished with it (see 
+	// client_move).
+	shard_t *moving;
 } client_t;
 
 void clients_init(struct event_base *evbase);
+void clients_evbase(struct event_base *evbase);
+void clients_watermarks(int high, int low);
+void clients_max_frame(int max);
 
 client_t * client_new(void);
 void client_free(client_t *client);
 void client_accept(client_t *client, evutil_socket_t handle, struct sockaddr *address, int socklen);
 void client_send_message(PAYLOAD payload_id);
 void client_send_reply(client_t *client, header_t *header, short code, PAYLOAD payload_id);
+void client_send_reply_data(client_t *client, header_t *header, short code, PAYLOAD payload_id, char *data, int length, void (*release)(void *ptr));
 void client_attach_node(client_t *client, void *node, int fd);
 void client_shutdown(client_t *client);
 void client_closing(client_t *client);
 void client_fail(client_t *client);
+void client_call(client_t *client, shard_t *shard, void (*fn)(void *arg), void (*done)(client_t *client, void *arg), void *arg);
 
 void clients_dump(void);
 
 void client_add_cmd(int cmd, void *fn);
 void client_add_response(int cmd, int code, void *fn);
 void client_add_special(int code, void *fn);
+void client_route_cmd(int cmd, int (*route)(char *payload, int length));
+void client_control_cmd(int cmd);
 
 void client_update_hashmasks(hash_t mask, hash_t hashmask, int level);
 
@@ -4,6 +4,7 @@
 #include "bucket.h"
 #include "client.h"
 #include "commands.h"
+#include "constants.h"
 #include "hashfn.h"
 #include "header.h"
 #include "logging.h"
@@ -20,6 +21,18 @@
 
 
 
+// the payload didn't have everything in it that the command needs (see data.c).  Nothing is done 
+// with it, and the other end is told that it failed.
+static void reply_invalid(client_t *client, header_t *header)
+{
+	assert(client);
+	assert(header);
+	
+	logger(LOG_WARN, "Invalid payload for command 0x%X from socket %d (%d bytes).", header->command, client->handle, header->length);
+	client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+}
+
+
 // Get a value from storage.
 static void cmd_get_int(client_t *client, header_t *header, char *payload)
 {
@@ -143,6 +156,9 @@ static void cmd_get_str(client_t *client, header_t *header, char *payload)
 	hash_t key_hash;
 	int max_length;
 	value_t *value;
+	char *str;
+	int str_len;
+	void (*release)(void *ptr);
 	
 	assert(client);
 	assert(header);
@@ -182,18 +198,24 @@ static void cmd_get_str(client_t *client, header_t *header, char *payload)
 			else {
 				
 				// the value is a string, but is it within the max length specified?
-				if (max_length > 0 && value->data.s.length > max_length) {
+				if (max_length > 0 && value_str_length(value) > max_length) {
 					client_send_reply(client, header, RESPONSE_TOOLARGE, NO_PAYLOAD);
 				}
+				else if ((str = value_str_share(value, &str_len, &release)) == NULL) {
+					// the stored string could not be decompressed.
+					logger(LOG_ERROR, "Unable to decompress value [%#llx/%#llx].", map_hash, key_hash);
+					client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+				}
 				else {
-					// everything is goog, so build the reply.
+					// everything is goog, so build the reply.  The string itself isn't put in the 
+					// payload, it goes straight out after it (see client_send_reply_data).
 					PAYLOAD out = payload_new_reply();
 					payload_long(out, map_hash);
 					payload_long(out, key_hash);
 					payload_long(out, value->valuehash);
-					payload_data(out, value->data.s.length, value->data.s.data);
+					payload_int(out, str_len);
 					
-					client_send_reply(client, header, RESPONSE_DATA_STRING, out);
+					client_send_reply_data(client, header, RESPONSE_DATA_STRING, out, str, str_len, release);
 				}
 			}
 		}
@@ -236,6 +258,157 @@ static void cmd_get_str(client_t *client, header_t *header, char *payload)
 
 
 
+// the page of a SCAN reply that is being built up.
+typedef struct {
+	PAYLOAD out;
+	int max_items;
+	int items;
+	int bytes;
+} scan_page_t;
+
+
+// add the item to the scan reply.  Returns non-zero when the page is full.
+static int scan_item(item_t *item, void *arg)
+{
+	scan_page_t *page = arg;
+	char *str;
+	int str_len;
+	
+	assert(item);
+	assert(page);
+	assert(page->out);
+	
+	if (item->value.type == VALUE_LONG) {
+		payload_int(page->out, VALUE_LONG);
+		payload_long(page->out, item->map_key);
+		payload_long(page->out, item->item_key);
+		payload_long(page->out, item->value.valuehash);
+		payload_long(page->out, item->value.data.l);
+		page->bytes += 36;
+	}
+	else if (item->value.type == VALUE_STRING) {
+		if ((str = value_str_open(&item->value, &str_len)) == NULL) {
+			logger(LOG_ERROR, "Unable to decompress value [%#llx/%#llx].", item->map_key, item->item_key);
+			return(0);
+		}
+		payload_int(page->out, VALUE_STRING);
+		payload_long(page->out, item->map_key);
+		payload_long(page->out, item->item_key);
+		payload_long(page->out, item->value.valuehash);
+		payload_data(page->out, str_len, str);
+		value_str_close(&item->value, str);
+		page->bytes += 32 + str_len;
+	}
+	else {
+		return(0);
+	}
+	
+	page->items ++;
+	return(page->items >= page->max_items || page->bytes >= SCAN_MAX_BYTES);
+}
+
+
+// Return a page of the items that this node is primary for.  The cursor that is returned with the 
+// page is opaque to the client, and is passed back in to get the next page.  A zeroed cursor 
+// starts from the beginning.  The items are sent as a list (each one starting with its type), 
+// ending with a 0 type, followed by the cursor and a flag indicating if there are more pages.
+static void cmd_scan(client_t *client, header_t *header, char *payload)
+{
+	char *next;
+	hash_t map_hash;
+	int max_items;
+	buckets_scan_t cursor;
+	scan_page_t page;
+	int done;
+	
+	assert(client);
+	assert(header);
+
+	int avail = header->length;
+	
+	next = payload;
+	map_hash = data_long(&next, &avail);
+	max_items = data_int(&next, &avail);
+	cursor.bucket = data_long(&next, &avail);
+	cursor.mask = data_long(&next, &avail);
+	cursor.data.container = data_int(&next, &avail);
+	cursor.data.slot = data_int(&next, &avail);
+	cursor.data.resizes = data_int(&next, &avail);
+
+	if (avail < 0) {
+		reply_invalid(client, header);
+	}
+	else if (cursor.data.container < -1 || cursor.data.slot < 0) {
+		// the cursor has been mangled.
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+	}
+	else {
+		logger(LOG_DEBUG, "CMD: scan [%#llx] from %#llx", map_hash, cursor.bucket);
+		
+		if (max_items <= 0 || max_items > SCAN_MAX_ITEMS) {
+			max_items = SCAN_MAX_ITEMS;
+		}
+		
+		page.out = payload_new_reply();
+		page.max_items = max_items;
+		page.items = 0;
+		page.bytes = 0;
+		
+		done = buckets_scan(&cursor, map_hash, SCAN_LIMIT, scan_item, &page);
+		
+		// the end of the list.
+		payload_int(page.out, 0);
+		
+		payload_long(page.out, cursor.bucket);
+		payload_long(page.out, cursor.mask);
+		payload_int(page.out, cursor.data.container);
+		payload_int(page.out, cursor.data.slot);
+		payload_int(page.out, cursor.data.resizes);
+		payload_int(page.out, done ? 0 : 1);
+		
+		client_send_reply(client, header, RESPONSE_SCAN, page.out);
+	}
+}
+
+
+
+// Delete an item.  If the map_hash is 0, then everything for the key is deleted (the items in all 
+// the maps, and its keyvalue).
+static void cmd_delete(client_t *client, header_t *header, char *payload)
+{
+	char *next;
+	hash_t map_hash;
+	hash_t key_hash;
+	int deleted;
+	
+	assert(client);
+	assert(header);
+
+	int avail = header->length;
+	
+	next = payload;
+	map_hash = data_long(&next, &avail);
+	key_hash = data_long(&next, &avail);
+
+	if (avail < 0) {
+		reply_invalid(client, header);
+	}
+	else {
+		logger(LOG_INFO, "CMD: delete [%#llx/%#llx]", map_hash, key_hash);
+		
+		deleted = buckets_delete(map_hash, key_hash, 1);
+		if (deleted > 0) {
+			client_send_reply(client, header, RESPONSE_OK, NO_PAYLOAD);
+		}
+		else {
+			// either there was nothing to delete, or this node is not the primary for the bucket.
+			client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		}
+	}
+}
+
+
+
 // Set a value into the hash storage.
 static void cmd_set_str(client_t *client, header_t *header, char *payload)
 {
@@ -243,7 +416,7 @@ static void cmd_set_str(client_t *client, header_t *header, char *payload)
 	hash_t map_hash;
 	hash_t key_hash;
 	int expires;
-	value_t *value;
+	value_t value;
 	char *str;
 	int result;
 	int str_len;
@@ -271,29 +444,26 @@ static void cmd_set_str(client_t *client, header_t *header, char *payload)
 	}
 	else {
 		
-		// create a new value.
-		value = calloc(1, sizeof(value_t));
-		assert(value);
-
-		value->type = VALUE_STRING;
-		value->valuehash = generate_hash_str(str, str_len);
-		value->data.s.data = malloc(str_len + 1);
-		memcpy(value->data.s.data, str, str_len);
-		value->data.s.data[str_len] = 0;
-		value->data.s.length = str_len;
-
-		// store the value into the trees.  If a value already exists, it will get released and this one 
-		// will replace it, so control of this value is given to the tree structure.
-		// NOTE: value is controlled by the tree after this function call.
-		result = buckets_store_value(map_hash, key_hash, expires, value);
-		value = NULL;
+		// build the value on the stack.  Short strings are kept inside the value, so nothing needs 
+		// to be allocated for them.
+		value_init(&value);
+		result = value_set_str(&value, str, str_len);
+		if (result == 0) {
+			// store the value into the trees.  If a value already exists, it will get released and 
+			// this one will replace it.  The contents of 'value' are moved into the stored item.
+			result = buckets_store_value(map_hash, key_hash, expires, &value);
+		}
+		
+		// if the value was not stored, then it might still have a buffer that needs to be released.
+		value_clear(&value);
 		
 		// send the ACK reply.
 		if (result == 0) {
 			client_send_reply(client, header, RESPONSE_OK, NO_PAYLOAD);
 		}
 		else {
-			assert(0);
+			// there was no memory available to store it.
+			client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
 		}
 	}
 }
@@ -346,7 +516,8 @@ static void cmd_set_keyvalue(client_t *client, header_t *header, char *payload)
 			client_send_reply(client, header, RESPONSE_KEYVALUE_HASH, out);
 		}
 		else {
-			assert(0);
+			// there was no memory available to store it.
+			client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
 		}
 	}
 }
@@ -405,15 +576,22 @@ static void cmd_loadlevels(client_t *client, header_t *header)
 	int primary_count = buckets_get_primary_count();
 	int secondary_count = buckets_get_secondary_count();
 	int trans = buckets_transferring();
+	long long items, keyvalues, bytes;
 
 	assert(primary_count >= 0);
 	assert(secondary_count >= 0);
 	assert(trans >= 0);
 	
+	buckets_data_totals(&items, &keyvalues, &bytes);
+	assert(items >= 0 && keyvalues >= 0 && bytes >= 0);
+	
 	PAYLOAD out = payload_new_reply();
 	payload_int(out, primary_count);
 	payload_int(out, secondary_count);
 	payload_int(out, trans);
+	payload_long(out, bytes);
+	payload_long(out, items);
+	payload_long(out, keyvalues);
 	
 	// send the reply.
 	client_send_reply(client, header, RESPONSE_LOADLEVELS, out);
@@ -442,81 +620,604 @@ static void cmd_accept_bucket(client_t *client, header_t *header, char *payload)
 	
 		logger(LOG_INFO, "CMD: accept bucket (%#llx/%#llx)", mask, hashmask);
 
-		int accepted = buckets_accept_bucket(client, mask, hashmask);
-		if (accepted == 0) {
-			// bucket was not accepted.
-			client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		int accepted = buckets_accept_bucket(client, mask, hashmask);
+		if (accepted == 0) {
+			// bucket was not accepted.
+			client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		}
+		else {
+			client_send_reply(client, header, RESPONSE_OK, NO_PAYLOAD);
+		}
+	}
+}
+
+
+
+
+// Set a value into the hash storage.
+static void cmd_set_int(client_t *client, header_t *header, char *payload)
+{
+	char *next;
+	hash_t map_hash;
+	hash_t key_hash;
+	int expires;
+	value_t value;
+	int result;
+	
+	assert(client);
+	assert(header);
+
+	int avail = header->length;
+	
+	// create a new value.
+	value_init(&value);
+	
+	next = payload;
+	map_hash = data_long(&next, &avail);
+	key_hash = data_long(&next, &avail);
+	expires = data_int(&next, &avail);
+	value_set_long(&value, data_long(&next, &avail));
+
+	if (avail < 0) {
+		reply_invalid(client, header);
+	}
+	else if (expires < 0) {
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+	}
+	else {
+		logger(LOG_DEBUG, "CMD: set (integer): [%#llx/%#llx]=%lld", map_hash, key_hash, value.data.l);
+
+		// store the value into the trees.  If a value already exists, it will get released and this one 
+		// will replace it.  The contents of 'value' are moved into the stored item.
+		result = buckets_store_value(map_hash, key_hash, expires, &value);
+		
+		// send the ACK reply.
+		if (result == 0) {
+			client_send_reply(client, header, RESPONSE_OK, NO_PAYLOAD);
+		}
+		else {
+			// either this node is not the primary for the bucket, or there was no memory available.
+			client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		}
+	}
+}
+
+
+
+// send the reply for a conditional set.  Either way, the current valuehash is returned so that the 
+// client can tell what it is now working with.
+static void reply_set_if(client_t *client, header_t *header, hash_t map_hash, hash_t key_hash, int result, long long current)
+{
+	PAYLOAD out;
+	
+	assert(client);
+	assert(header);
+	
+	if (result == 0 || result == -2) {
+		out = payload_new_reply();
+		payload_long(out, map_hash);
+		payload_long(out, key_hash);
+		payload_long(out, current);
+		client_send_reply(client, header, result == 0 ? RESPONSE_OK : RESPONSE_CONFLICT, out);
+	}
+	else {
+		// either this node is not the primary for the bucket, or there was no memory available.
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+	}
+}
+
+
+
+// Set an integer value, but only if the valuehash of what is stored is the one the client expects 
+// (0 if the client expects there to be nothing there).
+static void cmd_set_int_if(client_t *client, header_t *header, char *payload)
+{
+	char *next;
+	hash_t map_hash;
+	hash_t key_hash;
+	int expires;
+	long long expected;
+	long long current = 0;
+	value_t value;
+	int result;
+	
+	assert(client);
+	assert(header);
+
+	int avail = header->length;
+	
+	value_init(&value);
+	
+	next = payload;
+	map_hash = data_long(&next, &avail);
+	key_hash = data_long(&next, &avail);
+	expires = data_int(&next, &avail);
+	expected = data_long(&next, &avail);
+	value_set_long(&value, data_long(&next, &avail));
+
+	if (avail < 0) {
+		reply_invalid(client, header);
+	}
+	else if (expires < 0) {
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+	}
+	else {
+		logger(LOG_DEBUG, "CMD: set if (integer): [%#llx/%#llx]=%lld, expecting %#llx", map_hash, key_hash, value.data.l, expected);
+		
+		result = buckets_store_value_if(map_hash, key_hash, expires, &value, expected, &current);
+		reply_set_if(client, header, map_hash, key_hash, result, current);
+	}
+}
+
+
+
+// Set a string value, but only if the valuehash of what is stored is the one the client expects 
+// (0 if the client expects there to be nothing there).
+static void cmd_set_str_if(client_t *client, header_t *header, char *payload)
+{
+	char *next;
+	hash_t map_hash;
+	hash_t key_hash;
+	int expires;
+	long long expected;
+	long long current = 0;
+	value_t value;
+	char *str;
+	int str_len;
+	int result;
+	
+	assert(client);
+	assert(header);
+
+	int avail = header->length;
+	
+	next = payload;
+	map_hash = data_long(&next, &avail);
+	key_hash = data_long(&next, &avail);
+	expires = data_int(&next, &avail);
+	expected = data_long(&next, &avail);
+	str = data_string(&next, &str_len, &avail);
+
+	// data_string only gives a NULL string for an empty one, but the string is going to be hashed 
+	// and copied, so that is checked as well.
+	if (avail < 0 || str_len < 0 || (str == NULL && str_len > 0)) {
+		reply_invalid(client, header);
+	}
+	else if (expires < 0) {
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+	}
+	else {
+		logger(LOG_DEBUG, "CMD: set if (string): [%#llx/%#llx], expecting %#llx", map_hash, key_hash, expected);
+		
+		// the value is built before the stored hash is checked, because building it can allocate 
+		// (and so evict items).
+		value_init(&value);
+		result = value_set_str(&value, str, str_len);
+		if (result == 0) {
+			result = buckets_store_value_if(map_hash, key_hash, expires, &value, expected, &current);
+		}
+		
+		// if the value was not stored, then it might still have a buffer that needs to be released.
+		value_clear(&value);
+		
+		reply_set_if(client, header, map_hash, key_hash, result, current);
+	}
+}
+
+
+
+// Add to an integer value (or subtract if the delta is negative), creating it if it isn't there.  
+// The new value is returned.
+static void cmd_incr_int(client_t *client, header_t *header, char *payload)
+{
+	char *next;
+	hash_t map_hash;
+	hash_t key_hash;
+	int expires;
+	long long delta;
+	value_t value;
+	int result;
+	
+	assert(client);
+	assert(header);
+
+	int avail = header->length;
+	
+	next = payload;
+	map_hash = data_long(&next, &avail);
+	key_hash = data_long(&next, &avail);
+	expires = data_int(&next, &avail);
+	delta = data_long(&next, &avail);
+
+	if (avail < 0) {
+		reply_invalid(client, header);
+	}
+	else if (expires < 0) {
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+	}
+	else {
+		logger(LOG_DEBUG, "CMD: incr (integer): [%#llx/%#llx] %+lld", map_hash, key_hash, delta);
+		
+		result = buckets_incr_value(map_hash, key_hash, delta, expires, &value);
+		if (result == 0) {
+			assert(value.type == VALUE_LONG);
+			PAYLOAD out = payload_new_reply();
+			payload_long(out, map_hash);
+			payload_long(out, key_hash);
+			payload_long(out, value.valuehash);
+			payload_long(out, value.data.l);
+			client_send_reply(client, header, RESPONSE_DATA_INT, out);
+		}
+		else if (result == -2) {
+			// the stored value is a different type.
+			client_send_reply(client, header, RESPONSE_WRONGTYPE, NO_PAYLOAD);
+		}
+		else {
+			// this node is not the primary for the bucket, there was no memory available, or the 
+			// counter would have overflowed.
+			client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		}
+	}
+}
+
+
+
+
+// one of the keys in an MGET or MSET.  It is looked after by the shard that owns its bucket, which 
+// fills in the result.
+typedef struct {
+	hash_t map_hash;
+	hash_t key_hash;
+	int shard;
+	
+	short status;
+	hash_t valuehash;
+	long long value;
+	char *str;				// MGET: a copy of the string.  MSET: points into the request.
+	int str_len;
+	node_t *node;			// the node that has the key, if it isn't this one.
+} multi_key_t;
+
+
+// an MGET or MSET that is being worked on.  The keys are split up between the shards that own 
+// them, and the reply is sent when they have all been done.
+typedef struct {
+	header_t header;
+	int expires;
+	int pending;
+	char *request;
+	int count;
+	multi_key_t keys[];
+} multi_t;
+
+
+// a shard's share of the keys.
+typedef struct {
+	multi_t *multi;
+	int shard;
+} multi_part_t;
+
+
+static void multi_free(multi_t *multi)
+{
+	int i;
+	
+	assert(multi);
+	
+	if (multi->header.command == COMMAND_MGET_STRING) {
+		for (i=0; i<multi->count; i++) {
+			if (multi->keys[i].str) {
+				free(multi->keys[i].str);
+			}
+		}
+	}
+	
+	if (multi->request) {
+		free(multi->request);
+	}
+	free(multi);
+}
+
+
+// look up or store a single key.  This is the same as the single key commands do.
+static void multi_key(multi_t *multi, multi_key_t *key)
+{
+	value_t *stored;
+	value_t value;
+	char *str;
+	int result;
+	
+	assert(multi);
+	assert(key);
+	assert(key->status == 0);
+	
+	if (multi->header.command == COMMAND_MGET_INT || multi->header.command == COMMAND_MGET_STRING) {
+		stored = buckets_get_value(key->map_hash, key->key_hash);
+		if (stored == NULL) {
+			key->node = buckets_get_primary_node(key->key_hash);
+			key->status = key->node ? RESPONSE_TRYELSEWHERE : RESPONSE_FAIL;
+		}
+		else if (multi->header.command == COMMAND_MGET_INT) {
+			if (stored->type != VALUE_LONG) {
+				key->status = RESPONSE_WRONGTYPE;
+			}
+			else {
+				key->valuehash = stored->valuehash;
+				key->value = stored->data.l;
+				key->status = RESPONSE_DATA_INT;
+			}
+		}
+		else {
+			if (stored->type != VALUE_STRING) {
+				key->status = RESPONSE_WRONGTYPE;
+			}
+			else if ((str = value_str_open(stored, &key->str_len)) == NULL) {
+				logger(LOG_ERROR, "Unable to decompress value [%#llx/%#llx].", key->map_hash, key->key_hash);
+				key->status = RESPONSE_FAIL;
+			}
+			else {
+				// the value could be changed by the time the reply is sent, so it is copied.
+				key->str = malloc(key->str_len > 0 ? key->str_len : 1);
+				assert(key->str);
+				memcpy(key->str, str, key->str_len);
+				value_str_close(stored, str);
+				key->valuehash = stored->valuehash;
+				key->status = RESPONSE_DATA_STRING;
+			}
+		}
+	}
+	else {
+		key->node = buckets_get_primary_node(key->key_hash);
+		if (key->node) {
+			key->status = RESPONSE_TRYELSEWHERE;
+		}
+		else {
+			value_init(&value);
+			if (multi->header.command == COMMAND_MSET_INT) {
+				value_set_long(&value, key->value);
+				result = 0;
+			}
+			else {
+				result = value_set_str(&value, key->str, key->str_len);
+			}
+			
+			if (result == 0) {
+				result = buckets_store_value(key->map_hash, key->key_hash, multi->expires, &value);
+			}
+			value_clear(&value);
+			
+			key->status = result == 0 ? RESPONSE_OK : RESPONSE_FAIL;
+		}
+	}
+	
+	assert(key->status > 0);
+}
+
+
+// do all the keys that belong to a shard.
+static void multi_run(void *arg)
+{
+	multi_part_t *part = arg;
+	int i;
+	
+	assert(part);
+	assert(part->multi);
+	
+	for (i=0; i<part->multi->count; i++) {
+		if (part->multi->keys[i].shard == part->shard) {
+			multi_key(part->multi, &part->multi->keys[i]);
+		}
+	}
+}
+
+
+// All the keys have been done, so reply with the result for each key (in the order they were 
+// asked for).  The keys that are on other nodes are then listed again, grouped by the node, so 
+// the client knows where to send them.
+static void multi_reply(client_t *client, multi_t *multi)
+{
+	PAYLOAD out;
+	multi_key_t *key;
+	node_t *node;
+	int groups;
+	int count;
+	int i, j;
+	
+	assert(client);
+	assert(multi);
+	assert(multi->pending == 0);
+	
+	out = payload_new_reply();
+	payload_int(out, multi->count);
+	
+	groups = 0;
+	for (i=0; i<multi->count; i++) {
+		key = &multi->keys[i];
+		payload_int(out, key->status);
+		if (key->status == RESPONSE_DATA_INT) {
+			payload_long(out, key->valuehash);
+			payload_long(out, key->value);
 		}
-		else {
-			client_send_reply(client, header, RESPONSE_OK, NO_PAYLOAD);
+		else if (key->status == RESPONSE_DATA_STRING) {
+			payload_long(out, key->valuehash);
+			payload_data(out, key->str_len, key->str);
+		}
+		else if (key->status == RESPONSE_TRYELSEWHERE) {
+			groups ++;
+		}
+	}
+	
+	// 'groups' is only how many keys are elsewhere so far.  Each node is listed once, with the 
+	// keys that it has, and those are marked off as they are listed.
+	for (i=0; i<multi->count && groups > 0; i++) {
+		if (multi->keys[i].status == RESPONSE_TRYELSEWHERE && multi->keys[i].node) {
+			count = 0;
+			node = multi->keys[i].node;
+			for (j=i; j<multi->count; j++) {
+				if (multi->keys[j].node == node) { count ++; }
+			}
+			assert(count > 0);
+			
+			assert(node->conninfo);
+			payload_string(out, conninfo_name(node->conninfo));
+			payload_int(out, count);
+			for (j=i; j<multi->count; j++) {
+				if (multi->keys[j].node == node) {
+					payload_int(out, j);
+					multi->keys[j].node = NULL;
+					groups --;
+				}
+			}
 		}
 	}
+	assert(groups == 0);
+	
+	// the end of the list of nodes.
+	payload_string(out, "");
+	
+	client_send_reply(client, &multi->header, RESPONSE_MULTI, out);
 }
 
 
+// a shard has finished its share.  When they all have, the reply can be sent.
+static void multi_done(client_t *client, void *arg)
+{
+	multi_part_t *part = arg;
+	multi_t *multi;
+	
+	assert(part);
+	multi = part->multi;
+	assert(multi);
+	free(part);
+	
+	assert(multi->pending > 0);
+	multi->pending --;
+	if (multi->pending == 0) {
+		if (client) {
+			multi_reply(client, multi);
+		}
+		multi_free(multi);
+	}
+}
 
 
-// Set a value into the hash storage.
-static void cmd_set_int(client_t *client, header_t *header, char *payload)
+// Get (or set) a list of values in one go.  The payload is the number of keys (and for MSET, the 
+// expiry), followed by the map and key of each one (and for MSET, the value).  The keys can be in 
+// buckets that belong to different shards, so each shard does its own keys, and the client's shard 
+// replies once they are all done.
+static void cmd_multi(client_t *client, header_t *header, char *payload)
 {
 	char *next;
-	hash_t map_hash;
-	hash_t key_hash;
-	int expires;
-	value_t *value;
-	int result;
+	multi_t *multi;
+	multi_key_t *key;
+	multi_part_t *part;
+	int count;
+	int expires = 0;
+	int shard;
+	int i;
 	
 	assert(client);
 	assert(header);
-	assert(payload);
 
-	// create a new value.
-	// ** PERF: get the 'value' objects from a pool to improve performance.
-	value = calloc(1, sizeof(value_t));
-	assert(value);
+	int avail = header->length;
 	
 	next = payload;
-	map_hash      = data_long(&next);
-	key_hash      = data_long(&next);
-	expires       = data_int(&next);
-	value->data.l = data_long(&next);
-	value->type = VALUE_LONG;
-
-	// check payload meets protocol specifications.
-	assert(0);
-
-	// first we need to check that this server is responsible for this data.  If not, we need to pass a message to the server that is.
-	node_t *node = buckets_get_primary_node(key_hash);
-	if (node) {
-		// this data is being served by another node... we need to relay the query.
-		assert(0);
+	count = data_int(&next, &avail);
+	if (header->command == COMMAND_MSET_INT || header->command == COMMAND_MSET_STRING) {
+		expires = data_int(&next, &avail);
 	}
-	else {
 	
-		
-		logger(LOG_DEBUG, "CMD: set (integer): [%#llx/%#llx]=%d", map_hash, key_hash, value->data.l);
-
-		// store the value into the trees.  If a value already exists, it will get released and this one 
-		// will replace it, so control of this value is given to the tree structure.
-		// NOTE: value is controlled by the tree after this function call.
-		result = buckets_store_value(map_hash, key_hash, expires, value);
-		value = NULL;
-		
-		// send the ACK reply.
-		if (result == 0) {
-			client_send_reply(client, header, RESPONSE_OK, NO_PAYLOAD);
+	if (avail < 0) {
+		reply_invalid(client, header);
+		return;
+	}
+	else if (count <= 0 || expires < 0) {
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		return;
+	}
+	else if (count > MULTI_MAX_KEYS) {
+		client_send_reply(client, header, RESPONSE_TOOLARGE, NO_PAYLOAD);
+		return;
+	}
+	
+	logger(LOG_DEBUG, "CMD: multi (%#x): %d keys", header->command, count);
+	
+	multi = calloc(1, sizeof(multi_t) + (sizeof(multi_key_t) * count));
+	assert(multi);
+	multi->header = *header;
+	multi->expires = expires;
+	multi->count = count;
+	
+	// the strings for MSET are used where they are, but the incoming buffer will be re-used before 
+	// the other shards get to them, so they need a copy of it.
+	if (header->command == COMMAND_MSET_STRING && avail > 0) {
+		multi->request = malloc(avail);
+		assert(multi->request);
+		memcpy(multi->request, next, avail);
+		next = multi->request;
+	}
+	
+	for (i=0; i<count && avail >= 0; i++) {
+		key = &multi->keys[i];
+		key->map_hash = data_long(&next, &avail);
+		key->key_hash = data_long(&next, &avail);
+		if (header->command == COMMAND_MSET_INT) {
+			key->value = data_long(&next, &avail);
 		}
-		else {
-			assert(0);
+		else if (header->command == COMMAND_MSET_STRING) {
+			// an empty string comes back as NULL, which is fine, but a NULL with a length means 
+			// the string wasn't all there.  multi_key would be handing that to value_set_str.
+			key->str = data_string(&next, &key->str_len, &avail);
+			if (key->str_len < 0 || (key->str == NULL && key->str_len > 0)) {
+				avail = -1;
+			}
 		}
+		key->shard = shards_workers() > 0 ? buckets_shard(key->key_hash) : shard_id();
 	}
 	
-	// if the value was not passed to the storage system, then we need to free it ourself.
-	if (value) { free(value); }
+	if (avail < 0) {
+		// there were not as many keys as it said.  None of them have been done yet, so the whole 
+		// thing is rejected.
+		multi_free(multi);
+		reply_invalid(client, header);
+		return;
+	}
+	
+	// the keys that this shard owns are done straight away.  The others are sent to their shards, 
+	// one call for each shard.
+	part = NULL;
+	for (shard=0; shard<=shards_workers(); shard++) {
+		if (shard == shard_id()) {
+			continue;
+		}
+		for (i=0; i<count; i++) {
+			if (multi->keys[i].shard == shard) {
+				part = malloc(sizeof(multi_part_t));
+				assert(part);
+				part->multi = multi;
+				part->shard = shard;
+				multi->pending ++;
+				client_call(client, shard_get(shard), multi_run, multi_done, part);
+				break;
+			}
+		}
+	}
+	
+	// the parts that were sent off cant be finished before this returns (they come back through 
+	// this shard's queue), so the local keys can still be done now.
+	for (i=0; i<count; i++) {
+		if (multi->keys[i].shard == shard_id()) {
+			multi_key(multi, &multi->keys[i]);
+		}
+	}
+	
+	if (multi->pending == 0) {
+		multi_reply(client, multi);
+		multi_free(multi);
+	}
 }
 
 
-
 static void cmd_ping(client_t *client, header_t *header)
 {
 	assert(client);
@@ -916,7 +1617,7 @@ static void cmd_sync_string(client_t *client, header_t *header, char *payload)
 	hash_t map_hash;
 	hash_t key_hash;
 	int expires;
-	value_t *value;
+	value_t value;
 	char *str;
 	int result;
 	int str_len;
@@ -925,10 +1626,6 @@ static void cmd_sync_string(client_t *client, header_t *header, char *payload)
 	assert(header);
 	assert(payload);
 
-	// create a new value.
-	value = calloc(1, sizeof(value_t));
-	assert(value);
-	
 	next = payload;
 	
 	map_hash = data_long(&next);
@@ -941,25 +1638,24 @@ static void cmd_sync_string(client_t *client, header_t *header, char *payload)
 
 	// we cant treat the string as a typical C string, because it is actually a binary blob that may 
 	// contain NULL chars.
-	value->data.s.data = malloc(str_len + 1);
-	memcpy(value->data.s.data, str, str_len);
-	value->data.s.data[str_len] = 0;
-	value->data.s.length = str_len;
-	value->type = VALUE_STRING;
-	
-	// store the value into the trees.  If a value already exists, it will get released and this one 
-	// will replace it, so control of this value is given to the tree structure.
-	// NOTE: value is controlled by the tree after this function call.
-	// NOTE: name is controlled by the tree after this function call.
-	result = buckets_store_value(map_hash, key_hash, expires, value);
-	value = NULL;
+	value_init(&value);
+	result = value_set_str(&value, str, str_len);
+	if (result == 0) {
+		// store the value into the trees.  If a value already exists, it will get released and this one 
+		// will replace it.  The contents of 'value' are moved into the stored item.
+		result = buckets_store_value(map_hash, key_hash, expires, &value);
+	}
+	
+	// if the value was not stored, then it might still have a buffer that needs to be released.
+	value_clear(&value);
 	
 	// send the ACK reply.
 	if (result == 0) {
 		client_send_reply(client, header, RESPONSE_OK, NO_PAYLOAD);
 	}
 	else {
-		assert(0);
+		// there was no memory available to store it.
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
 	}
 }
 
@@ -974,41 +1670,41 @@ static void cmd_sync_int(client_t *client, header_t *header, char *payload)
 	hash_t map_hash;
 	hash_t key_hash;
 	int expires;
-	value_t *value;
+	value_t value;
 	int result;
 	
 	assert(client);
 	assert(header);
-	assert(payload);
 
+	int avail = header->length;
+	
 	// create a new value.
-	value = calloc(1, sizeof(value_t));
-	assert(value);
+	value_init(&value);
 	
 	next = payload;
+	map_hash = data_long(&next, &avail);
+	key_hash = data_long(&next, &avail);
+	expires = data_int(&next, &avail);
+	value_set_long(&value, data_long(&next, &avail));
 	
-	map_hash = data_long(&next);
-	key_hash = data_long(&next);
-	expires = data_int(&next);
-	value->data.l = data_long(&next);
-	value->type = VALUE_LONG;
-	
-	// check payload meets protocol specifications.
-	assert(0);
-
-	// store the value into the trees.  If a value already exists, it will get released and this one 
-	// will replace it, so control of this value is given to the tree structure.
-	// NOTE: value is controlled by the tree after this function call.
-	// NOTE: name is controlled by the tree after this function call (if it is supplied).
-	result = buckets_store_value(map_hash, key_hash, expires, value);
-	value = NULL;
-	
-	// send the ACK reply.
-	if (result == 0) {
-		client_send_reply(client, header, RESPONSE_OK, NO_PAYLOAD);
+	if (avail < 0) {
+		reply_invalid(client, header);
 	}
 	else {
-		assert(0);
+		logger(LOG_DEBUG, "Received: CMD_SYNC_INT: [%#llx/%#llx]=%lld", map_hash, key_hash, value.data.l);
+		
+		// store the value into the trees.  If a value already exists, it will get released and this one 
+		// will replace it.  The contents of 'value' are moved into the stored item.
+		result = buckets_store_value(map_hash, key_hash, expires, &value);
+		
+		// send the ACK reply.
+		if (result == 0) {
+			client_send_reply(client, header, RESPONSE_OK, NO_PAYLOAD);
+		}
+		else {
+			// there was no memory available to store it.
+			client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		}
 	}
 }
 
@@ -1045,8 +1741,206 @@ static void cmd_sync_keyvalue(client_t *client, header_t *header, char *payload)
 		client_send_reply(client, header, RESPONSE_OK, NO_PAYLOAD);
 	}
 	else {
-		assert(0);
+		// there was no memory available to store it.
+		client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+	}
+}
+
+
+
+
+// Set a compressed string into the hash storage for a bucket we are a backup for.  Almost the same 
+// as cmd_sync_string, except the value is stored as it is, without decompressing it.
+static void cmd_sync_string_packed(client_t *client, header_t *header, char *payload)
+{
+	char *next;
+	hash_t map_hash;
+	hash_t key_hash;
+	long long valuehash;
+	int expires;
+	value_t value;
+	char *packed;
+	int packed_len = 0;
+	int result;
+	
+	assert(client);
+	assert(header);
+
+	int avail = header->length;
+	
+	next = payload;
+	map_hash = data_long(&next, &avail);
+	key_hash = data_long(&next, &avail);
+	expires = data_int(&next, &avail);
+	valuehash = data_long(&next, &avail);
+	packed = data_string(&next, &packed_len, &avail);
+
+	if (avail < 0) {
+		reply_invalid(client, header);
+	}
+	else {
+		logger(LOG_DEBUG, "Received: CMD_SYNC_STRING_PACKED: [%#llx/%#llx] %d bytes", map_hash, key_hash, packed_len);
+		
+		value_init(&value);
+		result = value_set_packed(&value, valuehash, packed, packed_len);
+		if (result == 0) {
+			result = buckets_store_value(map_hash, key_hash, expires, &value);
+		}
+		value_clear(&value);
+		
+		if (result == 0) {
+			client_send_reply(client, header, RESPONSE_OK, NO_PAYLOAD);
+		}
+		else {
+			// there was no memory available to store it (or it was invalid).
+			client_send_reply(client, header, RESPONSE_FAIL, NO_PAYLOAD);
+		}
+	}
+}
+
+
+
+// The primary node for a bucket has removed an item (most likely because it expired), so we need to 
+// remove our copy as well.
+static void cmd_sync_delete(client_t *client, header_t *header, char *payload)
+{
+	char *next;
+	hash_t map_hash;
+	hash_t key_hash;
+	
+	assert(client);
+	assert(header);
+
+	int avail = header->length;
+	
+	next = payload;
+	map_hash = data_long(&next, &avail);
+	key_hash = data_long(&next, &avail);
+
+	if (avail < 0) {
+		reply_invalid(client, header);
+	}
+	else {
+		logger(LOG_DEBUG, "Received: CMD_SYNC_DELETE: [%#llx/%#llx]", map_hash, key_hash);
+		
+		// it doesn't matter if the item wasn't here, the end result is the same.
+		buckets_delete_value(map_hash, key_hash);
+		client_send_reply(client, header, RESPONSE_OK, NO_PAYLOAD);
+	}
+}
+
+
+
+// the primary node has deleted an item (or a whole key), so we leave a tombstone for it as well.
+static void cmd_sync_tombstone(client_t *client, header_t *header, char *payload)
+{
+	char *next;
+	hash_t map_hash;
+	hash_t key_hash;
+	
+	assert(client);
+	assert(header);
+
+	int avail = header->length;
+	
+	next = payload;
+	map_hash = data_long(&next, &avail);
+	key_hash = data_long(&next, &avail);
+
+	if (avail < 0) {
+		reply_invalid(client, header);
+	}
+	else {
+		logger(LOG_DEBUG, "Received: CMD_SYNC_TOMBSTONE: [%#llx/%#llx]", map_hash, key_hash);
+		
+		// if the item wasn't here, a tombstone is still left for it.
+		buckets_delete(map_hash, key_hash, 0);
+		client_send_reply(client, header, RESPONSE_OK, NO_PAYLOAD);
+	}
+}
+
+
+
+static void cmd_sync_delete_keyvalue(client_t *client, header_t *header, char *payload)
+{
+	char *next;
+	hash_t key_hash;
+	
+	assert(client);
+	assert(header);
+
+	int avail = header->length;
+	
+	next = payload;
+	key_hash = data_long(&next, &avail);
+
+	if (avail < 0) {
+		reply_invalid(client, header);
+	}
+	else {
+		logger(LOG_DEBUG, "Received: CMD_SYNC_DELETE_KEYVALUE: %#llx", key_hash);
+		
+		buckets_delete_keyvalue(key_hash);
+		client_send_reply(client, header, RESPONSE_OK, NO_PAYLOAD);
+	}
+}
+
+
+
+
+// When there are worker threads, the commands for a key are run by the shard that owns the bucket 
+// it is in (see client_route_cmd).  These get the key out of the payload without checking the rest 
+// of it, and return -1 if it is too short (the handler will deal with that).
+static int route_key_at(char *payload, int length, int offset)
+{
+	hash_t key_hash;
+	
+	if (payload == NULL || length < offset + sizeof(hash_t)) {
+		return(-1);
+	}
+	
+	memcpy(&key_hash, payload + offset, sizeof(hash_t));
+	return(buckets_shard(be64toh(key_hash)));
+}
+
+
+// the key after the map.
+static int route_map_key(char *payload, int length)
+{
+	return(route_key_at(payload, length, sizeof(hash_t)));
+}
+
+
+// the key on its own.
+static int route_key(char *payload, int length)
+{
+	return(route_key_at(payload, length, 0));
+}
+
+
+// the bucket that the scan cursor is up to, after the map and the page size.
+static int route_scan(char *payload, int length)
+{
+	return(route_key_at(payload, length, sizeof(hash_t) + sizeof(int)));
+}
+
+
+// the keyvalue is stored under the hash of the string, after the expiry.
+static int route_keyvalue(char *payload, int length)
+{
+	int str_len;
+	
+	if (payload == NULL || length < (sizeof(int) * 2)) {
+		return(-1);
 	}
+	
+	memcpy(&str_len, payload + sizeof(int), sizeof(int));
+	str_len = be32toh(str_len);
+	if (str_len <= 0 || length < (sizeof(int) * 2) + str_len) {
+		return(-1);
+	}
+	
+	return(buckets_shard(generate_hash_str(payload + (sizeof(int) * 2), str_len)));
 }
 
 
@@ -1058,8 +1952,17 @@ void cmd_init(void)
 	// It doesn't really matter which order they are set.  
 	client_add_cmd(COMMAND_GET_INT, cmd_get_int);
  	client_add_cmd(COMMAND_GET_STRING, cmd_get_str);
+ 	client_add_cmd(COMMAND_SCAN, cmd_scan);
  	client_add_cmd(COMMAND_SET_INT, cmd_set_int);
  	client_add_cmd(COMMAND_SET_STRING, cmd_set_str);
+ 	client_add_cmd(COMMAND_SET_INT_IF, cmd_set_int_if);
+ 	client_add_cmd(COMMAND_SET_STRING_IF, cmd_set_str_if);
+ 	client_add_cmd(COMMAND_DELETE, cmd_delete);
+ 	client_add_cmd(COMMAND_INCR_INT, cmd_incr_int);
+ 	client_add_cmd(COMMAND_MGET_INT, cmd_multi);
+ 	client_add_cmd(COMMAND_MGET_STRING, cmd_multi);
+ 	client_add_cmd(COMMAND_MSET_INT, cmd_multi);
+ 	client_add_cmd(COMMAND_MSET_STRING, cmd_multi);
 
 	client_add_cmd(COMMAND_SET_KEYVALUE, cmd_set_keyvalue);
 	client_add_cmd(COMMAND_GET_KEYVALUE, cmd_get_keyvalue);
@@ -1067,6 +1970,10 @@ void cmd_init(void)
 	client_add_cmd(COMMAND_SYNC_INT, cmd_sync_int);
  	client_add_cmd(COMMAND_SYNC_KEYVALUE, cmd_sync_keyvalue);
  	client_add_cmd(COMMAND_SYNC_STRING, cmd_sync_string);
+ 	client_add_cmd(COMMAND_SYNC_STRING_PACKED, cmd_sync_string_packed);
+ 	client_add_cmd(COMMAND_SYNC_DELETE, cmd_sync_delete);
+ 	client_add_cmd(COMMAND_SYNC_TOMBSTONE, cmd_sync_tombstone);
+ 	client_add_cmd(COMMAND_SYNC_DELETE_KEYVALUE, cmd_sync_delete_keyvalue);
 
 	client_add_cmd(COMMAND_PING, cmd_ping);
  	client_add_cmd(COMMAND_LOADLEVELS, cmd_loadlevels);
@@ -1077,6 +1984,34 @@ void cmd_init(void)
  	client_add_cmd(COMMAND_HELLO, cmd_hello);
  	client_add_cmd(COMMAND_GOODBYE, cmd_goodbye);
  	client_add_cmd(COMMAND_SERVERHELLO, cmd_serverhello);
+	
+	// the data commands are run by the shard that owns the data.
+	client_route_cmd(COMMAND_GET_INT, route_map_key);
+	client_route_cmd(COMMAND_GET_STRING, route_map_key);
+	client_route_cmd(COMMAND_SCAN, route_scan);
+	client_route_cmd(COMMAND_SET_INT, route_map_key);
+	client_route_cmd(COMMAND_SET_STRING, route_map_key);
+	client_route_cmd(COMMAND_SET_INT_IF, route_map_key);
+	client_route_cmd(COMMAND_SET_STRING_IF, route_map_key);
+	client_route_cmd(COMMAND_DELETE, route_map_key);
+	client_route_cmd(COMMAND_INCR_INT, route_map_key);
+	client_route_cmd(COMMAND_SET_KEYVALUE, route_keyvalue);
+	client_route_cmd(COMMAND_GET_KEYVALUE, route_key);
+	client_route_cmd(COMMAND_SYNC_INT, route_map_key);
+	client_route_cmd(COMMAND_SYNC_KEYVALUE, route_key);
+	client_route_cmd(COMMAND_SYNC_STRING, route_map_key);
+	client_route_cmd(COMMAND_SYNC_STRING_PACKED, route_map_key);
+	client_route_cmd(COMMAND_SYNC_DELETE, route_map_key);
+	client_route_cmd(COMMAND_SYNC_TOMBSTONE, route_map_key);
+	client_route_cmd(COMMAND_SYNC_DELETE_KEYVALUE, route_key);
+	
+	// and the ones that change the cluster are run by the main loop.
+	client_control_cmd(COMMAND_LOADLEVELS);
+	client_control_cmd(COMMAND_ACCEPT_BUCKET);
+	client_control_cmd(COMMAND_CONTROL_BUCKET);
+	client_control_cmd(COMMAND_FINALISE_MIGRATION);
+	client_control_cmd(COMMAND_HASHMASK);
+	client_control_cmd(COMMAND_SERVERHELLO);
 }
 
 
@@ -10,6 +10,24 @@
 
 #define DEFAULT_BUFSIZE 4096
 
+// replies with a value at least this big are sent from where the value is stored, instead of 
+// being copied into the connection's out buffer first (see client_send_reply_data).  Smaller ones 
+// are cheaper to copy.
+#define CLIENT_COPY_MAX  2048
+
+// the most pieces of outgoing data that are given to a single writev().
+#define CLIENT_IOV_MAX  64
+
+// each time a connection has a turn, it can have this many frames processed, and this many bytes 
+// read, before the other connections get theirs (see read_handler).
+#define CLIENT_FRAME_BUDGET  64
+#define CLIENT_READ_BUDGET   (1024*256)
+
+// the biggest frame that a connection can send, if 'max-frame' isn't set in the config.  The 
+// length comes from the header, so without a limit a single header could have any amount of 
+// memory reserved for it.
+#define CLIENT_FRAME_MAX  (1024*1024*4)
+
 #ifndef INVALID_HANDLE
 #define INVALID_HANDLE -1
 #endif
@@ -30,14 +48,41 @@
 #define TRANSIT_MIN 0
 #define TRANSIT_MAX 1
 
+// after the buckets are split, this is the maximum number of entries that will be looked at each 
+// time the drain event fires for a bucket (see _timeout_drain).
+#define DRAIN_LIMIT 500
+
+// the maximum number of expired items that will be removed each time the 'seconds' event fires.
+#define EXPIRY_LIMIT 1000
+
+// the number of items that are looked at to pick one to evict, if it isn't set in the config.
+#define EVICT_SAMPLES 5
+
+// strings at least this long are put in the shared pool (see pool.h), if 'string-pool' isn't set 
+// in the config.
+#define POOL_MIN_LENGTH 256
+
+// a bucket will be sent to even out the data between two nodes if this node has more than 
+// 1/LOADLEVEL_BYTES_MARGIN more data than the other one, and at least LOADLEVEL_BYTES_MIN more, so 
+// that nearly empty nodes dont keep moving buckets around.
+#define LOADLEVEL_BYTES_MARGIN 10
+#define LOADLEVEL_BYTES_MIN    (1024*1024)
+
+// the number of seconds that a deleted item is kept as a tombstone before it is removed.  This 
+// needs to be long enough for any older copies of the item that are on their way from other nodes 
+// to have arrived.
+#define TOMBSTONE_LIFE  60
+
+// limits on a single page of a SCAN.  The page is finished when it has SCAN_MAX_ITEMS items, or 
+// has more than SCAN_MAX_BYTES of data, or SCAN_LIMIT entries have been looked at (so that sparse 
+// buckets or a map filter don't hold everything else up).
+#define SCAN_MAX_ITEMS  1000
+#define SCAN_MAX_BYTES  (1024*256)
+#define SCAN_LIMIT      10000
+
+// the most keys that can be in a single MGET or MSET.
+#define MULTI_MAX_KEYS  1024
 
-// When data is received on a socket, and processed, the offset is where processed items are still 
-// in the incoming buffer.  This occurs if data arrives fragmented.  If the server receives a lot 
-// of rapid messages from a client, the offset can creep up to unmanageable levels.  So we set a 
-// maximum offset.  This means that if the offset gets this high, then it needs to move the data 
-// up the buffer.   This is not something we want to happen a lot because it impacts performance 
-// to be moving data in memory like that.
-#define MAX_INCOMING_OFFSET  65536
 
 // minimum number of buckets that a node should have before it splits the buckets.  This means that 
 // if some action causes the server to get less than this many buckets (but not if the server never 
@@ -7,37 +7,52 @@
 #include <endian.h>
 
 
+// All of these take the number of bytes left in the payload in 'avail', and take off what they 
+// use.  If there isn't enough left for what is being asked for (or a string has a length that 
+// doesn't make sense), 'avail' is set to -1 and nothing is returned (0 or NULL).  Once it is -1, 
+// everything after it returns nothing as well, so the fields can all be pulled out first and 
+// 'avail' only checked once at the end.  The payload comes from the other end of the connection, 
+// so a short one is not a reason to crash.
+
+
 // This function will return a pointer to the internal data.  It will also 
 // update the length variable to indicate the length of the string.  It will 
 // increase the 'next' to point to the next potential field in the payload.  
-// If there is no more data in the payload, you will need to check that yourself
+// An empty string returns NULL with a length of 0, which isn't an error.
 char * data_string(char **data, int *length, int *avail)
 {
 	char *str = NULL;
+	int *ptr;
+	int len;
 	
 	assert(data);
-	assert(*data);
 	assert(length);
 	assert(avail);
-	assert(avail[0] > 0);
 	assert(sizeof(int) == 4);
 	
-	assert(avail[0] >= sizeof(int));
-	if (avail[0] >= sizeof(int)) {
-		int *ptr = (void*) *data;
-		length[0] = be32toh(ptr[0]);
-		*data += (sizeof(int));
-		avail[0] += sizeof(int);
-		if (length[0] > 0) {
-			assert(avail[0] >= length[0]);
-			if (avail[0] >= length[0]) {
-				str = *data;
-				*data += length[0];
-				avail[0] += length[0];
-			}
-		}
+	length[0] = 0;
+	
+	if (avail[0] < (int) sizeof(int)) {
+		avail[0] = -1;
+		return(NULL);
 	}
 	
+	ptr = (void*) *data;
+	len = be32toh(ptr[0]);
+	if (len < 0 || len > avail[0] - (int) sizeof(int)) {
+		avail[0] = -1;
+		return(NULL);
+	}
+	
+	*data += (sizeof(int));
+	avail[0] -= sizeof(int);
+	if (len > 0) {
+		str = *data;
+		*data += len;
+		avail[0] -= len;
+	}
+	length[0] = len;
+	
 	assert(avail[0] >= 0);
 	return(str);
 }
@@ -46,92 +61,73 @@ char * data_string(char **data, int *length, int *avail)
 char * data_string_copy(char **data, int *avail) 
 {
 	char *sal = NULL;
+	int length = 0;
+	char *s;
 	
 	assert(data);
-	assert(*data);
-	
 	assert(avail);
-	assert(avail[0] > 0);
 	
-	if (avail[0] > 0) {
-		int length = 0;
-		char *s = data_string(data, &length, avail);
-		assert(length >= 0);
-		if (length > 0) {
-			assert(s);
-			assert((length + 1) > 0);
-			sal = malloc(length + 1);
-			assert(sal);
-			memcpy(sal, s, length);
-			sal[length] = 0;
-		}
-		else {
-			assert(s == NULL);
-			assert(sal == NULL);
-		}
+	s = data_string(data, &length, avail);
+	if (length > 0) {
+		assert(s);
+		assert(avail[0] >= 0);
+		sal = malloc(length + 1);
+		assert(sal);
+		memcpy(sal, s, length);
+		sal[length] = 0;
 	}
 
-	assert(avail[0] >= 0);
 	return(sal);
 }
 
 
-// This function will return a pointer to the internal data.  It will also update the length 
-// variable to indicate the length of the string.  It will increase the 'next' to point to the next 
-// potential field in the payload.  If there is no more data in the payload, you will need to check 
-// that yourself
+// pull an integer out of the payload, and move 'next' on past it.
 int data_int(char **data, int *avail)
 {
 	int *ptr;
 	int value = 0;
 	
 	assert(data);
-	assert(*data);
 	assert(avail);
-	assert(avail[0] >= 0);
-	assert(avail[0] >= sizeof(int));
 	
-	if (avail[0] >= sizeof(int)) {
+	if (avail[0] < (int) sizeof(int)) {
+		avail[0] = -1;
+	}
+	else {
 		ptr = (void*) *data;
 		value = be32toh(ptr[0]);
 
 		*data += sizeof(int);
-		avail[0] += sizeof(int);
+		avail[0] -= sizeof(int);
 	}
 	
-	assert(avail[0] >= 0);
 	return(value);
 }
 
 
 
 
-// This function will return a pointer to the internal data.  It will also update the length 
-// variable to indicate the length of the string.  It will increase the 'next' to point to the next 
-// potential field in the payload.  If there is no more data in the payload, you will need to check 
-// that yourself
+// pull a long out of the payload, and move 'next' on past it.
 long long data_long(char **data, int *avail)
 {
 	long long *ptr;
 	long long value = 0;
 	
 	assert(data);
-	assert(*data);
 	assert(avail);
-	assert(avail[0] >= 0);
 	assert(sizeof(long long) == 8);
 	
-	assert(avail[0] >= sizeof(long long));
-	if (avail[0] >= sizeof(long long)) {
-	
+	if (avail[0] < (int) sizeof(long long)) {
+		avail[0] = -1;
+	}
+	else {
 		ptr = (void*) *data;
 		value = be64toh(ptr[0]);
 
 		*data += sizeof(long long);
-		avail[0] += sizeof(long long);
+		avail[0] -= sizeof(long long);
 	}
 	
-	assert(avail[0] >= 0);
 	return(value);
 }
 
@@ -158,6 +158,30 @@ static void evconn_cb(int ls_sfd, short flags, void *arg)
 
 
 
+// simulate the listener stuff from libevent2, for a socket that is already bound and listening 
+// (the backlog is not supported here).
+struct evconnlistener * evconnlistener_new(struct event_base *evbase, void (*fn)(struct evconnlistener *, int, struct sockaddr *, int, void *), void *arg, int flags, int backlog, evutil_socket_t sfd)
+{
+	struct evconnlistener *listener;
+	
+	assert(evbase && fn);
+	assert(flags == LEV_OPT_CLOSE_ON_FREE);
+	assert(backlog == 0);
+	assert(sfd >= 0);
+	
+	listener = calloc(1, sizeof(*listener));
+	assert(listener);
+	
+	listener->handle = sfd;
+	listener->listen_event = event_new(evbase, sfd, EV_READ | EV_PERSIST, evconn_cb, (void *)listener);
+	event_add(listener->listen_event, NULL);
+	listener->fn = fn;
+	listener->arg = arg;
+	
+	return(listener);
+}
+
+
 // simulate the listener stuff from libevent2.
 // static void accept_conn_cb(struct evconnlistener *listener, evutil_socket_t fd, struct sockaddr *address, int socklen, void *ctx);
 struct evconnlistener * evconnlistener_new_bind(struct event_base *evbase, void (*fn)(struct evconnlistener *, int, struct sockaddr *, int, void *), void *arg, int flags, int queues, struct sockaddr *sin, int slen )
@@ -197,15 +221,7 @@ struct evconnlistener * evconnlistener_new_bind(struct event_base *evbase, void
 		}
 		else {
 			// we've got a listener.
-			
-			listener = calloc(1, sizeof(*listener));
-			assert(listener);
-			
-			listener->handle = sfd;
-			listener->listen_event = event_new(evbase, sfd, EV_READ | EV_PERSIST, evconn_cb, (void *)listener);
-			event_add(listener->listen_event, NULL);
-			listener->fn = fn;
-			listener->arg = arg;
+			listener = evconnlistener_new(evbase, fn, arg, LEV_OPT_CLOSE_ON_FREE, 0, sfd);
 		}
 	}
 	
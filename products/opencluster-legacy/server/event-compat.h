@@ -50,6 +50,7 @@ struct evconnlistener {
 	void *arg;
 };
 
+struct evconnlistener * evconnlistener_new(struct event_base *evbase, void (*fn)(struct evconnlistener *, int, struct sockaddr *, int, void *), void *arg, int flags, int backlog, evutil_socket_t sfd);
 struct evconnlistener * evconnlistener_new_bind(struct event_base *evbase, void (*fn)(struct evconnlistener *, int, struct sockaddr *, int, void *), void *arg, int flags, int queues, struct sockaddr *sin, int slen );
 void evconnlistener_free(struct evconnlistener * listener);
 
@@ -0,0 +1,273 @@
+// expiry.c
+
+// Items (and keyvalues) that have an expiry are added to a hierarchical timing wheel so that they
+// can be removed when they expire, even if nobody ever asks for them again.
+//
+// The first level has a slot for each of the next 256 seconds.  Each of the higher levels has 64
+// slots, each covering a whole lap of the level below it.  When the lower level wraps around, the
+// next slot of the level above is 'cascaded', which puts each of its entries into the level below
+// it, closer to the time it expires.  So adding an entry is always quick, and every second only
+// one slot (and occasionally a cascade) needs to be looked at.
+//
+// The wheel does not keep pointers to the items themselves.  Instead it keeps the hashes and the
+// expiry time, and when the time comes, the item is looked up.  If the item has been removed, or
+// set again with a different expiry since then, it is simply ignored, unless it now expires later,
+// in which case it is put back on the wheel for then.  This means nothing needs to be done when an
+// item is deleted, and an item that is set again only needs a new entry if it now expires sooner
+// (see data_set_value).
+
+#include "expiry.h"
+
+#include "bucket.h"
+#include "logging.h"
+#include "shard.h"
+#include "slab.h"
+#include "stats.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+
+#define WHEEL_LEVELS       4
+#define WHEEL_ROOT_BITS    8
+#define WHEEL_BITS         6
+#define WHEEL_ROOT_SIZE    (1 << WHEEL_ROOT_BITS)
+#define WHEEL_SIZE         (1 << WHEEL_BITS)
+
+// the furthest ahead the top level can reach.  Anything further than that is put in the last slot
+// it can reach, and will be moved along again when that slot is cascaded.
+#define WHEEL_SPAN         (1 << (WHEEL_ROOT_BITS + ((WHEEL_LEVELS - 1) * WHEEL_BITS)))
+
+
+typedef struct __expiry_t {
+	hash_t map_hash;
+	hash_t key_hash;
+	unsigned int expires;
+	int keyvalue;
+	struct __expiry_t *next;
+} expiry_t;
+
+
+// each shard has its own wheel, for the items that it owns (see shard.h).
+static SHARD_LOCAL expiry_t *_root[WHEEL_ROOT_SIZE];
+static SHARD_LOCAL expiry_t *_levels[WHEEL_LEVELS - 1][WHEEL_SIZE];
+
+// entries that have expired, but have not been processed yet.
+static SHARD_LOCAL expiry_t *_due = NULL;
+
+// the second that the wheel has been moved up to.
+static SHARD_LOCAL unsigned int _wheel_time = 0;
+static SHARD_LOCAL int _initialised = 0;
+
+static SHARD_LOCAL long long _pending = 0;
+static SHARD_LOCAL long long _pending_due = 0;
+static SHARD_LOCAL long long _expired = 0;
+static SHARD_LOCAL long long _stale = 0;
+static SHARD_LOCAL long long _failed = 0;
+
+
+
+
+void expiry_init(unsigned int seconds)
+{
+	assert(_initialised == 0);
+	_wheel_time = seconds;
+	_initialised = 1;
+}
+
+
+
+// an entry is due once its expiry time has passed (ie, the second after it).
+static void wheel_place(expiry_t *entry)
+{
+	unsigned int due;
+	unsigned int delta;
+	int level;
+	int slot;
+
+	assert(entry);
+
+	due = entry->expires + 1;
+	if (due <= _wheel_time) {
+		entry->next = _due;
+		_due = entry;
+		_pending_due ++;
+		return;
+	}
+
+	delta = due - _wheel_time;
+	if (delta < WHEEL_ROOT_SIZE) {
+		slot = due & (WHEEL_ROOT_SIZE - 1);
+		entry->next = _root[slot];
+		_root[slot] = entry;
+		return;
+	}
+
+	if (delta >= WHEEL_SPAN) {
+		due = _wheel_time + WHEEL_SPAN - 1;
+		delta = WHEEL_SPAN - 1;
+	}
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level ++) {
+		if (delta < (1u << (WHEEL_ROOT_BITS + ((level + 1) * WHEEL_BITS)))) {
+			slot = (due >> (WHEEL_ROOT_BITS + (level * WHEEL_BITS))) & (WHEEL_SIZE - 1);
+			entry->next = _levels[level][slot];
+			_levels[level][slot] = entry;
+			return;
+		}
+	}
+
+	assert(0);
+}
+
+
+
+// take all the entries out of a slot and place them again.  Since the wheel has moved on, they
+// will end up in a lower level.
+static void wheel_cascade(int level)
+{
+	expiry_t *entry;
+	expiry_t *next;
+	int slot;
+
+	assert(level >= 0 && level < WHEEL_LEVELS - 1);
+
+	slot = (_wheel_time >> (WHEEL_ROOT_BITS + (level * WHEEL_BITS))) & (WHEEL_SIZE - 1);
+	entry = _levels[level][slot];
+	_levels[level][slot] = NULL;
+
+	while (entry) {
+		next = entry->next;
+		wheel_place(entry);
+		entry = next;
+	}
+}
+
+
+
+// move the wheel forward one second.
+static void wheel_advance(void)
+{
+	expiry_t *entry;
+	expiry_t *next;
+	int slot;
+	int level;
+	unsigned int t;
+
+	_wheel_time ++;
+
+	// when a level wraps around, the level above it needs to be cascaded.  Starting from the top
+	// means that anything cascaded from a higher level will be picked up by the lower ones.
+	slot = _wheel_time & (WHEEL_ROOT_SIZE - 1);
+	if (slot == 0) {
+		t = _wheel_time >> WHEEL_ROOT_BITS;
+		level = 0;
+		while (level < WHEEL_LEVELS - 2 && (t & (WHEEL_SIZE - 1)) == 0) {
+			t >>= WHEEL_BITS;
+			level ++;
+		}
+		for (; level >= 0; level --) {
+			wheel_cascade(level);
+		}
+	}
+
+	// everything in this slot is now due.
+	entry = _root[slot];
+	_root[slot] = NULL;
+	while (entry) {
+		next = entry->next;
+		entry->next = _due;
+		_due = entry;
+		_pending_due ++;
+		entry = next;
+	}
+}
+
+
+
+// 'keyvalue' indicates that the entry is for a keyvalue, rather than an item.
+void expiry_add(hash_t map_hash, hash_t key_hash, unsigned int expires, int keyvalue)
+{
+	expiry_t *entry;
+
+	assert(_initialised);
+	assert(expires > 0);
+
+	entry = slab_alloc(sizeof(expiry_t));
+	if (entry == NULL) {
+		// without an entry, the item will still be treated as expired when it is looked up, but
+		// it wont be removed until then.
+		_failed ++;
+		return;
+	}
+
+	entry->map_hash = map_hash;
+	entry->key_hash = key_hash;
+	entry->expires = expires;
+	entry->keyvalue = keyvalue;
+	wheel_place(entry);
+	_pending ++;
+}
+
+
+
+// move the wheel up to the current time, and then remove up to 'limit' of the entries that have
+// expired.  Whatever is left over will be done the next time.  Returns the number of entries that
+// were removed.
+int expiry_process(unsigned int seconds, int limit)
+{
+	expiry_t *entry;
+	int removed = 0;
+	int checked = 0;
+
+	assert(limit > 0);
+
+	if (_initialised == 0) {
+		return(0);
+	}
+
+	while (_wheel_time < seconds) {
+		wheel_advance();
+	}
+
+	while (_due && checked < limit) {
+		entry = _due;
+		_due = entry->next;
+		_pending_due --;
+		_pending --;
+		checked ++;
+
+		if (buckets_expire(entry->map_hash, entry->key_hash, entry->expires, entry->keyvalue) > 0) {
+			removed ++;
+			_expired ++;
+		}
+		else {
+			_stale ++;
+		}
+
+		slab_free(entry, sizeof(expiry_t));
+	}
+
+	assert(_pending >= 0);
+	assert(_pending_due >= 0);
+
+	if (removed > 0) {
+		logger(LOG_DEBUG, "expiry: removed %d expired entries.", removed);
+	}
+
+	return(removed);
+}
+
+
+
+void expiry_dump(void)
+{
+	stat_dumpstr("EXPIRY");
+	stat_dumpstr("  Wheel Time: %u", _wheel_time);
+	stat_dumpstr("  Pending: %lld", _pending);
+	stat_dumpstr("  Due: %lld", _pending_due);
+	stat_dumpstr("  Expired: %lld", _expired);
+	stat_dumpstr("  Stale: %lld", _stale);
+	stat_dumpstr("  Failed: %lld", _failed);
+	stat_dumpstr(NULL);
+}
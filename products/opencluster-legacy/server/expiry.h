@@ -0,0 +1,15 @@
+// expiry.h
+
+#ifndef __EXPIRY_H
+#define __EXPIRY_H
+
+#include "hash.h"
+
+
+void expiry_init(unsigned int seconds);
+void expiry_add(hash_t map_hash, hash_t key_hash, unsigned int expires, int keyvalue);
+int expiry_process(unsigned int seconds, int limit);
+void expiry_dump(void);
+
+
+#endif
@@ -0,0 +1,419 @@
+// hashindex.c
+
+#include "hashindex.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// tag values.  A slot that is in use has the top bit set, and the remaining 7 bits are taken from
+// the top of the mixed hash, so that most non-matching slots can be skipped without looking at
+// the entry itself.
+#define TAG_EMPTY     0x00
+#define TAG_DELETED   0x01
+#define TAG_USED      0x80
+
+#define MIN_SLOTS     16
+
+// every insert will move this many slots from the old table when the index is being resized.
+#define MOVE_SLOTS    16
+
+
+// The key hashes that are stored in a bucket all share the same low bits (that is how they were
+// assigned to the bucket), so we cant use them directly to pick a slot.  Combine the two hashes
+// and run them through a finalizer (from murmur3) so that all the bits are spread out.
+static inline hash_t index_mix(hash_t key_hash, hash_t map_hash)
+{
+	register hash_t h = key_hash ^ (map_hash * 0x9E3779B97F4A7C15llu);
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdllu;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53llu;
+	h ^= h >> 33;
+
+	return(h);
+}
+
+static inline unsigned char index_tag(hash_t h)
+{
+	return(TAG_USED | (unsigned char)(h >> 57));
+}
+
+
+static void table_alloc(hashindex_table_t *table, int slots)
+{
+	assert(table);
+	assert(slots >= MIN_SLOTS);
+	assert((slots & (slots - 1)) == 0);
+
+	table->tags = calloc(slots, sizeof(unsigned char));
+	assert(table->tags);
+	table->entries = malloc(sizeof(hashindex_entry_t) * slots);
+	assert(table->entries);
+
+	table->mask = slots - 1;
+	table->count = 0;
+	table->deleted = 0;
+}
+
+
+static void table_release(hashindex_table_t *table)
+{
+	assert(table);
+	assert(table->count == 0);
+	assert(table->tags);
+	assert(table->entries);
+
+	free(table->tags);
+	free(table->entries);
+	table->tags = NULL;
+	table->entries = NULL;
+	table->mask = 0;
+	table->deleted = 0;
+}
+
+
+// return the slot that contains the entry, or -1 if it is not in this table.
+static int table_find(hashindex_table_t *table, hash_t h, hash_t key_hash, hash_t map_hash)
+{
+	register int slot;
+	register unsigned char tag = index_tag(h);
+	register unsigned char t;
+
+	assert(table->tags);
+
+	// there is always at least one empty slot in the table, so this will always end.
+	slot = h & table->mask;
+	while ((t = table->tags[slot]) != TAG_EMPTY) {
+		if (t == tag && table->entries[slot].key_hash == key_hash && table->entries[slot].map_hash == map_hash) {
+			return(slot);
+		}
+		slot = (slot + 1) & table->mask;
+	}
+
+	return(-1);
+}
+
+
+// put the entry in the first free slot.  The entry must not already be in the table.
+static void table_place(hashindex_table_t *table, hash_t h, hash_t key_hash, hash_t map_hash, void *ptr)
+{
+	register int slot;
+
+	assert(table->tags);
+	assert((table->count + table->deleted) < table->mask);
+
+	slot = h & table->mask;
+	while (table->tags[slot] & TAG_USED) {
+		slot = (slot + 1) & table->mask;
+	}
+
+	if (table->tags[slot] == TAG_DELETED) {
+		table->deleted --;
+		assert(table->deleted >= 0);
+	}
+
+	table->tags[slot] = index_tag(h);
+	table->entries[slot].key_hash = key_hash;
+	table->entries[slot].map_hash = map_hash;
+	table->entries[slot].ptr = ptr;
+	table->count ++;
+}
+
+
+static void * table_take(hashindex_table_t *table, int slot)
+{
+	void *ptr;
+
+	assert(slot >= 0 && slot <= table->mask);
+	assert(table->tags[slot] & TAG_USED);
+
+	ptr = table->entries[slot].ptr;
+
+	// if the next slot is empty, then nothing could have probed past this one, so it can go
+	// straight back to being empty instead of leaving a tombstone.
+	if (table->tags[(slot + 1) & table->mask] == TAG_EMPTY) {
+		table->tags[slot] = TAG_EMPTY;
+	}
+	else {
+		table->tags[slot] = TAG_DELETED;
+		table->deleted ++;
+	}
+	table->count --;
+	assert(table->count >= 0);
+
+	return(ptr);
+}
+
+
+
+
+hashindex_t * hashindex_new(int hint)
+{
+	hashindex_t *index;
+	int slots = MIN_SLOTS;
+
+	assert(hint >= 0);
+
+	// keep the load under 7/8ths.
+	while ((slots - (slots >> 3)) <= hint) {
+		slots <<= 1;
+	}
+
+	index = calloc(1, sizeof(hashindex_t));
+	assert(index);
+	table_alloc(&index->current, slots);
+
+	assert(index->old.tags == NULL);
+	assert(index->moved == 0);
+	assert(index->resizes == 0);
+
+	return(index);
+}
+
+
+// The index must be empty before it is freed.
+void hashindex_free(hashindex_t *index)
+{
+	assert(index);
+	assert(hashindex_count(index) == 0);
+
+	if (index->old.tags) {
+		table_release(&index->old);
+	}
+	table_release(&index->current);
+
+	free(index);
+}
+
+
+// move up to 'slots' slots from the old table into the current one.  Returns non-zero if there is
+// still a resize in progress.
+int hashindex_step(hashindex_t *index, int slots)
+{
+	hashindex_table_t *old;
+	hashindex_entry_t *entry;
+
+	assert(index);
+	assert(slots > 0);
+
+	old = &index->old;
+	if (old->tags == NULL) {
+		return(0);
+	}
+
+	while (slots > 0 && index->moved <= old->mask) {
+		if (old->tags[index->moved] & TAG_USED) {
+			entry = &old->entries[index->moved];
+			table_place(&index->current, index_mix(entry->key_hash, entry->map_hash), entry->key_hash, entry->map_hash, entry->ptr);
+
+			// entries further along may have probed past this slot, so it needs to be a tombstone.
+			old->tags[index->moved] = TAG_DELETED;
+			old->count --;
+			old->deleted ++;
+		}
+		index->moved ++;
+		slots --;
+	}
+
+	if (index->moved > old->mask) {
+		assert(old->count == 0);
+		table_release(old);
+		index->moved = 0;
+		return(0);
+	}
+
+	return(1);
+}
+
+
+// the current table is getting full.  Put it aside as the 'old' table and start moving the
+// entries into a new one.  If there are a lot of tombstones, then the new table might be the same
+// size, which clears them out.
+static void index_grow(hashindex_t *index)
+{
+	int slots;
+
+	assert(index);
+
+	// only one resize can be happening at a time.  This should rarely be needed, because the old
+	// table is drained long before the new one fills up.
+	if (index->old.tags) {
+		hashindex_step(index, index->old.mask + 1);
+		assert(index->old.tags == NULL);
+	}
+
+	slots = index->current.mask + 1;
+	if (index->current.count >= (slots >> 1)) {
+		slots <<= 1;
+	}
+
+	index->old = index->current;
+	index->moved = 0;
+	index->resizes ++;
+	table_alloc(&index->current, slots);
+}
+
+
+
+
+void * hashindex_get(hashindex_t *index, hash_t key_hash, hash_t map_hash)
+{
+	hash_t h;
+	int slot;
+
+	assert(index);
+
+	h = index_mix(key_hash, map_hash);
+	slot = table_find(&index->current, h, key_hash, map_hash);
+	if (slot >= 0) {
+		return(index->current.entries[slot].ptr);
+	}
+
+	if (index->old.tags) {
+		slot = table_find(&index->old, h, key_hash, map_hash);
+		if (slot >= 0) {
+			return(index->old.entries[slot].ptr);
+		}
+	}
+
+	return(NULL);
+}
+
+
+// add an entry to the index.  The entry must not already be in there.
+void hashindex_insert(hashindex_t *index, hash_t key_hash, hash_t map_hash, void *ptr)
+{
+	int slots;
+
+	assert(index);
+	assert(ptr);
+	assert(hashindex_get(index, key_hash, map_hash) == NULL);
+
+	if (index->old.tags) {
+		hashindex_step(index, MOVE_SLOTS);
+	}
+
+	slots = index->current.mask + 1;
+	if ((index->current.count + index->current.deleted + 1) > (slots - (slots >> 3))) {
+		index_grow(index);
+	}
+
+	table_place(&index->current, index_mix(key_hash, map_hash), key_hash, map_hash, ptr);
+}
+
+
+// remove the entry from the index, and return the pointer that was stored with it.  Returns NULL
+// if the entry was not found.
+void * hashindex_remove(hashindex_t *index, hash_t key_hash, hash_t map_hash)
+{
+	hash_t h;
+	int slot;
+
+	assert(index);
+
+	h = index_mix(key_hash, map_hash);
+	slot = table_find(&index->current, h, key_hash, map_hash);
+	if (slot >= 0) {
+		return(table_take(&index->current, slot));
+	}
+
+	if (index->old.tags) {
+		slot = table_find(&index->old, h, key_hash, map_hash);
+		if (slot >= 0) {
+			return(table_take(&index->old, slot));
+		}
+	}
+
+	return(NULL);
+}
+
+
+int hashindex_count(hashindex_t *index)
+{
+	assert(index);
+	assert(index->current.count >= 0);
+	assert(index->old.count >= 0);
+	return(index->current.count + index->old.count);
+}
+
+
+// the number of bytes used by the index itself (not including the items that it points to).
+long long hashindex_bytes(hashindex_t *index)
+{
+	long long bytes;
+
+	assert(index);
+
+	bytes = sizeof(hashindex_t);
+	bytes += (long long)(index->current.mask + 1) * (sizeof(unsigned char) + sizeof(hashindex_entry_t));
+	if (index->old.tags) {
+		bytes += (long long)(index->old.mask + 1) * (sizeof(unsigned char) + sizeof(hashindex_entry_t));
+	}
+
+	return(bytes);
+}
+
+
+// The cursor goes through the current table first, and then the old table.  Removing entries
+// while iterating is fine, but inserting can cause entries to be skipped or returned twice.
+hashindex_entry_t * hashindex_next(hashindex_t *index, int *cursor)
+{
+	hashindex_table_t *table;
+	int slot;
+
+	assert(index);
+	assert(cursor);
+	assert(cursor[0] >= 0);
+
+	while (1) {
+		slot = cursor[0];
+		table = &index->current;
+		if (slot > table->mask) {
+			slot -= (table->mask + 1);
+			table = &index->old;
+			if (table->tags == NULL || slot > table->mask) {
+				return(NULL);
+			}
+		}
+
+		cursor[0] ++;
+		if (table->tags[slot] & TAG_USED) {
+			return(&table->entries[slot]);
+		}
+	}
+}
+
+
+
+
+// return an entry from somewhere in the index, starting the search at the slot picked by 'r'.  
+// Used to sample entries, so it doesn't matter that entries after a gap are picked more often.  
+// Returns NULL if the index is empty.
+hashindex_entry_t * hashindex_random(hashindex_t *index, unsigned int r)
+{
+	hashindex_table_t *table;
+	int slot;
+	
+	assert(index);
+	
+	if (index->current.count > 0) {
+		table = &index->current;
+	}
+	else if (index->old.tags && index->old.count > 0) {
+		table = &index->old;
+	}
+	else {
+		return(NULL);
+	}
+	
+	// since the table has entries in it, this will find one.
+	slot = r & table->mask;
+	while ((table->tags[slot] & TAG_USED) == 0) {
+		slot = (slot + 1) & table->mask;
+	}
+	
+	return(&table->entries[slot]);
+}
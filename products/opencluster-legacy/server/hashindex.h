@@ -0,0 +1,68 @@
+// hashindex.h
+
+#ifndef __HASHINDEX_H
+#define __HASHINDEX_H
+
+// Flat open-addressing index used by the data containers.  The keys we store are already 64-bit
+// FNV hashes, so instead of walking balanced trees of pointers, entries are stored in a single
+// array keyed on the (key_hash, map_hash) pair.  A parallel array of one byte 'tags' is probed
+// first, so that most misses and hits only touch a cache line or two before the full key is
+// compared.
+//
+// When the index needs to grow, a new table is allocated, and the entries are moved over a few
+// slots at a time on every insert (or when hashindex_step() is called), rather than stopping
+// everything to rehash the whole table in one go.  Lookups and removals never move entries
+// around, so it is safe to remove entries while iterating through the index.
+
+#include "hash.h"
+
+
+typedef struct {
+	hash_t key_hash;
+	hash_t map_hash;
+	void *ptr;
+} hashindex_entry_t;
+
+
+typedef struct {
+	unsigned char *tags;
+	hashindex_entry_t *entries;
+	int mask;				// number of slots minus one.  Always a power of two minus one.
+	int count;				// number of slots that contain an entry.
+	int deleted;			// number of slots that contain a tombstone.
+} hashindex_table_t;
+
+
+typedef struct {
+	hashindex_table_t current;
+
+	// when the index is being resized, the entries in the 'old' table are slowly moved into the
+	// 'current' table.  'moved' is the position in the old table that we have moved up to.  None
+	// of the slots below that position contain entries any more.
+	hashindex_table_t old;
+	int moved;
+
+	// incremented every time the entries are moved into a new table, so that anything holding a
+	// position in the index (see data_scan) knows that the position is no longer valid.
+	int resizes;
+} hashindex_t;
+
+
+hashindex_t * hashindex_new(int hint);
+void hashindex_free(hashindex_t *index);
+
+void * hashindex_get(hashindex_t *index, hash_t key_hash, hash_t map_hash);
+void hashindex_insert(hashindex_t *index, hash_t key_hash, hash_t map_hash, void *ptr);
+void * hashindex_remove(hashindex_t *index, hash_t key_hash, hash_t map_hash);
+
+int hashindex_count(hashindex_t *index);
+long long hashindex_bytes(hashindex_t *index);
+int hashindex_step(hashindex_t *index, int slots);
+
+// iterate through all the entries in the index.  'cursor' should start at 0.  Returns NULL when
+// there are no more entries.  Entries can be removed while iterating.
+hashindex_entry_t * hashindex_next(hashindex_t *index, int *cursor);
+hashindex_entry_t * hashindex_random(hashindex_t *index, unsigned int r);
+
+
+#endif
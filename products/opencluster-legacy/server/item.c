@@ -2,21 +2,131 @@
 
 #include "item.h"
 
+#include "shard.h"
+#include "slab.h"
+
 #include <assert.h>
 #include <stdlib.h>
 
 
+// the number of seconds an item needs to go unused for its hits to be halved.
+#define ITEM_HITS_DECAY    60
+
+// the higher this is, the slower the hits grow once it has a few.
+#define ITEM_HITS_FACTOR   10
+
+
+// rand() takes a lock that every shard would be fighting over, so each shard has its own generator 
+// (xorshift32).  It only needs to be good enough to spread the hits and the eviction samples.
+static SHARD_LOCAL unsigned int _random = 0;
+
+
 
 void item_destroy(item_t *item) 
 {
 	assert(item);
 	
-	assert(item->value);
-	value_clear(item->value);
-	free(item->value);
-	item->value = NULL;
+	value_clear(&item->value);
+
+	slab_free(item, sizeof(item_t));
+}
+
+
+// a cheap random number, from this shard's generator.
+unsigned int item_random(void)
+{
+	unsigned int x = _random;
+	
+	if (x == 0) {
+		// each shard needs to start from somewhere different, and the address of its own state is.
+		x = (unsigned int) ((unsigned long) &_random >> 4) | 1;
+	}
+	
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	_random = x;
+	
+	return(x);
+}
+
+
+// the hits, after taking into account how long it has been since it was last used.
+static unsigned int item_hits(item_t *item, unsigned int now)
+{
+	unsigned int periods;
+	
+	assert(item);
+	
+	if (now <= item->accessed) {
+		return(item->hits);
+	}
+	
+	periods = (now - item->accessed) / ITEM_HITS_DECAY;
+	if (periods >= 16) {
+		return(0);
+	}
+	else {
+		return(item->hits >> periods);
+	}
+}
+
+
+// the item has been used, so update its access details.  The more hits an item has, the less likely 
+// it is that another one will be counted, so the count grows roughly logarithmically and a short 
+// is enough for even the busiest items.
+void item_touch(item_t *item, unsigned int now)
+{
+	unsigned int hits;
+	
+	assert(item);
+	
+	hits = item_hits(item, now);
+	if (hits < 0xFFFF && (item_random() % ((hits / ITEM_HITS_FACTOR) + 1)) == 0) {
+		hits ++;
+	}
+	
+	item->hits = hits;
+	item->accessed = now;
+}
+
 
-	free(item);
+// the amount of memory that the item is taking up.
+int item_bytes(item_t *item)
+{
+	assert(item);
+	return(sizeof(item_t) + value_bytes(&item->value));
 }
 
 
+// the higher the score, the better a candidate the item is for eviction.
+long long item_evict_score(item_t *item, int policy, unsigned int now)
+{
+	long long idle;
+	
+	assert(item);
+	assert(policy != EVICT_NONE);
+
+	idle = now > item->accessed ? now - item->accessed : 0;
+	
+	switch (policy) {
+		case EVICT_LRU:
+			return(idle);
+			
+		case EVICT_LFU:
+			// fewest hits first, and the longest unused out of those.
+			return(((long long) (0xFFFF - item_hits(item, now)) << 32) + idle);
+			
+		case EVICT_TTL:
+			// items that are going to expire anyway go first, soonest first.  If there aren't any, 
+			// then fall back to the least recently used.
+			if (item->expires > 0) {
+				return((1LL << 40) + (0xFFFFFFFFLL - (unsigned int) item->expires));
+			}
+			return(idle);
+			
+		default:
+			assert(0);
+			return(0);
+	}
+}
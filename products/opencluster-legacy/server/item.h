@@ -4,13 +4,29 @@
 #include "hash.h"
 #include "value.h"
 
+
+// the ways that an item can be chosen to be evicted when the memory runs out.
+#define EVICT_NONE  0
+#define EVICT_LRU   1
+#define EVICT_LFU   2
+#define EVICT_TTL   3
+
+
+// the value is kept inside the item, so that storing a counter or a short string only needs the one 
+// allocation.
 typedef struct {
 	hash_t item_key;
 	hash_t map_key;
 	int expires;
-	value_t *value;
 	int migrate;
-	void *maplist;
+	
+	// used to pick the items to evict.  'accessed' is the second that it was last read or written, 
+	// and 'hits' is a rough count of how often it is used, which decays while it isn't.  These fill 
+	// the space that would otherwise be padding before the value.
+	unsigned int accessed;
+	unsigned short hits;
+	
+	value_t value;
 } item_t;
 
 
@@ -18,6 +34,10 @@ typedef struct {
 
 
 void item_destroy(item_t *item);
+void item_touch(item_t *item, unsigned int now);
+int item_bytes(item_t *item);
+long long item_evict_score(item_t *item, int policy, unsigned int now);
+unsigned int item_random(void);
 
 
 
@@ -0,0 +1,213 @@
+// lz.c
+
+#include "lz.h"
+
+#include <assert.h>
+#include <string.h>
+
+
+#define LZ_MIN_MATCH       4
+#define LZ_LAST_LITERALS   5
+#define LZ_MAX_OFFSET      65535
+#define LZ_HASH_BITS       12
+#define LZ_HASH_SIZE       (1 << LZ_HASH_BITS)
+
+
+
+static unsigned int lz_read32(const unsigned char *ptr)
+{
+	unsigned int value;
+	memcpy(&value, ptr, sizeof(value));
+	return(value);
+}
+
+
+static int lz_hash(unsigned int sequence)
+{
+	return((sequence * 2654435761u) >> (32 - LZ_HASH_BITS));
+}
+
+
+// lengths that dont fit in the token are continued in extra bytes, 255 at a time.  Returns the 
+// new output position, or -1 if it doesn't fit.
+static int lz_put_length(unsigned char *dst, int op, int max, int length)
+{
+	assert(length >= 0);
+	
+	while (length >= 255) {
+		if (op >= max) { return(-1); }
+		dst[op++] = 255;
+		length -= 255;
+	}
+	if (op >= max) { return(-1); }
+	dst[op++] = length;
+	
+	return(op);
+}
+
+
+// write a sequence of literals, and the match that follows them (if 'match_length' is not 0).
+static int lz_put_sequence(unsigned char *dst, int op, int max, const unsigned char *literals, int literal_length, int offset, int match_length)
+{
+	int token;
+	
+	if (op >= max) { return(-1); }
+	token = op++;
+	dst[token] = (literal_length < 15 ? literal_length : 15) << 4;
+	if (literal_length >= 15) {
+		op = lz_put_length(dst, op, max, literal_length - 15);
+		if (op < 0) { return(-1); }
+	}
+	
+	if (literal_length > max - op) { return(-1); }
+	memcpy(&dst[op], literals, literal_length);
+	op += literal_length;
+	
+	if (match_length > 0) {
+		assert(match_length >= LZ_MIN_MATCH);
+		assert(offset > 0 && offset <= LZ_MAX_OFFSET);
+		
+		if (max - op < 2) { return(-1); }
+		dst[op++] = offset & 0xff;
+		dst[op++] = offset >> 8;
+		
+		match_length -= LZ_MIN_MATCH;
+		dst[token] |= (match_length < 15 ? match_length : 15);
+		if (match_length >= 15) {
+			op = lz_put_length(dst, op, max, match_length - 15);
+		}
+	}
+	
+	return(op);
+}
+
+
+
+// compress 'length' bytes from 'src' into 'dst'.  Returns the compressed length, or 0 if it would 
+// not fit in 'max' bytes (so the caller can ask for it to be smaller by some margin, and simply 
+// keep the original if it isn't).
+int lz_compress(const char *src, int length, char *dst, int max)
+{
+	const unsigned char *in = (const unsigned char *) src;
+	unsigned char *out = (unsigned char *) dst;
+	int table[LZ_HASH_SIZE];
+	int ip = 0;
+	int anchor = 0;
+	int op = 0;
+	int limit;
+	int ref;
+	int match;
+	int h;
+	
+	assert(src);
+	assert(dst);
+	assert(length >= 0);
+	assert(max >= 0);
+	
+	// table holds the position+1 of the last place each hash was seen (0 for none).
+	memset(table, 0, sizeof(table));
+	
+	// a match cant start in the last few bytes, they are always literals.
+	limit = length - LZ_LAST_LITERALS - LZ_MIN_MATCH;
+	
+	while (ip <= limit) {
+		h = lz_hash(lz_read32(&in[ip]));
+		ref = table[h] - 1;
+		table[h] = ip + 1;
+		
+		if (ref < 0 || ip - ref > LZ_MAX_OFFSET || lz_read32(&in[ref]) != lz_read32(&in[ip])) {
+			ip ++;
+			continue;
+		}
+		
+		match = LZ_MIN_MATCH;
+		while (ip + match < length - LZ_LAST_LITERALS && in[ref + match] == in[ip + match]) {
+			match ++;
+		}
+		
+		op = lz_put_sequence(out, op, max, &in[anchor], ip - anchor, ip - ref, match);
+		if (op < 0) { return(0); }
+		
+		ip += match;
+		anchor = ip;
+	}
+	
+	op = lz_put_sequence(out, op, max, &in[anchor], length - anchor, 0, 0);
+	if (op < 0) { return(0); }
+	
+	assert(op > 0 && op <= max);
+	return(op);
+}
+
+
+
+// decompress into 'dst', which must be exactly 'dst_length' bytes.  Returns the decompressed 
+// length, or -1 if the data is corrupt.
+int lz_decompress(const char *src, int length, char *dst, int dst_length)
+{
+	const unsigned char *in = (const unsigned char *) src;
+	unsigned char *out = (unsigned char *) dst;
+	int ip = 0;
+	int op = 0;
+	int token;
+	int literals;
+	int match;
+	int offset;
+	int extra;
+	
+	assert(src);
+	assert(dst);
+	assert(length >= 0);
+	assert(dst_length >= 0);
+	
+	while (ip < length) {
+		token = in[ip++];
+		
+		literals = token >> 4;
+		if (literals == 15) {
+			do {
+				if (ip >= length) { return(-1); }
+				extra = in[ip++];
+				literals += extra;
+			} while (extra == 255);
+		}
+		if (literals > length - ip || literals > dst_length - op) { return(-1); }
+		memcpy(&out[op], &in[ip], literals);
+		ip += literals;
+		op += literals;
+		
+		if (ip >= length) {
+			// the last sequence doesn't have a match.
+			break;
+		}
+		
+		if (length - ip < 2) { return(-1); }
+		offset = in[ip] | (in[ip+1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > op) { return(-1); }
+		
+		match = token & 15;
+		if (match == 15) {
+			do {
+				if (ip >= length) { return(-1); }
+				extra = in[ip++];
+				match += extra;
+			} while (extra == 255);
+		}
+		match += LZ_MIN_MATCH;
+		if (match > dst_length - op) { return(-1); }
+		
+		// the match can overlap what it is writing, so it needs to be copied a byte at a time.
+		while (match > 0) {
+			out[op] = out[op - offset];
+			op ++;
+			match --;
+		}
+	}
+	
+	if (op != dst_length) {
+		return(-1);
+	}
+	
+	return(op);
+}
@@ -0,0 +1,20 @@
+// lz.h
+
+#ifndef __LZ_H
+#define __LZ_H
+
+// A small LZ77 codec for compressing large string values.  It is built for speed rather than 
+// ratio, and uses a byte oriented format (the same idea as LZ4 blocks):  each sequence is a token 
+// byte with the number of literals in the top 4 bits and the match length in the bottom 4 bits, 
+// followed by the literals, a 2 byte offset and any extra length bytes.  The last sequence is only 
+// literals.
+//
+// The decompressor checks every length and offset, so corrupt data is rejected rather than 
+// reading or writing outside of the buffers.
+
+
+int lz_compress(const char *src, int length, char *dst, int max);
+int lz_decompress(const char *src, int length, char *dst, int dst_length);
+
+
+#endif
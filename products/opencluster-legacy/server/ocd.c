@@ -10,17 +10,23 @@
 // includes
 #include "auth.h"
 #include "bucket.h"
+#include "client.h"
 #include "constants.h"
 #include "daemon.h"
 #include "item.h"
 #include "params.h"
 #include "payload.h"
+#include "pool.h"
 #include "seconds.h"
 #include "server.h"
+#include "shard.h"
 #include "shutdown.h"
+#include "slab.h"
 #include "stats.h"
 #include "timeout.h"
+#include "uring.h"
 #include "usage.h"
+#include "value.h"
 
 #include <assert.h>
 #include <stdlib.h>
@@ -62,6 +68,29 @@ static void sigint_handler(evutil_socket_t fd, short what, void *arg)
 
 
 
+//--------------------------------------------------------------------------------------------------
+// set up the modules that each shard has its own copy of (see shard.h).  The memory limit is 
+// shared evenly between them.
+static void shard_setup(int shards)
+{
+	assert(shards > 0);
+	
+	// pre-allocate the memory that will be used to store the data.  The limit is in megabytes, and if 
+	// it isn't set, then there is no limit.
+	slab_init((config_get_long("memory-limit") * 1024 * 1024) / shards);
+	
+	// when that memory runs out, items can be evicted to make room for new ones.
+	buckets_eviction(config_get("eviction-policy"), config_get_long("eviction-samples"));
+	
+	// identical long strings can be shared between items, and a pooled string can be sent to a 
+	// client without being copied (see value_str_share).  So it is on unless the config turns it off.
+	pool_init(config_get("string-pool") ? config_get_long("string-pool") : POOL_MIN_LENGTH);
+	
+	payload_init();
+}
+
+
+
 //-----------------------------------------------------------------------------
 // Main... process command line parameters, and then setup our listening 
 // sockets and event loop.
@@ -168,9 +197,30 @@ int main(int argc, char **argv)
 	}
 
 	
+	// large strings can be compressed.
+	value_compression(config_get_long("compress-threshold"));
+	
+	// the connections stop being read while too much is waiting to be sent to them.
+	clients_watermarks(config_get_long("out-high") * 1024, config_get_long("out-low") * 1024);
+	
+	// a frame bigger than this closes the connection, instead of having memory reserved for it.
+	clients_max_frame(config_get_long("max-frame") * 1024);
+
+	
 	// create our event base which will be the pivot point for pretty much everything.
 	_evbase = event_base_new();
 	assert(_evbase);
+	
+	// the connections can be read and written through io_uring instead of events, if the kernel 
+	// supports it.
+	uring_enable(config_get_bool("io-uring"));
+	
+	// the data can be split between worker threads, each with its own event base.  If there aren't 
+	// any, the main loop looks after the data itself.
+	shards_init(_evbase, config_get_long("threads"), shard_setup);
+	if (shards_workers() == 0) {
+		shard_setup(1);
+	}
 
 	// initialise signal handlers.
 	assert(_evbase);
@@ -183,7 +233,9 @@ int main(int argc, char **argv)
 	// have expired.  Expiry is done at intervals of one second.
 	seconds_init(_evbase);
 	
-	payload_init();
+	if (shards_workers() > 0) {
+		payload_init();
+	}
 	
 	// statistics are generated every second, setup a timer that can fire and handle the stats.
 	stats_init(_evbase);
@@ -202,6 +254,7 @@ int main(int argc, char **argv)
 	// needs to be setup and running before this point.  
 	syslog(LOG_INFO, "Starting main loop.");
 	assert(_evbase);
+	shards_start();
 	event_base_dispatch(_evbase);
 
 ///============================================================================
@@ -210,6 +263,9 @@ int main(int argc, char **argv)
 
 	// make sure signal handlers have been cleared.
 	assert(_sigint_event == NULL);
+	
+	// stop the workers.
+	shards_shutdown();
 
 	// close the eventbase, because the main loop has exited, there is nothing 
 	// more we can do with events.
@@ -2,6 +2,8 @@
 
 #include "payload.h"
 
+#include "shard.h"
+
 #include <arpa/inet.h>
 #include <assert.h>
 #include <stdlib.h>
@@ -20,14 +22,15 @@
 // The Available list is for payload objects that are not currently in use, and are ready to be used 
 // again. The _avail_next index will point to the next entry on the list available for use.  There 
 // should not be any empty slots in this list, it should be treated as a stack.
+// Each shard has its own lists, so a reply has to be processed by the shard that sent the message.
 
-payload_t **_active_list = NULL;
-int _active_max = 0;
-int _active_count = 0;
+SHARD_LOCAL payload_t **_active_list = NULL;
+SHARD_LOCAL int _active_max = 0;
+SHARD_LOCAL int _active_count = 0;
 
-payload_t **_avail_list = NULL;
-int _avail_max = 0;
-int _avail_count = 0;
+SHARD_LOCAL payload_t **_avail_list = NULL;
+SHARD_LOCAL int _avail_max = 0;
+SHARD_LOCAL int _avail_count = 0;
 
 #ifndef DEFAULT_BUFSIZE
 #define DEFAULT_BUFSIZE 2048
@@ -253,7 +256,7 @@ void payload_data(PAYLOAD entry, int length, void *data)
 	assert(sizeof(length) == 4);
 	
 	// add the length of the string first.
-	char *ptr = ((char*) payload->buffer + payload->length);
+	int *ptr = ((void*) payload->buffer + payload->length);
 	ptr[0] = htobe32(length);
 
 	if (length > 0) {
@@ -268,6 +271,45 @@ void payload_data(PAYLOAD entry, int length, void *data)
 
 
 
+// add the bytes as they are, without a length in front of them.  Used to copy the contents of a 
+// payload built somewhere else.
+void payload_raw(PAYLOAD entry, int length, const void *data)
+{
+	assert(entry >= 0);
+	assert(entry < _active_count);
+	assert(_active_count <= _active_max);
+	assert(_active_list);
+	assert(length >= 0);
+	assert(length == 0 || data);
+	
+	payload_t *payload = _active_list[entry];
+	assert(payload);
+	assert(payload->used > 0);
+	
+	assert(payload->max >= 0 && payload->length >= 0);
+	assert(payload->length <= payload->max);
+	assert(payload->buffer);
+	
+	int avail = payload->max - payload->length;
+	if (avail < length) {
+		payload->max += (DEFAULT_BUFSIZE + length);
+		payload->buffer = realloc(payload->buffer, payload->max);
+		assert(payload->buffer);
+		assert(payload->max > 0);
+	}
+
+	if (length > 0) {
+		memcpy(payload->buffer + payload->length, data, length);
+	}
+	
+	payload->length += length;
+	
+	assert(payload->buffer);
+	assert(payload->length <= payload->max);
+}
+
+
+
 void payload_string(PAYLOAD entry, const char *str)
 {
 	if (str == NULL) {
@@ -82,6 +82,7 @@ void payload_int(PAYLOAD entry, int value);
 void payload_long(PAYLOAD entry, long long value);
 void payload_string(PAYLOAD entry, const char *str);
 void payload_data(PAYLOAD entry, int length, void *data);
+void payload_raw(PAYLOAD entry, int length, const void *data);
 
 void payload_free_client(void *client_ptr);
 
@@ -0,0 +1,198 @@
+// pool.c
+
+#include "pool.h"
+
+#include "hashindex.h"
+#include "shard.h"
+#include "slab.h"
+#include "stats.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// the string is stored straight after the entry.
+typedef struct {
+	hash_t hash;
+	int refs;
+	int length;
+} pool_entry_t;
+
+
+// each shard has its own pool (see shard.h).  Strings shorter than this are not put in it, and 0
+// means the pool is not being used.
+static SHARD_LOCAL int _min_length = 0;
+
+// indexed on the hash of the string, and its length.
+static SHARD_LOCAL hashindex_t *_index = NULL;
+
+static SHARD_LOCAL long long _entries = 0;
+static SHARD_LOCAL long long _refs = 0;
+static SHARD_LOCAL long long _stored_bytes = 0;
+static SHARD_LOCAL long long _shared_bytes = 0;
+static SHARD_LOCAL long long _collisions = 0;
+
+
+
+
+void pool_init(int min_length)
+{
+	assert(min_length >= 0);
+	assert(_index == NULL);
+	
+	_min_length = min_length;
+	if (_min_length > 0) {
+		_index = hashindex_new(0);
+		assert(_index);
+	}
+}
+
+
+static int entry_size(int length)
+{
+	assert(length > 0);
+	return(sizeof(pool_entry_t) + length + 1);
+}
+
+
+
+// returns a buffer with the contents of the string in it, that is shared with any other values that 
+// have the same string.  If the string isn't going to be pooled (because it is too small, or 
+// there is a different string with the same hash already there, or there is no memory) then NULL 
+// is returned, and the caller will need to store it itself.
+char * pool_get(hash_t hash, const char *str, int length)
+{
+	pool_entry_t *entry;
+	char *ptr;
+	
+	assert(str);
+	assert(length >= 0);
+	
+	if (_index == NULL || length < _min_length) {
+		return(NULL);
+	}
+	
+	entry = hashindex_get(_index, hash, length);
+	if (entry) {
+		assert(entry->hash == hash);
+		assert(entry->length == length);
+		assert(entry->refs > 0);
+		
+		ptr = (char *) (entry + 1);
+		if (memcmp(ptr, str, length) != 0) {
+			// same hash, but a different string.
+			_collisions ++;
+			return(NULL);
+		}
+		
+		entry->refs ++;
+	}
+	else {
+		entry = slab_alloc(entry_size(length));
+		if (entry == NULL) {
+			return(NULL);
+		}
+		
+		entry->hash = hash;
+		entry->refs = 1;
+		entry->length = length;
+		ptr = (char *) (entry + 1);
+		memcpy(ptr, str, length);
+		ptr[length] = 0;
+		
+		hashindex_insert(_index, hash, length, entry);
+		_entries ++;
+		_stored_bytes += length + 1;
+	}
+	
+	_refs ++;
+	_shared_bytes += length + 1;
+	
+	return(ptr);
+}
+
+
+
+// a value has finished with the buffer.  When nothing is using it anymore, it is removed from the 
+// pool.
+void pool_release(char *ptr, int length)
+{
+	pool_entry_t *entry;
+	
+	assert(ptr);
+	assert(_index);
+	
+	entry = ((pool_entry_t *) ptr) - 1;
+	assert(entry->length == length);
+	assert(entry->refs > 0);
+	
+	entry->refs --;
+	_refs --;
+	_shared_bytes -= length + 1;
+	assert(_refs >= 0 && _shared_bytes >= 0);
+	
+	if (entry->refs == 0) {
+		if (hashindex_remove(_index, entry->hash, length) != entry) {
+			assert(0);
+		}
+		_entries --;
+		_stored_bytes -= length + 1;
+		assert(_entries >= 0 && _stored_bytes >= 0);
+		
+		slab_free(entry, entry_size(length));
+	}
+}
+
+
+
+// something else (like a reply that is being sent) is going to hold on to a buffer that a value 
+// already has, so it needs another reference.  It is let go with pool_unref().
+void pool_ref(char *ptr)
+{
+	pool_entry_t *entry;
+	
+	assert(ptr);
+	assert(_index);
+	
+	entry = ((pool_entry_t *) ptr) - 1;
+	assert(entry->refs > 0);
+	
+	entry->refs ++;
+	_refs ++;
+	_shared_bytes += entry->length + 1;
+}
+
+
+// the same as pool_release(), for when the length isn't known.
+void pool_unref(void *ptr)
+{
+	pool_entry_t *entry;
+	
+	assert(ptr);
+	
+	entry = ((pool_entry_t *) ptr) - 1;
+	pool_release(ptr, entry->length);
+}
+
+
+
+void pool_dump(void)
+{
+	stat_dumpstr("STRING POOL");
+	if (_index == NULL) {
+		stat_dumpstr("  Disabled");
+	}
+	else {
+		stat_dumpstr("  Minimum Length: %d", _min_length);
+		stat_dumpstr("  Strings: %lld", _entries);
+		stat_dumpstr("  References: %lld", _refs);
+		stat_dumpstr("  Stored Bytes: %lld", _stored_bytes);
+		stat_dumpstr("  Referenced Bytes: %lld", _shared_bytes);
+		if (_stored_bytes > 0) {
+			stat_dumpstr("  Dedup Ratio: %.2f", (double) _shared_bytes / (double) _stored_bytes);
+		}
+		stat_dumpstr("  Collisions: %lld", _collisions);
+	}
+	stat_dumpstr(NULL);
+}
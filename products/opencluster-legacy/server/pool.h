@@ -0,0 +1,25 @@
+// pool.h
+
+#ifndef __POOL_H
+#define __POOL_H
+
+#include "hash.h"
+
+// Shared pool of string buffers.  When a lot of items are storing the same big string, it only 
+// needs to be stored once.  The strings are indexed on their hash and length, and are compared 
+// byte-for-byte before being shared, so a hash collision just means the string gets its own buffer 
+// as normal.  Each buffer has a reference count, and is freed when the last value using it is 
+// cleared.
+//
+// Strings in the pool are shared, so they must never be modified.
+
+
+void pool_init(int min_length);
+char * pool_get(hash_t hash, const char *str, int length);
+void pool_release(char *ptr, int length);
+void pool_ref(char *ptr);
+void pool_unref(void *ptr);
+void pool_dump(void);
+
+
+#endif
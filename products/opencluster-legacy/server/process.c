@@ -123,11 +123,28 @@ static void process_loadlevels(client_t *client, header_t *header, void *ptr, pa
 
 	// need to get the data out of the payload.
 	char *next = ptr;
-	int primary = data_int(&next);
-	int backups = data_int(&next);
-	int transferring = data_int(&next);
+	int avail = header->length;
+	int primary = data_int(&next, &avail);
+	int backups = data_int(&next, &avail);
+	int transferring = data_int(&next, &avail);
+	
+	// the amount of data the node has.  Older nodes dont include it, in which case we can only 
+	// balance on the number of buckets.
+	long long bytes = -1;
+	long long items = -1;
+	long long keyvalues = -1;
+	if (avail > 0) {
+		bytes = data_long(&next, &avail);
+		items = data_long(&next, &avail);
+		keyvalues = data_long(&next, &avail);
+		if (avail < 0) {
+			// they were cut short, so can't be trusted.
+			logger(LOG_WARN, "LoadLevel data from '%s' was cut short.", node_name(node));
+			bytes = items = keyvalues = -1;
+		}
+	}
 
-	logger(LOG_DEBUG, "Received LoadLevel data from '%s'.  Primary:%d, Backups:%d, Transferring:%d", node_name(node), primary, backups, transferring); 
+	logger(LOG_DEBUG, "Received LoadLevel data from '%s'.  Primary:%d, Backups:%d, Transferring:%d, Bytes:%lld, Items:%lld, Keyvalues:%lld", node_name(node), primary, backups, transferring, bytes, items, keyvalues); 
 	
 	int switching = 0;
 	
@@ -148,7 +165,7 @@ static void process_loadlevels(client_t *client, header_t *header, void *ptr, pa
 			assert(client->node);
 			logger(LOG_DEBUG, "Processing loadlevel data from: '%s' (%d/%d)", node_name(node), primary, backups); 
 			
-			bucket_t *bucket = buckets_check_loadlevels(client, primary, backups);
+			bucket_t *bucket = buckets_check_loadlevels(client, primary, backups, bytes);
 				
 			if (bucket) {
 				
@@ -15,22 +15,38 @@
 #define COMMAND_FINALISE_MIGRATION          0x0130
 #define COMMAND_GET_INT                     0x2010
 #define COMMAND_GET_STRING                  0x2020
+#define COMMAND_MGET_INT                    0x2030
+#define COMMAND_MGET_STRING                 0x2040
+#define COMMAND_SCAN                        0x2100
 #define COMMAND_SET_INT                     0x2200
 #define COMMAND_SET_STRING                  0x2210
+#define COMMAND_MSET_INT                    0x2220
+#define COMMAND_MSET_STRING                 0x2230
+#define COMMAND_SET_INT_IF                  0x2300
+#define COMMAND_SET_STRING_IF               0x2310
+#define COMMAND_DELETE                      0x2400
 
 #define COMMAND_SET_KEYVALUE                0x2500
 #define COMMAND_GET_KEYVALUE                0x2520
 
+#define COMMAND_INCR_INT                    0x2600
+
 #define COMMAND_SYNC_INT                    0x3000
 #define COMMAND_SYNC_STRING                 0x3010
+#define COMMAND_SYNC_DELETE                 0x3020
+#define COMMAND_SYNC_STRING_PACKED          0x3030
+#define COMMAND_SYNC_TOMBSTONE              0x3040
 #define COMMAND_SYNC_KEYVALUE               0x3060
+#define COMMAND_SYNC_DELETE_KEYVALUE        0x3070
 
 
 
+#define RESPONSE_TRYELSEWHERE     0x0001
 #define RESPONSE_UNKNOWN          0x0002
 #define RESPONSE_FAIL             0x0003
 #define RESPONSE_WRONGTYPE        0x0005
 #define RESPONSE_TOOLARGE         0x0006
+#define RESPONSE_CONFLICT         0x0007
 
 #define RESPONSE_OK               0x0010
 #define RESPONSE_KEYVALUE_HASH    0x001F
@@ -38,6 +54,8 @@
 #define RESPONSE_LOADLEVELS       0x0013
 #define RESPONSE_DATA_INT         0x0110
 #define RESPONSE_DATA_STRING      0x0120
+#define RESPONSE_SCAN             0x0130
+#define RESPONSE_MULTI            0x0140
 
 
 
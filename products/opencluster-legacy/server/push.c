@@ -173,28 +173,42 @@ void push_sync_item(client_t *client, item_t *item)
 	assert(client->handle > 0);
 	
 	assert(item);
-	assert(item->value);
 
 	int expires = 0;
 	if (item->expires > 0) {
 		expires = item->expires - seconds_get();
 	}
 	
-	if (item->value->type == VALUE_LONG) {
+	if (item->value.type == VALUE_LONG) {
 		PAYLOAD payload = payload_new(client, COMMAND_SYNC_INT);
 		payload_long(payload, item->map_key);
 		payload_long(payload, item->item_key);
 		payload_int(payload, expires);
-		payload_long(payload, item->value->data.l);
-		logger(LOG_DEBUG, "sending SYNC_INT: (%#llx:%#llx, %ld)", item->map_key, item->item_key, item->value->data.l);
+		payload_long(payload, item->value.data.l);
+		logger(LOG_DEBUG, "sending SYNC_INT: (%#llx:%#llx, %ld)", item->map_key, item->item_key, item->value.data.l);
 		client_send_message(payload);
 	}
-	else if (item->value->type == VALUE_STRING) {
-		PAYLOAD payload = payload_new(client, COMMAND_SYNC_INT);
+	else if (item->value.type == VALUE_STRING && (item->value.flags & VALUE_FLAG_COMPRESSED)) {
+		// the other node can store the compressed string as it is.
+		PAYLOAD payload = payload_new(client, COMMAND_SYNC_STRING_PACKED);
+		payload_long(payload, item->map_key);
+		payload_long(payload, item->item_key);
+		payload_int(payload, expires);
+		payload_long(payload, item->value.valuehash);
+		payload_data(payload, item->value.length, value_str(&item->value));
+		logger(LOG_DEBUG, "sending SYNC_STRING_PACKED: (%#llx:%#llx)", item->map_key, item->item_key);
+		client_send_message(payload);
+	}
+	else if (item->value.type == VALUE_DELETED) {
+		// the item has been deleted, and is only a tombstone.
+		push_sync_tombstone(client, item->map_key, item->item_key);
+	}
+	else if (item->value.type == VALUE_STRING) {
+		PAYLOAD payload = payload_new(client, COMMAND_SYNC_STRING);
 		payload_long(payload, item->map_key);
 		payload_long(payload, item->item_key);
 		payload_int(payload, expires);
-		payload_data(payload, item->value->data.s.length, item->value->data.s.data);
+		payload_data(payload, item->value.length, value_str(&item->value));
 		logger(LOG_DEBUG, "sending SYNC_STRING: (%#llx:%#llx)", item->map_key, item->item_key);
 		client_send_message(payload);
 	}
@@ -204,6 +218,47 @@ void push_sync_item(client_t *client, item_t *item)
 }
 
 
+// tell the backup node that an item has been removed.
+void push_sync_delete(client_t *client, hash_t map_hash, hash_t key_hash)
+{
+	assert(client);
+	assert(client->handle > 0);
+	
+	PAYLOAD payload = payload_new(client, COMMAND_SYNC_DELETE);
+	payload_long(payload, map_hash);
+	payload_long(payload, key_hash);
+	logger(LOG_DEBUG, "sending SYNC_DELETE: (%#llx:%#llx)", map_hash, key_hash);
+	client_send_message(payload);
+}
+
+
+// tell the backup node that an item has been deleted, so it can leave a tombstone as well.  If 
+// 'map_hash' is 0, then everything for the key has been deleted.
+void push_sync_tombstone(client_t *client, hash_t map_hash, hash_t key_hash)
+{
+	assert(client);
+	assert(client->handle > 0);
+	
+	PAYLOAD payload = payload_new(client, COMMAND_SYNC_TOMBSTONE);
+	payload_long(payload, map_hash);
+	payload_long(payload, key_hash);
+	logger(LOG_DEBUG, "sending SYNC_TOMBSTONE: (%#llx:%#llx)", map_hash, key_hash);
+	client_send_message(payload);
+}
+
+
+void push_sync_delete_keyvalue(client_t *client, hash_t key_hash)
+{
+	assert(client);
+	assert(client->handle > 0);
+	
+	PAYLOAD payload = payload_new(client, COMMAND_SYNC_DELETE_KEYVALUE);
+	payload_long(payload, key_hash);
+	logger(LOG_DEBUG, "sending SYNC_DELETE_KEYVALUE: (%#llx)", key_hash);
+	client_send_message(payload);
+}
+
+
 void push_sync_keyvalue(client_t *client, hash_t keyhash, int length, char *keyvalue)
 {
 	assert(client);
@@ -18,6 +18,9 @@ void push_promote(client_t *client, hash_t hash);
 void push_control_bucket(client_t *client, hash_t mask, hash_t hashmask, int level);
 void push_sync_item(client_t *client, item_t *item);
 void push_sync_keyvalue(client_t *client, hash_t keyhash, int length, char *keyvalue);
+void push_sync_delete(client_t *client, hash_t map_hash, hash_t key_hash);
+void push_sync_tombstone(client_t *client, hash_t map_hash, hash_t key_hash);
+void push_sync_delete_keyvalue(client_t *client, hash_t key_hash);
 void push_sync_keyvalue_int(client_t *client, hash_t key, long long int_key);
 void push_finalise_migration(client_t *client, hash_t mask, hash_t hashmask, const char *conninfo, int level);
 void push_all_newserver(char *name, client_t *source_client);
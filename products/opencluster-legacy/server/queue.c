@@ -1,34 +1,60 @@
 /*
- * single-linked list used as a queue.  
- * Push things at the head, and pop them from the tail.
- * Very limited queue, intended to be used only as a queue of items.  
- * 
+ * bounded ring queues of pointers, for handing things between threads.
+ * See queue.h for the two kinds.
+ *
  * (c) Copyright Clinton Webb, 2011
- * 
+ *
  * Released under GPL 3 and later.
- * 
+ *
  */
 
 #include "queue.h"
 
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+
+
+// the cells are published with release stores and read with acquire loads, which is all that is
+// needed to make sure the pointer is there before the other side sees the counter move.
+#define LOAD(p)       __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE(p, v)   __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define RELAXED(p)    __atomic_load_n((p), __ATOMIC_RELAXED)
+
 
 /*
- * Create a new queue object and initialise it.  Should be freed by queue_free().
+ * Create a new queue that can hold at least 'size' pointers.  Should be freed by queue_free().
  */
-queue_t * queue_new(void)
+queue_t * queue_new(int mode, int size)
 {
 	queue_t *q;
-	
-	q = malloc(sizeof(queue_t));
-	assert(q);
-	
-	q->head = NULL;
-	q->tail = NULL;
-	q->avail = NULL;
-	q->count = 0;
-	
+	unsigned long capacity;
+	unsigned long i;
+
+	assert(mode == QUEUE_SPSC || mode == QUEUE_MPMC);
+	assert(size > 0);
+
+	capacity = 2;
+	while (capacity < size) {
+		capacity <<= 1;
+	}
+
+	if (posix_memalign((void **) &q, QUEUE_CACHELINE, sizeof(queue_t)) != 0) {
+		assert(0);
+		return(NULL);
+	}
+	memset(q, 0, sizeof(queue_t));
+
+	q->mode = mode;
+	q->mask = capacity - 1;
+	q->cells = calloc(capacity, sizeof(queue_cell_t));
+	assert(q->cells);
+
+	// each cell in an MPMC queue says which lap it is ready for.
+	for (i=0; i<capacity; i++) {
+		q->cells[i].seq = i;
+	}
+
 	return(q);
 }
 
@@ -37,116 +63,250 @@ queue_t * queue_new(void)
  */
 void queue_free(queue_t *q)
 {
-	queue_item_t *item;
 	assert(q);
-	
-	assert(q->head == NULL);
-	assert(q->tail == NULL);
-	assert(q->count == 0);
-	
-	while(q->avail) {
-		item = q->avail;
-		q->avail = item->next;
-		
-		free(item);
-	}
-	
+	assert(q->cells);
+	assert(q->head == q->tail);
+
+	free(q->cells);
 	free(q);
 }
 
 
-void queue_push(queue_t *q, void *ptr)
+
+static int spsc_push_batch(queue_t *q, void **ptrs, int count)
+{
+	unsigned long tail;
+	unsigned long space;
+	int i;
+
+	tail = q->tail;
+	space = (q->mask + 1) - (tail - q->head_cache);
+	if (space < count) {
+		q->head_cache = LOAD(&q->head);
+		space = (q->mask + 1) - (tail - q->head_cache);
+		if (space < count) {
+			count = space;
+		}
+	}
+
+	for (i=0; i<count; i++) {
+		assert(ptrs[i]);
+		q->cells[(tail + i) & q->mask].ptr = ptrs[i];
+	}
+
+	if (count > 0) {
+		STORE(&q->tail, tail + count);
+	}
+
+	return(count);
+}
+
+
+static int spsc_pop_batch(queue_t *q, void **ptrs, int max)
+{
+	unsigned long head;
+	unsigned long avail;
+	int i;
+
+	head = q->head;
+	avail = q->tail_cache - head;
+	if (avail < max) {
+		q->tail_cache = LOAD(&q->tail);
+		avail = q->tail_cache - head;
+	}
+	if (avail < max) {
+		max = avail;
+	}
+
+	for (i=0; i<max; i++) {
+		ptrs[i] = q->cells[(head + i) & q->mask].ptr;
+		assert(ptrs[i]);
+	}
+
+	if (max > 0) {
+		STORE(&q->head, head + max);
+	}
+
+	return(max);
+}
+
+
+
+// the bounded MPMC queue described by Dmitry Vyukov.  Each cell has a sequence number that says
+// whether it is ready to be pushed into (seq == position) or popped from (seq == position + 1) on
+// the current lap.  The producers and consumers claim positions by moving the counters with a CAS.
+static int mpmc_push(queue_t *q, void *ptr)
+{
+	queue_cell_t *cell;
+	unsigned long pos;
+	long diff;
+
+	pos = RELAXED(&q->tail);
+	for (;;) {
+		cell = &q->cells[pos & q->mask];
+		diff = (long) LOAD(&cell->seq) - (long) pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		}
+		else if (diff < 0) {
+			// the cell still has something in it from the last lap, so the queue is full.
+			return(0);
+		}
+		else {
+			pos = RELAXED(&q->tail);
+		}
+	}
+
+	cell->ptr = ptr;
+	STORE(&cell->seq, pos + 1);
+	return(1);
+}
+
+
+static void * mpmc_pop(queue_t *q)
+{
+	queue_cell_t *cell;
+	unsigned long pos;
+	long diff;
+	void *ptr;
+
+	pos = RELAXED(&q->head);
+	for (;;) {
+		cell = &q->cells[pos & q->mask];
+		diff = (long) LOAD(&cell->seq) - (long) (pos + 1);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		}
+		else if (diff < 0) {
+			// nothing has been put in the cell on this lap yet, so the queue is empty.
+			return(NULL);
+		}
+		else {
+			pos = RELAXED(&q->head);
+		}
+	}
+
+	ptr = cell->ptr;
+	STORE(&cell->seq, pos + q->mask + 1);
+	return(ptr);
+}
+
+
+
+/*
+ * Add a pointer to the queue.  Returns 0 if the queue is full.
+ */
+int queue_push(queue_t *q, void *ptr)
 {
-	queue_item_t *item;
-	
 	assert(q);
 	assert(ptr);
-	
-	// first get a free item.
-	item = NULL;
-	if (q->avail) {
-		item = q->avail;
-		q->avail = item->next;
-		item->next = NULL;
-		assert(item->ptr == NULL);
+
+	if (q->mode == QUEUE_SPSC) {
+		return(spsc_push_batch(q, &ptr, 1));
 	}
 	else {
-		item = calloc(1, sizeof(queue_item_t));
-		assert(item->ptr == NULL);
-		assert(item->next == NULL);
-	}
-	assert(item);
-
-	// add the pointer payload to the item.
-	item->ptr = ptr;
-	
-	// now add this item to the end of the list.
-	if (q->head == NULL) {
-		assert(q->tail == NULL);
-		assert(q->count == 0);
-		
-		q->head = item;
-		q->tail = item;
-		assert(item->next == NULL);
+		return(mpmc_push(q, ptr));
 	}
-	else {
-		assert(q->tail);
-		assert(q->tail->next == NULL);
-		q->tail->next = item;
-		assert(item->next == NULL);
-		q->tail = item;
-	}
-	
-	// increment the count of items in the queue.
-	q->count ++;
-	assert(q->count > 0);
 }
 
 /*
- * Remove an item from the queue.
+ * Remove a pointer from the queue.  Returns NULL if the queue is empty.
  */
 void * queue_pop(queue_t *q)
 {
-	queue_item_t *item;
 	void *ptr;
-	
+
 	assert(q);
-	
-	if (q->head == NULL) {
-		assert(q->tail == NULL);
-		assert(q->count == 0);
-		return(NULL);
+
+	if (q->mode == QUEUE_SPSC) {
+		return(spsc_pop_batch(q, &ptr, 1) ? ptr : NULL);
+	}
+	else {
+		return(mpmc_pop(q));
+	}
+}
+
+
+/*
+ * Add as many of the pointers as will fit, in order, and return how many were added.  On an SPSC
+ * queue, the consumer sees them all at once.
+ */
+int queue_push_batch(queue_t *q, void **ptrs, int count)
+{
+	int i;
+
+	assert(q);
+	assert(ptrs);
+	assert(count >= 0);
+
+	if (q->mode == QUEUE_SPSC) {
+		return(spsc_push_batch(q, ptrs, count));
+	}
+	else {
+		for (i=0; i<count; i++) {
+			if (mpmc_push(q, ptrs[i]) == 0) {
+				break;
+			}
+		}
+		return(i);
+	}
+}
+
+/*
+ * Remove up to 'max' pointers from the queue, and return how many were removed.
+ */
+int queue_pop_batch(queue_t *q, void **ptrs, int max)
+{
+	int i;
+
+	assert(q);
+	assert(ptrs);
+	assert(max >= 0);
+
+	if (q->mode == QUEUE_SPSC) {
+		return(spsc_pop_batch(q, ptrs, max));
 	}
 	else {
-		assert(q->tail);
-		assert(q->count > 0);
-		
-		item = q->head;
-		q->head = item->next;
-		
-		// if the head is now empty, tail needs to be too.
-		if (q->head == NULL) q->tail = NULL;
-		
-		q->count --;
-		assert(q->count >= 0);
-		
-		ptr = item->ptr;
-		assert(ptr);
-		
-		item->ptr = NULL;
-		item->next = q->avail;
-		q->avail = item;
-		
-		return(ptr);
+		for (i=0; i<max; i++) {
+			ptrs[i] = mpmc_pop(q);
+			if (ptrs[i] == NULL) {
+				break;
+			}
+		}
+		return(i);
 	}
 }
 
+
+/*
+ * The number of pointers in the queue.  If other threads are using it, this can be out of date by
+ * the time it is returned.
+ */
 int queue_count(queue_t *q)
 {
+	unsigned long head;
+	unsigned long tail;
+
 	assert(q);
-	
-	assert(q->count >= 0);
-	assert((q->count == 0 && q->head == NULL && q->tail == NULL) || (q->count > 0 && q->head && q->tail));
-	return(q->count);
+
+	// the head is read first, so the tail can't be behind it, but other threads could have pushed
+	// and popped a lot in between.
+	head = LOAD(&q->head);
+	tail = LOAD(&q->tail);
+	if ((tail - head) > (q->mask + 1)) {
+		return(q->mask + 1);
+	}
+
+	return(tail - head);
 }
 
+
+int queue_size(queue_t *q)
+{
+	assert(q);
+	return(q->mask + 1);
+}
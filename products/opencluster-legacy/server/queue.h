@@ -1,28 +1,55 @@
-// single-linked list used as a queue.  Push things at the head, and pop them from the tail.
+// bounded ring queues of pointers, for handing things between threads without locking.
+//
+//   QUEUE_SPSC - one thread pushes, and one (other) thread pops.  Used for the calls that the
+//                shards hand to each other (see shard.c), where each pair of shards has its own.
+//   QUEUE_MPMC - any number of threads can push and pop at the same time.
+//
+// The queues have a fixed size (rounded up to a power of 2), and a push will fail when it is full,
+// so the caller needs to decide what to do then.  The counters that the producers and consumers
+// update are kept on seperate cache lines, so that they dont keep taking the line off each other.
 #ifndef __QUEUE_H
 #define __QUEUE_H
 
-typedef struct __queue_item_t {
+#define QUEUE_SPSC  1
+#define QUEUE_MPMC  2
+
+#define QUEUE_CACHELINE  64
+
+
+typedef struct {
+	volatile unsigned long seq;				// only used by QUEUE_MPMC.
 	void *ptr;
-	struct __queue_item_t *next;
-} queue_item_t;
+} queue_cell_t;
+
 
 typedef struct {
-	queue_item_t *head;
-	queue_item_t *tail;
-	queue_item_t *avail;
-	int count;
+	// written by the producers.  'head_cache' is the last head that the (single) producer saw, so
+	// that it doesn't need to look at the consumer's line until the queue looks full.
+	volatile unsigned long tail __attribute__((aligned(QUEUE_CACHELINE)));
+	unsigned long head_cache;
+
+	// written by the consumers.
+	volatile unsigned long head __attribute__((aligned(QUEUE_CACHELINE)));
+	unsigned long tail_cache;
+
+	// set when the queue is created, and not changed after that.
+	queue_cell_t *cells __attribute__((aligned(QUEUE_CACHELINE)));
+	unsigned long mask;
+	int mode;
 } queue_t;
 
 
-queue_t * queue_new(void);
+queue_t * queue_new(int mode, int size);
 void queue_free(queue_t *q);
 
-void queue_push(queue_t *q, void *ptr);
+int queue_push(queue_t *q, void *ptr);
 void * queue_pop(queue_t *q);
+int queue_push_batch(queue_t *q, void **ptrs, int count);
+int queue_pop_batch(queue_t *q, void **ptrs, int max);
 
 int queue_count(queue_t *q);
+int queue_size(queue_t *q);
 
 
 
-#endif
\ No newline at end of file
+#endif
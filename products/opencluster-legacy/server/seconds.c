@@ -3,7 +3,9 @@
 
 #include "seconds.h"
 
+#include "constants.h"
 #include "event-compat.h"
+#include "expiry.h"
 #include "timeout.h"
 
 #include <assert.h>
@@ -19,8 +21,9 @@ static struct timeval _current_time = {0,0};
 static struct timeval _start_time = {0,0};
 
 
-// number of seconds since the service was started.
-static unsigned int _seconds = 0;
+// number of seconds since the service was started.  Only the main loop updates it, but the workers 
+// read it as well.
+static volatile unsigned int _seconds = 0;
 
 
 // several times a second, this handler will fire and get the current time.  Normally we only care 
@@ -43,6 +46,9 @@ static void seconds_handler(int fd, short int flags, void *arg)
 		assert(0);
 	}
 
+	// remove some of the items that have expired.  If there are more than we can handle in one go, 
+	// the rest will be done next time.
+	expiry_process(_seconds, EXPIRY_LIMIT);
 	
 	evtimer_add(_seconds_event, &_timeout_seconds);
 }
@@ -58,6 +64,8 @@ void seconds_init(struct event_base *evbase)
 	gettimeofday(&_current_time, NULL);
 	_seconds = _current_time.tv_sec - _start_time.tv_sec;
 	
+	expiry_init(_seconds);
+	
 	// we need to set a timer to fire in 5 seconds to setup the cluster if no connections were made.
 	_seconds_event = evtimer_new(_evbase, seconds_handler, NULL);
 	assert(_seconds_event);
@@ -7,14 +7,18 @@
 #include "client.h"
 #include "conninfo.h"
 #include "logging.h"
+#include "shard.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
-// number of connections that we are currently listening for activity from.
+// number of connections that we are currently listening for activity from.  The connections are 
+// accepted and closed by whichever shard they belong to, so this is only changed atomically.
 static int _conncount = 0;
 
 // maximum number of connections we allow to be open.  Used to stop a node from taking too many resources.   Includes server-node connections.
@@ -24,11 +28,44 @@ static conninfo_t *_conninfo = NULL;
 
 static struct event_base *_evbase = NULL;
 
-static struct evconnlistener *_listener = NULL;
+// when there are workers, each one has its own listening socket on the same address 
+// (SO_REUSEPORT), and the kernel spreads the incoming connections between them.  Each listener is 
+// only touched by the shard it belongs to.  If the sockets can't be shared, there is only one 
+// listener, on the main loop, and it hands the connections out to the workers (see 
+// accept_conn_cb).
+static evutil_socket_t _sockets[SHARD_MAX + 1];
+static struct evconnlistener *_listeners[SHARD_MAX + 1];
+static int _reuseport = 0;
 
 
+// a connection that has been accepted, and given to a worker to look after.
+typedef struct {
+	evutil_socket_t fd;
+	struct sockaddr_storage address;
+	int socklen;
+} accepted_t;
 
-// Accept a connection.  Create the client object, and then attach the socket handle to it.
+
+
+// run by the worker that the connection was given to.  The client object belongs to it.
+static void accept_on_shard(void *arg)
+{
+	accepted_t *accepted = arg;
+	client_t *client;
+	
+	assert(accepted);
+	assert(accepted->fd > 0);
+	
+	client = client_new();
+	client_accept(client, accepted->fd, (struct sockaddr *) &accepted->address, accepted->socklen);
+	
+	free(accepted);
+}
+
+
+
+// Accept a connection.  Create the client object, and then attach the socket handle to it.  This 
+// is run by the shard that the listener belongs to.
 static void accept_conn_cb(
 	struct evconnlistener *listener,
 	evutil_socket_t fd,
@@ -37,18 +74,39 @@ static void accept_conn_cb(
 	void *ctx)
 {
 	client_t *client;
+	accepted_t *accepted;
+	shard_t *shard;
 
 	assert(listener);
 	assert(fd > 0);
 	assert(address && socklen > 0);
 	assert(ctx == NULL);
 
-	// create client object.
-	// TODO: We should be pulling these client objects out of a mempool.
-	client = client_new();
-	client_accept(client, fd, address, socklen);
+	if (__sync_add_and_fetch(&_conncount, 1) > _maxconns) {
+		__sync_fetch_and_sub(&_conncount, 1);
+		logger(LOG_WARN, "Connection rejected, already have the maximum of %d connections.", _maxconns);
+		close(fd);
+		return;
+	}
 
-	_conncount ++;
+	// if the main loop is doing the accepting for the workers, the connections are spread 
+	// between them.  Otherwise the connection belongs to the shard that accepted it.
+	shard = (shard_id() == 0) ? shard_next() : shard_current();
+	if (shard == shard_current()) {
+		// create client object.
+		// TODO: We should be pulling these client objects out of a mempool.
+		client = client_new();
+		client_accept(client, fd, address, socklen);
+	}
+	else {
+		assert(socklen <= sizeof(struct sockaddr_storage));
+		accepted = malloc(sizeof(accepted_t));
+		assert(accepted);
+		accepted->fd = fd;
+		memcpy(&accepted->address, address, socklen);
+		accepted->socklen = socklen;
+		shard_call(shard, accept_on_shard, accepted);
+	}
 }
 
 
@@ -56,24 +114,98 @@ static void accept_conn_cb(
 void server_conn_inc(void)
 {
 	assert(_conncount >= 0);
-	_conncount ++;
-	assert(_conncount > 0);
+	__sync_fetch_and_add(&_conncount, 1);
 }
 
 // the server is being told that a client connection was closed, so that it can update its counters.
 void server_conn_closed(void)
 {
 	assert(_conncount > 0);
-	_conncount --;
-	assert(_conncount >= 0);
+	__sync_fetch_and_sub(&_conncount, 1);
 }
 
 
-// Listen for socket connections on a particular interface.
+
+// create a non-blocking socket that is bound and listening on the address.  If 'reuseport' is set, 
+// other sockets can be bound to the same address (one for each worker).  Returns -1 if it couldn't 
+// be done.
+static evutil_socket_t listen_socket(struct sockaddr *sin, int len, int reuseport)
+{
+	evutil_socket_t sfd;
+	int sockflags = 1;
+
+	assert(sin && len > 0);
+
+	sfd = socket(sin->sa_family, SOCK_STREAM, 0);
+	if (sfd < 0) {
+		return(-1);
+	}
+
+	fcntl(sfd, F_SETFL, fcntl(sfd, F_GETFL) | O_NONBLOCK);
+	setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&sockflags, sizeof(sockflags));
+	setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&sockflags, sizeof(sockflags));
+
+	if (reuseport) {
+#ifdef SO_REUSEPORT
+		if (setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (void *)&sockflags, sizeof(sockflags)) != 0) {
+			close(sfd);
+			return(-1);
+		}
+#else
+		close(sfd);
+		return(-1);
+#endif
+	}
+
+	// when a lot of clients reconnect at once (for example, after the client fleet is restarted) 
+	// the backlog needs to be able to hold them until they are accepted.
+	if (bind(sfd, sin, len) != 0 || listen(sfd, SOMAXCONN) != 0) {
+		close(sfd);
+		return(-1);
+	}
+
+	return(sfd);
+}
+
+
+
+// run by the shard that the listening socket was created for.
+static void listen_on_shard(void *arg)
+{
+	int id = shard_id();
+
+	assert(arg == NULL);
+	assert(_sockets[id] >= 0);
+	assert(_listeners[id] == NULL);
+
+	_listeners[id] = evconnlistener_new(shard_current()->evbase, accept_conn_cb, NULL, LEV_OPT_CLOSE_ON_FREE, 0, _sockets[id]);
+	assert(_listeners[id]);
+}
+
+
+static void unlisten_on_shard(void *arg)
+{
+	int id = shard_id();
+
+	assert(arg == NULL);
+
+	if (_listeners[id]) {
+		evconnlistener_free(_listeners[id]);
+		_listeners[id] = NULL;
+		_sockets[id] = -1;
+	}
+}
+
+
+
+// Listen for socket connections on a particular interface.  If there are workers, they each get 
+// their own listening socket (they will start accepting on it when they start running).
 void server_listen(struct event_base *evbase, conninfo_t *conninfo)
 {
 	struct sockaddr_in sin;
 	int len;
+	int workers;
+	int i;
 	
 	assert(evbase);
 	assert(_evbase == NULL);
@@ -81,7 +213,6 @@ void server_listen(struct event_base *evbase, conninfo_t *conninfo)
 	
 	assert(_maxconns > 0);
 	assert(_conncount == 0);
-	assert(_listener == NULL);
 
 	memset(&sin, 0, sizeof(sin));
 	// 	sin.sin_family = AF_INET;
@@ -98,21 +229,45 @@ void server_listen(struct event_base *evbase, conninfo_t *conninfo)
 	}
 	else {
 		
-		assert(_listener == NULL);
-		assert(_evbase);
-		
 		logger(LOG_INFO, "listen: %s", remote_addr);
 
-		_listener = evconnlistener_new_bind(
-								_evbase,
-								accept_conn_cb,
-								NULL,
-								LEV_OPT_CLOSE_ON_FREE|LEV_OPT_REUSEABLE,
-								-1,
-								(struct sockaddr*)&sin,
-								sizeof(sin)
-							);
-		assert(_listener);
+		for (i=0; i<=SHARD_MAX; i++) {
+			_sockets[i] = -1;
+			_listeners[i] = NULL;
+		}
+		
+		workers = shards_workers();
+		assert(_reuseport == 0);
+		if (workers > 0) {
+			_reuseport = 1;
+			for (i=1; i<=workers && _reuseport; i++) {
+				_sockets[i] = listen_socket((struct sockaddr*)&sin, len, 1);
+				if (_sockets[i] < 0) {
+					_reuseport = 0;
+				}
+			}
+
+			if (_reuseport) {
+				for (i=1; i<=workers; i++) {
+					shard_call(shard_get(i), listen_on_shard, NULL);
+				}
+			}
+			else {
+				logger(LOG_WARN, "Unable to give each worker its own listener (%s).  Connections will be accepted by the main loop instead.", strerror(errno));
+				for (i=1; i<=workers; i++) {
+					if (_sockets[i] >= 0) {
+						close(_sockets[i]);
+						_sockets[i] = -1;
+					}
+				}
+			}
+		}
+
+		if (_reuseport == 0) {
+			_sockets[0] = listen_socket((struct sockaddr*)&sin, len, 0);
+			assert(_sockets[0] >= 0);
+			listen_on_shard(NULL);
+		}
 	}
 }
 
@@ -121,17 +276,18 @@ void server_listen(struct event_base *evbase, conninfo_t *conninfo)
 
 void server_shutdown(void)
 {
+	int i;
+
 	assert(_conninfo);
 	const char *remote_addr = conninfo_remoteaddr(_conninfo);
 		
 	logger(LOG_INFO, "Shutting down server interface: %s", remote_addr);
 
-	// need to close the listener socket.
-	if (_listener) {
-		evconnlistener_free(_listener);
-		_listener = NULL;
-		logger(LOG_INFO, "Stopping listening on: %s", remote_addr);
+	// need to close the listener sockets.  The workers close their own.
+	for (i=0; i<=shards_workers(); i++) {
+		shard_call(shard_get(i), unlisten_on_shard, NULL);
 	}
+	logger(LOG_INFO, "Stopping listening on: %s", remote_addr);
 }
 
 
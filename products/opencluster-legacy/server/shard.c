@@ -0,0 +1,843 @@
+// shard.c
+
+#include "shard.h"
+
+#include "chunk.h"
+#include "client.h"
+#include "constants.h"
+#include "expiry.h"
+#include "logging.h"
+#include "pool.h"
+#include "queue.h"
+#include "seconds.h"
+#include "slab.h"
+#include "stats.h"
+#include "timeout.h"
+#include "uring.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+
+// the number of calls that can be waiting in the ring from one shard to another.
+#define SHARD_INBOX_SIZE  256
+
+// the most calls from one shard that are run before looking at the others (and giving the
+// connections a turn).
+#define SHARD_BATCH  64
+
+
+// a call that has been handed to a shard.  If 'done' is set, the caller is waiting for it to
+// finish (see shard_run).
+typedef struct __shard_call_t {
+	void (*fn)(void *arg);
+	void *arg;
+	int *done;
+	struct __shard_call_t *next;
+} shard_call_t;
+
+
+// the calls that one shard has handed to another.  Only the caller pushes into the ring, and only
+// the shard that owns the inbox pops from it, so it doesn't need a lock.  If the ring is full, the
+// call is put in the overflow list instead (which does need the lock), and the calls after it go
+// there too until the shard has caught up, so that they are still run in the order they were made.
+struct __shard_inbox_t {
+	queue_t *ring;
+	pthread_mutex_t lock;
+	int overflowed;
+	shard_call_t *overflow_head;
+	shard_call_t *overflow_tail;
+};
+
+
+// shard 0 is the main loop.  The workers (if there are any) are 1 to _workers.
+static shard_t _shards[SHARD_MAX + 1];
+static int _workers = 0;
+
+// the shard that the current thread is running.
+static SHARD_LOCAL shard_t *_current = NULL;
+
+// run by each worker when it starts, to set up the modules that it has its own copy of.
+static void (*_setup)(int shards) = NULL;
+
+// the worker that the next connection will be given to.
+static int _next = 0;
+
+// shard_run() waits on this for the call to be done.
+static pthread_mutex_t _run_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _run_cond = PTHREAD_COND_INITIALIZER;
+
+// while the workers are paused, they are all waiting on this (see shards_pause).
+static pthread_mutex_t _pause_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _pause_cond = PTHREAD_COND_INITIALIZER;
+static int _paused = 0;
+static int _parked = 0;
+static int _pause_depth = 0;
+static long long _pauses = 0;
+
+
+// something that the main loop has taken out of the workers' reach, but which they could still be
+// looking at.  It is handed to 'fn' to be freed once they have all moved on (see shard_defer).
+typedef struct __shard_deferred_t {
+	void (*fn)(void *arg);
+	void *arg;
+	long long epoch;
+	struct __shard_deferred_t *next;
+} shard_deferred_t;
+
+// the epoch is moved on each time something is deferred.  Only the main loop changes it, and it is
+// the only one that looks at the list.
+static long long _epoch = 1;
+static shard_deferred_t *_deferred_head = NULL;
+static shard_deferred_t *_deferred_tail = NULL;
+static struct event *_reclaim_event = NULL;
+static long long _deferred = 0;
+static long long _reclaimed = 0;
+
+
+
+// the current shard isn't in the middle of anything, so it isn't holding on to anything that was
+// deferred before now.  The workers do this between callbacks.
+static void shard_quiescent(shard_t *shard)
+{
+	assert(shard);
+	assert(shard == _current);
+
+	__atomic_store_n(&shard->quiescent, __atomic_load_n(&_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+
+
+// wake the shard up to look at its inbox, unless it has already been woken and hasn't got to it
+// yet.
+static void shard_wakeup(shard_t *shard)
+{
+	uint64_t one = 1;
+
+	assert(shard);
+
+	if (__atomic_exchange_n(&shard->signalled, 1, __ATOMIC_SEQ_CST) == 0) {
+		if (write(shard->wakeup[1], &one, sizeof(one)) < 0) {
+			assert(errno == EAGAIN);
+		}
+	}
+}
+
+
+
+static void inbox_push(shard_t *shard, shard_call_t *call)
+{
+	struct __shard_inbox_t *inbox;
+
+	assert(shard);
+	assert(call);
+	assert(_current && _current != shard);
+
+	inbox = &shard->inbox[_current->id];
+	assert(inbox->ring);
+
+	__sync_fetch_and_add(&shard->handoffs, 1);
+
+	if (__atomic_load_n(&inbox->overflowed, __ATOMIC_ACQUIRE) || queue_push(inbox->ring, call) == 0) {
+		pthread_mutex_lock(&inbox->lock);
+		call->next = NULL;
+		if (inbox->overflow_tail) {
+			inbox->overflow_tail->next = call;
+		}
+		else {
+			inbox->overflow_head = call;
+		}
+		inbox->overflow_tail = call;
+		__atomic_store_n(&inbox->overflowed, 1, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&inbox->lock);
+
+		__sync_fetch_and_add(&shard->overflows, 1);
+	}
+
+	shard_wakeup(shard);
+}
+
+
+
+static void call_run(shard_call_t *call)
+{
+	assert(call);
+	assert(call->fn);
+
+	(*call->fn)(call->arg);
+
+	if (call->done) {
+		pthread_mutex_lock(&_run_lock);
+		*call->done = 1;
+		pthread_cond_broadcast(&_run_cond);
+		pthread_mutex_unlock(&_run_lock);
+	}
+
+	free(call);
+}
+
+
+
+// run the calls that one shard has handed to this one (up to a batch of them).  Returns non-zero if
+// there are more waiting.
+static int inbox_run(struct __shard_inbox_t *inbox)
+{
+	void *calls[SHARD_BATCH];
+	shard_call_t *call;
+	shard_call_t *next;
+	int count;
+	int i;
+
+	assert(inbox);
+	assert(inbox->ring);
+
+	count = queue_pop_batch(inbox->ring, calls, SHARD_BATCH);
+	for (i=0; i<count; i++) {
+		call_run(calls[i]);
+	}
+
+	if (count == SHARD_BATCH) {
+		return(1);
+	}
+
+	// the overflow can only be run once everything that went in the ring before it has been.
+	call = NULL;
+	if (__atomic_load_n(&inbox->overflowed, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&inbox->lock);
+		if (queue_count(inbox->ring) == 0) {
+			call = inbox->overflow_head;
+			inbox->overflow_head = NULL;
+			inbox->overflow_tail = NULL;
+			__atomic_store_n(&inbox->overflowed, 0, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&inbox->lock);
+	}
+
+	while (call) {
+		next = call->next;
+		call_run(call);
+		call = next;
+	}
+
+	return(queue_count(inbox->ring) > 0 || __atomic_load_n(&inbox->overflowed, __ATOMIC_ACQUIRE));
+}
+
+
+
+// the inbox has had something put in it.  Run the calls that are there now.  If there are still
+// more after a batch from each of the callers, the wakeup is fired again so that the connections
+// get a turn before we come back for the rest.
+static void wakeup_handler(evutil_socket_t fd, short what, void *arg)
+{
+	shard_t *shard = arg;
+	char buffer[64];
+	int more;
+	int i;
+
+	assert(shard);
+	assert(shard == _current);
+	assert(fd == shard->wakeup[0]);
+
+	while (read(fd, buffer, sizeof(buffer)) > 0) {
+		// nothing to do with the count, it is only there to wake us up.
+	}
+
+	// anything pushed after this will fire the wakeup again.
+	__atomic_store_n(&shard->signalled, 0, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	more = 0;
+	for (i=0; i<=_workers; i++) {
+		if (shard->inbox[i].ring) {
+			more |= inbox_run(&shard->inbox[i]);
+		}
+	}
+
+	if (more) {
+		shard_wakeup(shard);
+	}
+
+	shard_quiescent(shard);
+}
+
+
+
+// remove some of the items owned by this shard that have expired (see seconds_handler, which does
+// this for the main loop).
+static void expiry_handler(evutil_socket_t fd, short what, void *arg)
+{
+	shard_t *shard = arg;
+
+	assert(fd == -1);
+	assert(shard);
+	assert(shard == _current);
+
+	expiry_process(seconds_get(), EXPIRY_LIMIT);
+	evtimer_add(shard->expiry_event, &_timeout_seconds);
+
+	// even when there is nothing else for it to do, this makes sure that the shard doesn't hold up
+	// the things that are waiting to be reclaimed for long.
+	shard_quiescent(shard);
+}
+
+
+
+// run the deferred calls that every worker has moved on from since they were deferred.
+static void reclaim_handler(evutil_socket_t fd, short what, void *arg)
+{
+	shard_deferred_t *deferred;
+	long long oldest;
+	long long quiescent;
+	int i;
+
+	assert(fd == -1);
+	assert(arg == NULL);
+	assert(_current == &_shards[0]);
+
+	oldest = _epoch;
+	for (i=1; i<=_workers; i++) {
+		quiescent = __atomic_load_n(&_shards[i].quiescent, __ATOMIC_SEQ_CST);
+		if (quiescent < oldest) {
+			oldest = quiescent;
+		}
+	}
+
+	while (_deferred_head && _deferred_head->epoch <= oldest) {
+		deferred = _deferred_head;
+		_deferred_head = deferred->next;
+		if (_deferred_head == NULL) {
+			_deferred_tail = NULL;
+		}
+
+		(*deferred->fn)(deferred->arg);
+		free(deferred);
+		_reclaimed ++;
+	}
+
+	if (_deferred_head) {
+		evtimer_add(_reclaim_event, &_timeout_seconds);
+	}
+}
+
+
+
+static void shard_new(shard_t *shard, int id, struct event_base *evbase)
+{
+	int i;
+
+	assert(shard);
+	assert(id >= 0 && id <= SHARD_MAX);
+	assert(evbase);
+
+	memset(shard, 0, sizeof(shard_t));
+	shard->id = id;
+	shard->evbase = evbase;
+
+	// a ring from each of the other shards.
+	shard->inbox = calloc(_workers + 1, sizeof(struct __shard_inbox_t));
+	assert(shard->inbox);
+	for (i=0; i<=_workers; i++) {
+		if (i != id) {
+			shard->inbox[i].ring = queue_new(QUEUE_SPSC, SHARD_INBOX_SIZE);
+			pthread_mutex_init(&shard->inbox[i].lock, NULL);
+		}
+	}
+
+#ifdef __linux__
+	shard->wakeup[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	shard->wakeup[1] = shard->wakeup[0];
+	if (shard->wakeup[0] < 0) {
+		logger(LOG_CRIT, "Unable to create the wakeup eventfd for shard %d: %s", id, strerror(errno));
+		exit(1);
+	}
+#else
+	if (pipe(shard->wakeup) != 0) {
+		logger(LOG_CRIT, "Unable to create the wakeup pipe for shard %d: %s", id, strerror(errno));
+		exit(1);
+	}
+	for (i=0; i<2; i++) {
+		fcntl(shard->wakeup[i], F_SETFL, fcntl(shard->wakeup[i], F_GETFL) | O_NONBLOCK);
+	}
+#endif
+
+	shard->wakeup_event = event_new(evbase, shard->wakeup[0], EV_READ | EV_PERSIST, wakeup_handler, shard);
+	assert(shard->wakeup_event);
+	event_add(shard->wakeup_event, NULL);
+}
+
+
+
+static void * shard_thread(void *arg)
+{
+	shard_t *shard = arg;
+
+	assert(shard);
+	assert(shard->id > 0);
+	assert(_current == NULL);
+	_current = shard;
+
+	// this shard has its own copy of the slab memory, the string pool, and the payloads.
+	assert(_setup);
+	(*_setup)(_workers);
+
+	// and its own expiry wheel, and client list.
+	expiry_init(seconds_get());
+	shard->expiry_event = evtimer_new(shard->evbase, expiry_handler, shard);
+	assert(shard->expiry_event);
+	evtimer_add(shard->expiry_event, &_timeout_seconds);
+
+	clients_evbase(shard->evbase);
+
+	logger(LOG_INFO, "Shard %d started.", shard->id);
+	event_base_dispatch(shard->evbase);
+	logger(LOG_INFO, "Shard %d stopped.", shard->id);
+
+	return(NULL);
+}
+
+
+
+// set up the main loop as shard 0, and create the workers (but dont start them yet, that is done
+// by shards_start once everything else is ready).  'setup' is called by each worker when it
+// starts.
+void shards_init(struct event_base *evbase, int workers, void (*setup)(int shards))
+{
+	int i;
+
+	assert(evbase);
+	assert(workers >= 0);
+	assert(setup);
+	assert(_workers == 0);
+	assert(_current == NULL);
+
+	if (workers > SHARD_MAX) {
+		logger(LOG_WARN, "Only %d threads can be used (%d requested).", SHARD_MAX, workers);
+		workers = SHARD_MAX;
+	}
+
+	_setup = setup;
+	_workers = workers;
+
+	shard_new(&_shards[0], 0, evbase);
+	_current = &_shards[0];
+
+	for (i=1; i<=_workers; i++) {
+		shard_new(&_shards[i], i, event_base_new());
+	}
+}
+
+
+
+void shards_start(void)
+{
+	int i;
+
+	assert(_current == &_shards[0]);
+
+	for (i=1; i<=_workers; i++) {
+		if (pthread_create(&_shards[i].thread, NULL, shard_thread, &_shards[i]) != 0) {
+			logger(LOG_CRIT, "Unable to start the thread for shard %d.", i);
+			exit(1);
+		}
+	}
+
+	if (_workers > 0) {
+		_reclaim_event = evtimer_new(_shards[0].evbase, reclaim_handler, NULL);
+		assert(_reclaim_event);
+		logger(LOG_INFO, "Started %d worker threads.", _workers);
+	}
+}
+
+
+
+// anything still in the inbox arrived after the shard was stopped, and is dropped.
+static void shard_free(shard_t *shard)
+{
+	shard_call_t *call;
+	int i;
+
+	assert(shard);
+
+	event_free(shard->wakeup_event);
+	close(shard->wakeup[0]);
+	if (shard->wakeup[1] != shard->wakeup[0]) {
+		close(shard->wakeup[1]);
+	}
+
+	for (i=0; i<=_workers; i++) {
+		if (shard->inbox[i].ring) {
+			while ((call = queue_pop(shard->inbox[i].ring))) {
+				free(call);
+			}
+			while ((call = shard->inbox[i].overflow_head)) {
+				shard->inbox[i].overflow_head = call->next;
+				free(call);
+			}
+			queue_free(shard->inbox[i].ring);
+			pthread_mutex_destroy(&shard->inbox[i].lock);
+		}
+	}
+	free(shard->inbox);
+	shard->inbox = NULL;
+}
+
+
+
+static void shard_stop(void *arg)
+{
+	assert(arg == NULL);
+	assert(_current);
+
+	if (_current->expiry_event) {
+		event_free(_current->expiry_event);
+		_current->expiry_event = NULL;
+	}
+	event_base_loopexit(_current->evbase, NULL);
+}
+
+
+
+// stop the workers, and wait for them to finish.  The connections they had should have already
+// been closed.
+void shards_shutdown(void)
+{
+	int i;
+
+	assert(_current == &_shards[0]);
+	assert(_pause_depth == 0);
+
+	// the deferred calls might need the workers, so they are done first.
+	if (_reclaim_event) {
+		shards_synchronize();
+		reclaim_handler(-1, 0, NULL);
+		assert(_deferred_head == NULL);
+		event_free(_reclaim_event);
+		_reclaim_event = NULL;
+	}
+
+	for (i=1; i<=_workers; i++) {
+		shard_call(&_shards[i], shard_stop, NULL);
+	}
+
+	for (i=1; i<=_workers; i++) {
+		pthread_join(_shards[i].thread, NULL);
+	}
+
+	// the inboxes can't be freed until none of the workers can be calling each other.
+	for (i=1; i<=_workers; i++) {
+		shard_free(&_shards[i]);
+		event_base_free(_shards[i].evbase);
+	}
+	_workers = 0;
+}
+
+
+
+// the number of worker threads.  0 when everything is done on the main loop.
+int shards_workers(void)
+{
+	assert(_workers >= 0);
+	return(_workers);
+}
+
+
+int shard_id(void)
+{
+	return(_current ? _current->id : 0);
+}
+
+
+shard_t * shard_current(void)
+{
+	assert(_current);
+	return(_current);
+}
+
+
+shard_t * shard_get(int id)
+{
+	assert(id >= 0 && id <= _workers);
+	return(&_shards[id]);
+}
+
+
+
+// the worker that a new connection should be given to, when the main loop is accepting them for
+// the workers.  They are spread evenly between them.
+shard_t * shard_next(void)
+{
+	assert(_current == &_shards[0]);
+
+	if (_workers == 0) {
+		return(&_shards[0]);
+	}
+
+	_next = (_next % _workers) + 1;
+	return(&_shards[_next]);
+}
+
+
+
+// the shard that should own a new bucket.  When a bucket is split, the new buckets stay with the
+// shard that owned the old one (they share its data until it has been drained), so this is only
+// used for buckets that are created from nothing.  Neighbouring buckets go to different shards, so
+// that the load is spread out even when there are only a few buckets.
+int shard_owner(hash_t hashmask)
+{
+	assert(hashmask >= 0);
+
+	if (_workers == 0) {
+		return(0);
+	}
+	else {
+		return(1 + (hashmask % _workers));
+	}
+}
+
+
+
+// hand a call to the shard, to be run on its thread.  If the shard is the current one, it is just
+// run straight away.  The call is run after anything that was handed to the shard before it.
+void shard_call(shard_t *shard, void (*fn)(void *arg), void *arg)
+{
+	shard_call_t *call;
+
+	assert(shard);
+	assert(fn);
+
+	if (shard == _current) {
+		(*fn)(arg);
+	}
+	else {
+		call = malloc(sizeof(shard_call_t));
+		assert(call);
+		call->fn = fn;
+		call->arg = arg;
+		call->done = NULL;
+		call->next = NULL;
+
+		inbox_push(shard, call);
+	}
+}
+
+
+
+// run the call on the shard, and wait for it to finish.  This is only done by the main loop, and
+// only for things that need to be done by the shard that owns the data (such as sending a bucket
+// to another node).  The worker never waits for the main loop, so this cant deadlock.
+void shard_run(shard_t *shard, void (*fn)(void *arg), void *arg)
+{
+	shard_call_t *call;
+	int done = 0;
+
+	assert(shard);
+	assert(fn);
+	assert(_current == &_shards[0]);
+	assert(_pause_depth == 0);
+
+	if (shard == _current) {
+		(*fn)(arg);
+	}
+	else {
+		call = malloc(sizeof(shard_call_t));
+		assert(call);
+		call->fn = fn;
+		call->arg = arg;
+		call->done = &done;
+		call->next = NULL;
+
+		inbox_push(shard, call);
+
+		pthread_mutex_lock(&_run_lock);
+		while (done == 0) {
+			pthread_cond_wait(&_run_cond, &_run_lock);
+		}
+		pthread_mutex_unlock(&_run_lock);
+	}
+}
+
+
+
+static void shard_noop(void *arg)
+{
+	assert(arg == NULL);
+}
+
+
+// wait until every worker has got to the end of whatever it was doing.  After this, nothing that
+// was deferred before it was called is still being looked at.
+void shards_synchronize(void)
+{
+	int i;
+
+	assert(_current == &_shards[0]);
+
+	for (i=1; i<=_workers; i++) {
+		shard_run(&_shards[i], shard_noop, NULL);
+		__atomic_store_n(&_shards[i].quiescent, _epoch, __ATOMIC_SEQ_CST);
+	}
+}
+
+
+
+// The main loop has taken something out of the workers' reach (for example, an old bucket table
+// that has been replaced, see buckets_split_mask), but they might still be in the middle of looking
+// at it.  Instead of stopping them, 'fn' is called to free it once every worker has been between
+// callbacks at least once since (which is when they report in, see shard_quiescent).  Nothing
+// that a worker looks up is kept past the end of a callback, so by then none of them can still
+// have it.  If there aren't any workers, it is done straight away.
+void shard_defer(void (*fn)(void *arg), void *arg)
+{
+	shard_deferred_t *deferred;
+
+	assert(fn);
+	assert(_current == &_shards[0]);
+
+	if (_workers == 0) {
+		(*fn)(arg);
+		return;
+	}
+
+	deferred = malloc(sizeof(shard_deferred_t));
+	assert(deferred);
+	deferred->fn = fn;
+	deferred->arg = arg;
+	deferred->next = NULL;
+	deferred->epoch = __atomic_add_fetch(&_epoch, 1, __ATOMIC_SEQ_CST);
+
+	if (_deferred_tail) {
+		_deferred_tail->next = deferred;
+	}
+	else {
+		_deferred_head = deferred;
+	}
+	_deferred_tail = deferred;
+	_deferred ++;
+
+	assert(_reclaim_event);
+	if (evtimer_pending(_reclaim_event, NULL) == 0) {
+		evtimer_add(_reclaim_event, &_timeout_seconds);
+	}
+}
+
+
+
+// run by each worker when it is told to pause.  It waits here until the main loop has finished
+// what it needed to do.
+static void shard_park(void *arg)
+{
+	assert(arg == NULL);
+	assert(_current && _current->id > 0);
+
+	pthread_mutex_lock(&_pause_lock);
+	_parked ++;
+	pthread_cond_broadcast(&_pause_cond);
+	while (_paused) {
+		pthread_cond_wait(&_pause_cond, &_pause_lock);
+	}
+	_parked --;
+	pthread_mutex_unlock(&_pause_lock);
+}
+
+
+
+// stop all the workers, so that the main loop can change the bucket table (and the buckets in it)
+// without any of them looking at it.  The workers finish whatever they are doing first.  Nothing
+// that allocates memory for the data should be done while they are paused, because that memory
+// belongs to the shards.  Pauses can be nested, the workers are only let go by the last resume.
+void shards_pause(void)
+{
+	int i;
+
+	assert(_current == &_shards[0]);
+	assert(_pause_depth >= 0);
+
+	_pause_depth ++;
+	if (_workers > 0 && _pause_depth == 1) {
+
+		pthread_mutex_lock(&_pause_lock);
+		assert(_paused == 0);
+		_paused = 1;
+		pthread_mutex_unlock(&_pause_lock);
+
+		for (i=1; i<=_workers; i++) {
+			shard_call(&_shards[i], shard_park, NULL);
+		}
+
+		pthread_mutex_lock(&_pause_lock);
+		while (_parked < _workers) {
+			pthread_cond_wait(&_pause_cond, &_pause_lock);
+		}
+		pthread_mutex_unlock(&_pause_lock);
+
+		_pauses ++;
+	}
+}
+
+
+void shards_resume(void)
+{
+	assert(_current == &_shards[0]);
+	assert(_pause_depth > 0);
+
+	_pause_depth --;
+	if (_workers > 0 && _pause_depth == 0) {
+		pthread_mutex_lock(&_pause_lock);
+		assert(_paused == 1);
+		_paused = 0;
+		pthread_cond_broadcast(&_pause_cond);
+		pthread_mutex_unlock(&_pause_lock);
+	}
+}
+
+
+
+// dump the parts that each worker has its own copy of.  This is run by the worker while the main
+// loop is waiting for it, so the dump string isn't being used by anything else.
+static void shard_dump(void *arg)
+{
+	assert(arg == NULL);
+	assert(_current && _current->id > 0);
+
+	stat_dumpstr("SHARD %d", _current->id);
+	stat_dumpstr(NULL);
+
+	clients_dump();
+	slab_dump();
+	expiry_dump();
+	pool_dump();
+	chunk_dump();
+	uring_dump();
+}
+
+
+void shards_dump(void)
+{
+	int i;
+
+	assert(_current == &_shards[0]);
+
+	stat_dumpstr("SHARDS");
+	stat_dumpstr("  Workers: %d", _workers);
+	stat_dumpstr("  Pauses: %lld", _pauses);
+	stat_dumpstr("  Epoch: %lld", _epoch);
+	stat_dumpstr("  Deferred: %lld (%lld reclaimed)", _deferred, _reclaimed);
+	for (i=0; i<=_workers; i++) {
+		stat_dumpstr("  [%d] Handoffs=%lld, Overflows=%lld, Clients=%d", i, _shards[i].handoffs, _shards[i].overflows, _shards[i].clients);
+	}
+	stat_dumpstr(NULL);
+
+	for (i=1; i<=_workers; i++) {
+		shard_run(&_shards[i], shard_dump, NULL);
+	}
+}
+
@@ -0,0 +1,81 @@
+// shard.h
+
+#ifndef __SHARD_H
+#define __SHARD_H
+
+// When the 'threads' config option is set, the buckets are split between that many worker threads
+// (shards), each with its own event_base.  A shard owns the data for its buckets, and everything
+// that goes with it (the slab memory, the expiry wheel, the string pool and the payloads), so none
+// of it needs to be locked.  Commands for a key are handed to the shard that owns its bucket, and
+// anything that shard sends to a connection that belongs to another shard is handed back (see
+// client.c).  Each worker accepts its own connections (see server_listen).  The main loop keeps the
+// node connections, and everything to do with the shape of the cluster.  The workers look up the
+// bucket table without locking it, and the main loop only frees the parts that it replaces once
+// they have all moved on (see shard_defer).
+//
+// When the option is not set, there are no workers, and the main loop is shard 0, which owns
+// everything, the same as it always has.
+
+#include "event-compat.h"
+#include "hash.h"
+
+#include <pthread.h>
+
+
+#define SHARD_MAX  64
+
+// module state that each shard has its own copy of.
+#define SHARD_LOCAL  __thread
+
+
+typedef struct {
+	int id;
+	struct event_base *evbase;
+	pthread_t thread;
+
+	// each of the other shards has its own ring in the inbox (indexed by its id) to put calls for
+	// this one in (see shard.c).  They bump the eventfd so that it wakes up to run them, unless it
+	// has already been 'signalled' and hasn't got to them yet.
+	struct __shard_inbox_t *inbox;
+	int wakeup[2];
+	int signalled;
+	struct event *wakeup_event;
+
+	// fires 10 times a second to remove the expired items owned by this shard.
+	struct event *expiry_event;
+
+	// the last epoch that this shard was seen between callbacks (see shard_defer).
+	long long quiescent;
+
+	// number of calls handed to this shard, the number that had to wait because the ring they
+	// came in was full, and number of connections it is serving.
+	long long handoffs;
+	long long overflows;
+	int clients;
+} shard_t;
+
+
+void shards_init(struct event_base *evbase, int workers, void (*setup)(int shards));
+void shards_start(void);
+void shards_shutdown(void);
+
+int shards_workers(void);
+int shard_id(void);
+shard_t * shard_current(void);
+shard_t * shard_get(int id);
+shard_t * shard_next(void);
+int shard_owner(hash_t hashmask);
+
+void shard_call(shard_t *shard, void (*fn)(void *arg), void *arg);
+void shard_run(shard_t *shard, void (*fn)(void *arg), void *arg);
+
+void shard_defer(void (*fn)(void *arg), void *arg);
+void shards_synchronize(void);
+
+void shards_pause(void);
+void shards_resume(void);
+
+void shards_dump(void);
+
+
+#endif
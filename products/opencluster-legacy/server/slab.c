@@ -0,0 +1,545 @@
+// slab.c
+
+#include "slab.h"
+
+#include "logging.h"
+#include "shard.h"
+#include "stats.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// memory is handed out to the classes a page at a time.  Anything bigger than a page is allocated
+// from the heap, but the pages it would take up are reserved so that the limit still holds.
+#define SLAB_PAGE_SIZE     (1024*1024)
+#define SLAB_MIN_CHUNK     16
+#define SLAB_MAX_CLASSES   64
+
+// the most times an allocation will ask for memory to be reclaimed before giving up.
+#define SLAB_RECLAIM_ATTEMPTS  64
+
+
+typedef struct {
+	int size;
+	int chunks;				// how many fit in a page.
+	int pages;
+	
+	// the pages that have room in them.  The chunks come from the first one.
+	int partial;
+
+	long long used;
+	long long requested;
+} slab_class_t;
+
+
+// a page of the arena.  Once all of its chunks have been freed, it is given back so that any class 
+// can use it.  Otherwise a class that had a lot of pages once would keep them, and evicting items 
+// of that size would never make room for anything else.
+typedef struct {
+	int class;				// -1 when it isn't being used by a class.
+	int used;
+	
+	// the chunks are carved off the page as they are needed, and freed ones are linked together 
+	// through their first word.
+	int carved;
+	void *free_list;
+	
+	// the class's list of partial pages, or the list of free pages (which only uses 'next').
+	int next;
+	int prev;
+} slab_page_t;
+
+
+// each shard has its own slab memory (see shard.h).
+static SHARD_LOCAL slab_class_t _classes[SLAB_MAX_CLASSES];
+static SHARD_LOCAL int _class_count = 0;
+
+// when _limit is 0, there is no arena and everything comes from the heap.
+static SHARD_LOCAL long long _limit = 0;
+static SHARD_LOCAL char *_arena = NULL;
+static SHARD_LOCAL int _arena_pages = 0;
+static SHARD_LOCAL int _pages_used = 0;
+static SHARD_LOCAL slab_page_t *_pages = NULL;
+static SHARD_LOCAL int _free_pages = -1;
+static SHARD_LOCAL long long _pages_returned = 0;
+
+static SHARD_LOCAL long long _large_count = 0;
+static SHARD_LOCAL long long _large_bytes = 0;
+static SHARD_LOCAL long long _failed = 0;
+
+// when the memory runs out, this is called to free some up (see slab_reclaim).
+static SHARD_LOCAL int (*_reclaim)(int size) = NULL;
+static SHARD_LOCAL int _reclaiming = 0;
+static SHARD_LOCAL long long _reclaims = 0;
+static SHARD_LOCAL long long _reclaimed = 0;
+
+
+
+
+void slab_init(long long limit)
+{
+	int size;
+	int i;
+
+	assert(limit >= 0);
+	assert(_class_count == 0);
+	assert(_arena == NULL);
+
+	// each class is about 25% bigger than the one before it, rounded up to 8 bytes.  The last class
+	// is a full page.
+	size = SLAB_MIN_CHUNK;
+	while (size < SLAB_PAGE_SIZE/2) {
+		assert(_class_count < SLAB_MAX_CLASSES);
+		memset(&_classes[_class_count], 0, sizeof(slab_class_t));
+		_classes[_class_count].size = size;
+		_classes[_class_count].chunks = SLAB_PAGE_SIZE / size;
+		_classes[_class_count].partial = -1;
+		_class_count ++;
+
+		size = ((size + (size >> 2)) + 7) & ~7;
+	}
+	assert(_class_count < SLAB_MAX_CLASSES);
+	memset(&_classes[_class_count], 0, sizeof(slab_class_t));
+	_classes[_class_count].size = SLAB_PAGE_SIZE;
+	_classes[_class_count].chunks = 1;
+	_classes[_class_count].partial = -1;
+	_class_count ++;
+
+	if (limit > 0) {
+		_arena_pages = limit / SLAB_PAGE_SIZE;
+		if (_arena_pages < 1) { _arena_pages = 1; }
+		_limit = (long long) _arena_pages * SLAB_PAGE_SIZE;
+
+		_arena = malloc(_limit);
+		if (_arena == NULL) {
+			logger(LOG_CRIT, "Unable to allocate %lld bytes for data storage.", _limit);
+			exit(1);
+		}
+		
+		// all the pages start off free.
+		_pages = malloc(sizeof(slab_page_t) * _arena_pages);
+		assert(_pages);
+		for (i=0; i<_arena_pages; i++) {
+			memset(&_pages[i], 0, sizeof(slab_page_t));
+			_pages[i].class = -1;
+			_pages[i].next = i + 1 < _arena_pages ? i + 1 : -1;
+			_pages[i].prev = -1;
+		}
+		_free_pages = 0;
+
+		logger(LOG_INFO, "Allocated %d pages (%lld bytes) for data storage.", _arena_pages, _limit);
+	}
+}
+
+
+
+// find the smallest class that the size will fit in.  Returns -1 if it is bigger than a page.
+static int slab_class(int size)
+{
+	int low = 0;
+	int high = _class_count - 1;
+	int mid;
+
+	assert(size > 0);
+	assert(_class_count > 0);
+
+	if (size > _classes[high].size) {
+		return(-1);
+	}
+
+	while (low < high) {
+		mid = (low + high) >> 1;
+		if (_classes[mid].size < size) { low = mid + 1; }
+		else { high = mid; }
+	}
+
+	assert(_classes[low].size >= size);
+	assert(low == 0 || _classes[low-1].size < size);
+	return(low);
+}
+
+
+
+// add the page to the front of the class's partial pages.
+static void slab_partial_add(slab_class_t *class, int index)
+{
+	assert(class);
+	assert(index >= 0 && index < _arena_pages);
+	
+	_pages[index].prev = -1;
+	_pages[index].next = class->partial;
+	if (class->partial >= 0) {
+		_pages[class->partial].prev = index;
+	}
+	class->partial = index;
+}
+
+
+static void slab_partial_remove(slab_class_t *class, int index)
+{
+	slab_page_t *page;
+	
+	assert(class);
+	assert(index >= 0 && index < _arena_pages);
+	
+	page = &_pages[index];
+	if (page->prev >= 0) {
+		_pages[page->prev].next = page->next;
+	}
+	else {
+		assert(class->partial == index);
+		class->partial = page->next;
+	}
+	if (page->next >= 0) {
+		_pages[page->next].prev = page->prev;
+	}
+	page->next = -1;
+	page->prev = -1;
+}
+
+
+// give a free page to the class.  Returns -1 if they have all been used.
+static int slab_page_get(int class_index)
+{
+	slab_class_t *class;
+	slab_page_t *page;
+	int index;
+	
+	assert(class_index >= 0 && class_index < _class_count);
+	
+	if (_pages_used >= _arena_pages) {
+		return(-1);
+	}
+	
+	// the large allocations only count pages, so if there is room there is always a free one.
+	index = _free_pages;
+	assert(index >= 0);
+	page = &_pages[index];
+	_free_pages = page->next;
+	
+	assert(page->class < 0);
+	assert(page->used == 0);
+	page->class = class_index;
+	page->carved = 0;
+	page->free_list = NULL;
+	
+	class = &_classes[class_index];
+	class->pages ++;
+	_pages_used ++;
+	slab_partial_add(class, index);
+	
+	return(index);
+}
+
+
+// all the chunks in the page have been freed, so it can be used by any class.
+static void slab_page_put(int index)
+{
+	slab_class_t *class;
+	slab_page_t *page;
+	
+	assert(index >= 0 && index < _arena_pages);
+	page = &_pages[index];
+	assert(page->class >= 0);
+	assert(page->used == 0);
+	
+	class = &_classes[page->class];
+	slab_partial_remove(class, index);
+	class->pages --;
+	assert(class->pages >= 0);
+	
+	page->class = -1;
+	page->carved = 0;
+	page->free_list = NULL;
+	page->next = _free_pages;
+	_free_pages = index;
+	
+	_pages_used --;
+	assert(_pages_used >= 0);
+	_pages_returned ++;
+}
+
+
+
+static void * slab_large(int size)
+{
+	void *ptr;
+	int pages;
+
+	if (_limit > 0) {
+		pages = (size + SLAB_PAGE_SIZE - 1) / SLAB_PAGE_SIZE;
+		if (_pages_used + pages > _arena_pages) {
+			return(NULL);
+		}
+		_pages_used += pages;
+	}
+
+	ptr = malloc(size);
+	assert(ptr);
+	_large_count ++;
+	_large_bytes += size;
+
+	return(ptr);
+}
+
+
+
+static void * slab_take(int size)
+{
+	slab_class_t *class;
+	slab_page_t *page;
+	void *ptr;
+	int index;
+	int page_index;
+
+	assert(size > 0);
+	assert(_class_count > 0);
+
+	index = slab_class(size);
+	if (index < 0) {
+		return(slab_large(size));
+	}
+	class = &_classes[index];
+
+	if (_limit == 0) {
+		ptr = malloc(size);
+		assert(ptr);
+	}
+	else {
+		page_index = class->partial;
+		if (page_index < 0) {
+			// need another page for this class.
+			page_index = slab_page_get(index);
+			if (page_index < 0) {
+				return(NULL);
+			}
+		}
+		
+		page = &_pages[page_index];
+		assert(page->class == index);
+		assert(page->used < class->chunks);
+		
+		if (page->free_list) {
+			ptr = page->free_list;
+			page->free_list = *((void **) ptr);
+		}
+		else {
+			assert(page->carved < class->chunks);
+			ptr = _arena + ((long long) page_index * SLAB_PAGE_SIZE) + ((long long) page->carved * class->size);
+			page->carved ++;
+		}
+		
+		// a full page comes off the list until something in it is freed.
+		page->used ++;
+		if (page->used == class->chunks) {
+			slab_partial_remove(class, page_index);
+		}
+	}
+
+	class->used ++;
+	class->requested += size;
+
+	return(ptr);
+}
+
+
+
+// if there is no memory left, the reclaim function (if there is one) is asked to free some up, 
+// and it is tried again.  Freeing memory only helps if it is the same class as what we are after, 
+// or if it empties a page (which any class can then have), so it may need a few goes.
+void * slab_alloc(int size)
+{
+	void *ptr;
+	int attempts = 0;
+	int freed;
+	
+	ptr = slab_take(size);
+	
+	// the reclaim function is not allowed to allocate anything, but if it somehow does, it wont be 
+	// asked to reclaim again.
+	while (ptr == NULL && _reclaim && _reclaiming == 0 && attempts < SLAB_RECLAIM_ATTEMPTS) {
+		_reclaiming = 1;
+		freed = (*_reclaim)(size);
+		_reclaiming = 0;
+		attempts ++;
+		_reclaims ++;
+		
+		if (freed <= 0) {
+			break;
+		}
+		_reclaimed += freed;
+		
+		ptr = slab_take(size);
+	}
+	
+	if (ptr == NULL) {
+		_failed ++;
+	}
+	
+	return(ptr);
+}
+
+
+
+void * slab_calloc(int size)
+{
+	void *ptr = slab_alloc(size);
+	if (ptr) {
+		memset(ptr, 0, size);
+	}
+	return(ptr);
+}
+
+
+
+void slab_free(void *ptr, int size)
+{
+	slab_class_t *class;
+	slab_page_t *page;
+	int index;
+	int page_index;
+
+	assert(ptr);
+	assert(size > 0);
+
+	index = slab_class(size);
+	if (index < 0) {
+		free(ptr);
+		_large_count --;
+		_large_bytes -= size;
+		assert(_large_count >= 0 && _large_bytes >= 0);
+		if (_limit > 0) {
+			_pages_used -= (size + SLAB_PAGE_SIZE - 1) / SLAB_PAGE_SIZE;
+			assert(_pages_used >= 0);
+		}
+		return;
+	}
+
+	class = &_classes[index];
+	assert(class->used > 0);
+	class->used --;
+	class->requested -= size;
+
+	if (_limit == 0) {
+		free(ptr);
+	}
+	else {
+		assert((char *) ptr >= _arena && (char *) ptr < _arena + _limit);
+		page_index = ((char *) ptr - _arena) / SLAB_PAGE_SIZE;
+		page = &_pages[page_index];
+		assert(page->class == index);
+		assert(page->used > 0);
+		
+		// it was full, so it wasnt on the list.
+		if (page->used == class->chunks) {
+			slab_partial_add(class, page_index);
+		}
+		
+		*((void **) ptr) = page->free_list;
+		page->free_list = ptr;
+		page->used --;
+		
+		if (page->used == 0) {
+			slab_page_put(page_index);
+		}
+	}
+}
+
+
+
+// set the function that will be called to free up memory when an allocation cant be satisfied.  It 
+// is given the size that is being allocated, and returns the number of bytes it freed (0 if it 
+// couldnt free anything).
+void slab_reclaim(int (*reclaim)(int size))
+{
+	assert(reclaim);
+	assert(_reclaim == NULL);
+	_reclaim = reclaim;
+}
+
+
+// returns non-zero if freeing a chunk of 'freed' bytes would make room for an allocation of 
+// 'wanted' bytes straight away.  That is when they come from the same class, or when they are both 
+// large allocations which give their pages back.  Anything else only helps once it has emptied a 
+// page.
+int slab_same_class(int freed, int wanted)
+{
+	int freed_class, wanted_class;
+	
+	assert(freed > 0);
+	assert(wanted > 0);
+	
+	freed_class = slab_class(freed);
+	wanted_class = slab_class(wanted);
+	if (freed_class < 0) {
+		return(wanted_class < 0 && freed >= wanted);
+	}
+	
+	return(freed_class == wanted_class);
+}
+
+
+
+long long slab_limit(void)
+{
+	assert(_limit >= 0);
+	return(_limit);
+}
+
+
+// the number of bytes that are taken up by the data.  When there is a limit, this is the number of
+// pages that have been handed out, because a page that belongs to a class cant be used by any other 
+// until it is empty.
+long long slab_used(void)
+{
+	long long used = 0;
+	int i;
+
+	if (_limit > 0) {
+		used = (long long) _pages_used * SLAB_PAGE_SIZE;
+	}
+	else {
+		for (i=0; i<_class_count; i++) {
+			used += _classes[i].used * _classes[i].size;
+		}
+		used += _large_bytes;
+	}
+
+	return(used);
+}
+
+
+
+void slab_dump(void)
+{
+	slab_class_t *class;
+	int i;
+
+	stat_dumpstr("MEMORY");
+	if (_limit > 0) {
+		stat_dumpstr("  Limit: %lld", _limit);
+		stat_dumpstr("  Pages: %d of %d used", _pages_used, _arena_pages);
+		stat_dumpstr("  Pages returned: %lld", _pages_returned);
+	}
+	else {
+		stat_dumpstr("  Limit: none");
+	}
+	stat_dumpstr("  Used: %lld", slab_used());
+	stat_dumpstr("  Failed allocations: %lld", _failed);
+	stat_dumpstr("  Reclaims: %lld (%lld bytes)", _reclaims, _reclaimed);
+	stat_dumpstr("  Large allocations: %lld (%lld bytes)", _large_count, _large_bytes);
+
+	stat_dumpstr("  Classes:");
+	for (i=0; i<_class_count; i++) {
+		class = &_classes[i];
+		if (class->pages > 0 || class->used > 0) {
+			stat_dumpstr("    Class %d: Size:%d, Pages:%d, Used:%lld, Free:%lld, Requested:%lld, Wasted:%lld",
+				i, class->size, class->pages, class->used,
+				_limit > 0 ? ((long long) class->pages * class->chunks) - class->used : 0, class->requested,
+				(class->used * class->size) - class->requested);
+		}
+	}
+	stat_dumpstr(NULL);
+}
@@ -0,0 +1,34 @@
+// slab.h
+
+#ifndef __SLAB_H
+#define __SLAB_H
+
+// Chunk allocator for the data that is stored in the buckets (items, values, keyvalue lists and
+// string payloads).  When a memory limit is set, all of that memory is allocated on startup and
+// split into pages, which are handed to the size classes as they need them.  Each class carves its
+// pages into equal sized chunks, and freed chunks go back on the free-list for their page, so
+// string churn cannot fragment the heap.  A page that has had all its chunks freed is given back,
+// so that another class can have it.  When the memory runs out, slab_alloc() returns NULL.
+//
+// When no limit is set, the allocations are passed straight through to malloc/free, but the
+// counters are still kept so that they can be dumped.
+//
+// The caller needs to supply the size again when freeing, the same as it was allocated with.
+
+
+void slab_init(long long limit);
+
+void * slab_alloc(int size);
+void * slab_calloc(int size);
+void slab_free(void *ptr, int size);
+
+void slab_reclaim(int (*reclaim)(int size));
+int slab_same_class(int freed, int wanted);
+
+long long slab_limit(void);
+long long slab_used(void);
+
+void slab_dump(void);
+
+
+#endif
@@ -3,9 +3,15 @@
 #include "stats.h"
 
 #include "bucket.h"
+#include "chunk.h"
+#include "expiry.h"
 #include "logging.h"
 #include "node.h"
+#include "pool.h"
+#include "shard.h"
+#include "slab.h"
 #include "timeout.h"
+#include "uring.h"
 
 #include <assert.h>
 #include <string.h>
@@ -20,8 +26,9 @@ struct {
 		int clients;
 		int primary_buckets;
 		int secondary_buckets;
-		int items;
-		int maps;
+		long long items;
+		long long keyvalues;
+		long long bytes;
 	} last;
 	
 //	int clients;
@@ -33,6 +40,7 @@ struct {
 	int secondary_buckets;
 	int bucket_transfer;
 
+	// all the shards add to these, so they are only changed atomically.
 	int bytes_in;
 	int bytes_out;
 	
@@ -133,8 +141,31 @@ static void sighup_handler(evutil_socket_t fd, short what, void *arg)
 	// dump the list of clients.
 	clients_dump();
 	
-	// dump the list of buckets.
+	// dump the list of buckets.  The workers are stopped while the data is looked at.
+	shards_pause();
 	buckets_dump();
+	shards_resume();
+	
+	if (shards_workers() == 0) {
+		// dump the memory usage of the data.
+		slab_dump();
+		
+		// dump the state of the expiry wheel.
+		expiry_dump();
+		
+		// dump the shared string pool.
+		pool_dump();
+		
+		// dump the buffers that the connections are using.
+		chunk_dump();
+		
+		// and the io_uring that they are using, if there is one.
+		uring_dump();
+	}
+	else {
+		// each worker has its own.
+		shards_dump();
+	}
 	
 	stat_dumpstr("--------------------------------------------------------------");
 	
@@ -169,6 +200,8 @@ static void stats_handler(int fd, short int flags, void *arg)
 	int changed = 0;
 	int new_nodes;
 	int new_clients;
+	int bytes_in, bytes_out;
+	long long new_items, new_keyvalues, new_bytes;
 	
 	assert(fd == -1);
 	assert(flags & EV_TIMEOUT);
@@ -186,17 +219,25 @@ static void stats_handler(int fd, short int flags, void *arg)
 		changed++;
 	}
 	
-	if (_stats.bytes_in > 0 || _stats.bytes_out > 0) {
+	buckets_data_totals(&new_items, &new_keyvalues, &new_bytes);
+	if (_stats.last.items != new_items || _stats.last.keyvalues != new_keyvalues || _stats.last.bytes != new_bytes) {
+		_stats.last.items = new_items;
+		_stats.last.keyvalues = new_keyvalues;
+		_stats.last.bytes = new_bytes;
+		changed++;
+	}
+	
+	// take the counts, and start them again from 0.
+	bytes_in = __sync_fetch_and_and(&_stats.bytes_in, 0);
+	bytes_out = __sync_fetch_and_and(&_stats.bytes_out, 0);
+	if (bytes_in > 0 || bytes_out > 0) {
 		changed ++;
 	}
 	
 	if (changed > 0) {
-		logger(LOG_STATS, "Stats. Nodes:%d, Clients:%d, Bytes IN:%d, Bytes OUT:%d", new_nodes, new_clients, _stats.bytes_in, _stats.bytes_out);
+		logger(LOG_STATS, "Stats. Nodes:%d, Clients:%d, Items:%lld, Keyvalues:%lld, Data:%lld, Bytes IN:%d, Bytes OUT:%d", new_nodes, new_clients, new_items, new_keyvalues, new_bytes, bytes_in, bytes_out);
 	}
 
-	_stats.bytes_in = 0;
-	_stats.bytes_out = 0;
-
 	evtimer_add(_stats_event, &_timeout_stats);
 }
 
@@ -246,15 +287,13 @@ void stats_shutdown(void)
 void stats_bytes_in(int bb) {
 	assert(bb > 0);
 	
-	_stats.bytes_in += bb;
-	assert(_stats.bytes_in > 0);
+	__sync_fetch_and_add(&_stats.bytes_in, bb);
 }
 
 void stats_bytes_out(int bb) {
 	assert(bb > 0);
 	
-	_stats.bytes_out += bb;
-	assert(_stats.bytes_out > 0);
+	__sync_fetch_and_add(&_stats.bytes_out, bb);
 }
 
 
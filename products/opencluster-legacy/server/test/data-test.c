@@ -0,0 +1,300 @@
+// data-test.c
+// Checks the bucket data containers (bucket_data.c) on their own, without the rest of the server.
+// Each test prints a line saying whether it passed, and the exit code is the number that failed.
+//
+//   ./data-test [items]
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../bucket_data.h"
+#include "../constants.h"
+#include "../expiry.h"
+#include "../hashfn.h"
+#include "../seconds.h"
+#include "../slab.h"
+#include "../value.h"
+
+
+// the tests move the clock along themselves.
+static unsigned int _now = 100;
+
+unsigned int seconds_get(void) { return(_now); }
+
+// the bucket that the expiry wheel removes items from (see buckets_expire in bucket.c).
+static bucket_data_t *_expiring = NULL;
+
+int buckets_expire(hash_t map_hash, hash_t key_hash, int expires, int keyvalue)
+{
+	if (_expiring == NULL) { return(0); }
+	if (keyvalue) { return(data_delete_keyvalue(_expiring, key_hash, expires)); }
+	return(data_delete_item(_expiring, map_hash, key_hash, expires));
+}
+
+
+// the dumps are only looked at to get the number of entries waiting on the expiry wheel.
+static long long _pending = -1;
+
+void stat_dumpstr(const char *format, ...)
+{
+	va_list ap;
+	if (format && strcmp(format, "  Pending: %lld") == 0) {
+		va_start(ap, format);
+		_pending = va_arg(ap, long long);
+		va_end(ap);
+	}
+}
+
+static long long expiry_pending(void)
+{
+	_pending = -1;
+	expiry_dump();
+	return(_pending);
+}
+
+
+// the parts of the server that the containers call out to, which these tests dont need.
+void logger(int level, const char *format, ...) {}
+void push_sync_item(client_t *client, item_t *item) {}
+int buckets_get_migrate_sync(void) { return(0); }
+
+
+static int _failed = 0;
+
+static void result(const char *name, int ok)
+{
+	printf("%-40s %s\n", name, ok ? "ok" : "FAILED");
+	if (ok == 0) { _failed ++; }
+}
+
+
+// a key hash that falls in the given bucket.  Spread across the rest of the bits, so that a split
+// sends some of them each way.
+static hash_t key_for(hash_t mask, hash_t hashmask, long i)
+{
+	hash_t hash = ((hash_t) i * 0x9E3779B97F4A7C15ULL) ^ ((hash_t) i << 17);
+	return((hash & ~mask) | hashmask);
+}
+
+
+static int check_long(bucket_data_t *data, hash_t key_hash, long long expected)
+{
+	value_t *value = data_get_value(0, key_hash, data);
+	return(value && value->type == VALUE_LONG && value->data.l == expected);
+}
+
+
+
+// a populated bucket is split in two (the way buckets_split_mask does it), and the new buckets
+// are drained.  Every key must be found in the bucket it now belongs to, before, during and after
+// the draining, and the counts must add up.
+static void test_split(long items)
+{
+	bucket_data_t *old, *low, *high;
+	value_t value;
+	hash_t key;
+	long i;
+	int ok = 1;
+	int steps = 0;
+
+	old = data_new(0x1, 0x0);
+	for (i=0; i<items; i++) {
+		value_init(&value);
+		value_set_long(&value, i);
+		data_set_value(0, key_for(0x1, 0x0, i), old, &value, 0, NULL);
+	}
+
+	low = data_new(0x3, 0x0);
+	high = data_new(0x3, 0x2);
+	low->next = old;
+	high->next = old;
+	old->ref += 2;
+	data_release(old);
+	data_recount(low);
+	data_recount(high);
+
+	ok = ok && (low->item_count + high->item_count == items);
+
+	while (low->next || high->next) {
+		data_drain(low, 100);
+		data_drain(high, 100);
+		steps ++;
+
+		// check part of the way through as well.
+		if (steps == 3) {
+			for (i=0; i<items; i++) {
+				key = key_for(0x1, 0x0, i);
+				ok = ok && check_long((key & 0x3) == 0x2 ? high : low, key, i);
+			}
+		}
+	}
+
+	for (i=0; i<items; i++) {
+		key = key_for(0x1, 0x0, i);
+		ok = ok && check_long((key & 0x3) == 0x2 ? high : low, key, i);
+		ok = ok && data_get_value(0, key, (key & 0x3) == 0x2 ? low : high) == NULL;
+	}
+
+	data_recount(low);
+	data_recount(high);
+	ok = ok && (low->item_count + high->item_count == items);
+	ok = ok && low->item_count > 0 && high->item_count > 0;
+
+	result("split and drain", ok);
+
+	data_destroy(low, 0x3, 0x0);
+	data_destroy(high, 0x3, 0x2);
+	data_release(low);
+	data_release(high);
+}
+
+
+
+static void set_long(bucket_data_t *data, hash_t key_hash, long long l, int ttl)
+{
+	value_t value;
+	value_init(&value);
+	value_set_long(&value, l);
+	data_set_value(0, key_hash, data, &value, ttl, NULL);
+}
+
+// move the clock along a second at a time, letting the wheel remove what has expired.
+static void advance(unsigned int seconds)
+{
+	while (seconds-- > 0) {
+		_now ++;
+		expiry_process(_now, 100000);
+	}
+}
+
+
+// a key that is set again and again with the same ttl must only have the one entry on the expiry 
+// wheel, and still be removed when the last ttl runs out.  One that is set with a shorter ttl must 
+// be removed then.
+static void test_expiry(void)
+{
+	bucket_data_t *data;
+	long long pending;
+	int i;
+	int ok = 1;
+
+	data = data_new(0x1, 0x0);
+	_expiring = data;
+	pending = expiry_pending();
+
+	for (i=0; i<1000; i++) {
+		set_long(data, 0x1110, i, 3600);
+		advance(1);
+	}
+	ok = ok && expiry_pending() == pending + 1;
+	ok = ok && check_long(data, 0x1110, 999);
+
+	// the first entry goes off part way through, and is put back on the wheel for the last ttl.
+	advance(3599);
+	ok = ok && check_long(data, 0x1110, 999);
+	ok = ok && expiry_pending() == pending + 1;
+	advance(2);
+	ok = ok && data->item_count == 0;
+	ok = ok && expiry_pending() == pending;
+
+	set_long(data, 0x2220, 1, 3600);
+	set_long(data, 0x2220, 2, 10);
+	ok = ok && expiry_pending() == pending + 2;
+	advance(11);
+	ok = ok && data->item_count == 0;
+	advance(3600);
+	ok = ok && expiry_pending() == pending;
+
+	result("expiry entries", ok);
+
+	_expiring = NULL;
+	data_destroy(data, 0x1, 0x0);
+	data_release(data);
+}
+
+
+
+// a backup that is told about a delete leaves a tombstone even if it didn't have the item, setting 
+// it again brings it back, and the tombstone is removed after TOMBSTONE_LIFE.
+static void test_tombstone(void)
+{
+	bucket_data_t *data;
+	int ok = 1;
+
+	data = data_new(0x1, 0x0);
+	_expiring = data;
+
+	ok = ok && data_tombstone(data, 0x10, 0x3330, 0) == 0;
+	ok = ok && data->tombstone_count == 0;
+	ok = ok && data_tombstone(data, 0x10, 0x3330, 1) == 0;
+	ok = ok && data->tombstone_count == 1 && data->item_count == 0;
+	ok = ok && data_get_value(0x10, 0x3330, data) == NULL;
+
+	advance(TOMBSTONE_LIFE + 1);
+	ok = ok && data->tombstone_count == 0 && data->data_size == 0;
+
+	set_long(data, 0x4440, 1, 0);
+	ok = ok && data_tombstone(data, 0, 0x4440, 0) == 1;
+	ok = ok && data->tombstone_count == 1 && data->item_count == 0;
+	set_long(data, 0x4440, 2, 0);
+	ok = ok && check_long(data, 0x4440, 2);
+	ok = ok && data->tombstone_count == 0 && data->item_count == 1;
+
+	result("tombstones", ok);
+
+	_expiring = NULL;
+	data_destroy(data, 0x1, 0x0);
+	data_release(data);
+}
+
+
+
+// an incremented counter must have the valuehash for its new value, the same as if it had been set 
+// to it, because that is what the clients compare against.  One that would overflow is refused.
+static void test_incr(void)
+{
+	bucket_data_t *data;
+	value_t counter;
+	value_t *value;
+	int ok = 1;
+
+	data = data_new(0x1, 0x0);
+
+	ok = ok && data_incr_value(0, 0x5550, data, 5, 0, NULL, &counter) == 0;
+	ok = ok && data_incr_value(0, 0x5550, data, 37, 0, NULL, &counter) == 0;
+	ok = ok && counter.type == VALUE_LONG && counter.data.l == 42;
+	ok = ok && counter.valuehash == generate_hash_long(42);
+	value = data_get_value(0, 0x5550, data);
+	ok = ok && value && value->valuehash == generate_hash_long(42);
+
+	// going past the largest long is refused, and leaves the counter as it was.
+	ok = ok && data_incr_value(0, 0x6660, data, 0x7FFFFFFFFFFFFFF0LL, 0, NULL, &counter) == 0;
+	ok = ok && data_incr_value(0, 0x6660, data, 0x10, 0, NULL, &counter) == -3;
+	ok = ok && check_long(data, 0x6660, 0x7FFFFFFFFFFFFFF0LL);
+
+	result("incr valuehash", ok);
+
+	data_destroy(data, 0x1, 0x0);
+	data_release(data);
+}
+
+
+
+int main(int argc, char **argv)
+{
+	long items = 10000;
+
+	if (argc > 1) { items = atol(argv[1]); }
+
+	expiry_init(_now);
+	slab_init(0);
+
+	test_split(items);
+	test_expiry();
+	test_tombstone();
+	test_incr();
+
+	return(_failed);
+}
@@ -0,0 +1,159 @@
+// index-bench.c
+// Compares the lookup speed and memory use of the old GTree-of-GTrees data layout against the flat
+// hashindex that bucket_data now uses.
+//
+//   ./index-bench [keys] [maps-per-key]
+
+#include <glib.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../hashindex.h"
+
+
+static gint key_compare_fn(gconstpointer a, gconstpointer b)
+{
+	const hash_t *aa = a;
+	const hash_t *bb = b;
+	if (*aa < *bb) return(-1);
+	else if (*aa > *bb) return(1);
+	else return(0);
+}
+
+
+typedef struct {
+	hash_t item_key;
+	hash_t map_key;
+	long long value;
+} bench_item_t;
+
+
+// something roughly the same as the FNV keys we would get, all in the same bucket.
+static hash_t bench_key(int i)
+{
+	hash_t h = 0xcbf29ce484222325llu ^ (hash_t) i;
+	h *= 0x100000001b3llu;
+	h ^= h >> 29;
+	return((h << 8) | 0x2a);
+}
+
+
+static double elapsed_ns(struct timespec *start)
+{
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return(((end.tv_sec - start->tv_sec) * 1e9) + (end.tv_nsec - start->tv_nsec));
+}
+
+
+static size_t heap_used(void)
+{
+	struct mallinfo2 info = mallinfo2();
+	return(info.uordblks);
+}
+
+
+int main(int argc, char **argv)
+{
+	int keys = 200000;
+	int maps = 4;
+	int total, i, j;
+	size_t base;
+	struct timespec start;
+	double ns;
+	long long found;
+	bench_item_t *items;
+	GTree *tree;
+	GTree *mapstree;
+	hashindex_t *index;
+	bench_item_t *item;
+
+	if (argc > 1) { keys = atoi(argv[1]); }
+	if (argc > 2) { maps = atoi(argv[2]); }
+	total = keys * maps;
+
+	items = malloc(sizeof(bench_item_t) * total);
+	for (i=0; i<keys; i++) {
+		for (j=0; j<maps; j++) {
+			items[(i*maps)+j].item_key = bench_key(i);
+			items[(i*maps)+j].map_key = bench_key(j + 0x10000000);
+			items[(i*maps)+j].value = i;
+		}
+	}
+
+	printf("%d keys, %d maps per key, %d items\n\n", keys, maps, total);
+	printf("%-12s %12s %12s %12s\n", "layout", "insert ns", "lookup ns", "bytes/item");
+
+
+	// the old layout.
+	base = heap_used();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	tree = g_tree_new(key_compare_fn);
+	for (i=0; i<total; i++) {
+		mapstree = g_tree_lookup(tree, &items[i].item_key);
+		if (mapstree == NULL) {
+			mapstree = g_tree_new(key_compare_fn);
+			g_tree_insert(tree, &items[i].item_key, mapstree);
+		}
+		g_tree_insert(mapstree, &items[i].map_key, &items[i]);
+	}
+	ns = elapsed_ns(&start) / total;
+	printf("%-12s %12.1f ", "gtree", ns);
+
+	found = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i=0; i<total; i++) {
+		j = (int) (((unsigned) i * 2654435761u) % total);
+		mapstree = g_tree_lookup(tree, &items[j].item_key);
+		item = g_tree_lookup(mapstree, &items[j].map_key);
+		found += item->value;
+	}
+	ns = elapsed_ns(&start) / total;
+	printf("%12.1f %12.1f\n", ns, (double) (heap_used() - base) / total);
+
+	// the trees are cleaned up before the next one is measured.
+	for (i=0; i<keys; i++) {
+		mapstree = g_tree_lookup(tree, &items[i*maps].item_key);
+		if (mapstree) {
+			g_tree_remove(tree, &items[i*maps].item_key);
+			g_tree_destroy(mapstree);
+		}
+	}
+	g_tree_destroy(tree);
+
+
+	// the new layout.
+	base = heap_used();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	index = hashindex_new(0);
+	for (i=0; i<total; i++) {
+		hashindex_insert(index, items[i].item_key, items[i].map_key, &items[i]);
+	}
+	ns = elapsed_ns(&start) / total;
+	printf("%-12s %12.1f ", "hashindex", ns);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i=0; i<total; i++) {
+		j = (int) (((unsigned) i * 2654435761u) % total);
+		item = hashindex_get(index, items[j].item_key, items[j].map_key);
+		found -= item->value;
+	}
+	ns = elapsed_ns(&start) / total;
+	printf("%12.1f %12.1f\n", ns, (double) (heap_used() - base) / total);
+
+	for (i=0; i<total; i++) {
+		hashindex_remove(index, items[i].item_key, items[i].map_key);
+	}
+	hashindex_free(index);
+
+	// both layouts should have found exactly the same items.
+	if (found != 0) {
+		printf("\nMISMATCH: %lld\n", found);
+		return(1);
+	}
+
+	free(items);
+	return(0);
+}
@@ -0,0 +1,296 @@
+// queue-bench.c
+// Measures the ring queues that the shards use to hand calls to each other, against the
+// mutex-protected list that they used to use.  Throughput is pointers moved per second between
+// threads, and latency is half of a round trip between two threads.
+//
+//   ./queue-bench [operations] [threads]
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../queue.h"
+
+
+#define BENCH_SIZE   256
+#define BENCH_BATCH  64
+
+
+// what the shard inbox used to be.  A list under a mutex, so any thread can use it.
+typedef struct __locked_item_t {
+	void *ptr;
+	struct __locked_item_t *next;
+} locked_item_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	locked_item_t *head;
+	locked_item_t *tail;
+} locked_t;
+
+
+static void locked_push(locked_t *q, void *ptr)
+{
+	locked_item_t *item = malloc(sizeof(locked_item_t));
+	item->ptr = ptr;
+	item->next = NULL;
+	pthread_mutex_lock(&q->lock);
+	if (q->tail) { q->tail->next = item; }
+	else { q->head = item; }
+	q->tail = item;
+	pthread_mutex_unlock(&q->lock);
+}
+
+static void * locked_pop(locked_t *q)
+{
+	locked_item_t *item;
+	void *ptr = NULL;
+	pthread_mutex_lock(&q->lock);
+	item = q->head;
+	if (item) {
+		q->head = item->next;
+		if (q->head == NULL) { q->tail = NULL; }
+	}
+	pthread_mutex_unlock(&q->lock);
+	if (item) {
+		ptr = item->ptr;
+		free(item);
+	}
+	return(ptr);
+}
+
+
+typedef struct {
+	queue_t *queue;
+	locked_t *locked;
+	long ops;
+	int batch;
+	long long sum;
+} bench_arg_t;
+
+static int _go = 0;
+
+// when the other side isn't keeping up, let it have the cpu (in case there aren't enough of them
+// for all the threads).
+#define BACKOFF()  sched_yield()
+
+
+static double elapsed_ns(struct timespec *start)
+{
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return(((end.tv_sec - start->tv_sec) * 1e9) + (end.tv_nsec - start->tv_nsec));
+}
+
+
+// the values pushed are 1..ops, so that the consumers can check that they got all of them.
+static void * producer(void *arg)
+{
+	bench_arg_t *b = arg;
+	void *ptrs[BENCH_BATCH];
+	long i, j, n;
+
+	while (__atomic_load_n(&_go, __ATOMIC_ACQUIRE) == 0) { BACKOFF(); }
+
+	for (i=1; i<=b->ops; ) {
+		if (b->locked) {
+			locked_push(b->locked, (void *) i);
+			i++;
+		}
+		else if (b->batch > 1) {
+			n = (b->ops - i + 1) < b->batch ? (b->ops - i + 1) : b->batch;
+			for (j=0; j<n; j++) { ptrs[j] = (void *) (i + j); }
+			j = 0;
+			while (j < n) {
+				j += queue_push_batch(b->queue, ptrs + j, n - j);
+				if (j < n) { BACKOFF(); }
+			}
+			i += n;
+		}
+		else {
+			while (queue_push(b->queue, (void *) i) == 0) { BACKOFF(); }
+			i++;
+		}
+	}
+	return(NULL);
+}
+
+
+static void * consumer(void *arg)
+{
+	bench_arg_t *b = arg;
+	void *ptrs[BENCH_BATCH];
+	long got = 0;
+	long j, n;
+	void *ptr;
+
+	while (__atomic_load_n(&_go, __ATOMIC_ACQUIRE) == 0) { BACKOFF(); }
+
+	while (got < b->ops) {
+		if (b->locked) {
+			if ((ptr = locked_pop(b->locked))) { b->sum += (long) ptr; got ++; }
+			else { BACKOFF(); }
+		}
+		else if (b->batch > 1) {
+			// with more than one consumer, dont take any of the others' share.
+			n = queue_pop_batch(b->queue, ptrs, (b->ops - got) < b->batch ? (b->ops - got) : b->batch);
+			for (j=0; j<n; j++) { b->sum += (long) ptrs[j]; }
+			got += n;
+			if (n == 0) { BACKOFF(); }
+		}
+		else {
+			if ((ptr = queue_pop(b->queue))) { b->sum += (long) ptr; got ++; }
+			else { BACKOFF(); }
+		}
+	}
+	return(NULL);
+}
+
+
+// 'threads' producers and the same number of consumers, each moving ops/threads pointers.
+static void throughput(const char *name, int mode, int batch, long ops, int threads)
+{
+	pthread_t prod[threads], cons[threads];
+	bench_arg_t parg[threads], carg[threads];
+	locked_t locked = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL };
+	queue_t *queue = NULL;
+	struct timespec start;
+	long long sum = 0, expected;
+	long per = ops / threads;
+	double ns;
+	int i;
+
+	if (mode) { queue = queue_new(mode, BENCH_SIZE); }
+
+	_go = 0;
+	for (i=0; i<threads; i++) {
+		parg[i] = (bench_arg_t) { queue, mode ? NULL : &locked, per, batch, 0 };
+		carg[i] = parg[i];
+		pthread_create(&prod[i], NULL, producer, &parg[i]);
+		pthread_create(&cons[i], NULL, consumer, &carg[i]);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	__atomic_store_n(&_go, 1, __ATOMIC_RELEASE);
+	for (i=0; i<threads; i++) {
+		pthread_join(prod[i], NULL);
+		pthread_join(cons[i], NULL);
+		sum += carg[i].sum;
+	}
+	ns = elapsed_ns(&start);
+
+	expected = ((long long) per * (per + 1) / 2) * threads;
+	printf("%-16s %8d %14.0f %10.1f%s\n", name, threads, (per * threads) / (ns / 1e9), ns / (per * threads), sum == expected ? "" : "  MISMATCH");
+
+	if (queue) { queue_free(queue); }
+}
+
+
+
+// bounce a token between two threads, through a ring each way.  If 'wait' is set, the threads
+// sleep on an eventfd between tokens (the way the shards do), otherwise they spin.
+typedef struct {
+	queue_t *in;
+	queue_t *out;
+	int in_fd;
+	int out_fd;
+	int wait;
+	long rounds;
+} pong_arg_t;
+
+
+static void token_send(pong_arg_t *p, void *token)
+{
+	uint64_t one = 1;
+	while (queue_push(p->out, token) == 0) { BACKOFF(); }
+	if (p->wait) { if (write(p->out_fd, &one, sizeof(one)) < 0) {} }
+}
+
+static void * token_recv(pong_arg_t *p)
+{
+	uint64_t count;
+	void *token;
+	while ((token = queue_pop(p->in)) == NULL) {
+		if (p->wait) { if (read(p->in_fd, &count, sizeof(count)) < 0) {} }
+		else { BACKOFF(); }
+	}
+	return(token);
+}
+
+static void * ponger(void *arg)
+{
+	pong_arg_t *p = arg;
+	long i;
+	for (i=0; i<p->rounds; i++) {
+		token_send(p, token_recv(p));
+	}
+	return(NULL);
+}
+
+
+static void latency(const char *name, int wait, long rounds)
+{
+	pong_arg_t ping, pong;
+	pthread_t thread;
+	struct timespec start;
+	double ns;
+	long i;
+
+	ping.in = queue_new(QUEUE_SPSC, BENCH_SIZE);
+	ping.out = queue_new(QUEUE_SPSC, BENCH_SIZE);
+	ping.in_fd = eventfd(0, 0);
+	ping.out_fd = eventfd(0, 0);
+	ping.wait = wait;
+	ping.rounds = rounds;
+	pong = (pong_arg_t) { ping.out, ping.in, ping.out_fd, ping.in_fd, wait, rounds };
+
+	pthread_create(&thread, NULL, ponger, &pong);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i=0; i<rounds; i++) {
+		token_send(&ping, (void *) 1);
+		token_recv(&ping);
+	}
+	ns = elapsed_ns(&start);
+	pthread_join(thread, NULL);
+
+	printf("%-16s %12.1f\n", name, ns / rounds / 2);
+
+	close(ping.in_fd);
+	close(ping.out_fd);
+	queue_free(ping.in);
+	queue_free(ping.out);
+}
+
+
+
+int main(int argc, char **argv)
+{
+	long ops = 10000000;
+	int threads = 2;
+
+	if (argc > 1) { ops = atol(argv[1]); }
+	if (argc > 2) { threads = atoi(argv[2]); }
+
+	printf("%ld operations, ring size %d\n\n", ops, BENCH_SIZE);
+
+	printf("%-16s %8s %14s %10s\n", "queue", "threads", "ops/sec", "ns/op");
+	throughput("locked list", 0, 1, ops / 4, 1);
+	throughput("spsc", QUEUE_SPSC, 1, ops, 1);
+	throughput("spsc batch", QUEUE_SPSC, BENCH_BATCH, ops, 1);
+	throughput("mpmc", QUEUE_MPMC, 1, ops, 1);
+	throughput("locked list", 0, 1, ops / 4, threads);
+	throughput("mpmc", QUEUE_MPMC, 1, ops, threads);
+	throughput("mpmc batch", QUEUE_MPMC, BENCH_BATCH, ops, threads);
+
+	printf("\n%-16s %12s\n", "handoff", "latency ns");
+	latency("spin", 0, ops / 20);
+	latency("eventfd", 1, ops / 200);
+
+	return(0);
+}
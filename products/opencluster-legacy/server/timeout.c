@@ -22,6 +22,7 @@ struct timeval _timeout_connect = {.tv_sec = 30, .tv_usec = 0};
 struct timeval _timeout_node_wait = {.tv_sec = 5, .tv_usec = 0};
 struct timeval _timeout_node_loadlevel = {.tv_sec = 5, .tv_usec = 0};
 struct timeval _timeout_client = {.tv_sec = 1, .tv_usec = 0};
+struct timeval _timeout_drain = {.tv_sec = 0, .tv_usec = 10000};  // 100 times a second.
 
 
 
@@ -16,6 +16,7 @@
 	extern struct timeval _timeout_node_wait;
 	extern struct timeval _timeout_node_loadlevel;
 	extern struct timeval _timeout_client;
+	extern struct timeval _timeout_drain;
 #endif
 
 
@@ -0,0 +1,652 @@
+// uring.c
+
+#include "uring.h"
+
+#include "chunk.h"
+#include "logging.h"
+#include "shard.h"
+#include "stats.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+
+// the receives need multishot and the buffer rings, and SINGLE_ISSUER came with them (6.0), so if
+// it is there, so are they.
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_SETUP_SINGLE_ISSUER)
+#define URING_SUPPORTED
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+
+// the buffer group that the receive buffers are in.
+#define URING_GROUP  0
+
+
+// set by the main thread before the shards are started, so doesn't need to be shard-local.
+static int _enabled = 0;
+
+
+#ifdef URING_SUPPORTED
+
+// the parts of the ring that are shared with the kernel are mapped in.  The kernel moves the
+// submission head and the completion tail, and we move the others.
+typedef struct {
+	int fd;
+	int eventfd;
+	struct event *event;
+	struct event *submit_event;
+
+	char *sq_map;
+	size_t sq_size;
+	char *cq_map;
+	size_t cq_size;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned sq_entries;
+	unsigned tail;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	// the receive buffers.  The ring has the ones that are free, and takes one each time it
+	// receives something.
+	struct io_uring_buf_ring *buf_ring;
+	char *buffers[URING_BUFFERS];
+	unsigned short buf_tail;
+
+	// number of operations that have been put in the ring, but not submitted yet.  While the
+	// completions are being handled, the new ones wait until they are all done.
+	int pending;
+	int reaping;
+	int scheduled;
+
+	// operations that didn't fit in the submission queue, because it was full and the kernel
+	// wouldn't take any more yet.  They go in, in order, as soon as there is room (see sqe_get).
+	struct io_uring_sqe *backlog;
+	int backlog_count;
+	int backlog_max;
+} uring_t;
+
+
+static SHARD_LOCAL uring_t *_ring = NULL;
+
+#define LOAD(p)       __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE(p, v)   __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+// when the kernel won't take what is waiting to be submitted, it is tried again after this long
+// (or sooner, if there are completions to pick up first).
+static const struct timeval _submit_retry = {0, 1000};
+
+#endif
+
+
+static SHARD_LOCAL long long _submits = 0;
+static SHARD_LOCAL long long _ops = 0;
+static SHARD_LOCAL long long _completions = 0;
+static SHARD_LOCAL long long _received = 0;
+static SHARD_LOCAL long long _nobufs = 0;
+static SHARD_LOCAL long long _backlogged = 0;
+
+
+
+// should the shards try to use io_uring.  Needs to be set before they are started.
+void uring_enable(int enable)
+{
+	_enabled = enable;
+}
+
+
+#ifdef URING_SUPPORTED
+
+// unmap and close whatever was set up, when the ring couldn't be.
+static void ring_close(uring_t *ring)
+{
+	int i;
+
+	assert(ring);
+
+	if (ring->event) {
+		event_free(ring->event);
+	}
+	if (ring->submit_event) {
+		event_free(ring->submit_event);
+	}
+	if (ring->eventfd >= 0) {
+		close(ring->eventfd);
+	}
+	if (ring->sqes && ring->sqes != MAP_FAILED) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if (ring->cq_map && ring->cq_map != (char *) MAP_FAILED && ring->cq_map != ring->sq_map) {
+		munmap(ring->cq_map, ring->cq_size);
+	}
+	if (ring->sq_map && ring->sq_map != (char *) MAP_FAILED) {
+		munmap(ring->sq_map, ring->sq_size);
+	}
+	if (ring->fd >= 0) {
+		close(ring->fd);
+	}
+
+	for (i=0; i<URING_BUFFERS; i++) {
+		if (ring->buffers[i]) {
+			chunk_put(ring->buffers[i]);
+		}
+	}
+	free(ring->buf_ring);
+	free(ring->backlog);
+	free(ring);
+}
+
+
+// give a receive buffer back to the ring.
+static void buffer_add(int bid)
+{
+	struct io_uring_buf *buf;
+
+	assert(_ring);
+	assert(bid >= 0 && bid < URING_BUFFERS);
+
+	buf = &_ring->buf_ring->bufs[_ring->buf_tail & (URING_BUFFERS - 1)];
+	buf->addr = (uintptr_t) _ring->buffers[bid];
+	buf->len = CHUNK_SIZE;
+	buf->bid = bid;
+
+	_ring->buf_tail ++;
+	STORE(&_ring->buf_ring->tail, _ring->buf_tail);
+}
+
+
+// move what is in the backlog into the submission queue, as far as there is room for it.
+static void backlog_fill(void)
+{
+	int moved = 0;
+
+	assert(_ring);
+
+	while (moved < _ring->backlog_count && _ring->tail - LOAD(_ring->sq_head) < _ring->sq_entries) {
+		memcpy(&_ring->sqes[_ring->tail & *_ring->sq_mask], &_ring->backlog[moved], sizeof(struct io_uring_sqe));
+		_ring->tail ++;
+		_ring->pending ++;
+		moved ++;
+	}
+
+	if (moved > 0) {
+		STORE(_ring->sq_tail, _ring->tail);
+		_ring->backlog_count -= moved;
+		memmove(_ring->backlog, _ring->backlog + moved, _ring->backlog_count * sizeof(struct io_uring_sqe));
+	}
+}
+
+
+// submit everything that has been put in the ring since the last time.
+static void ring_submit(void)
+{
+	int res;
+	int busy = 0;
+
+	assert(_ring);
+
+	backlog_fill();
+	while (_ring->pending > 0) {
+		res = syscall(__NR_io_uring_enter, _ring->fd, _ring->pending, 0, 0, NULL, 0);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			// if the kernel is busy with completions that we haven't picked up yet, the rest will
+			// be submitted when we have (or when it is tried again).
+			if (errno == EAGAIN || errno == EBUSY) {
+				busy = 1;
+			}
+			else {
+				logger(LOG_ERROR, "io_uring submit failed: %s", strerror(errno));
+			}
+			break;
+		}
+
+		_submits ++;
+		_ring->pending -= res;
+		assert(_ring->pending >= 0);
+
+		// what was submitted has made room for what was waiting.
+		backlog_fill();
+	}
+
+	// when it is done handling completions, it submits again anyway.
+	if (busy && _ring->reaping == 0 && _ring->scheduled == 0) {
+		_ring->scheduled = 1;
+		event_add(_ring->submit_event, &_submit_retry);
+	}
+}
+
+
+static void submit_handler(evutil_socket_t fd, short what, void *arg)
+{
+	assert(_ring);
+	assert(_ring->scheduled);
+
+	_ring->scheduled = 0;
+	ring_submit();
+}
+
+
+// get the next entry in the submission queue.  If it is full, what is there is submitted first.  If 
+// that doesn't make room (the kernel can refuse to take them until we have picked up some of the 
+// completions), the entry is put in the backlog instead.  Once anything is in the backlog, the 
+// rest go there as well, so that they are still submitted in order.
+static struct io_uring_sqe * sqe_get(void)
+{
+	struct io_uring_sqe *sqe;
+
+	assert(_ring);
+
+	if (_ring->backlog_count == 0 && _ring->tail - LOAD(_ring->sq_head) >= _ring->sq_entries) {
+		ring_submit();
+	}
+
+	if (_ring->backlog_count > 0 || _ring->tail - LOAD(_ring->sq_head) >= _ring->sq_entries) {
+		if (_ring->backlog_count == _ring->backlog_max) {
+			_ring->backlog_max = _ring->backlog_max > 0 ? _ring->backlog_max * 2 : 64;
+			_ring->backlog = realloc(_ring->backlog, _ring->backlog_max * sizeof(struct io_uring_sqe));
+			assert(_ring->backlog);
+		}
+		sqe = &_ring->backlog[_ring->backlog_count];
+		_backlogged ++;
+	}
+	else {
+		sqe = &_ring->sqes[_ring->tail & *_ring->sq_mask];
+	}
+
+	memset(sqe, 0, sizeof(*sqe));
+	return(sqe);
+}
+
+
+// the entry is ready.  It is submitted along with the others that are started before the event
+// loop gets to the submit event (or at the end of the completions, if that is where it came from).
+static void sqe_push(struct io_uring_sqe *sqe)
+{
+	assert(_ring);
+	assert(sqe);
+
+	if (sqe >= _ring->sqes && sqe < _ring->sqes + _ring->sq_entries) {
+		assert(_ring->backlog_count == 0);
+		_ring->tail ++;
+		STORE(_ring->sq_tail, _ring->tail);
+		_ring->pending ++;
+	}
+	else {
+		assert(sqe == &_ring->backlog[_ring->backlog_count]);
+		_ring->backlog_count ++;
+	}
+	_ops ++;
+
+	if (_ring->reaping == 0 && _ring->scheduled == 0) {
+		_ring->scheduled = 1;
+		event_active(_ring->submit_event, EV_TIMEOUT, 1);
+	}
+}
+
+
+static void recv_start(uring_op_t *op)
+{
+	struct io_uring_sqe *sqe;
+
+	assert(op);
+	assert(op->active);
+	assert(op->fd >= 0);
+
+	sqe = sqe_get();
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = op->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_GROUP;
+	sqe->user_data = (uintptr_t) op;
+	sqe_push(sqe);
+}
+
+
+// an operation has completed (or a receive has some data).  The operation could be freed by its
+// handler, so it isn't touched after that.
+static void complete(uring_op_t *op, int res, unsigned flags)
+{
+	char *data = NULL;
+	int bid = -1;
+
+	// the cancels dont have an operation of their own.
+	if (op == NULL) {
+		return;
+	}
+
+	assert(op->active);
+	_completions ++;
+
+	if (flags & IORING_CQE_F_BUFFER) {
+		bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		assert(bid >= 0 && bid < URING_BUFFERS);
+		data = _ring->buffers[bid];
+		_received ++;
+	}
+
+	if ((flags & IORING_CQE_F_MORE) == 0) {
+		if (res == -ENOBUFS) {
+			// all the buffers were in use.  The ones that were have been given back by now, so it
+			// can carry on (unless it was being cancelled anyway).
+			assert(data == NULL);
+			_nobufs ++;
+			if (op->cancelled == 0) {
+				recv_start(op);
+				return;
+			}
+			res = -ECANCELED;
+		}
+
+		op->active = 0;
+	}
+
+	(*op->handler)(op, res, data);
+
+	if (data) {
+		buffer_add(bid);
+	}
+}
+
+
+// the eventfd is bumped when there are completions.
+static void uring_handler(evutil_socket_t fd, short what, void *arg)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+	uint64_t count;
+	uring_op_t *op;
+	unsigned flags;
+	int res;
+
+	assert(_ring);
+	assert(fd == _ring->eventfd);
+
+	if (read(fd, &count, sizeof(count)) < 0) {
+		// nothing to do with the count, it is only there to wake us up.
+	}
+
+	_ring->reaping ++;
+
+	// only the completions that are there now are handled.  Any that arrive while they are being
+	// handled will bump the eventfd again, and are left for the next time around the loop (so that
+	// a busy connection can't keep the shard here, and the submits that were held back are done).
+	head = *_ring->cq_head;
+	tail = LOAD(_ring->cq_tail);
+	for ( ; head != tail; head ++) {
+		cqe = &_ring->cqes[head & *_ring->cq_mask];
+		op = (uring_op_t *) (uintptr_t) cqe->user_data;
+		res = cqe->res;
+		flags = cqe->flags;
+
+		// the entry can be re-used as soon as we have what is in it.
+		STORE(_ring->cq_head, head + 1);
+
+		complete(op, res, flags);
+	}
+
+	_ring->reaping --;
+	assert(_ring->reaping == 0);
+
+	ring_submit();
+}
+
+#endif
+
+
+// set up the ring for this shard.  Returns 0 if it can't be used (or isn't wanted), in which case
+// the connections use the events.
+int uring_init(struct event_base *evbase)
+{
+#ifdef URING_SUPPORTED
+	struct io_uring_params params;
+	struct io_uring_buf_reg reg;
+	uring_t *ring;
+	int ok;
+	int i;
+
+	assert(evbase);
+	assert(_ring == NULL);
+
+	if (_enabled == 0) {
+		return(0);
+	}
+
+	ring = calloc(1, sizeof(uring_t));
+	assert(ring);
+	ring->eventfd = -1;
+
+	// each ring is only used by the shard that created it, which lets the kernel skip the
+	// locking.  The completion queue is bigger, because each receive can have lots of them.
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER;
+	params.cq_entries = URING_ENTRIES * 4;
+	ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	ok = (ring->fd >= 0);
+
+	if (ok && ((params.features & IORING_FEAT_NODROP) == 0 || (params.features & IORING_FEAT_SUBMIT_STABLE) == 0)) {
+		errno = ENOTSUP;
+		ok = 0;
+	}
+
+	if (ok) {
+		ring->sq_size = params.sq_off.array + (params.sq_entries * sizeof(unsigned));
+		ring->cq_size = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+		if (params.features & IORING_FEAT_SINGLE_MMAP) {
+			if (ring->cq_size > ring->sq_size) {
+				ring->sq_size = ring->cq_size;
+			}
+		}
+
+		ring->sq_map = (char *) mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+		if (params.features & IORING_FEAT_SINGLE_MMAP) {
+			ring->cq_map = ring->sq_map;
+		}
+		else {
+			ring->cq_map = (char *) mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		}
+		ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+		ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+		ok = (ring->sq_map != (char *) MAP_FAILED && ring->cq_map != (char *) MAP_FAILED && ring->sqes != MAP_FAILED);
+	}
+
+	if (ok) {
+		ring->sq_head = (unsigned *) (ring->sq_map + params.sq_off.head);
+		ring->sq_tail = (unsigned *) (ring->sq_map + params.sq_off.tail);
+		ring->sq_mask = (unsigned *) (ring->sq_map + params.sq_off.ring_mask);
+		ring->sq_array = (unsigned *) (ring->sq_map + params.sq_off.array);
+		ring->sq_entries = params.sq_entries;
+		ring->tail = *ring->sq_tail;
+
+		// the entries are always used in order, so the array just points at each of them.
+		for (i=0; i<params.sq_entries; i++) {
+			ring->sq_array[i] = i;
+		}
+
+		ring->cq_head = (unsigned *) (ring->cq_map + params.cq_off.head);
+		ring->cq_tail = (unsigned *) (ring->cq_map + params.cq_off.tail);
+		ring->cq_mask = (unsigned *) (ring->cq_map + params.cq_off.ring_mask);
+		ring->cqes = (struct io_uring_cqe *) (ring->cq_map + params.cq_off.cqes);
+
+		// the receive buffers are connection buffers, and the ring that they are handed to the
+		// kernel in needs to be page aligned.
+		ok = (posix_memalign((void **) &ring->buf_ring, getpagesize(), URING_BUFFERS * sizeof(struct io_uring_buf)) == 0);
+	}
+
+	if (ok) {
+		memset(ring->buf_ring, 0, URING_BUFFERS * sizeof(struct io_uring_buf));
+		memset(&reg, 0, sizeof(reg));
+		reg.ring_addr = (uintptr_t) ring->buf_ring;
+		reg.ring_entries = URING_BUFFERS;
+		reg.bgid = URING_GROUP;
+		ok = (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == 0);
+	}
+
+	if (ok) {
+		ring->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		ok = (ring->eventfd >= 0 && syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_EVENTFD, &ring->eventfd, 1) == 0);
+	}
+
+	if (ok == 0) {
+		logger(LOG_WARN, "Unable to use io_uring (%s), the connections will use events instead.", strerror(errno));
+		ring_close(ring);
+		return(0);
+	}
+
+	_ring = ring;
+	for (i=0; i<URING_BUFFERS; i++) {
+		ring->buffers[i] = chunk_get(CHUNK_SIZE);
+		assert(chunk_size(ring->buffers[i]) == CHUNK_SIZE);
+		buffer_add(i);
+	}
+
+	ring->event = event_new(evbase, ring->eventfd, EV_READ | EV_PERSIST, uring_handler, NULL);
+	assert(ring->event);
+	event_add(ring->event, NULL);
+
+	ring->submit_event = event_new(evbase, -1, 0, submit_handler, NULL);
+	assert(ring->submit_event);
+
+	logger(LOG_INFO, "Shard %d is using io_uring.", shard_id());
+	return(1);
+#else
+	assert(evbase);
+	if (_enabled) {
+		logger(LOG_WARN, "This build does not support io_uring, the connections will use events instead.");
+	}
+	return(0);
+#endif
+}
+
+
+// is this shard using io_uring.
+int uring_active(void)
+{
+#ifdef URING_SUPPORTED
+	return(_ring != NULL);
+#else
+	return(0);
+#endif
+}
+
+
+// start receiving from the socket.  The handler is called with each lot of data as it arrives,
+// until the receive fails or is cancelled, or the socket is closed (res == 0).
+void uring_recv(uring_op_t *op, int fd)
+{
+	assert(op);
+	assert(op->handler);
+	assert(op->active == 0);
+	assert(fd >= 0);
+
+#ifdef URING_SUPPORTED
+	assert(_ring);
+	op->fd = fd;
+	op->active = 1;
+	op->cancelled = 0;
+	recv_start(op);
+#else
+	assert(0);
+#endif
+}
+
+
+// send what the message points to.  The message (and the iovec's) need to stay where they are
+// until it is submitted.  It is only complete when it has all been sent, or the connection has
+// failed.
+void uring_sendmsg(uring_op_t *op, int fd, struct msghdr *msg)
+{
+#ifdef URING_SUPPORTED
+	struct io_uring_sqe *sqe;
+#endif
+
+	assert(op);
+	assert(op->handler);
+	assert(op->active == 0);
+	assert(fd >= 0);
+	assert(msg);
+
+#ifdef URING_SUPPORTED
+	assert(_ring);
+	op->fd = fd;
+	op->active = 1;
+	op->cancelled = 0;
+
+	sqe = sqe_get();
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t) msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	sqe->user_data = (uintptr_t) op;
+	sqe_push(sqe);
+#else
+	assert(0);
+#endif
+}
+
+
+// stop the operation.  Its handler will still be called when it has stopped (with -ECANCELED if
+// it hadn't finished).
+void uring_cancel(uring_op_t *op)
+{
+#ifdef URING_SUPPORTED
+	struct io_uring_sqe *sqe;
+#endif
+
+	assert(op);
+
+	if (op->active == 0 || op->cancelled) {
+		return;
+	}
+
+#ifdef URING_SUPPORTED
+	assert(_ring);
+	op->cancelled = 1;
+
+	sqe = sqe_get();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t) op;
+	sqe->user_data = 0;
+	sqe_push(sqe);
+#endif
+}
+
+
+
+void uring_dump(void)
+{
+	stat_dumpstr("IO_URING");
+	stat_dumpstr("  Active: %s", uring_active() ? "yes" : "no");
+	if (uring_active()) {
+		stat_dumpstr("  Submitted: %lld operations in %lld calls", _ops, _submits);
+		stat_dumpstr("  Completed: %lld", _completions);
+		stat_dumpstr("  Received: %lld buffers (ran out %lld times)", _received, _nobufs);
+		stat_dumpstr("  Backlogged: %lld (submission queue was full)", _backlogged);
+	}
+	stat_dumpstr(NULL);
+}
@@ -0,0 +1,53 @@
+// uring.h
+
+#ifndef __URING_H
+#define __URING_H
+
+// When the 'io-uring' config option is set (and the kernel supports it, 6.0 or later), each shard
+// has its own io_uring, and the connections are read and written through that instead of waiting
+// for the read and write events.  A connection has one receive that keeps going (multishot), into
+// buffers that the ring picks from a set that were taken from the connection buffers (see
+// chunk.h), and the data is handed to its handler a buffer at a time.  The sends are gathered
+// writes of everything that is waiting, the same as writev().  The operations that are started
+// while the shard is handling events are all submitted together, in one system call, and the
+// completions are picked up when the ring's eventfd wakes the event loop.
+//
+// If the ring can't be set up, uring_init() returns 0 and the events are used, as they always
+// were.
+
+#include "event-compat.h"
+
+#include <sys/socket.h>
+
+
+// the number of operations that can be waiting to be submitted, and the number of receive buffers
+// (of CHUNK_SIZE) that each shard has.  Both must be a power of 2.
+#define URING_ENTRIES  1024
+#define URING_BUFFERS  128
+
+
+// an operation that has been started on the ring.  When it completes, the handler is called with
+// the result (as a system call would return it, but with -errno), and for a receive, the data.
+// 'active' is cleared before the handler is called for the last time, so that it knows that the
+// ring is finished with the operation (and whatever it was using).
+typedef struct __uring_op_t {
+	void (*handler)(struct __uring_op_t *op, int res, char *data);
+	void *arg;
+	int fd;
+	int active;
+	int cancelled;
+} uring_op_t;
+
+
+void uring_enable(int enable);
+int uring_init(struct event_base *evbase);
+int uring_active(void);
+
+void uring_recv(uring_op_t *op, int fd);
+void uring_sendmsg(uring_op_t *op, int fd, struct msghdr *msg);
+void uring_cancel(uring_op_t *op);
+
+void uring_dump(void);
+
+
+#endif
@@ -2,66 +2,323 @@
 
 #include "value.h"
 
+#include "hashfn.h"
+#include "lz.h"
+#include "pool.h"
+#include "slab.h"
+
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 
+// strings at least this long are compressed (0 to not compress anything).
+static int _compress_threshold = 0;
 
-// assumes that the value object has valid data already in it.
-void value_clear(value_t *value)
+
+
+void value_init(value_t *value)
 {
 	assert(value);
+	memset(value, 0, sizeof(value_t));
+	assert(value->type == VALUE_DELETED);
+}
+
 
-	if (value->type == VALUE_STRING) {
-		assert(value->data.s.data);
-		free(value->data.s.data);
-		value->data.s.data = NULL;
+void value_compression(int threshold)
+{
+	assert(threshold >= 0);
+	_compress_threshold = threshold;
+}
+
+
+// put the bytes into the value.  Short strings are kept inside the value, and only longer ones 
+// need a buffer, which will be shared if the same bytes are already in the pool.  Returns -1 if 
+// there is no memory available for the buffer.
+static int value_store(value_t *value, const char *str, int length, int flags)
+{
+	char *dest;
+	
+	assert(value);
+	assert(value->type == VALUE_DELETED);
+	assert(length >= 0);
+	assert(str || length == 0);
+	
+	if (length < VALUE_INLINE_SIZE) {
+		dest = value->data.str;
+	}
+	else if ((dest = pool_get(value->valuehash, str, length))) {
+		// the pool has given us a buffer that already has the string in it.
+		value->data.ptr = dest;
+		value->length = length;
+		value->type = VALUE_STRING;
+		value->flags = flags | VALUE_FLAG_POOLED;
+		return(0);
+	}
+	else {
+		dest = slab_alloc(length + 1);
+		if (dest == NULL) {
+			return(-1);
+		}
+		value->data.ptr = dest;
 	}
 	
+	memcpy(dest, str, length);
+	dest[length] = 0;
+	value->length = length;
+	value->type = VALUE_STRING;
+	value->flags = flags;
 	
-	value->type = VALUE_DELETED;
+	return(0);
+}
+
+
+// set an integer value.  The valuehash is the same hash that the clients use for a long, so they 
+// can work out what to expect without asking for it.
+void value_set_long(value_t *value, long long l)
+{
+	assert(value);
+	assert(value->type == VALUE_DELETED || value->type == VALUE_LONG);
+	
+	value->type = VALUE_LONG;
+	value->data.l = l;
+	value->valuehash = generate_hash_long(l);
+}
+
+
+// copy the string into the value.  The string is treated as a binary blob, but will have a null 
+// terminator added to the end.  Large strings are compressed if it saves enough to be worth it.  
+// The valuehash is set from the (uncompressed) string.  Returns -1 if there is no memory available 
+// for the buffer.
+int value_set_str(value_t *value, const char *str, int length)
+{
+	char *packed;
+	int packed_length;
+	int max;
+	int result;
+	
+	assert(value);
+	assert(value->type == VALUE_DELETED);
+	assert(length >= 0);
+	assert(str || length == 0);
+	
+	value->valuehash = generate_hash_str(str, length);
+	
+	// it needs to save at least an eighth, otherwise it isn't worth having to decompress it.
+	max = length - (length >> 3) - VALUE_PACKED_HEADER;
+	if (_compress_threshold > 0 && length >= _compress_threshold && max > 0) {
+		packed = malloc(VALUE_PACKED_HEADER + max);
+		assert(packed);
+		packed_length = lz_compress(str, length, packed + VALUE_PACKED_HEADER, max);
+		if (packed_length > 0) {
+			packed[0] = length & 0xff;
+			packed[1] = (length >> 8) & 0xff;
+			packed[2] = (length >> 16) & 0xff;
+			packed[3] = (length >> 24) & 0xff;
+			result = value_store(value, packed, VALUE_PACKED_HEADER + packed_length, VALUE_FLAG_COMPRESSED);
+			free(packed);
+			return(result);
+		}
+		free(packed);
+	}
+	
+	return(value_store(value, str, length, 0));
 }
 
 
-void value_free(value_t *value)
+// store a string that has already been compressed (by value_set_str on another node).  Returns -1 
+// if there is no memory, or if it doesn't look like a compressed string.
+int value_set_packed(value_t *value, long long valuehash, const char *packed, int length)
 {
 	assert(value);
-	value_clear(value);
-	free(value);
+	assert(value->type == VALUE_DELETED);
+	assert(length >= 0);
+	
+	if (packed == NULL || length <= VALUE_PACKED_HEADER) {
+		return(-1);
+	}
+	
+	value->valuehash = valuehash;
+	return(value_store(value, packed, length, VALUE_FLAG_COMPRESSED));
 }
 
 
+// the bytes that are stored for the string.  If the string is compressed, then this is the 
+// compressed data.
+char * value_str(value_t *value)
+{
+	assert(value);
+	assert(value->type == VALUE_STRING);
+	assert(value->length >= 0);
+	
+	if (value->length < VALUE_INLINE_SIZE) {
+		return(value->data.str);
+	}
+	else {
+		assert(value->data.ptr);
+		return(value->data.ptr);
+	}
+}
 
-// move the data from the src to the dest.  Src will be empty after this operation.  
+
+// the length of the actual string, regardless of how it is stored.
+int value_str_length(value_t *value)
+{
+	unsigned char *packed;
+	
+	assert(value);
+	assert(value->type == VALUE_STRING);
+	
+	if (value->flags & VALUE_FLAG_COMPRESSED) {
+		assert(value->length > VALUE_PACKED_HEADER);
+		packed = (unsigned char *) value_str(value);
+		return(packed[0] | (packed[1] << 8) | (packed[2] << 16) | (packed[3] << 24));
+	}
+	else {
+		return(value->length);
+	}
+}
+
+
+// get the actual string.  If it is compressed, it is decompressed into a new buffer, so 
+// value_str_close() needs to be called when finished with it.  Returns NULL if the compressed 
+// data is corrupt.
+char * value_str_open(value_t *value, int *length)
+{
+	char *str;
+	int str_length;
+	
+	assert(value);
+	assert(length);
+	assert(value->type == VALUE_STRING);
+	
+	if ((value->flags & VALUE_FLAG_COMPRESSED) == 0) {
+		*length = value->length;
+		return(value_str(value));
+	}
+	
+	str_length = value_str_length(value);
+	if (str_length < 0) {
+		return(NULL);
+	}
+	
+	str = malloc(str_length + 1);
+	assert(str);
+	if (lz_decompress(value_str(value) + VALUE_PACKED_HEADER, value->length - VALUE_PACKED_HEADER, str, str_length) != str_length) {
+		free(str);
+		return(NULL);
+	}
+	str[str_length] = 0;
+	
+	*length = str_length;
+	return(str);
+}
+
+
+void value_str_close(value_t *value, char *str)
+{
+	assert(value);
+	assert(str);
+	
+	if (value->flags & VALUE_FLAG_COMPRESSED) {
+		free(str);
+	}
+}
+
+
+// get the string so that it can be sent without being copied.  If 'release' is set when it 
+// returns, then the string stays where it is (even if the value is changed or cleared) until 
+// release() is called with it, by the same shard.  Otherwise it is only there until the value is 
+// changed, the same as value_str(), and the caller needs to copy it.  Returns NULL if the 
+// compressed data is corrupt.
+// NOTE: only pooled strings have a reference count, so those are the only ones that can be shared 
+//       (compressed ones are decompressed into a buffer of their own).  Strings shorter than the 
+//       pool's minimum, or that couldn't go in the pool, are still copied (see 'string-pool').
+char * value_str_share(value_t *value, int *length, void (**release)(void *ptr))
+{
+	char *str;
+	
+	assert(value);
+	assert(length);
+	assert(release);
+	assert(value->type == VALUE_STRING);
+	
+	*release = NULL;
+	
+	if (value->flags & VALUE_FLAG_COMPRESSED) {
+		// the decompressed copy already belongs to the caller.
+		str = value_str_open(value, length);
+		if (str) {
+			*release = free;
+		}
+		return(str);
+	}
+	
+	if (value->flags & VALUE_FLAG_POOLED) {
+		assert(value->length >= VALUE_INLINE_SIZE);
+		pool_ref(value->data.ptr);
+		*release = pool_unref;
+	}
+	
+	*length = value->length;
+	return(value_str(value));
+}
+
+
+// assumes that the value object has valid data already in it.
+void value_clear(value_t *value)
+{
+	assert(value);
+
+	if (value->type == VALUE_STRING && value->length >= VALUE_INLINE_SIZE) {
+		assert(value->data.ptr);
+		if (value->flags & VALUE_FLAG_POOLED) {
+			pool_release(value->data.ptr, value->length);
+		}
+		else {
+			slab_free(value->data.ptr, value->length + 1);
+		}
+		value->data.ptr = NULL;
+	}
+	
+	value->flags = 0;
+	value->length = 0;
+	value->type = VALUE_DELETED;
+}
+
+
+
+// move the data from the src to the dest.  Src will be empty after this operation.  Since any 
+// string buffer (pooled or not) just changes hands, the whole value can simply be copied across.
 void value_move(value_t *dest, value_t *src)
 {
 	assert(dest);
 	assert(src);
+	assert(dest != src);
+	assert(src->type == VALUE_LONG || src->type == VALUE_STRING);
 	
 	value_clear(dest);
-	
-	dest->type = src->type;
-
-	switch(src->type) {
-			
-		case VALUE_LONG:
-			dest->data.l = src->data.l;
-			break;
-			
-		case VALUE_STRING:
-			dest->data.s.data = src->data.s.data;
-			dest->data.s.length = src->data.s.length;
-			src->data.s.data = NULL;
-			src->data.s.length = 0;
-			src->type = VALUE_DELETED;
-			break;
-			
-		default:
-			assert(0);
-			break;
-	}
+	memcpy(dest, src, sizeof(value_t));
+
+	src->flags = 0;
+	src->length = 0;
+	src->type = VALUE_DELETED;
 }
 
 
 
 
+
+// the size of the buffer that the value is using outside of itself (0 if it is all inline).  A 
+// pooled buffer is counted in full, even though it is shared.
+int value_bytes(value_t *value)
+{
+	assert(value);
+	
+	if (value->type == VALUE_STRING && value->length >= VALUE_INLINE_SIZE) {
+		return(value->length + 1);
+	}
+	else {
+		return(0);
+	}
+}
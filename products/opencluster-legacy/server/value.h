@@ -8,23 +8,50 @@
 #define VALUE_LONG     1
 #define VALUE_STRING   2
 
+// flags for how a string is stored.
+#define VALUE_FLAG_POOLED      0x01				// buffer is shared from the pool (see pool.h)
+#define VALUE_FLAG_COMPRESSED  0x02				// string is compressed (see value_str_open)
 
+// a compressed string starts with its original length (4 bytes, little endian).
+#define VALUE_PACKED_HEADER  4
 
+
+// strings shorter than this (leaving room for the null terminator) are stored inside the value 
+// itself.  Longer strings are put in a seperate buffer.  This is sized so that an item_t (with its 
+// access details) still fits in a 72 byte chunk.
+#define VALUE_INLINE_SIZE  24
+
+
+// values are embedded directly in the item that holds them, so they need to be kept compact.  Use 
+// value_str() to get at the stored bytes, because they could be in either place.  Long strings can 
+// be shared with other values (see pool.h), so the string must not be modified in place.  Large 
+// strings may also be compressed, in which case 'length' is the compressed length, and 
+// value_str_open() is needed to get the actual string.
 typedef struct {
-	short type;
 	long long valuehash;
 	union {
-		long long l;			// long
-		struct {
-			char *data;
-			int length;
-		} s;					// string
+		long long l;							// long
+		char *ptr;								// string (length >= VALUE_INLINE_SIZE)
+		char str[VALUE_INLINE_SIZE];			// string (length < VALUE_INLINE_SIZE)
 	} data;
+	int length;
+	short type;
+	short flags;
 } value_t;
 
 
+void value_init(value_t *value);
+void value_compression(int threshold);
+void value_set_long(value_t *value, long long l);
+int value_set_str(value_t *value, const char *str, int length);
+int value_set_packed(value_t *value, long long valuehash, const char *packed, int length);
+char * value_str(value_t *value);
+int value_str_length(value_t *value);
+char * value_str_open(value_t *value, int *length);
+void value_str_close(value_t *value, char *str);
+char * value_str_share(value_t *value, int *length, void (**release)(void *ptr));
 void value_clear(value_t *value);
-void value_free(value_t *value);
 void value_move(value_t *dest, value_t *src);
+int value_bytes(value_t *value);
 
-#endif
\ No newline at end of file
+#endif